@@ -23,20 +23,64 @@
 #include "core/Common.h"
 #include "core/ObjectPool.h"
 #include "core/SharedPtr.h"
+#include "core/Atomic.h"
+#include "core/BufferAllocator.h"
 #include "utility/UUIDUtil.h"
 #include "utility/BitTrickUtil.h"
+#include "utility/ByteOrderUtil.h"
+#include "utility/ChecksumUtil.h"
 
+#include <limits>
+#include <cerrno>
+#include <deque>
+#include <set>
+#ifdef __GXX_EXPERIMENTAL_CXX0X__
+#include <atomic>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#endif
 #include <boost/type_traits.hpp>
 #include <boost/mpl/bool.hpp>
 #include <boost/mpl/or.hpp>
 #include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
 #include <boost/array.hpp>
+#include <boost/tuple/tuple.hpp>
+#include <boost/optional.hpp>
 #include <boost/thread.hpp>
+#ifndef __GXX_EXPERIMENTAL_CXX0X__
+#include <boost/atomic.hpp>
+#endif
+#include <boost/static_assert.hpp>
+
+#ifdef __PLATFORM_LINUX__
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdlib.h>
+#endif
 
 #ifndef ZILLIANS_BUFFER_DEFAULT_SIZE
 #define ZILLIANS_BUFFER_DEFAULT_SIZE	128
 #endif
 
+#ifndef ZILLIANS_BUFFER_CACHE_MIN_SIZE
+#define ZILLIANS_BUFFER_CACHE_MIN_SIZE	256
+#endif
+
+#ifndef ZILLIANS_BUFFER_CACHE_MAX_SIZE
+#define ZILLIANS_BUFFER_CACHE_MAX_SIZE	(1024*1024)
+#endif
+
+#ifndef ZILLIANS_BUFFER_CACHE_MAX_BYTES
+#define ZILLIANS_BUFFER_CACHE_MAX_BYTES	(4*1024*1024)
+#endif
+
 namespace zillians {
 
 namespace detail {
@@ -113,9 +157,135 @@ struct is_std_pair< std::pair<K, V> >
 	enum { value = true };
 };
 
+template<typename T>
+struct is_std_deque
+{
+	enum { value = false };
+};
+
+template<typename T>
+struct is_std_deque< std::deque<T> >
+{
+	enum { value = true };
+};
+
+template<typename T>
+struct is_std_set
+{
+	enum { value = false };
+};
+
+template<typename T>
+struct is_std_set< std::set<T> >
+{
+	enum { value = true };
+};
+
+template<typename T>
+struct is_boost_tuple
+{
+	enum { value = false };
+};
+
+template<typename T0, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8, typename T9>
+struct is_boost_tuple< boost::tuple<T0, T1, T2, T3, T4, T5, T6, T7, T8, T9> >
+{
+	enum { value = true };
+};
+
+template<typename T>
+struct is_boost_optional
+{
+	enum { value = false };
+};
+
+template<typename T>
+struct is_boost_optional< boost::optional<T> >
+{
+	enum { value = true };
+};
+
+#ifdef __GXX_EXPERIMENTAL_CXX0X__
+template<typename T>
+struct is_std_unordered_map
+{
+	enum { value = false };
+};
+
+template<typename K, typename V>
+struct is_std_unordered_map< std::unordered_map<K,V> >
+{
+	enum { value = true };
+};
+
+template<typename T>
+struct is_std_unordered_set
+{
+	enum { value = false };
+};
+
+template<typename T>
+struct is_std_unordered_set< std::unordered_set<T> >
+{
+	enum { value = true };
+};
+
+template<typename T>
+struct is_std_tuple
+{
+	enum { value = false };
+};
+
+template<typename... Types>
+struct is_std_tuple< std::tuple<Types...> >
+{
+	enum { value = true };
+};
+#endif
+
+/**
+ * @brief Helper class to identify the containers (and tuple-like types) added to the built-in types
+ * besides std::vector, std::list and std::map.
+ */
+template<typename T>
+struct is_extended_container
+{
+	enum { value =
+		is_std_deque<T>::value ||
+		is_std_set<T>::value ||
+		is_boost_tuple<T>::value ||
+		is_boost_optional<T>::value
+#ifdef __GXX_EXPERIMENTAL_CXX0X__
+		|| is_std_unordered_map<T>::value
+		|| is_std_unordered_set<T>::value
+		|| is_std_tuple<T>::value
+#endif
+		};
+};
+
 
 }
 
+/**
+ * @brief Trait to mark a trivially-copyable type to be serialized as a whole by memcpy.
+ *
+ * A marked type is written and read as its raw memory layout (including padding),
+ * and a std::vector or boost::array of it is copied with a single memcpy. Use
+ * ZILLIANS_BUFFER_BULK_SERIALIZABLE(T) at global scope to mark a type.
+ *
+ * @note Both ends must share the same memory layout of the type, so it can't be written to
+ * or read from a buffer whose byte order differs from the host's (std::logic_error is
+ * thrown), use serialize() for such types instead.
+ */
+template<typename T>
+struct is_bulk_serializable
+{
+	enum { value = false };
+};
+
+#define ZILLIANS_BUFFER_BULK_SERIALIZABLE(T) \
+	namespace zillians { template<> struct is_bulk_serializable< T > { enum { value = true }; }; }
+
 /**
  * @brief BufferContext allows user structure to be associated with (or
  * super-imposed on) BufferBase object.
@@ -127,7 +297,28 @@ struct BufferMode
 	enum type
 	{
 		plain,
-		circular
+		circular,
+		mirrored	// circular buffer whose pages are mapped twice in a row, so any range in the ring is contiguous
+	};
+};
+
+struct BufferEncoding
+{
+	enum type
+	{
+		fixed,		// integers and length prefixes are written in fixed width
+		compact		// integers and length prefixes are written in LEB128 varint (zigzag for signed integers)
+	};
+};
+
+struct BufferByteOrder
+{
+	enum type
+	{
+		host,		// multi-byte scalars are written in host byte order
+		little,
+		big,
+		network = big
 	};
 };
 
@@ -136,7 +327,8 @@ struct BufferConcurrency
 	enum type
 	{
 		none,
-		spsc
+		spsc,
+		mpsc
 	};
 };
 
@@ -150,9 +342,123 @@ struct BufferObjectPoolStrategy
 	};
 };
 
+struct BufferMapping
+{
+	enum type
+	{
+		read_only,
+		read_write	// writes go straight to the file (shared mapping)
+	};
+};
+
+struct BufferAdvice
+{
+	enum type
+	{
+		normal,
+		sequential,
+		random,
+		willneed,
+		dontneed
+	};
+};
+
+/**
+ * @brief BufferSpan is a non-owning view of a contiguous array stored in a buffer.
+ *
+ * A view stays valid as long as the underlying buffer is not resized, crunched,
+ * cleared or overwritten (i.e. by wrapping around in circular buffer).
+ *
+ * @see BufferBase::readView()
+ * @see BufferBase::readSpan()
+ */
+template<typename T>
+class BufferSpan
+{
+public:
+	BufferSpan() : mData(NULL), mSize(0)
+	{ }
+
+	BufferSpan(const T* data, std::size_t size) : mData(data), mSize(size)
+	{ }
+
+public:
+	inline const T* data() const { return mData; }
+	inline std::size_t size() const { return mSize; }
+	inline bool empty() const { return mSize == 0; }
+
+	inline const T* begin() const { return mData; }
+	inline const T* end() const { return mData + mSize; }
+
+	inline const T& operator[] (std::size_t index) const
+	{
+		BOOST_ASSERT(index < mSize);
+		return mData[index];
+	}
+
+	/**
+	 * @brief Copy the viewed data out as a string.
+	 *
+	 * @return The string containing a copy of the viewed data.
+	 */
+	inline std::basic_string<T> str() const
+	{
+		return std::basic_string<T>(mData, mSize);
+	}
+
+private:
+	const T* mData;
+	std::size_t mSize;
+};
+
+/**
+ * @brief BufferFrame locates the payload of a length-prefixed frame in a buffer without copying.
+ *
+ * The payload of a frame in circular buffer may wrap around the end of the internal
+ * data buffer, in which case it's described by two ranges (just like getDataRanges()).
+ * A frame stays valid as long as the underlying buffer is not resized, crunched,
+ * cleared or overwritten.
+ *
+ * @see BufferBase::readFrames()
+ */
+struct BufferFrame
+{
+	BufferFrame() : count(0)
+	{ }
+
+	/**
+	 * @brief Get the payload size of the frame.
+	 *
+	 * @return The payload size.
+	 */
+	inline std::size_t size() const
+	{
+		std::size_t size = 0;
+		for(int i = 0; i < count; ++i)
+			size += ranges[i].second;
+		return size;
+	}
+
+	/**
+	 * @brief Copy the payload out to the given array.
+	 *
+	 * @param dest The array to copy to, which must be large enough to hold size() bytes.
+	 */
+	inline void copyTo(char* dest) const
+	{
+		for(int i = 0; i < count; ++i)
+		{
+			::memcpy(dest, ranges[i].first, ranges[i].second);
+			dest += ranges[i].second;
+		}
+	}
+
+	std::pair<byte*,std::size_t> ranges[2];
+	int count;
+};
+
 template<bool ShadowRead, bool ShadowWrite>
-struct BufferRef
-{ };
+class BufferRef;
 
 namespace {
 
@@ -171,6 +477,12 @@ struct position_type_selector<BufferConcurrency::spsc>
 	typedef volatile std::size_t type;	// we use volatile to prevent GCC optimization around buffer pointers to get correct set/get ordering
 };
 
+template<>
+struct position_type_selector<BufferConcurrency::mpsc>
+{
+	typedef volatile std::size_t type;	// write and reserve pointers are updated by CAS among producers
+};
+
 }
 
 /**
@@ -188,6 +500,8 @@ class BufferBase
 {
 	typedef typename position_type_selector<Concurrency>::type position_t;
 
+	template<bool ShadowRead, bool ShadowWrite> friend class BufferRef;
+
 	template <typename T>
 	struct is_buffer
 	{
@@ -197,7 +511,12 @@ class BufferBase
 				boost::is_base_and_derived<BufferBase<BufferMode::plain,BufferConcurrency::none>, T>::value ||
 				boost::is_base_and_derived<BufferBase<BufferMode::plain,BufferConcurrency::spsc>, T>::value ||
 				boost::is_base_and_derived<BufferBase<BufferMode::circular,BufferConcurrency::none>, T>::value ||
-				boost::is_base_and_derived<BufferBase<BufferMode::circular,BufferConcurrency::spsc>, T>::value
+				boost::is_base_and_derived<BufferBase<BufferMode::circular,BufferConcurrency::spsc>, T>::value ||
+				boost::is_base_and_derived<BufferBase<BufferMode::mirrored,BufferConcurrency::none>, T>::value ||
+				boost::is_base_and_derived<BufferBase<BufferMode::mirrored,BufferConcurrency::spsc>, T>::value ||
+				boost::is_base_and_derived<BufferBase<BufferMode::plain,BufferConcurrency::mpsc>, T>::value ||
+				boost::is_base_and_derived<BufferBase<BufferMode::circular,BufferConcurrency::mpsc>, T>::value ||
+				boost::is_base_and_derived<BufferBase<BufferMode::mirrored,BufferConcurrency::mpsc>, T>::value
 		};
 	};
 
@@ -214,6 +533,8 @@ class BufferBase
 			detail::is_std_vector<T>::value ||
 			detail::is_std_list<T>::value ||
 			detail::is_std_map<T>::value ||
+			detail::is_std_pair<T>::value ||
+			detail::is_extended_container<T>::value ||
 			//boost::is_same<T, BufferBase >::value
 			//boost::is_base_and_derived<typename boost::remove_const<T>::type, BufferBase>::value
 			is_buffer<T>::value
@@ -264,6 +585,7 @@ class BufferBase
 			detail::is_std_map<T>::value ||
 			detail::is_boost_array<T>::value ||
 			detail::is_std_pair<T>::value ||
+			detail::is_extended_container<T>::value ||
 			boost::is_same<typename boost::remove_const<T>::type, boost::system::error_code>::value ||
 			//boost::is_same<typename boost::remove_const<T>::type, BufferBase >::value
 			//boost::is_base_and_derived<typename boost::remove_const<T>::type, BufferBase>::value
@@ -309,20 +631,51 @@ class BufferBase
 			};
 	};
 
+	/**
+	 * @brief Helper class to identify whether a contiguous array of a given type can be
+	 * read/write by a single memcpy (unless it's written as varint in compact encoding).
+	 */
+	template <typename T>
+	struct is_bulk_types
+	{
+		enum { value =
+			(is_direct_types<T>::value && !boost::is_pointer<T>::value) ||
+			is_bulk_serializable<T>::value
+			};
+	};
+
+	/**
+	 * @brief Helper class to identify whether a given type is written as varint in compact encoding.
+	 */
+	template <typename T>
+	struct is_compact_types
+	{
+		enum { value =
+			boost::is_integral<T>::value &&
+			!boost::is_same<T, bool>::value &&
+			(sizeof(T) > 1)
+			};
+	};
+
 public:
 	BufferBase()
 	{
 		mOwner = true; mReadOnly = false; mOnDemand = true;
+		mEncoding = BufferEncoding::fixed;
+		mByteOrder = BufferByteOrder::host; mSwapBytes = false;
+		mReadChecksumActive = mWriteChecksumActive = false;
+		mMapped = false;
+		mAllocator = BufferAllocator::getDefault();
 		mData = NULL;
 		mAllocatedSize = 0;
 		if(Mode == BufferMode::plain)
 		{
-			mReadPos = mWritePos = 0;
+			mReadPos = mWritePos = mReservePos = 0;
 			mReadPosMarked = mWritePosMarked = 0;
 		}
 		else
 		{
-			mReadPos = mWritePos = 0;
+			mReadPos = mWritePos = mReservePos = 0;
 			mReadPosMarked = mWritePosMarked = 0;
 		}
 	}
@@ -334,23 +687,29 @@ public:
 	 * be freed in the BufferBase's destructor.
 	 *
 	 * @param size The internal data size.
+	 * @param allocator The allocator of the internal data, or NULL to use the default one.
 	 */
-	BufferBase(std::size_t size)
+	BufferBase(std::size_t size, BufferAllocator* allocator = NULL)
 	{
 		BOOST_ASSERT(size > 0);
 		mOwner = true; mReadOnly = false; mOnDemand = false;
+		mEncoding = BufferEncoding::fixed;
+		mByteOrder = BufferByteOrder::host; mSwapBytes = false;
+		mReadChecksumActive = mWriteChecksumActive = false;
+		mMapped = false;
+		mAllocator = allocator ? allocator : BufferAllocator::getDefault();
 		if(Mode == BufferMode::plain)
 		{
-			mData = (byte*)malloc(size);
 			mAllocatedSize = size;
-			mReadPos = mWritePos = 0;
+			mData = allocateData(mAllocatedSize);
+			mReadPos = mWritePos = mReservePos = 0;
 			mReadPosMarked = mWritePosMarked = 0;
 		}
 		else
 		{
-			mData = (byte*)malloc(size + 1);
 			mAllocatedSize = size + 1;
-			mReadPos = mWritePos = 0;
+			mData = allocateData(mAllocatedSize);
+			mReadPos = mWritePos = mReservePos = 0;
 			mReadPosMarked = mWritePosMarked = 0;
 		}
 	}
@@ -366,17 +725,23 @@ public:
 	 */
 	BufferBase(byte* data, std::size_t size)
 	{
+		BOOST_STATIC_ASSERT(Mode != BufferMode::mirrored);	// mirrored buffer must own its mapping
 		mOwner = false; mReadOnly = false; mOnDemand = false;
+		mEncoding = BufferEncoding::fixed;
+		mByteOrder = BufferByteOrder::host; mSwapBytes = false;
+		mReadChecksumActive = mWriteChecksumActive = false;
+		mMapped = false;
+		mAllocator = BufferAllocator::getDefault();
 		mData = data;
 		mAllocatedSize = size;
 		if(Mode == BufferMode::plain)
 		{
-			mReadPos = mWritePos = 0;
+			mReadPos = mWritePos = mReservePos = 0;
 			mReadPosMarked = mWritePosMarked = 0;
 		}
 		else
 		{
-			mReadPos = mWritePos = 0;
+			mReadPos = mWritePos = mReservePos = 0;
 			mReadPosMarked = mWritePosMarked = 0;
 		}
 	}
@@ -396,21 +761,66 @@ public:
 	 */
 	BufferBase(const byte* data, std::size_t size)
 	{
+		BOOST_STATIC_ASSERT(Mode != BufferMode::mirrored);	// mirrored buffer must own its mapping
 		mOwner = false; mReadOnly = true; mOnDemand = false;
+		mEncoding = BufferEncoding::fixed;
+		mByteOrder = BufferByteOrder::host; mSwapBytes = false;
+		mReadChecksumActive = mWriteChecksumActive = false;
+		mMapped = false;
+		mAllocator = BufferAllocator::getDefault();
 		mData = (byte*)data;
 		mAllocatedSize = size;
 		if(Mode == BufferMode::plain)
 		{
-			mReadPos = mWritePos = 0;
+			mReadPos = mWritePos = mReservePos = 0;
 			mReadPosMarked = mWritePosMarked = 0;
 		}
 		else
 		{
-			mReadPos = mWritePos = 0;
+			mReadPos = mWritePos = mReservePos = 0;
 			mReadPosMarked = mWritePosMarked = 0;
 		}
 	}
 
+	/**
+	 * @brief Construct a plain BufferBase object over a memory-mapped file.
+	 *
+	 * The whole file is mapped as readable data, so it can be deserialized by the usual
+	 * read() calls while the pages are loaded lazily by page faults instead of being
+	 * copied up-front. Use advise() to hint the access pattern.
+	 *
+	 * In read_write mapping, the file is created if it doesn't exist and extended to the
+	 * given size, the write pointer starts at the end of the original file content, and
+	 * the written data goes straight to the file (use sync() to flush it explicitly).
+	 *
+	 * @note The mapping is released in the BufferBase's destructor, and the buffer never
+	 * grows beyond the mapped size.
+	 *
+	 * @note Throws boost::system::system_error if the file cannot be opened or mapped.
+	 *
+	 * @note The mapping mode comes first, so a string literal path is never mistaken for
+	 * the data pointer of BufferBase(const byte*, std::size_t).
+	 *
+	 * @param mapping The access mode of the mapping.
+	 * @param path The file path.
+	 * @param size The minimal file size for read_write mapping, ignored for read_only mapping.
+	 */
+	BufferBase(BufferMapping::type mapping, const std::string& path, std::size_t size = 0)
+	{
+		BOOST_STATIC_ASSERT(Mode == BufferMode::plain);	// file content is never wrapped around
+		mOwner = false; mReadOnly = (mapping == BufferMapping::read_only); mOnDemand = false;
+		mEncoding = BufferEncoding::fixed;
+		mByteOrder = BufferByteOrder::host; mSwapBytes = false;
+		mReadChecksumActive = mWriteChecksumActive = false;
+		mMapped = false;
+		mAllocator = BufferAllocator::getDefault();
+		mData = NULL;
+		mAllocatedSize = 0;
+		mReadPos = 0;
+		mReadPosMarked = mWritePosMarked = 0;
+		mWritePos = mReservePos = mapFile(path, mapping, size);
+	}
+
 	/**
 	 * @brief Consutrct a clone of given buffer
 	 *
@@ -424,11 +834,17 @@ public:
 			mOwner = true;
 			mReadOnly = false;
 			mOnDemand = buffer.mOnDemand;
-			mData = (byte*)malloc(buffer.mAllocatedSize);
+			mAllocator = buffer.mAllocator;
 			mAllocatedSize = buffer.mAllocatedSize;
+			mData = allocateData(mAllocatedSize);
 			mReadPos = buffer.mReadPos;
 			mWritePos = buffer.mWritePos;
+			mReservePos = buffer.mWritePos;
 			mReadPosMarked = buffer.mReadPosMarked;
+			mEncoding = buffer.mEncoding;
+			mByteOrder = buffer.mByteOrder; mSwapBytes = buffer.mSwapBytes;
+			mReadChecksumActive = mWriteChecksumActive = false;
+			mMapped = false;
 			mWritePosMarked = buffer.mWritePosMarked;
 
 			::memcpy(mData, buffer.mData, buffer.mAllocatedSize);
@@ -437,12 +853,18 @@ public:
 		{
 			mOwner = false;
 			mReadOnly = buffer.mReadOnly;
+			mAllocator = buffer.mAllocator;
 			mOnDemand = buffer.mOnDemand;
 			mData = buffer.mData;
 			mAllocatedSize = buffer.mAllocatedSize;
 			mReadPos = buffer.mReadPos;
 			mWritePos = buffer.mWritePos;
+			mReservePos = buffer.mWritePos;
 			mReadPosMarked = buffer.mReadPosMarked;
+			mEncoding = buffer.mEncoding;
+			mByteOrder = buffer.mByteOrder; mSwapBytes = buffer.mSwapBytes;
+			mReadChecksumActive = mWriteChecksumActive = false;
+			mMapped = false;
 			mWritePosMarked = buffer.mWritePosMarked;
 		}
 	}
@@ -453,20 +875,28 @@ public:
 		mOwner = buffer.mOwner;
 		mReadOnly = buffer.mReadOnly;
 		mOnDemand = buffer.mOnDemand;
+		mAllocator = buffer.mAllocator;
 		mData = buffer.mData;
 		mAllocatedSize = buffer.mAllocatedSize;
 		mReadPos = buffer.mReadPos;
 		mWritePos = buffer.mWritePos;
+		mReservePos = buffer.mWritePos;
 		mReadPosMarked = buffer.mReadPosMarked;
+		mEncoding = buffer.mEncoding;
+		mByteOrder = buffer.mByteOrder; mSwapBytes = buffer.mSwapBytes;
+		mReadChecksumActive = mWriteChecksumActive = false;
+		mMapped = buffer.mMapped;
 		mWritePosMarked = buffer.mWritePosMarked;
 
 		buffer.mOwner = false;
 		buffer.mReadOnly = false;
+		buffer.mMapped = false;
 		buffer.mOnDemand = false;
 		buffer.mData = NULL;
 		buffer.mAllocatedSize = 0;
 		buffer.mReadPos = 0;
 		buffer.mWritePos = 0;
+		buffer.mReservePos = 0;
 		buffer.mReadPosMarked = 0;
 		buffer.mWritePosMarked = 0;
 	}
@@ -479,7 +909,11 @@ public:
 	{
 		if(mOwner && mData)
 		{
-			free((void*)mData); mData = NULL;
+			deallocateData(mData, mAllocatedSize); mData = NULL;
+		}
+		else if(mMapped)
+		{
+			unmapFile();
 		}
 	}
 
@@ -488,18 +922,28 @@ public:
 	{
 		if(mOwner && mData)
 		{
-			free((void*)mData); mData = NULL;
+			deallocateData(mData, mAllocatedSize); mData = NULL;
+		}
+		else if(mMapped)
+		{
+			unmapFile();
 		}
 
 		if(buffer.mOwner)
 		{
 			mOwner = true;
 			mReadOnly = false;
-			mData = (byte*)malloc(buffer.mAllocatedSize);
+			mAllocator = buffer.mAllocator;
 			mAllocatedSize = buffer.mAllocatedSize;
+			mData = allocateData(mAllocatedSize);
 			mReadPos = buffer.mReadPos;
 			mWritePos = buffer.mWritePos;
+			mReservePos = buffer.mWritePos;
 			mReadPosMarked = buffer.mReadPosMarked;
+			mEncoding = buffer.mEncoding;
+			mByteOrder = buffer.mByteOrder; mSwapBytes = buffer.mSwapBytes;
+			mReadChecksumActive = mWriteChecksumActive = false;
+			mMapped = false;
 			mWritePosMarked = buffer.mWritePosMarked;
 
 			::memcpy(mData, buffer.mData, buffer.mAllocatedSize);
@@ -508,11 +952,17 @@ public:
 		{
 			mOwner = false;
 			mReadOnly = buffer.mReadOnly;
+			mAllocator = buffer.mAllocator;
 			mData = buffer.mData;
 			mAllocatedSize = buffer.mAllocatedSize;
 			mReadPos = buffer.mReadPos;
 			mWritePos = buffer.mWritePos;
+			mReservePos = buffer.mWritePos;
 			mReadPosMarked = buffer.mReadPosMarked;
+			mEncoding = buffer.mEncoding;
+			mByteOrder = buffer.mByteOrder; mSwapBytes = buffer.mSwapBytes;
+			mReadChecksumActive = mWriteChecksumActive = false;
+			mMapped = false;
 			mWritePosMarked = buffer.mWritePosMarked;
 		}
 
@@ -527,26 +977,38 @@ public:
 
 		if(mOwner && mData)
 		{
-			free((void*)mData); mData = NULL;
+			deallocateData(mData, mAllocatedSize); mData = NULL;
+		}
+		else if(mMapped)
+		{
+			unmapFile();
 		}
 
 		mOwner = buffer.mOwner;
 		mReadOnly = buffer.mReadOnly;
 		mOnDemand = buffer.mOnDemand;
+		mAllocator = buffer.mAllocator;
 		mData = buffer.mData;
 		mAllocatedSize = buffer.mAllocatedSize;
 		mReadPos = buffer.mReadPos;
 		mWritePos = buffer.mWritePos;
+		mReservePos = buffer.mWritePos;
 		mReadPosMarked = buffer.mReadPosMarked;
+		mEncoding = buffer.mEncoding;
+		mByteOrder = buffer.mByteOrder; mSwapBytes = buffer.mSwapBytes;
+		mReadChecksumActive = mWriteChecksumActive = false;
+		mMapped = buffer.mMapped;
 		mWritePosMarked = buffer.mWritePosMarked;
 
 		buffer.mOwner = false;
 		buffer.mReadOnly = false;
+		buffer.mMapped = false;
 		buffer.mOnDemand = false;
 		buffer.mData = NULL;
 		buffer.mAllocatedSize = 0;
 		buffer.mReadPos = 0;
 		buffer.mWritePos = 0;
+		buffer.mReservePos = 0;
 		buffer.mReadPosMarked = 0;
 		buffer.mWritePosMarked = 0;
 
@@ -558,10 +1020,72 @@ public:
 	bool isMutable() { return !mReadOnly; }
 	void setMutable(bool m = true) { mReadOnly = !m; }
 
+	/**
+	 * @brief Get the encoding of integers and length prefixes.
+	 *
+	 * @return The current encoding.
+	 */
+	BufferEncoding::type encoding() const { return mEncoding; }
+
+	/**
+	 * @brief Select the encoding of integers and length prefixes for subsequent read/write.
+	 *
+	 * @note Both ends of a stream must agree on the encoding.
+	 *
+	 * @param e The encoding to use.
+	 */
+	void setEncoding(BufferEncoding::type e) { mEncoding = e; }
+
+	/**
+	 * @brief Get the byte order of multi-byte scalars.
+	 *
+	 * @return The current byte order.
+	 */
+	BufferByteOrder::type byteOrder() const { return mByteOrder; }
+
+	/**
+	 * @brief Select the byte order of multi-byte scalars for subsequent read/write.
+	 *
+	 * Fixed-width integers, floating points, wide characters and length prefixes (as well
+	 * as std::vector and boost::array of them) are converted on the fly if the byte order
+	 * differs from the host's. Varints in compact encoding are byte-order independent.
+	 *
+	 * @note Zero-copy views (readSpan()) of multi-byte types are not converted, and
+	 * bulk-serializable types are rejected (see is_bulk_serializable).
+	 *
+	 * @param order The byte order to use.
+	 */
+	void setByteOrder(BufferByteOrder::type order)
+	{
+		mByteOrder = order;
+		mSwapBytes = (order == BufferByteOrder::little && !is_little_endian_host()) || (order == BufferByteOrder::big && is_little_endian_host());
+	}
+
+	/**
+	 * @brief Get the allocator of the internal data.
+	 *
+	 * @return The allocator.
+	 */
+	BufferAllocator* getAllocator() const { return mAllocator; }
+
+	/**
+	 * @brief Change the allocator of the internal data, which is only allowed before the internal data is allocated.
+	 *
+	 * @param allocator The allocator, or NULL to use the default one.
+	 */
+	void setAllocator(BufferAllocator* allocator)
+	{
+		BOOST_ASSERT(!mOwner || !mData);
+		mAllocator = allocator ? allocator : BufferAllocator::getDefault();
+	}
+
 public:
 	/**
 	 * @brief Probe the actual data size of a given type.
 	 *
+	 * @note This is the size in fixed encoding. In compact encoding, integers take
+	 * a variable number of bytes, so use probeSize(value, encoding) instead.
+	 *
 	 * @return The actual size stored in BufferBase object.
 	 */
 	template <typename T>
@@ -577,71 +1101,88 @@ public:
 	 * @brief Probe the actual data size of a given variable.
 	 *
 	 * @param value The variable to probe its actual data size.
+	 * @param encoding The encoding of the target buffer, i.e. buffer.encoding().
 	 * @return The actual data size of the variable stored in the BufferBase object.
 	 */
 	template <typename T>
-	inline static std::size_t probeSize(const T &value)
+	inline static std::size_t probeSize(const T &value, BufferEncoding::type encoding = BufferEncoding::fixed)
 	{
-		return probeSizeDispatch<T>(value, boost::mpl::bool_<is_builtin_types<T>::value>());
+		return probeSizeDispatch<T>(value, encoding, boost::mpl::bool_<is_builtin_types<T>::value>());
 	}
 
 //private:
 	template <typename T>
-	inline static std::size_t probeSizeDispatch(const T &value, boost::mpl::true_ /* is_builtin_type */)
+	inline static std::size_t probeSizeDispatch(const T &value, BufferEncoding::type encoding, boost::mpl::true_ /* is_builtin_type */)
 	{
-		return probeSizeDispatchBuiltin(value, boost::mpl::bool_< is_buffer<T>::value >());
+		return probeSizeDispatchBuiltin(value, encoding, boost::mpl::bool_< is_buffer<T>::value >());
 	}
 
 	template <typename T>
-	inline static std::size_t probeSizeDispatch(const T &value, boost::mpl::false_ /* is_builtin_type */)
+	inline static std::size_t probeSizeDispatch(const T &value, BufferEncoding::type encoding, boost::mpl::false_ /* is_builtin_type */)
 	{
-		return probeSizeSerializable(value);
+		return probeSizeDispatchSerializable(value, encoding, boost::mpl::bool_< is_bulk_serializable<T>::value >());
 	}
 
-	template<typename T>
-	inline static std::size_t probeSizeDispatchBuiltin(const T& value, boost::mpl::true_ /* is_buffer */)
+	template <typename T>
+	inline static std::size_t probeSizeDispatchSerializable(const T &value, BufferEncoding::type encoding, boost::mpl::true_ /* is_bulk_serializable */)
+	{
+		UNUSED_ARGUMENT(value);
+		UNUSED_ARGUMENT(encoding);
+		return sizeof(T);
+	}
+
+	template <typename T>
+	inline static std::size_t probeSizeDispatchSerializable(const T &value, BufferEncoding::type encoding, boost::mpl::false_ /* is_bulk_serializable */)
 	{
-		return probeSizeBuiltin((const BufferBase*)&value);
+		return probeSizeSerializable(value, encoding);
 	}
 
 	template<typename T>
-	inline static std::size_t probeSizeDispatchBuiltin(const T& value, boost::mpl::false_ /* is_buffer */)
+	inline static std::size_t probeSizeDispatchBuiltin(const T& value, BufferEncoding::type encoding, boost::mpl::true_ /* is_buffer */)
 	{
-		return probeSizeBuiltin(value);
+		return probeSizeBuiltin((const BufferBase*)&value, encoding);
 	}
 
-	/**
+	template<typename T>
+	inline static std::size_t probeSizeDispatchBuiltin(const T& value, BufferEncoding::type encoding, boost::mpl::false_ /* is_buffer */)
+	{
+		return probeSizeBuiltin(value, encoding);
+	}
+
+	/**
 	 * @brief Probe the actual data size of a given std::vector.
 	 *
 	 * @param value The std::vector to probe its actual data size.
 	 * @return The actual data size of the std::vector stored in the BufferBase object.
 	 */
 	template <typename T>
-	inline static std::size_t probeSizeBuiltin(const std::vector<T> &value)
+	inline static std::size_t probeSizeBuiltin(const std::vector<T> &value, BufferEncoding::type encoding)
 	{
-		std::size_t size = sizeof(uint32);
-		size += probeSizeBuiltinForVector<T>(value, boost::mpl::bool_<is_variable_types<T>::value>());
+		std::size_t size = probeSizeLength(value.size(), encoding);
+		size += probeSizeBuiltinForVector<T>(value, encoding, boost::mpl::bool_<is_variable_types<T>::value>());
 		return size;
 	}
 
 	template <typename T>
-	inline static std::size_t probeSizeBuiltinForVector(const std::vector<T> &value, boost::mpl::true_ /* is_variable_type */)
+	inline static std::size_t probeSizeBuiltinForVector(const std::vector<T> &value, BufferEncoding::type encoding, boost::mpl::true_ /* is_variable_type */)
 	{
 		std::size_t size = 0;
 		for(typename std::vector<T>::const_iterator i = value.begin(); i != value.end(); ++i)
 		{
-			size += probeSize(*i);
+			size += probeSize(*i, encoding);
 		}
 		return size;
 	}
 
 	template <typename T>
-	inline static std::size_t probeSizeBuiltinForVector(const std::vector<T> &value, boost::mpl::false_ /* is_variable_type */)
+	inline static std::size_t probeSizeBuiltinForVector(const std::vector<T> &value, BufferEncoding::type encoding, boost::mpl::false_ /* is_variable_type */)
 	{
 		if(value.size() == 0)
 			return 0;
+		else if(encoding == BufferEncoding::compact && is_compact_types<T>::value)
+			return probeSizeBuiltinForVector(value, encoding, boost::mpl::true_());
 		else
-			return value.size() * probeSize(*value.begin());
+			return value.size() * probeSize(*value.begin(), encoding);
 	}
 
 	/**
@@ -651,31 +1192,33 @@ public:
 	 * @return The actual data size of the std::list stored in the BufferBase object.
 	 */
 	template <typename T>
-	inline static std::size_t probeSizeBuiltin(const std::list<T> &value)
+	inline static std::size_t probeSizeBuiltin(const std::list<T> &value, BufferEncoding::type encoding)
 	{
-		std::size_t size = sizeof(uint32);
-		size += probeSizeBuiltinForList<T>(value, boost::mpl::bool_<is_variable_types<T>::value>());
+		std::size_t size = probeSizeLength(value.size(), encoding);
+		size += probeSizeBuiltinForList<T>(value, encoding, boost::mpl::bool_<is_variable_types<T>::value>());
 		return size;
 	}
 
 	template <typename T>
-	inline static std::size_t probeSizeBuiltinForList(const std::list<T> &value, boost::mpl::true_ /* is_variable_type */)
+	inline static std::size_t probeSizeBuiltinForList(const std::list<T> &value, BufferEncoding::type encoding, boost::mpl::true_ /* is_variable_type */)
 	{
 		std::size_t size = 0;
 		for(typename std::list<T>::const_iterator i = value.begin(); i != value.end(); ++i)
 		{
-			size += probeSize(*i);
+			size += probeSize(*i, encoding);
 		}
 		return size;
 	}
 
 	template <typename T>
-	inline static std::size_t probeSizeBuiltinForList(const std::list<T> &value, boost::mpl::false_ /* is_variable_type */)
+	inline static std::size_t probeSizeBuiltinForList(const std::list<T> &value, BufferEncoding::type encoding, boost::mpl::false_ /* is_variable_type */)
 	{
 		if(value.size() == 0)
 			return 0;
+		else if(encoding == BufferEncoding::compact && is_compact_types<T>::value)
+			return probeSizeBuiltinForList(value, encoding, boost::mpl::true_());
 		else
-			return value.size() * probeSize(*value.begin());
+			return value.size() * probeSize(*value.begin(), encoding);
 	}
 
 	/**
@@ -685,32 +1228,180 @@ public:
 	 * @return The actual data size of the std::map stored in the BufferBase object.
 	 */
 	template <typename K, typename V>
-	inline static std::size_t probeSizeBuiltin(const std::map<K,V> &value)
+	inline static std::size_t probeSizeBuiltin(const std::map<K,V> &value, BufferEncoding::type encoding)
 	{
-		std::size_t size = sizeof(uint32);
-		size += probeSizeBuiltinForMap<K,V>(value, boost::mpl::or_< boost::mpl::bool_<is_variable_types<K>::value>, boost::mpl::bool_<is_variable_types<V>::value> >());
+		std::size_t size = probeSizeLength(value.size(), encoding);
+		size += probeSizeBuiltinForMap<K,V>(value, encoding, boost::mpl::or_< boost::mpl::bool_<is_variable_types<K>::value>, boost::mpl::bool_<is_variable_types<V>::value> >());
 		return size;
 	}
 
 	template <typename K, typename V>
-	inline static std::size_t probeSizeBuiltinForMap(const std::map<K,V> &value, boost::mpl::true_ /* is_variable_type */)
+	inline static std::size_t probeSizeBuiltinForMap(const std::map<K,V> &value, BufferEncoding::type encoding, boost::mpl::true_ /* is_variable_type */)
 	{
 		std::size_t size = 0;
 		for(typename std::map<K,V>::const_iterator i = value.begin(); i != value.end(); ++i)
 		{
-			size += probeSize(i->first);
-			size += probeSize(i->second);
+			size += probeSize(i->first, encoding);
+			size += probeSize(i->second, encoding);
 		}
 		return size;
 	}
 
 	template <typename K, typename V>
-	inline static std::size_t probeSizeBuiltinForMap(const std::map<K,V> &value, boost::mpl::false_ /* is_variable_type */)
+	inline static std::size_t probeSizeBuiltinForMap(const std::map<K,V> &value, BufferEncoding::type encoding, boost::mpl::false_ /* is_variable_type */)
 	{
 		if(value.size() == 0)
 			return 0;
+		else if(encoding == BufferEncoding::compact && (is_compact_types<K>::value || is_compact_types<V>::value))
+			return probeSizeBuiltinForMap(value, encoding, boost::mpl::true_());
 		else
-			return value.size() * (probeSize(value.begin()->first) + probeSize(value.begin()->second));
+			return value.size() * (probeSize(value.begin()->first, encoding) + probeSize(value.begin()->second, encoding));
+	}
+
+	/**
+	 * @brief Probe the actual data size of a given std::deque.
+	 *
+	 * @param value The std::deque to probe its actual data size.
+	 * @return The actual data size of the std::deque stored in the BufferBase object.
+	 */
+	template <typename T>
+	inline static std::size_t probeSizeBuiltin(const std::deque<T> &value, BufferEncoding::type encoding)
+	{
+		return probeSizeLength(value.size(), encoding) + probeSizeElements(value, encoding);
+	}
+
+	/**
+	 * @brief Probe the actual data size of a given std::set.
+	 *
+	 * @param value The std::set to probe its actual data size.
+	 * @return The actual data size of the std::set stored in the BufferBase object.
+	 */
+	template <typename T>
+	inline static std::size_t probeSizeBuiltin(const std::set<T> &value, BufferEncoding::type encoding)
+	{
+		return probeSizeLength(value.size(), encoding) + probeSizeElements(value, encoding);
+	}
+
+#ifdef __GXX_EXPERIMENTAL_CXX0X__
+	/**
+	 * @brief Probe the actual data size of a given std::unordered_set.
+	 *
+	 * @param value The std::unordered_set to probe its actual data size.
+	 * @return The actual data size of the std::unordered_set stored in the BufferBase object.
+	 */
+	template <typename T>
+	inline static std::size_t probeSizeBuiltin(const std::unordered_set<T> &value, BufferEncoding::type encoding)
+	{
+		return probeSizeLength(value.size(), encoding) + probeSizeElements(value, encoding);
+	}
+
+	/**
+	 * @brief Probe the actual data size of a given std::unordered_map.
+	 *
+	 * @note std::pair<const K,V> is probed element by element, which has the same layout as std::map.
+	 *
+	 * @param value The std::unordered_map to probe its actual data size.
+	 * @return The actual data size of the std::unordered_map stored in the BufferBase object.
+	 */
+	template <typename K, typename V>
+	inline static std::size_t probeSizeBuiltin(const std::unordered_map<K,V> &value, BufferEncoding::type encoding)
+	{
+		std::size_t size = probeSizeLength(value.size(), encoding);
+		for(typename std::unordered_map<K,V>::const_iterator i = value.begin(); i != value.end(); ++i)
+		{
+			size += probeSize(i->first, encoding);
+			size += probeSize(i->second, encoding);
+		}
+		return size;
+	}
+
+	/**
+	 * @brief Probe the actual data size of a given std::tuple.
+	 *
+	 * @param value The std::tuple to probe its actual data size.
+	 * @return The actual data size of the std::tuple stored in the BufferBase object.
+	 */
+	template <typename... Types>
+	inline static std::size_t probeSizeBuiltin(const std::tuple<Types...> &value, BufferEncoding::type encoding)
+	{
+		return probeSizeStdTuple<0>(value, encoding, boost::mpl::bool_<sizeof...(Types) == 0>());
+	}
+
+	template <std::size_t I, typename Tuple>
+	inline static std::size_t probeSizeStdTuple(const Tuple& value, BufferEncoding::type encoding, boost::mpl::false_ /* is_end */)
+	{
+		return probeSize(std::get<I>(value), encoding) + probeSizeStdTuple<I + 1>(value, encoding, boost::mpl::bool_<I + 1 == std::tuple_size<Tuple>::value>());
+	}
+
+	template <std::size_t I, typename Tuple>
+	inline static std::size_t probeSizeStdTuple(const Tuple& value, BufferEncoding::type encoding, boost::mpl::true_ /* is_end */)
+	{
+		UNUSED_ARGUMENT(value);
+		UNUSED_ARGUMENT(encoding);
+		return 0;
+	}
+#endif
+
+	/**
+	 * @brief Probe the actual data size of a given boost::tuple.
+	 *
+	 * @param value The boost::tuple to probe its actual data size.
+	 * @return The actual data size of the boost::tuple stored in the BufferBase object.
+	 */
+	template <typename T0, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8, typename T9>
+	inline static std::size_t probeSizeBuiltin(const boost::tuple<T0, T1, T2, T3, T4, T5, T6, T7, T8, T9> &value, BufferEncoding::type encoding)
+	{
+		return probeSizeBoostTuple(value, encoding);
+	}
+
+	template <typename H, typename T>
+	inline static std::size_t probeSizeBoostTuple(const boost::tuples::cons<H, T>& value, BufferEncoding::type encoding)
+	{
+		return probeSize(value.get_head(), encoding) + probeSizeBoostTuple(value.get_tail(), encoding);
+	}
+
+	inline static std::size_t probeSizeBoostTuple(const boost::tuples::null_type& value, BufferEncoding::type encoding)
+	{
+		UNUSED_ARGUMENT(value);
+		UNUSED_ARGUMENT(encoding);
+		return 0;
+	}
+
+	/**
+	 * @brief Probe the actual data size of a given boost::optional.
+	 *
+	 * @note A boolean flag is stored before the value (if any).
+	 *
+	 * @param value The boost::optional to probe its actual data size.
+	 * @return The actual data size of the boost::optional stored in the BufferBase object.
+	 */
+	template <typename T>
+	inline static std::size_t probeSizeBuiltin(const boost::optional<T> &value, BufferEncoding::type encoding)
+	{
+		return sizeof(int8) + (value ? probeSize(*value, encoding) : 0);
+	}
+
+	/**
+	 * @brief Probe the total data size of all elements in a container (excluding the length prefix).
+	 *
+	 * @param value The container.
+	 * @return The total data size of the elements.
+	 */
+	template <typename Container>
+	inline static std::size_t probeSizeElements(const Container &value, BufferEncoding::type encoding)
+	{
+		typedef typename Container::value_type T;
+		if(value.empty())
+			return 0;
+		else if(!is_variable_types<T>::value && !(encoding == BufferEncoding::compact && is_compact_types<T>::value))
+			return value.size() * probeSize(*value.begin(), encoding);
+
+		std::size_t size = 0;
+		for(typename Container::const_iterator i = value.begin(); i != value.end(); ++i)
+		{
+			size += probeSize(*i, encoding);
+		}
+		return size;
 	}
 
 	/**
@@ -720,8 +1411,9 @@ public:
 	 * @return The actual data size of the boost::array stored in the BufferBase object.
 	 */
 	template <typename T, std::size_t N>
-	inline static std::size_t probeSizeBuiltin(const boost::array<T,N> &value)
+	inline static std::size_t probeSizeBuiltin(const boost::array<T,N> &value, BufferEncoding::type encoding)
 	{
+		UNUSED_ARGUMENT(encoding);
 		return N * sizeof(T) + sizeof(uint32);
 	}
 
@@ -733,9 +1425,10 @@ public:
 	 * @param value The boolean variable to probe its actual data size.
 	 * @return The actual data size of the boolean variable stored in the BufferBase object.
 	 */
-	inline static std::size_t probeSizeBuiltin(const bool& value)
+	inline static std::size_t probeSizeBuiltin(const bool& value, BufferEncoding::type encoding)
 	{
 		UNUSED_ARGUMENT(value);
+		UNUSED_ARGUMENT(encoding);
 		return sizeof(int8);
 	}
 
@@ -749,9 +1442,10 @@ public:
 	 * @param value The const data pointer variable to probe its actual data size.
 	 * @return The actual data size of the const data pointer variable stored in the BufferBase object.
 	 */
-	inline static std::size_t probeSizeBuiltin(const char* value)
+	inline static std::size_t probeSizeBuiltin(const char* value, BufferEncoding::type encoding)
 	{
-		return strlen(value) + sizeof(uint32);
+		std::size_t length = strlen(value);
+		return length + probeSizeLength(length, encoding);
 	}
 
 	/**
@@ -760,9 +1454,9 @@ public:
 	 * @param value The const std::string reference to probe its actual data size.
 	 * @return The actual data size of the const std::string reference stored in the BufferBase object.
 	 */
-	inline static std::size_t probeSizeBuiltin(const std::string &value)
+	inline static std::size_t probeSizeBuiltin(const std::string &value, BufferEncoding::type encoding)
 	{
-		return value.length() + sizeof(uint32);
+		return value.length() + probeSizeLength(value.length(), encoding);
 	}
 
 	/**
@@ -771,9 +1465,9 @@ public:
 	 * @param value The const std::string reference to probe its actual data size.
 	 * @return The actual data size of the const std::string reference stored in the BufferBase object.
 	 */
-	inline static std::size_t probeSizeBuiltin(const std::wstring &value)
+	inline static std::size_t probeSizeBuiltin(const std::wstring &value, BufferEncoding::type encoding)
 	{
-		return (value.length() + 1) * sizeof(wchar_t);
+		return value.length() * sizeof(wchar_t) + probeSizeLength(value.length(), encoding);
 	}
 
 	/**
@@ -782,9 +1476,9 @@ public:
 	 * @param value The const BufferBase reference to probe its actual data size.
 	 * @return The actual data size of the const BufferBase reference stored in the BufferBase object.
 	 */
-	inline static std::size_t probeSizeBuiltin(const BufferBase* value)
+	inline static std::size_t probeSizeBuiltin(const BufferBase* value, BufferEncoding::type encoding)
 	{
-		return value->dataSize() + sizeof(uint32);
+		return value->dataSize() + probeSizeLength(value->dataSize(), encoding);
 	}
 
 	/**
@@ -795,9 +1489,10 @@ public:
 	 * @param value The boost::system::error variable to probe its actual data size.
 	 * @return The actual data size of the boost::system::error variable stored in the BufferBase object.
 	 */
-	inline static std::size_t probeSizeBuiltin(const boost::system::error_code& value)
+	inline static std::size_t probeSizeBuiltin(const boost::system::error_code& value, BufferEncoding::type encoding)
 	{
 		UNUSED_ARGUMENT(value);
+		UNUSED_ARGUMENT(encoding);
 		return sizeof(int32) + sizeof(int32);
 	}
 
@@ -808,9 +1503,9 @@ public:
 	 * @return The actual data size of the std::pair variable stored in the BufferBase object.
 	 */
 	template<typename K, typename V>
-	inline static std::size_t probeSizeBuiltin(const std::pair<K,V>& value)
+	inline static std::size_t probeSizeBuiltin(const std::pair<K,V>& value, BufferEncoding::type encoding)
 	{
-		return probeSize(value.first) + probeSize(value.second);
+		return probeSize(value.first, encoding) + probeSize(value.second, encoding);
 	}
 
 	/**
@@ -823,24 +1518,108 @@ public:
 	 * @return The actual data size of the const variable stored in the BufferBase object.
 	 */
 	template<typename T>
-	inline static std::size_t probeSizeBuiltin(const T& value)
+	inline static std::size_t probeSizeBuiltin(const T& value, BufferEncoding::type encoding)
+	{
+		return probeSizeBuiltinForScalar(value, encoding, boost::mpl::bool_<is_compact_types<T>::value>());
+	}
+
+	template<typename T>
+	inline static std::size_t probeSizeBuiltinForScalar(const T& value, BufferEncoding::type encoding, boost::mpl::true_ /* is_compact_type */)
+	{
+		if(encoding == BufferEncoding::compact)
+			return probeSizeVarint(encodeZigzag(value, boost::mpl::bool_<boost::is_signed<T>::value>()));
+		else
+			return sizeof(T);
+	}
+
+	template<typename T>
+	inline static std::size_t probeSizeBuiltinForScalar(const T& value, BufferEncoding::type encoding, boost::mpl::false_ /* is_compact_type */)
 	{
 		UNUSED_ARGUMENT(value);
+		UNUSED_ARGUMENT(encoding);
 		return sizeof(T);
 	}
 
+	/**
+	 * @brief Probe the actual data size of a length prefix (of string, container, etc.).
+	 *
+	 * @param length The length to be stored.
+	 * @param encoding The encoding of the buffer.
+	 * @return The actual data size of the length prefix stored in the BufferBase object.
+	 */
+	inline static std::size_t probeSizeLength(std::size_t length, BufferEncoding::type encoding)
+	{
+		if(encoding == BufferEncoding::compact)
+			return probeSizeVarint(length);
+		else
+			return sizeof(uint32);
+	}
+
+	/**
+	 * @brief Probe the actual data size of a LEB128 varint.
+	 *
+	 * @param value The unsigned value to be encoded.
+	 * @return The number of bytes of the varint.
+	 */
+	inline static std::size_t probeSizeVarint(uint64 value)
+	{
+		std::size_t size = 1;
+		while(value >= 0x80)
+		{
+			value >>= 7;
+			++size;
+		}
+		return size;
+	}
+
+	/**
+	 * @brief Map a signed integer to unsigned by zigzag encoding, so small negative values stay small.
+	 *
+	 * @param value The integer to be encoded.
+	 * @return The encoded value.
+	 */
+	template<typename T>
+	inline static uint64 encodeZigzag(const T& value, boost::mpl::true_ /* is_signed */)
+	{
+		return ((uint64)(int64)value << 1) ^ (uint64)((int64)value >> 63);
+	}
+
+	template<typename T>
+	inline static uint64 encodeZigzag(const T& value, boost::mpl::false_ /* is_signed */)
+	{
+		return (uint64)value;
+	}
+
+	/**
+	 * @brief Restore the integer encoded by encodeZigzag().
+	 *
+	 * @param value The encoded value.
+	 * @return The decoded integer.
+	 */
+	template<typename T>
+	inline static T decodeZigzag(uint64 value, boost::mpl::true_ /* is_signed */)
+	{
+		return (T)(int64)((value >> 1) ^ (~(value & 1) + 1));
+	}
+
+	template<typename T>
+	inline static T decodeZigzag(uint64 value, boost::mpl::false_ /* is_signed */)
+	{
+		return (T)value;
+	}
+
 public:
 	/**
 	 * @brief Helper class to probe the size of a serializable data structure.
 	 */
 	struct SizeProbingArchive
 	{
-		SizeProbingArchive() : size(0) { }
+		SizeProbingArchive(BufferEncoding::type e = BufferEncoding::fixed) : size(0), encoding(e) { }
 
 		template <typename T>
 		void operator & (T& v)
 		{
-			size += BufferBase::probeSize(v);
+			size += BufferBase::probeSize(v, encoding);
 		}
 
 		inline void skip(std::size_t s)
@@ -849,6 +1628,7 @@ public:
 		}
 
 		std::size_t size;
+		BufferEncoding::type encoding;
 	};
 
 	/**
@@ -873,13 +1653,14 @@ public:
 	 * @endcode
 	 *
 	 * @param t The non-const reference to the given serializable data structure.
+	 * @param encoding The encoding of the target buffer, i.e. buffer.encoding().
 	 * @return The actual data size of the given serializable data structure stored in the BufferBase object.
 	 */
 	template <typename T>
-	inline static std::size_t probeSizeSerializable(const T& t)
+	inline static std::size_t probeSizeSerializable(const T& t, BufferEncoding::type encoding = BufferEncoding::fixed)
 	{
 		T& value = *(const_cast<T*>(&t));
-		SizeProbingArchive ar;
+		SizeProbingArchive ar(encoding);
 		value.serialize(ar, /*UNUSED*/ 0);
 		return ar.size;
 	}
@@ -892,7 +1673,7 @@ public:
 	 */
 	inline void clear()
 	{
-		mReadPos = mWritePos = 0;
+		mReadPos = mWritePos = mReservePos = 0;
 		mReadPosMarked = mWritePosMarked = 0;
 	}
 
@@ -907,9 +1688,15 @@ public:
 	/**
 	 * @brief Move all data enclosed by current read pointer and write pointer to the beginning
 	 * of the internal data buffer and reset the read and write pointer afterwards.
+	 *
+	 * @note Not supported by mpsc buffer, whose producers may be filling the reserved space
+	 * after the write pointer at the same time.
 	 */
 	inline void crunch()
 	{
+		if(Concurrency == BufferConcurrency::mpsc)
+			throw std::logic_error("crunch is not supported by mpsc buffer");
+
 		if(Mode == BufferMode::plain)
 		{
 			if(dataSize() > 0 && rpos() > 0)
@@ -983,6 +1770,7 @@ public:
 		mReadPos = mReadPosMarked;
 		mWritePos = mWritePosMarked;
 		mReadPosMarked = mWritePosMarked = 0;
+		syncReservePos();
 	}
 
 	/**
@@ -991,6 +1779,7 @@ public:
 	inline void resetWrite()
 	{
 		mWritePos = mWritePosMarked;
+		syncReservePos();
 	}
 
 	/**
@@ -1000,6 +1789,79 @@ public:
 	{
 		mReadPos = mReadPosMarked;
 	}
+	/**
+	 * @brief Check whether the internal data buffer grows automatically on write.
+	 *
+	 * @return True if the buffer is allocated on demand, false otherwise.
+	 */
+	inline bool isOnDemand() const
+	{
+		return mOnDemand;
+	}
+
+	/**
+	 * @brief Check whether the internal data buffer is a memory-mapped file.
+	 *
+	 * @return True if the buffer is constructed over a memory-mapped file, false otherwise.
+	 */
+	inline bool isMapped() const
+	{
+		return mMapped;
+	}
+
+	/**
+	 * @brief Give the kernel a hint about the access pattern of a memory-mapped file by madvise().
+	 *
+	 * For example, BufferAdvice::sequential before deserializing a large snapshot from the
+	 * beginning enables aggressive read-ahead, and BufferAdvice::willneed prefetches the
+	 * given range asynchronously.
+	 *
+	 * @param advice The access pattern.
+	 * @param position The beginning of the range, which is rounded down to the page boundary.
+	 * @param size The size of the range, or 0 for everything after the position.
+	 * @return True on success (or if nothing is mapped for an empty file), false otherwise (errno is preserved).
+	 */
+	inline bool advise(BufferAdvice::type advice, std::size_t position = 0, std::size_t size = 0)
+	{
+		BOOST_ASSERT(mMapped || !mData);
+		BOOST_ASSERT(position <= mAllocatedSize);
+		if(!mMapped)
+			return true;	// an empty file is never mapped, so there's nothing to advise
+
+#ifdef __PLATFORM_LINUX__
+		static const int flags[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED, MADV_DONTNEED };
+
+		if(size == 0 || position + size > mAllocatedSize)
+			size = mAllocatedSize - position;
+
+		std::size_t page_size = (std::size_t)sysconf(_SC_PAGESIZE);
+		std::size_t offset = position % page_size;
+		return ::madvise((void*)(mData + position - offset), size + offset, flags[advice]) == 0;
+#else
+		UNUSED_ARGUMENT(advice);
+		UNUSED_ARGUMENT(position);
+		UNUSED_ARGUMENT(size);
+		return false;
+#endif
+	}
+
+	/**
+	 * @brief Flush the modified pages of a read_write memory-mapped file back to the file.
+	 *
+	 * @param wait True to block until the data is written, false to schedule the write only.
+	 * @return True on success, false otherwise (errno is preserved).
+	 */
+	inline bool sync(bool wait = true)
+	{
+		BOOST_ASSERT(mMapped);
+#ifdef __PLATFORM_LINUX__
+		return ::msync((void*)mData, mAllocatedSize, wait ? MS_SYNC : MS_ASYNC) == 0;
+#else
+		UNUSED_ARGUMENT(wait);
+		return false;
+#endif
+	}
+
 	/**
 	 * @brief Get the allocated size (the internal data buffer size).
 	 *
@@ -1142,79 +2004,335 @@ public:
 			}
 		}
 	}
-public:
+
 	/**
-	 * @brief Get the current read pointer position.
+	 * @brief Get the physical memory ranges of the available data without any allocation.
 	 *
-	 * @return The current read pointer position.
+	 * @param ranges The range array to fill, which contains at most two ranges (for circular buffer).
+	 * @return The number of ranges filled.
 	 */
-	inline std::size_t rpos() const { return mReadPos; }
+	inline int getDataRanges(std::pair<byte*,std::size_t> (&ranges)[2]) const
+	{
+		std::size_t current_wpos = wpos();
+		std::size_t current_rpos = rpos();
+
+		int n = 0;
+		if(Mode == BufferMode::mirrored && current_wpos < current_rpos)
+		{
+			ranges[n++] = std::make_pair(mData + current_rpos, mAllocatedSize - current_rpos + current_wpos);
+		}
+		else if(Mode == BufferMode::circular && current_wpos < current_rpos)
+		{
+			ranges[n++] = std::make_pair(mData + current_rpos, mAllocatedSize - current_rpos);
+			if(current_wpos > 0)
+				ranges[n++] = std::make_pair(mData, current_wpos);
+		}
+		else if(current_wpos > current_rpos)
+		{
+			ranges[n++] = std::make_pair(mData + current_rpos, current_wpos - current_rpos);
+		}
+		return n;
+	}
 
 	/**
-	 * @brief Get the current write pointer position.
+	 * @brief Get the physical memory ranges of the free space without any allocation.
 	 *
-	 * @return The current write pointer position.
+	 * @param ranges The range array to fill, which contains at most two ranges (for circular buffer).
+	 * @return The number of ranges filled.
 	 */
-	inline std::size_t wpos() const { return mWritePos; }
+	inline int getFreeRanges(std::pair<byte*,std::size_t> (&ranges)[2]) const
+	{
+		std::size_t current_wpos = wpos();
+		std::size_t current_rpos = rpos();
+
+		int n = 0;
+		if(Mode == BufferMode::plain)
+		{
+			if(mAllocatedSize > current_wpos)
+				ranges[n++] = std::make_pair(mData + current_wpos, mAllocatedSize - current_wpos);
+		}
+		else if(Mode == BufferMode::mirrored)
+		{
+			std::size_t free_size = freeSize();
+			if(free_size > 0)
+				ranges[n++] = std::make_pair(mData + current_wpos, free_size);
+		}
+		else
+		{
+			// one byte is always left unused to distinguish full buffer from empty buffer
+			if(current_wpos < current_rpos)
+			{
+				if(current_rpos - current_wpos > 1)
+					ranges[n++] = std::make_pair(mData + current_wpos, current_rpos - current_wpos - 1);
+			}
+			else if(current_rpos == 0)
+			{
+				if(mAllocatedSize - current_wpos > 1)
+					ranges[n++] = std::make_pair(mData + current_wpos, mAllocatedSize - current_wpos - 1);
+			}
+			else
+			{
+				ranges[n++] = std::make_pair(mData + current_wpos, mAllocatedSize - current_wpos);
+				if(current_rpos > 1)
+					ranges[n++] = std::make_pair(mData, current_rpos - 1);
+			}
+		}
+		return n;
+	}
 
 	/**
-	 * @brief Manually set the current read pointer position.
+	 * @brief Append the physical memory ranges of the available data to a buffer sequence.
 	 *
-	 * @param position The absolute read pointer position.
-	 * @return The updated current read pointer position.
+	 * This is used to feed scatter-gather I/O (i.e. boost::asio::async_write()) without copying,
+	 * for example with std::vector<boost::asio::const_buffer>. Call rskip() with the number of
+	 * bytes transferred once the operation completes.
+	 *
+	 * @param buffers The buffer sequence, whose value_type is constructible from (pointer, size).
+	 * @return The total size of the appended data ranges.
 	 */
-	inline std::size_t rpos(std::size_t position) { mReadPos = position; return mReadPos; }
+	template<typename BufferSequence>
+	inline std::size_t getDataBuffers(BufferSequence& buffers) const
+	{
+		std::pair<byte*,std::size_t> ranges[2];
+		int n = getDataRanges(ranges);
+
+		std::size_t total = 0;
+		for(int i = 0; i < n; ++i)
+		{
+			buffers.push_back(typename BufferSequence::value_type(ranges[i].first, ranges[i].second));
+			total += ranges[i].second;
+		}
+		return total;
+	}
 
 	/**
-	 * @brief Manually set the current write pointer position.
+	 * @brief Append the physical memory ranges of the free space to a buffer sequence.
 	 *
-	 * @param position The absolute write pointer position.
-	 * @return The updated current write pointer position.
+	 * This is used to feed scatter-gather I/O (i.e. boost::asio::async_read()) without copying,
+	 * for example with std::vector<boost::asio::mutable_buffer>. Call wskip() with the number of
+	 * bytes transferred once the operation completes.
+	 *
+	 * @param buffers The buffer sequence, whose value_type is constructible from (pointer, size).
+	 * @return The total size of the appended free ranges.
 	 */
-	inline std::size_t wpos(std::size_t position) { mWritePos = position; return mWritePos; }
+	template<typename BufferSequence>
+	inline std::size_t getFreeBuffers(BufferSequence& buffers) const
+	{
+		std::pair<byte*,std::size_t> ranges[2];
+		int n = getFreeRanges(ranges);
+
+		std::size_t total = 0;
+		for(int i = 0; i < n; ++i)
+		{
+			buffers.push_back(typename BufferSequence::value_type(ranges[i].first, ranges[i].second));
+			total += ranges[i].second;
+		}
+		return total;
+	}
 
+#ifdef __PLATFORM_LINUX__
 	/**
-	 * @brief Get the current read pointer.
+	 * @brief Fill the given iovec array with the physical memory ranges of the available data.
 	 *
-	 * @note You may use the raw read pointer to alter the content of the buffer, but
-	 * remember to use with caution.
+	 * The iovec entries point directly into the internal data array, so they can be passed to
+	 * writev()/sendmsg() without copying.
 	 *
-	 * @return The current read pointer.
+	 * @param iov The iovec array to fill.
+	 * @param count The capacity of the iovec array.
+	 * @return The number of iovec entries filled.
 	 */
-	inline byte* rptr() const { return (byte*)(mData + mReadPos); }
+	inline int getDataIovec(struct iovec* iov, int count) const
+	{
+		std::pair<byte*,std::size_t> ranges[2];
+		int n = std::min(getDataRanges(ranges), count);
+		for(int i = 0; i < n; ++i)
+		{
+			iov[i].iov_base = ranges[i].first;
+			iov[i].iov_len = ranges[i].second;
+		}
+		return n;
+	}
 
 	/**
-	 * @brief Get the current write pointer.
+	 * @brief Fill the given iovec array with the physical memory ranges of the free space.
 	 *
-	 * @note You may use the raw write pointer to alter the content of the buffer, but
-	 * remember to use with caution.
+	 * The iovec entries point directly into the internal data array, so they can be passed to
+	 * readv()/recvmsg() and the received data can be committed by wskip() afterwards.
 	 *
-	 * @return The current write pointer.
+	 * @param iov The iovec array to fill.
+	 * @param count The capacity of the iovec array.
+	 * @return The number of iovec entries filled.
 	 */
-	inline byte* wptr() const { return (byte*)(mData + mWritePos); }
+	inline int getFreeIovec(struct iovec* iov, int count) const
+	{
+		std::pair<byte*,std::size_t> ranges[2];
+		int n = std::min(getFreeRanges(ranges), count);
+		for(int i = 0; i < n; ++i)
+		{
+			iov[i].iov_base = ranges[i].first;
+			iov[i].iov_len = ranges[i].second;
+		}
+		return n;
+	}
 
 	/**
-	 * @brief Move forward the current read pointer by given number of bytes.
+	 * @brief Write the available data to the given file descriptor by a single writev() call.
 	 *
-	 * @param bytes The number of bytes to skip reading.
+	 * The read pointer is moved forward by the number of bytes accepted by the kernel.
+	 *
+	 * @param fd The file descriptor (socket, pipe, file...) to write to.
+	 * @return The number of bytes written, or -1 on error (errno is preserved).
 	 */
-	inline void rskip(std::size_t bytes)
+	inline ssize_t writeTo(int fd)
 	{
-		if(Mode == BufferMode::plain)
-		{
-			BOOST_ASSERT(bytes <= mAllocatedSize);
+		struct iovec iov[2];
+		int n = getDataIovec(iov, 2);
+		if(n == 0) return 0;
 
-			mReadPos += bytes;
-			BOOST_ASSERT(mReadPos <= mAllocatedSize);
-		}
-		else
+		ssize_t written = ::writev(fd, iov, n);
+		if(written > 0)
 		{
-			BOOST_ASSERT(bytes <= mAllocatedSize - 1);
-
-			if(bytes > dataSize())
-				throw std::length_error("out of data buffer");
-
-			//std::size_t size_before = dataSize();
+			rskip(written);
+		}
+		return written;
+	}
+
+	/**
+	 * @brief Read from the given file descriptor into the free space by a single readv() call.
+	 *
+	 * The write pointer is moved forward by the number of bytes received. For on-demand
+	 * buffers, the buffer is enlarged if there's no free space left.
+	 *
+	 * @param fd The file descriptor (socket, pipe, file...) to read from.
+	 * @return The number of bytes read, 0 on end-of-file, or -1 on error (errno is preserved).
+	 */
+	inline ssize_t readFrom(int fd)
+	{
+		BOOST_ASSERT(!mReadOnly);
+
+		struct iovec iov[2];
+		int n = getFreeIovec(iov, 2);
+		if(n == 0)
+		{
+			if(!mOnDemand) return 0;
+
+			if(Mode == BufferMode::plain)
+				resize(round_up_to_nearest_power_of_two<uint64>::apply(mAllocatedSize + DEFAULT_SIZE));
+			else
+				resize(round_up_to_nearest_power_of_two<uint64>::apply(mAllocatedSize + DEFAULT_SIZE) + 1);
+
+			n = getFreeIovec(iov, 2);
+		}
+
+		ssize_t received = ::readv(fd, iov, n);
+		if(received > 0)
+		{
+			wskip(received);
+		}
+		return received;
+	}
+#endif
+
+public:
+	/**
+	 * @brief Get the current read pointer position.
+	 *
+	 * @return The current read pointer position.
+	 */
+	inline std::size_t rpos() const { return mReadPos; }
+
+	/**
+	 * @brief Get the current write pointer position.
+	 *
+	 * @return The current write pointer position.
+	 */
+	inline std::size_t wpos() const { return mWritePos; }
+
+	/**
+	 * @brief Manually set the current read pointer position.
+	 *
+	 * @param position The absolute read pointer position.
+	 * @return The updated current read pointer position.
+	 */
+	inline std::size_t rpos(std::size_t position) { mReadPos = position; return mReadPos; }
+
+	/**
+	 * @brief Manually set the current write pointer position.
+	 *
+	 * @param position The absolute write pointer position.
+	 * @return The updated current write pointer position.
+	 */
+	inline std::size_t wpos(std::size_t position) { mWritePos = position; syncReservePos(); return mWritePos; }
+
+	/**
+	 * @brief Get the current read pointer.
+	 *
+	 * @note You may use the raw read pointer to alter the content of the buffer, but
+	 * remember to use with caution.
+	 *
+	 * @return The current read pointer.
+	 */
+	inline byte* rptr() const { return (byte*)(mData + mReadPos); }
+
+	/**
+	 * @brief Get the current write pointer.
+	 *
+	 * @note You may use the raw write pointer to alter the content of the buffer, but
+	 * remember to use with caution.
+	 *
+	 * @return The current write pointer.
+	 */
+	inline byte* wptr() const { return (byte*)(mData + mWritePos); }
+
+	/**
+	 * @brief Move forward the current read pointer by given number of bytes.
+	 *
+	 * @param bytes The number of bytes to skip reading.
+	 */
+	inline void rskip(std::size_t bytes)
+	{
+		if(UNLIKELY(mReadChecksumActive))
+			mReadChecksum = updateChecksum(mReadChecksum, rpos(), bytes);
+
+		moveReadPointer(bytes);
+	}
+
+	/**
+	 * @brief Move forward the current write pointer by given number of bytes.
+	 *
+	 * @param bytes The number of bytes to skip writing.
+	 */
+	inline void wskip(std::size_t bytes)
+	{
+		if(UNLIKELY(mWriteChecksumActive))
+			mWriteChecksum = updateChecksum(mWriteChecksum, wpos(), bytes);
+
+		moveWritePointer(bytes);
+	}
+
+private:
+	/**
+	 * @brief Move forward the current read pointer without feeding the skipped bytes into the checksum.
+	 *
+	 * @param bytes The number of bytes to move forward.
+	 */
+	inline void moveReadPointer(std::size_t bytes)
+	{
+		if(Mode == BufferMode::plain)
+		{
+			BOOST_ASSERT(bytes <= mAllocatedSize);
+
+			mReadPos += bytes;
+			BOOST_ASSERT(mReadPos <= mAllocatedSize);
+		}
+		else
+		{
+			BOOST_ASSERT(bytes <= mAllocatedSize - 1);
+
+			if(bytes > dataSize())
+				throw std::length_error("out of data buffer");
+
+			//std::size_t size_before = dataSize();
 
 			mReadPos += bytes;
 			if(mReadPos >= mAllocatedSize)
@@ -1226,11 +2344,11 @@ public:
 	}
 
 	/**
-	 * @brief Move forward the current write pointer by given number of bytes.
+	 * @brief Move forward the current write pointer without feeding the skipped bytes into the checksum.
 	 *
-	 * @param bytes The number of bytes to skip writing.
+	 * @param bytes The number of bytes to move forward.
 	 */
-	inline void wskip(std::size_t bytes)
+	inline void moveWritePointer(std::size_t bytes)
 	{
 		if(Mode == BufferMode::plain)
 		{
@@ -1255,8 +2373,10 @@ public:
 			//std::size_t size_after = dataSize();
 			//BOOST_ASSERT(size_before + bytes == size_after);
 		}
+		syncReservePos();
 	}
 
+public:
 	/**
 	 * @brief Move backward the current read pointer by given number of bytes.
 	 *
@@ -1305,6 +2425,7 @@ public:
 			else
 				mWritePos -= bytes;
 		}
+		syncReservePos();
 	}
 
 	inline byte* ptr(std::size_t s) const
@@ -1354,6 +2475,19 @@ public:
 	 */
 	template <typename T>
 	inline void readDispatch(T& value, boost::mpl::false_ /*is_builtin_types*/)
+	{
+		readDispatchSerializable(value, boost::mpl::bool_< is_bulk_serializable<T>::value >() );
+	}
+
+	template <typename T>
+	inline void readDispatchSerializable(T& value, boost::mpl::true_ /*is_bulk_serializable*/)
+	{
+		checkBulkByteOrder<T>();
+		readAny(value);
+	}
+
+	template <typename T>
+	inline void readDispatchSerializable(T& value, boost::mpl::false_ /*is_bulk_serializable*/)
 	{
 		readSerializable(value);
 	}
@@ -1416,6 +2550,71 @@ public:
 		value.serialize(ar, /*UNUSED*/ 0 );
 	}
 
+	/**
+	 * @brief Read a length-prefixed object written by writeSized().
+	 *
+	 * @note If the object consumes less data than the length prefix (i.e. written by a newer
+	 * version with more fields), the remaining data is skipped. Records left by abandon()
+	 * before the object are skipped as well.
+	 *
+	 * @param value The value to be read.
+	 */
+	template <typename T>
+	inline void readSized(T& value)
+	{
+		skipAbandoned();
+		uint32 length; readFixed(length);
+		BOOST_ASSERT(length <= dataSize());
+
+		std::size_t size_before = dataSize();
+		read(value);
+		std::size_t consumed = size_before - dataSize();
+
+		BOOST_ASSERT(consumed <= length);
+		if(consumed < length)
+			rskip(length - consumed);
+	}
+
+	/**
+	 * @brief Read an object followed by a CRC32C trailer written by writeChecked(), and verify it.
+	 *
+	 * The checksum is computed incrementally as the object is read, so the data is not
+	 * read twice.
+	 *
+	 * @param value The value to be read.
+	 * @return True if the checksum matches, false if the data is corrupted.
+	 */
+	template <typename T>
+	inline bool readChecked(T& value)
+	{
+		beginReadChecksum();
+		read(value);
+		uint32 checksum = endReadChecksum();
+
+		uint32 trailer; readFixed(trailer);
+		return checksum == trailer;
+	}
+
+	/**
+	 * @brief Start computing the CRC32C of all data consumed afterwards.
+	 */
+	inline void beginReadChecksum()
+	{
+		mReadChecksum = CRC32C_INIT;
+		mReadChecksumActive = true;
+	}
+
+	/**
+	 * @brief Stop computing the checksum started by beginReadChecksum().
+	 *
+	 * @return The CRC32C of the data consumed in between.
+	 */
+	inline uint32 endReadChecksum()
+	{
+		mReadChecksumActive = false;
+		return crc32c_final(mReadChecksum);
+	}
+
 	/**
 	 * @brief Read an int8 (1 byte) variable.
 	 *
@@ -1443,7 +2642,7 @@ public:
 	 */
 	inline void readBuiltin(int16& value)
 	{
-		readDirect(value);
+		readInteger(value);
 	}
 
 	/**
@@ -1453,7 +2652,7 @@ public:
 	 */
 	inline void readBuiltin(uint16& value)
 	{
-		readDirect(value);
+		readInteger(value);
 	}
 
 	/**
@@ -1463,7 +2662,7 @@ public:
 	 */
 	inline void readBuiltin(int32& value)
 	{
-		readDirect(value);
+		readInteger(value);
 	}
 
 	/**
@@ -1473,7 +2672,7 @@ public:
 	 */
 	inline void readBuiltin(uint32& value)
 	{
-		readDirect(value);
+		readInteger(value);
 	}
 
 	/**
@@ -1483,7 +2682,7 @@ public:
 	 */
 	inline void readBuiltin(int64& value)
 	{
-		readDirect(value);
+		readInteger(value);
 	}
 
 	/**
@@ -1493,7 +2692,7 @@ public:
 	 */
 	inline void readBuiltin(long long int& value)
 	{
-		readDirect(value);
+		readInteger(value);
 	}
 
 	/**
@@ -1503,7 +2702,7 @@ public:
 	 */
 	inline void readBuiltin(uint64& value)
 	{
-		readDirect(value);
+		readInteger(value);
 	}
 
 	/**
@@ -1513,7 +2712,7 @@ public:
 	 */
 	inline void readBuiltin(unsigned long long int& value)
 	{
-		readDirect(value);
+		readInteger(value);
 	}
 
 	/**
@@ -1523,7 +2722,7 @@ public:
 	 */
 	inline void readBuiltin(float& value)
 	{
-		readDirect(value);
+		readFixed(value);
 	}
 
 	/**
@@ -1533,7 +2732,7 @@ public:
 	 */
 	inline void readBuiltin(double& value)
 	{
-		readDirect(value);
+		readFixed(value);
 	}
 
 	/**
@@ -1554,11 +2753,11 @@ public:
 	 */
 	inline void readBuiltin(std::string& value)
 	{
-		uint32 length; readDirect(length);
+		uint32 length; readLength(length);
 		if(LIKELY(length <= MAX_STRING_LENGTH))
 		{
 			value.clear();
-			if(Mode == BufferMode::plain)
+			if(Mode != BufferMode::circular)
 			{
 				value.append((char*)rptr(), length);
 			}
@@ -1591,12 +2790,12 @@ public:
 	 */
 	inline void readBuiltin(std::wstring& value)
 	{
-		uint32 length; readDirect(length);
+		uint32 length; readLength(length);
 		uint32 bytes_count = length * sizeof(wchar_t);
 		if(LIKELY(length <= MAX_STRING_LENGTH))
 		{
 			value.clear();
-			if(Mode == BufferMode::plain)
+			if(Mode != BufferMode::circular)
 			{
 				value.append((wchar_t*)rptr(), length);
 			}
@@ -1616,6 +2815,8 @@ public:
 					*/
 				}
 			}
+			if(UNLIKELY(mSwapBytes) && length > 0)
+				byte_swap_array(&value[0], &value[0], length, sizeof(wchar_t));
 		}
 		else
 		{
@@ -1635,7 +2836,7 @@ public:
 	 */
 	inline void readBuiltin(char* value)
 	{
-		uint32 length; readDirect(length);
+		uint32 length; readLength(length);
 		if(LIKELY(length <= MAX_STRING_LENGTH))
 		{
 			BOOST_ASSERT(length <= dataSize());
@@ -1668,17 +2869,11 @@ public:
 	template <typename T>
 	inline void readBuiltin(std::vector<T>& value)
 	{
-		uint32 length; readDirect(length);
+		uint32 length; readLength(length);
 		if(LIKELY(length <= MAX_VECTOR_LENGTH))
 		{
 			value.clear();
-			// since we know the number of elements to read, just reserve it first for better performance
-			value.reserve(length);
-			for(uint32 i = 0; i < length; ++i)
-			{
-				T x; read(x);
-				value.push_back(x);
-			}
+			readVectorImpl(value, length, boost::mpl::bool_< is_bulk_types<T>::value >());
 		}
 		else
 		{
@@ -1686,6 +2881,44 @@ public:
 		}
 	}
 
+	/**
+	 * @brief The vector element can be copied directly, so read all elements by a single memory copy.
+	 *
+	 * @param value The std::vector<T> variable to be read.
+	 * @param length The number of elements.
+	 */
+	template <typename T>
+	inline void readVectorImpl(std::vector<T>& value, uint32 length, boost::mpl::true_ /*bulk_copy*/)
+	{
+		if(is_compact_types<T>::value && mEncoding == BufferEncoding::compact)
+		{
+			readVectorImpl(value, length, boost::mpl::false_());
+		}
+		else if(length > 0)
+		{
+			value.resize(length);
+			readFixedArray(&value[0], length);
+		}
+	}
+
+	/**
+	 * @brief The vector element is not native types, read the element one by one.
+	 *
+	 * @param value The std::vector<T> variable to be read.
+	 * @param length The number of elements.
+	 */
+	template <typename T>
+	inline void readVectorImpl(std::vector<T>& value, uint32 length, boost::mpl::false_ /*non_bulk_copy*/)
+	{
+		// since we know the number of elements to read, just reserve it first for better performance
+		value.reserve(length);
+		for(uint32 i = 0; i < length; ++i)
+		{
+			T x; read(x);
+			value.push_back(x);
+		}
+	}
+
 	/**
 	 * @brief Read a std::pair<K, V> object.
 	 *
@@ -1706,7 +2939,7 @@ public:
 	template <typename T>
 	inline void readBuiltin(std::list<T>& value)
 	{
-		uint32 length; readDirect(length);
+		uint32 length; readLength(length);
 		if(LIKELY(length <= MAX_LIST_LENGTH))
 		{
 			value.clear();
@@ -1730,7 +2963,7 @@ public:
 	template <typename K, typename V>
 	inline void readBuiltin(std::map<K,V>& value)
 	{
-		uint32 length; readDirect(length);
+		uint32 length; readLength(length);
 		if(LIKELY(length <= MAX_LIST_LENGTH))
 		{
 			value.clear();
@@ -1748,86 +2981,303 @@ public:
 	}
 
 	/**
-	 * @brief Read a boost::array<T,N> object.
+	 * @brief Read a std::deque<T> object.
 	 *
-	 * @param value The boost::array<T,N> variable to be read.
+	 * @param value The std::deque<T> variable to be read.
 	 */
-	template <typename T, std::size_t N>
-	inline void readBuiltin(boost::array<T, N>& value)
+	template <typename T>
+	inline void readBuiltin(std::deque<T>& value)
 	{
-		uint32 length; readDirect(length);
-		if(LIKELY(length == N * sizeof(T)))
+		uint32 length; readLength(length);
+		if(LIKELY(length <= MAX_LIST_LENGTH))
 		{
-			readBoostArrayImpl(value, boost::mpl::bool_< is_direct_types<T>::value >());
+			value.clear();
+			readDequeImpl(value, length, boost::mpl::bool_< is_bulk_types<T>::value >());
 		}
 		else
 		{
-			BOOST_ASSERT(length == N * sizeof(T));
+			BOOST_ASSERT(length <= MAX_LIST_LENGTH);
 		}
 	}
 
 	/**
-	 * @brief Read a boost::system::error_code object.
+	 * @brief The deque element can be copied directly, so read each contiguous block of elements by a single memory copy.
 	 *
-	 * @param value The boost::system::error_code to be read.
+	 * @param value The std::deque<T> variable to be read.
+	 * @param length The number of elements.
 	 */
-	inline void readBuiltin(boost::system::error_code &value)
+	template <typename T>
+	inline void readDequeImpl(std::deque<T>& value, uint32 length, boost::mpl::true_ /*bulk_copy*/)
 	{
-		int32 code; readDirect(code);
-		int32 category; readDirect(category);
+		if(is_compact_types<T>::value && mEncoding == BufferEncoding::compact)
+		{
+			readDequeImpl(value, length, boost::mpl::false_());
+			return;
+		}
 
-		switch(category)
+		value.resize(length);
+		typename std::deque<T>::iterator i = value.begin();
+		for(std::size_t remaining = length; remaining > 0; )
 		{
-		case 0:
-			value.assign(code, boost::system::get_system_category()); break;
-		case 1:
-			value.assign(code, boost::system::get_generic_category()); break;
-		case 2:
-			value.assign(code, boost::system::get_posix_category()); break;
-		default:
-			BOOST_ASSERT("reading unknown boost::system::error_code category code" && 0);
-			break;
+			std::size_t n = getDequeRunLength(i, remaining);
+			readFixedArray(&*i, n);
+			i += n;
+			remaining -= n;
 		}
 	}
 
 	/**
-	 * @brief Read another BufferBase object.
+	 * @brief The deque element is not native types, read the element one by one.
 	 *
-	 * @param value The BufferBase variable to be read.
+	 * @param value The std::deque<T> variable to be read.
+	 * @param length The number of elements.
 	 */
-	template<BufferMode::type M, BufferConcurrency::type C>
-	inline void readBuiltin(BufferBase<M, C>& value)
+	template <typename T>
+	inline void readDequeImpl(std::deque<T>& value, uint32 length, boost::mpl::false_ /*non_bulk_copy*/)
 	{
-		uint32 length; readDirect(length);
-
-		BOOST_ASSERT(dataSize() >= length);
-
-		value.append(*this, length);
+		for(uint32 i = 0; i < length; ++i)
+		{
+			T x; read(x);
+			value.push_back(x);
+		}
 	}
 
 	/**
-	 * @brief The array element is native types, so we can perform direct memory copy to save time
+	 * @brief Read a std::set<T> object.
 	 *
-	 * @param value The boost::array<T,N> variable to be read.
+	 * @param value The std::set<T> variable to be read.
 	 */
-	template <typename T, std::size_t N>
-	inline void readBoostArrayImpl(boost::array<T, N>& value, boost::mpl::true_ /*native_copy*/)
+	template <typename T>
+	inline void readBuiltin(std::set<T>& value)
 	{
-		readArray((char*)value.data(), N * sizeof(T));
+		uint32 length; readLength(length);
+		if(LIKELY(length <= MAX_LIST_LENGTH))
+		{
+			value.clear();
+			readSetImpl(value, length);
+		}
+		else
+		{
+			BOOST_ASSERT(length <= MAX_LIST_LENGTH);
+		}
 	}
 
+#ifdef __GXX_EXPERIMENTAL_CXX0X__
 	/**
-	 * @brief The array element is not native types, read the element one by one
+	 * @brief Read a std::unordered_set<T> object.
 	 *
-	 * @param value The boost::array<T,N> variable to be read.
+	 * @param value The std::unordered_set<T> variable to be read.
 	 */
-	template <typename T, std::size_t N>
-	inline void readBoostArrayImpl(boost::array<T, N>& value, boost::mpl::false_ /*non_native_copy*/)
+	template <typename T>
+	inline void readBuiltin(std::unordered_set<T>& value)
 	{
-		for(int i=0;i<N;++i)
+		uint32 length; readLength(length);
+		if(LIKELY(length <= MAX_LIST_LENGTH))
 		{
-			read(value[i]);
-		}
+			value.clear();
+			value.reserve(length);
+			readSetImpl(value, length);
+		}
+		else
+		{
+			BOOST_ASSERT(length <= MAX_LIST_LENGTH);
+		}
+	}
+
+	/**
+	 * @brief Read a std::unordered_map<K,V> object.
+	 *
+	 * @param value The std::unordered_map<K,V> variable to be read.
+	 */
+	template <typename K, typename V>
+	inline void readBuiltin(std::unordered_map<K,V>& value)
+	{
+		uint32 length; readLength(length);
+		if(LIKELY(length <= MAX_LIST_LENGTH))
+		{
+			value.clear();
+			// presize the buckets so that the insertion never rehashes
+			value.reserve(length);
+			for(uint32 i = 0; i < length; ++i)
+			{
+				K k; read(k);
+				read(value[k]);
+			}
+		}
+		else
+		{
+			BOOST_ASSERT(length <= MAX_LIST_LENGTH);
+		}
+	}
+
+	/**
+	 * @brief Read a std::tuple object.
+	 *
+	 * @param value The std::tuple variable to be read.
+	 */
+	template <typename... Types>
+	inline void readBuiltin(std::tuple<Types...>& value)
+	{
+		readStdTuple<0>(value, boost::mpl::bool_<sizeof...(Types) == 0>());
+	}
+
+	template <std::size_t I, typename Tuple>
+	inline void readStdTuple(Tuple& value, boost::mpl::false_ /* is_end */)
+	{
+		read(std::get<I>(value));
+		readStdTuple<I + 1>(value, boost::mpl::bool_<I + 1 == std::tuple_size<Tuple>::value>());
+	}
+
+	template <std::size_t I, typename Tuple>
+	inline void readStdTuple(Tuple& value, boost::mpl::true_ /* is_end */)
+	{
+		UNUSED_ARGUMENT(value);
+	}
+#endif
+
+	/**
+	 * @brief Read the elements of a set one by one, since they have to be inserted one by one anyway.
+	 *
+	 * @note Elements are written in iteration order, so the end hint makes the insertion into
+	 * std::set amortized constant time.
+	 *
+	 * @param value The set variable to be read.
+	 * @param length The number of elements.
+	 */
+	template <typename Set>
+	inline void readSetImpl(Set& value, uint32 length)
+	{
+		for(uint32 i = 0; i < length; ++i)
+		{
+			typename Set::value_type x; read(x);
+			value.insert(value.end(), x);
+		}
+	}
+
+	/**
+	 * @brief Read a boost::tuple object.
+	 *
+	 * @param value The boost::tuple variable to be read.
+	 */
+	template <typename T0, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8, typename T9>
+	inline void readBuiltin(boost::tuple<T0, T1, T2, T3, T4, T5, T6, T7, T8, T9>& value)
+	{
+		readBoostTuple(value);
+	}
+
+	template <typename H, typename T>
+	inline void readBoostTuple(boost::tuples::cons<H, T>& value)
+	{
+		read(value.get_head());
+		readBoostTuple(value.get_tail());
+	}
+
+	inline void readBoostTuple(const boost::tuples::null_type& value)
+	{
+		UNUSED_ARGUMENT(value);
+	}
+
+	/**
+	 * @brief Read a boost::optional<T> object.
+	 *
+	 * @param value The boost::optional<T> variable to be read.
+	 */
+	template <typename T>
+	inline void readBuiltin(boost::optional<T>& value)
+	{
+		bool initialized; read(initialized);
+		if(initialized)
+		{
+			T x; read(x);
+			value = x;
+		}
+		else
+		{
+			value.reset();
+		}
+	}
+
+	/**
+	 * @brief Read a boost::array<T,N> object.
+	 *
+	 * @param value The boost::array<T,N> variable to be read.
+	 */
+	template <typename T, std::size_t N>
+	inline void readBuiltin(boost::array<T, N>& value)
+	{
+		uint32 length; readFixed(length);
+		if(LIKELY(length == N * sizeof(T)))
+		{
+			readBoostArrayImpl(value, boost::mpl::bool_< is_direct_types<T>::value || is_bulk_serializable<T>::value >());
+		}
+		else
+		{
+			BOOST_ASSERT(length == N * sizeof(T));
+		}
+	}
+
+	/**
+	 * @brief Read a boost::system::error_code object.
+	 *
+	 * @param value The boost::system::error_code to be read.
+	 */
+	inline void readBuiltin(boost::system::error_code &value)
+	{
+		int32 code; readFixed(code);
+		int32 category; readFixed(category);
+
+		switch(category)
+		{
+		case 0:
+			value.assign(code, boost::system::get_system_category()); break;
+		case 1:
+			value.assign(code, boost::system::get_generic_category()); break;
+		case 2:
+			value.assign(code, boost::system::get_posix_category()); break;
+		default:
+			BOOST_ASSERT("reading unknown boost::system::error_code category code" && 0);
+			break;
+		}
+	}
+
+	/**
+	 * @brief Read another BufferBase object.
+	 *
+	 * @param value The BufferBase variable to be read.
+	 */
+	template<BufferMode::type M, BufferConcurrency::type C>
+	inline void readBuiltin(BufferBase<M, C>& value)
+	{
+		uint32 length; readLength(length);
+
+		BOOST_ASSERT(dataSize() >= length);
+
+		value.append(*this, length);
+	}
+
+	/**
+	 * @brief The array element is native types, so we can perform direct memory copy to save time
+	 *
+	 * @param value The boost::array<T,N> variable to be read.
+	 */
+	template <typename T, std::size_t N>
+	inline void readBoostArrayImpl(boost::array<T, N>& value, boost::mpl::true_ /*native_copy*/)
+	{
+		readFixedArray(value.data(), N);
+	}
+
+	/**
+	 * @brief The array element is not native types, read the element one by one
+	 *
+	 * @param value The boost::array<T,N> variable to be read.
+	 */
+	template <typename T, std::size_t N>
+	inline void readBoostArrayImpl(boost::array<T, N>& value, boost::mpl::false_ /*non_native_copy*/)
+	{
+		for(int i=0;i<N;++i)
+		{
+			read(value[i]);
+		}
 	}
 
 	/**
@@ -1843,17 +3293,502 @@ public:
 	}
 
 	/**
-	 * @brief Read an array of data with given size.
+	 * @brief Read a fixed-width scalar in the current byte order.
+	 *
+	 * @param value The value to be read.
+	 */
+	template <typename T>
+	inline void readFixed(T& value)
+	{
+		readDirect(value);
+		if(UNLIKELY(mSwapBytes))
+			value = byte_swap(value);
+	}
+
+	/**
+	 * @brief Read an array of scalars in the current byte order.
+	 *
+	 * @param dest The pointer to the array.
+	 * @param count The number of elements.
+	 * @param element_size The size of each element.
+	 */
+	inline void readFixedArray(char* dest, std::size_t count, std::size_t element_size)
+	{
+		std::size_t size = count * element_size;
+		if(LIKELY(!mSwapBytes) || element_size == 1)
+		{
+			readArray(dest, size);
+		}
+		else if(Mode != BufferMode::circular || rpos() + size <= mAllocatedSize)
+		{
+			// convert straight from the buffer
+			BOOST_ASSERT(size <= dataSize());
+			byte_swap_array(dest, rptr(), count, element_size);
+			rskip(size);
+		}
+		else
+		{
+			readArray(dest, size);
+			byte_swap_array(dest, dest, count, element_size);
+		}
+	}
+
+	/**
+	 * @brief Read an array of elements in the current byte order, where only arithmetic elements are converted.
+	 *
+	 * @param dest The pointer to the array.
+	 * @param count The number of elements.
+	 */
+	template <typename T>
+	inline void readFixedArray(T* dest, std::size_t count)
+	{
+		checkBulkByteOrder<T>();
+		if(boost::is_arithmetic<T>::value)
+			readFixedArray((char*)dest, count, sizeof(T));
+		else
+			readArray((char*)dest, count * sizeof(T));
+	}
+
+	/**
+	 * @brief Read an array of data with given size.
+	 *
+	 * @param dest The pointer to the array.
+	 * @param size The given size to be read.
+	 */
+	inline void readArray(char* dest, std::size_t size)
+	{
+		if(UNLIKELY(!dest))	return;
+
+		if(UNLIKELY(mReadChecksumActive))
+		{
+			// checksum the data while copying it out
+			mReadChecksum = getArrayChecksum(mReadChecksum, dest, rpos(), size);
+			moveReadPointer(size);
+			return;
+		}
+
+		getArray(dest, rpos(), size);
+		rskip(size);
+	}
+
+	/**
+	 * @brief Read a string (or any length-prefixed byte array) as a view into the buffer without copying.
+	 *
+	 * @note For circular buffer, the data is crunched first if it wraps around the end
+	 * of the internal data array, which invalidates previously returned views (and
+	 * throws std::logic_error for mpsc buffer).
+	 *
+	 * @return The view of the string.
+	 */
+	inline BufferSpan<char> readView()
+	{
+		uint32 length; readLength(length);
+		BOOST_ASSERT(length <= MAX_STRING_LENGTH);
+		return readView(length);
+	}
+
+	/**
+	 * @brief Read the given number of bytes as a view into the buffer without copying.
+	 *
+	 * @param size The number of bytes to read.
+	 * @return The view of the data.
+	 */
+	inline BufferSpan<char> readView(std::size_t size)
+	{
+		BOOST_ASSERT(size <= dataSize());
+
+		ensureContiguous(size);
+		BufferSpan<char> view((const char*)rptr(), size);
+		rskip(size);
+		return view;
+	}
+
+	/**
+	 * @brief Read an array written as std::vector<T> (or std::wstring) as a view into the buffer without copying.
+	 *
+	 * @note Only types which can be copied directly are supported, and integer types are not
+	 * supported in compact encoding (because they are written as varint). Multi-byte scalars
+	 * are not supported if the byte order differs from the host's.
+	 *
+	 * @note The view may not be aligned to T.
+	 *
+	 * @return The view of the array.
+	 */
+	template <typename T>
+	inline BufferSpan<T> readSpan()
+	{
+		BOOST_STATIC_ASSERT(is_bulk_types<T>::value || (boost::is_same<T, wchar_t>::value));
+		BOOST_ASSERT(!is_compact_types<T>::value || mEncoding == BufferEncoding::fixed);
+		BOOST_ASSERT(!mSwapBytes || sizeof(T) == 1 || !boost::is_arithmetic<T>::value);
+		checkBulkByteOrder<T>();
+
+		uint32 length; readLength(length);
+		BOOST_ASSERT(length <= MAX_VECTOR_LENGTH);
+
+		std::size_t size = length * sizeof(T);
+		BOOST_ASSERT(size <= dataSize());
+
+		ensureContiguous(size);
+		BufferSpan<T> span((const T*)rptr(), length);
+		rskip(size);
+		return span;
+	}
+
+	/**
+	 * @brief Iterate over length-prefixed records (written by writeSized()) by views.
+	 *
+	 * Nothing is consumed if there's no complete record available, so this can be used
+	 * to process a stream of records incrementally:
+	 * @code
+	 * 		BufferSpan<char> record;
+	 * 		while(buffer.nextView(record))
+	 * 		{
+	 * 			...
+	 * 		}
+	 * @endcode
+	 *
+	 * @note Records left by abandon() are skipped.
+	 *
+	 * @param view The view of the next record (excluding the length prefix).
+	 * @return True if a complete record is available, false otherwise.
+	 */
+	inline bool nextView(BufferSpan<char>& view)
+	{
+		skipAbandoned();
+		uint32 length;
+		if(!peekFrame(0, dataSize(), length))
+			return false;
+
+		rskip(sizeof(uint32));
+		view = readView(length);
+		return true;
+	}
+
+	/**
+	 * @brief Extract all complete length-prefixed frames (written by writeSized() or
+	 * beginFrame()/endFrame()) currently in the buffer as contiguous views.
+	 *
+	 * The buffer is scanned once to find the extent of complete frames. If that extent
+	 * wraps around the end of a circular buffer, the buffer is crunched once so every view
+	 * is contiguous; otherwise nothing is copied. An incomplete trailing frame is left
+	 * in the buffer, and records left by abandon() are skipped.
+	 *
+	 * @note The views are invalidated by any further write to the buffer. Use the
+	 * BufferFrame overload to avoid crunching circular buffer.
+	 *
+	 * @param frames The vector to append the views (excluding the length prefix) to.
+	 * @param max_frames The maximum number of frames to extract.
+	 * @return The number of frames extracted.
+	 */
+	inline std::size_t readFrames(std::vector<BufferSpan<char> >& frames, std::size_t max_frames = std::numeric_limits<std::size_t>::max())
+	{
+		skipAbandoned();
+
+		std::size_t available = dataSize();
+		std::size_t extent = 0;
+		std::size_t count = 0;
+		uint32 length;
+		bool abandoned;
+		while(count < max_frames && peekFrame(extent, available, length, abandoned))
+		{
+			extent += sizeof(uint32) + length;
+			if(!abandoned)
+				++count;
+		}
+
+		if(count == 0)
+			return 0;
+
+		ensureContiguous(extent);
+		frames.reserve(frames.size() + count);
+		for(std::size_t i = 0; i < count; ++i)
+		{
+			skipAbandoned();
+			readFixed(length);
+			frames.push_back(readView(length));
+		}
+		return count;
+	}
+
+	/**
+	 * @brief Extract all complete length-prefixed frames currently in the buffer as
+	 * memory ranges, without copying or crunching.
+	 *
+	 * A frame wrapping around the end of a circular buffer is described by two ranges,
+	 * which can be handed to scatter-gather I/O or copied out by BufferFrame::copyTo().
+	 * An incomplete trailing frame is left in the buffer, and records left by abandon()
+	 * are skipped.
+	 *
+	 * @note The frames are invalidated by any further write to the buffer.
+	 *
+	 * @param frames The vector to append the frames to.
+	 * @param max_frames The maximum number of frames to extract.
+	 * @return The number of frames extracted.
+	 */
+	inline std::size_t readFrames(std::vector<BufferFrame>& frames, std::size_t max_frames = std::numeric_limits<std::size_t>::max())
+	{
+		std::size_t count = 0;
+		uint32 length;
+		while(count < max_frames)
+		{
+			skipAbandoned();
+			if(!peekFrame(0, dataSize(), length))
+				break;
+
+			rskip(sizeof(uint32));
+
+			BufferFrame frame;
+			std::size_t position = rpos();
+			if(Mode == BufferMode::circular && position + length > mAllocatedSize)
+			{
+				frame.ranges[frame.count++] = std::make_pair(mData + position, mAllocatedSize - position);
+				frame.ranges[frame.count++] = std::make_pair(mData, position + length - mAllocatedSize);
+			}
+			else if(length > 0)
+			{
+				frame.ranges[frame.count++] = std::make_pair(mData + position, (std::size_t)length);
+			}
+			frames.push_back(frame);
+
+			rskip(length);
+			++count;
+		}
+		return count;
+	}
+
+	/**
+	 * @brief Make sure the given size of data at the read pointer is contiguous in memory.
+	 *
+	 * @note Only circular buffer may need to crunch, as plain and mirrored buffer are always contiguous.
+	 *
+	 * @param size The size of data.
+	 */
+	inline void ensureContiguous(std::size_t size)
+	{
+		if(Mode == BufferMode::circular && rpos() + size > mAllocatedSize)
+		{
+			crunch();
+		}
+	}
+
+public:
+	/**
+	 * @brief Reserve the given size of free space for a producer of mpsc buffer.
+	 *
+	 * In mpsc mode, producers claim space concurrently by reserve(), fill the reserved
+	 * space in parallel by setDirect()/setArray() and publish it by commit(). The consumer
+	 * only sees committed data, and commits are published in the order of reservation, so
+	 * every reservation must end with either commit() or abandon().
+	 *
+	 * @code
+	 * 		std::size_t position;
+	 * 		if(buffer.reserve(size, position))
+	 * 		{
+	 * 			buffer.setArray(message, position, size);
+	 * 			buffer.commit(position, size);
+	 * 		}
+	 * @endcode
+	 *
+	 * @note The mpsc buffer never grows, so it must be constructed with a fixed size. For
+	 * plain buffer, the space consumed by the reader is not reusable until clear() is called
+	 * (when there's no producer).
+	 *
+	 * @param size The size to reserve.
+	 * @param position The position of the reserved space.
+	 * @return True if the space is reserved, false if there's not enough free space.
+	 */
+	inline bool reserve(std::size_t size, std::size_t& position)
+	{
+		BOOST_STATIC_ASSERT(Concurrency == BufferConcurrency::mpsc);
+		BOOST_ASSERT(!mReadOnly);
+
+		while(true)
+		{
+			std::size_t current = mReservePos;
+			std::size_t next = current + size;
+
+			if(Mode == BufferMode::plain)
+			{
+				if(next > mAllocatedSize)
+					return false;
+			}
+			else
+			{
+				// the snapshot of read pointer may be stale, which only underestimates the free space
+				std::size_t current_rpos = rpos();
+				std::size_t used = (current >= current_rpos) ? current - current_rpos : mAllocatedSize - current_rpos + current;
+				if(used + size + 1 > mAllocatedSize)
+					return false;
+				if(next >= mAllocatedSize)
+					next -= mAllocatedSize;
+			}
+
+			if(atomic::b_cas(&mReservePos, next, current))
+			{
+				position = current;
+				return true;
+			}
+		}
+	}
+
+	/**
+	 * @brief Publish the reserved space to the consumer of mpsc buffer.
+	 *
+	 * @note The commit waits until all previous reservations are committed or abandoned.
+	 *
+	 * @param position The position of the reserved space returned by reserve().
+	 * @param size The reserved size.
+	 */
+	inline void commit(std::size_t position, std::size_t size)
+	{
+		BOOST_STATIC_ASSERT(Concurrency == BufferConcurrency::mpsc);
+
+		std::size_t next = position + size;
+		if(Mode != BufferMode::plain && next >= mAllocatedSize)
+			next -= mAllocatedSize;
+
+		for(int spin = 0; !atomic::b_cas(&mWritePos, next, position); ++spin)
+		{
+			if(spin > 64)
+				boost::this_thread::yield();
+		}
+	}
+
+	/**
+	 * @brief Give up the reserved space of mpsc buffer, i.e. when the producer fails to fill it.
+	 *
+	 * If nothing has been reserved after it, the space is returned. Otherwise the later commits
+	 * wait for this one, so the space is published like commit() as a skip record: a uint32
+	 * header holding FRAME_ABANDONED and the length of the rest of the space. The skip record
+	 * is consumed by readSized(), nextView() and readFrames(), so a stream of length-prefixed
+	 * records stays readable.
+	 *
+	 * @note The size must be at least sizeof(uint32) to hold the header, which always holds for
+	 * length-prefixed records.
+	 *
+	 * @param position The position of the reserved space returned by reserve().
+	 * @param size The reserved size.
+	 */
+	inline void abandon(std::size_t position, std::size_t size)
+	{
+		BOOST_STATIC_ASSERT(Concurrency == BufferConcurrency::mpsc);
+
+		std::size_t next = position + size;
+		if(Mode != BufferMode::plain && next >= mAllocatedSize)
+			next -= mAllocatedSize;
+
+		if(atomic::b_cas(&mReservePos, position, next))
+			return;
+
+		BOOST_ASSERT(size >= sizeof(uint32));
+		uint32 header = FRAME_ABANDONED | (uint32)(size - sizeof(uint32));
+		setDirect(mSwapBytes ? byte_swap(header) : header, position);
+		commit(position, size);
+	}
+
+	/**
+	 * @brief Write an arbitrary variable into mpsc buffer as a whole by reserve() and commit().
+	 *
+	 * @param value The value to be written.
+	 * @return True if the value is written, false if there's not enough free space.
+	 */
+	template <typename T>
+	inline bool tryWrite(const T& value)
+	{
+		std::size_t size = probeSize(value, mEncoding);
+		std::size_t position;
+		if(!reserve(size, position))
+			return false;
+
+		try
+		{
+			if(Mode != BufferMode::circular || position + size <= mAllocatedSize)
+			{
+				BufferBase<BufferMode::plain, BufferConcurrency::none> view(mData + position, size);
+				view.setEncoding(mEncoding);
+				view.setByteOrder(mByteOrder);
+				view.write(value);
+			}
+			else
+			{
+				// the reserved space wraps around the end of the internal data array
+				BufferBase<BufferMode::plain, BufferConcurrency::none> temporary(size);
+				temporary.setEncoding(mEncoding);
+				temporary.setByteOrder(mByteOrder);
+				temporary.write(value);
+				setArray((const char*)temporary.rptr(), position, size);
+			}
+		}
+		catch(...)
+		{
+			abandon(position, size);
+			throw;
+		}
+
+		commit(position, size);
+		return true;
+	}
+
+	/**
+	 * @brief Read an integer in the current encoding.
+	 *
+	 * @param value The integer to be read.
+	 */
+	template <typename T>
+	inline void readInteger(T& value)
+	{
+		if(mEncoding == BufferEncoding::compact)
+		{
+			value = decodeZigzag<T>(readVarint(), boost::mpl::bool_<boost::is_signed<T>::value>());
+		}
+		else
+		{
+			readFixed(value);
+		}
+	}
+
+	/**
+	 * @brief Read a length prefix (of string, container, etc.) in the current encoding.
+	 *
+	 * @param length The length to be read.
+	 */
+	inline void readLength(uint32& length)
+	{
+		if(mEncoding == BufferEncoding::compact)
+		{
+			length = (uint32)readVarint();
+		}
+		else
+		{
+			readFixed(length);
+		}
+	}
+
+	/**
+	 * @brief Read an unsigned LEB128 varint.
 	 *
-	 * @param dest The pointer to the array.
-	 * @param size The given size to be read.
+	 * @note Values less than 128 (the common case of small ids and counts) take the single-byte fast path.
+	 *
+	 * @return The decoded value.
 	 */
-	inline void readArray(char* dest, std::size_t size)
+	inline uint64 readVarint()
 	{
-		if(UNLIKELY(!dest))	return;
+		uint8 b; getDirect(b, rpos());
+		if(LIKELY(b < 0x80))
+		{
+			rskip(1);
+			return b;
+		}
 
-		getArray(dest, rpos(), size);
-		rskip(size);
+		uint64 value = 0;
+		for(int shift = 0; shift < 64; shift += 7)
+		{
+			readDirect(b);
+			value |= (uint64)(b & 0x7F) << shift;
+			if(!(b & 0x80))
+				break;
+		}
+		return value;
 	}
 
 public:
@@ -1871,6 +3806,20 @@ public:
 
 	template <typename T>
 	inline void writeDispatch(const T& value, boost::mpl::false_ /*is_builtin_types*/)
+	{
+		writeDispatchSerializable(value, boost::mpl::bool_< is_bulk_serializable<T>::value >() );
+	}
+
+	template <typename T>
+	inline void writeDispatchSerializable(const T& value, boost::mpl::true_ /*is_bulk_serializable*/)
+	{
+		BOOST_STATIC_ASSERT(boost::has_trivial_copy<T>::value);
+		checkBulkByteOrder<T>();
+		writeAny(value);
+	}
+
+	template <typename T>
+	inline void writeDispatchSerializable(const T& value, boost::mpl::false_ /*is_bulk_serializable*/)
 	{
 		writeSerializable(value);
 	}
@@ -1934,6 +3883,128 @@ public:
 		(const_cast<T&>(value)).serialize(ar, /*UNUSED*/ 0 );
 	}
 
+	/**
+	 * @brief Write an object with its length prefix in a single pass.
+	 *
+	 * A uint32 placeholder is reserved first, the object is serialized once (growing
+	 * the buffer on demand), and then the actual length is patched into the placeholder
+	 * by setDirect(), so there's no need to traverse the object by probeSize() beforehand.
+	 *
+	 * @note The length prefix is always a fixed-width uint32 (regardless of encoding) so
+	 * it can be patched in place.
+	 *
+	 * @note The placeholder is visible before it's patched, so don't use this with a
+	 * concurrent reader.
+	 *
+	 * @param value The value to be written.
+	 * @return The length of the serialized object (excluding the prefix).
+	 */
+	template <typename T>
+	inline std::size_t writeSized(const T& value)
+	{
+		std::size_t frame = beginFrame();
+		write(value);
+		return endFrame(frame);
+	}
+
+	/**
+	 * @brief Start a length-prefixed frame by reserving its uint32 length slot.
+	 *
+	 * Any number of values can be written afterwards, and endFrame() patches the total
+	 * length into the slot. The result is identical to writeSized() and can be read back
+	 * by readSized(), nextView() or readFrames().
+	 *
+	 * @code
+	 * 		std::size_t frame = buffer.beginFrame();
+	 * 		buffer << header << payload;
+	 * 		buffer.endFrame(frame);
+	 * @endcode
+	 *
+	 * @note The slot is visible before it's patched, so don't use this with a concurrent
+	 * reader, and don't read from the buffer before the frame is ended.
+	 *
+	 * @return The frame handle to be passed to endFrame().
+	 */
+	inline std::size_t beginFrame()
+	{
+		BOOST_ASSERT(!mReadOnly);
+
+		// keep the slot offset relative to the read pointer, which stays valid even
+		// if the buffer is resized (and crunched) while the frame is written
+		std::size_t frame = dataSize();
+		writeDirect((uint32)0);
+		return frame;
+	}
+
+	/**
+	 * @brief End a length-prefixed frame started by beginFrame() by patching its length slot.
+	 *
+	 * @param frame The frame handle returned by beginFrame().
+	 * @return The length of the frame (excluding the length slot).
+	 */
+	inline std::size_t endFrame(std::size_t frame)
+	{
+		std::size_t length = dataSize() - frame - sizeof(uint32);
+		std::size_t position = rpos() + frame;
+		if(Mode != BufferMode::plain && position >= mAllocatedSize)
+			position -= mAllocatedSize;
+
+		setDirect(mSwapBytes ? byte_swap((uint32)length) : (uint32)length, position);
+		return length;
+	}
+
+	/**
+	 * @brief Write the given array as a length-prefixed frame.
+	 *
+	 * @param source The pointer to the payload.
+	 * @param size The payload size.
+	 */
+	inline void writeFrame(const char* source, std::size_t size)
+	{
+		writeFixed((uint32)size);
+		writeArray(source, size);
+	}
+
+	/**
+	 * @brief Write an object followed by a CRC32C trailer of its serialized data.
+	 *
+	 * The checksum is computed incrementally as the object is written (while the data is
+	 * still in cache), so there's no separate pass over the frame.
+	 *
+	 * @param value The value to be written.
+	 */
+	template <typename T>
+	inline void writeChecked(const T& value)
+	{
+		beginWriteChecksum();
+		write(value);
+		writeFixed(endWriteChecksum());
+	}
+
+	/**
+	 * @brief Start computing the CRC32C of all data written afterwards.
+	 *
+	 * @note Data patched in place afterwards (i.e. the length prefix of writeSized()) is
+	 * not reflected in the checksum, so writeSized() should wrap writeChecked() but not
+	 * the other way around.
+	 */
+	inline void beginWriteChecksum()
+	{
+		mWriteChecksum = CRC32C_INIT;
+		mWriteChecksumActive = true;
+	}
+
+	/**
+	 * @brief Stop computing the checksum started by beginWriteChecksum().
+	 *
+	 * @return The CRC32C of the data written in between.
+	 */
+	inline uint32 endWriteChecksum()
+	{
+		mWriteChecksumActive = false;
+		return crc32c_final(mWriteChecksum);
+	}
+
 	/**
 	 * @brief Write an int8 (1 byte) variable.
 	 *
@@ -1961,7 +4032,7 @@ public:
 	 */
 	inline void writeBuiltin(const int16& value)
 	{
-		writeDirect(value);
+		writeInteger(value);
 	}
 
 	/**
@@ -1971,7 +4042,7 @@ public:
 	 */
 	inline void writeBuiltin(const uint16& value)
 	{
-		writeDirect(value);
+		writeInteger(value);
 	}
 
 	/**
@@ -1981,7 +4052,7 @@ public:
 	 */
 	inline void writeBuiltin(const int32& value)
 	{
-		writeDirect(value);
+		writeInteger(value);
 	}
 
 	/**
@@ -1991,7 +4062,7 @@ public:
 	 */
 	inline void writeBuiltin(const long long int& value)
 	{
-		writeDirect(value);
+		writeInteger(value);
 	}
 
 	/**
@@ -2001,7 +4072,7 @@ public:
 	 */
 	inline void writeBuiltin(const uint32& value)
 	{
-		writeDirect(value);
+		writeInteger(value);
 	}
 
 	/**
@@ -2011,7 +4082,7 @@ public:
 	 */
 	inline void writeBuiltin(const int64& value)
 	{
-		writeDirect(value);
+		writeInteger(value);
 	}
 
 	/**
@@ -2021,7 +4092,7 @@ public:
 	 */
 	inline void writeBuiltin(const uint64& value)
 	{
-		writeDirect(value);
+		writeInteger(value);
 	}
 
 	/**
@@ -2031,7 +4102,7 @@ public:
 	 */
 	inline void writeBuiltin(const unsigned long long int& value)
 	{
-		writeDirect(value);
+		writeInteger(value);
 	}
 
 	/**
@@ -2041,7 +4112,7 @@ public:
 	 */
 	inline void writeBuiltin(const float& value)
 	{
-		writeDirect(value);
+		writeFixed(value);
 	}
 
 	/**
@@ -2051,7 +4122,7 @@ public:
 	 */
 	inline void writeBuiltin(const double& value)
 	{
-		writeDirect(value);
+		writeFixed(value);
 	}
 
 	/**
@@ -2075,7 +4146,7 @@ public:
 		uint32 length = value.length();
 		if(LIKELY(length <= MAX_STRING_LENGTH))
 		{
-			writeDirect(length);
+			writeLength(length);
 			writeArray((const char*)value.data(), length);
 		}
 		else
@@ -2092,11 +4163,10 @@ public:
 	inline void writeBuiltin(const std::wstring& value)
 	{
 		uint32 length = value.length();
-		uint32 bytes_count = length * sizeof(wchar_t);
 		if(LIKELY(length <= MAX_STRING_LENGTH))
 		{
-			writeDirect(length);
-			writeArray((const char*)value.data(), bytes_count);
+			writeLength(length);
+			writeFixedArray((const char*)value.data(), length, sizeof(wchar_t));
 		}
 		else
 		{
@@ -2114,7 +4184,7 @@ public:
 		uint32 length = strlen(value);
 		if(LIKELY(length <= MAX_STRING_LENGTH))
 		{
-			writeDirect(length);
+			writeLength(length);
 			writeArray(value, length);
 		}
 		else
@@ -2145,11 +4215,8 @@ public:
 		uint32 length = value.size();
 		if(LIKELY(length <= MAX_VECTOR_LENGTH))
 		{
-			writeDirect(length);
-			for(typename std::vector<T>::const_iterator i = value.begin(); i != value.end(); ++i)
-			{
-				write(*i);
-			}
+			writeLength(length);
+			writeVectorImpl(value, boost::mpl::bool_< is_bulk_types<T>::value >());
 		}
 		else
 		{
@@ -2157,6 +4224,38 @@ public:
 		}
 	}
 
+	/**
+	 * @brief The vector element can be copied directly, so write all elements by a single memory copy.
+	 *
+	 * @param value The std::vector<T> variable to be written.
+	 */
+	template <typename T>
+	inline void writeVectorImpl(const std::vector<T>& value, boost::mpl::true_ /*bulk_copy*/)
+	{
+		if(is_compact_types<T>::value && mEncoding == BufferEncoding::compact)
+		{
+			writeVectorImpl(value, boost::mpl::false_());
+		}
+		else if(!value.empty())
+		{
+			writeFixedArray(&value[0], value.size());
+		}
+	}
+
+	/**
+	 * @brief The vector element is not native types, write the element one by one.
+	 *
+	 * @param value The std::vector<T> variable to be written.
+	 */
+	template <typename T>
+	inline void writeVectorImpl(const std::vector<T>& value, boost::mpl::false_ /*non_bulk_copy*/)
+	{
+		for(typename std::vector<T>::const_iterator i = value.begin(); i != value.end(); ++i)
+		{
+			write(*i);
+		}
+	}
+
 	/**
 	 * @brief Write a std::list<T> object.
 	 *
@@ -2168,7 +4267,7 @@ public:
 		uint32 length = value.size();
 		if(LIKELY(length <= MAX_VECTOR_LENGTH))
 		{
-			writeDirect(length);
+			writeLength(length);
 			for(typename std::list<T>::const_iterator i = value.begin(); i != value.end(); ++i)
 			{
 				write(*i);
@@ -2191,7 +4290,7 @@ public:
 		uint32 length = value.size();
 		if(LIKELY(length <= MAX_VECTOR_LENGTH))
 		{
-			writeDirect(length);
+			writeLength(length);
 			for(typename std::map<K,V>::const_iterator i = value.begin(); i != value.end(); ++i)
 			{
 				write(i->first);
@@ -2204,6 +4303,225 @@ public:
 		}
 	}
 
+	/**
+	 * @brief Write a std::deque<T> object.
+	 *
+	 * @param value The std::deque<T> variable to be written.
+	 */
+	template <typename T>
+	inline void writeBuiltin(const std::deque<T>& value)
+	{
+		uint32 length = value.size();
+		if(LIKELY(length <= MAX_LIST_LENGTH))
+		{
+			writeLength(length);
+			writeDequeImpl(value, boost::mpl::bool_< is_bulk_types<T>::value >());
+		}
+		else
+		{
+			BOOST_ASSERT(length <= MAX_LIST_LENGTH);
+		}
+	}
+
+	/**
+	 * @brief The deque element can be copied directly, so write each contiguous block of elements by a single memory copy.
+	 *
+	 * @param value The std::deque<T> variable to be written.
+	 */
+	template <typename T>
+	inline void writeDequeImpl(const std::deque<T>& value, boost::mpl::true_ /*bulk_copy*/)
+	{
+		if(is_compact_types<T>::value && mEncoding == BufferEncoding::compact)
+		{
+			writeDequeImpl(value, boost::mpl::false_());
+			return;
+		}
+
+		typename std::deque<T>::const_iterator i = value.begin();
+		for(std::size_t remaining = value.size(); remaining > 0; )
+		{
+			std::size_t n = getDequeRunLength(i, remaining);
+			writeFixedArray(&*i, n);
+			i += n;
+			remaining -= n;
+		}
+	}
+
+	/**
+	 * @brief Get the number of contiguous elements from a std::deque iterator, i.e. to the end of its block.
+	 *
+	 * @note std::deque stores elements in fixed-size blocks, so the run is found by comparing the
+	 * addresses of adjacent elements, which only relies on the standard iterator interface.
+	 *
+	 * @param i The iterator.
+	 * @param remaining The number of elements after the iterator (inclusive), which bounds the result.
+	 * @return The number of elements which can be copied at once.
+	 */
+	template <typename Iterator>
+	inline static std::size_t getDequeRunLength(const Iterator& i, std::size_t remaining)
+	{
+		const typename Iterator::value_type* run = &*i;
+		std::size_t n = 1;
+		while(n < remaining && &i[n] == run + n) ++n;
+		return n;
+	}
+
+	/**
+	 * @brief The deque element is not native types, write the element one by one.
+	 *
+	 * @param value The std::deque<T> variable to be written.
+	 */
+	template <typename T>
+	inline void writeDequeImpl(const std::deque<T>& value, boost::mpl::false_ /*non_bulk_copy*/)
+	{
+		for(typename std::deque<T>::const_iterator i = value.begin(); i != value.end(); ++i)
+		{
+			write(*i);
+		}
+	}
+
+	/**
+	 * @brief Write a std::set<T> object.
+	 *
+	 * @param value The std::set<T> variable to be written.
+	 */
+	template <typename T>
+	inline void writeBuiltin(const std::set<T>& value)
+	{
+		uint32 length = value.size();
+		if(LIKELY(length <= MAX_LIST_LENGTH))
+		{
+			writeLength(length);
+			writeSetImpl(value);
+		}
+		else
+		{
+			BOOST_ASSERT(length <= MAX_LIST_LENGTH);
+		}
+	}
+
+#ifdef __GXX_EXPERIMENTAL_CXX0X__
+	/**
+	 * @brief Write a std::unordered_set<T> object.
+	 *
+	 * @param value The std::unordered_set<T> variable to be written.
+	 */
+	template <typename T>
+	inline void writeBuiltin(const std::unordered_set<T>& value)
+	{
+		uint32 length = value.size();
+		if(LIKELY(length <= MAX_LIST_LENGTH))
+		{
+			writeLength(length);
+			writeSetImpl(value);
+		}
+		else
+		{
+			BOOST_ASSERT(length <= MAX_LIST_LENGTH);
+		}
+	}
+
+	/**
+	 * @brief Write a std::unordered_map<K,V> object.
+	 *
+	 * @note The layout is identical to std::map, but the entries are in hash order.
+	 *
+	 * @param value The std::unordered_map<K,V> variable to be written.
+	 */
+	template <typename K, typename V>
+	inline void writeBuiltin(const std::unordered_map<K,V>& value)
+	{
+		uint32 length = value.size();
+		if(LIKELY(length <= MAX_LIST_LENGTH))
+		{
+			writeLength(length);
+			for(typename std::unordered_map<K,V>::const_iterator i = value.begin(); i != value.end(); ++i)
+			{
+				write(i->first);
+				write(i->second);
+			}
+		}
+		else
+		{
+			BOOST_ASSERT(length <= MAX_LIST_LENGTH);
+		}
+	}
+
+	/**
+	 * @brief Write a std::tuple object.
+	 *
+	 * @param value The std::tuple variable to be written.
+	 */
+	template <typename... Types>
+	inline void writeBuiltin(const std::tuple<Types...>& value)
+	{
+		writeStdTuple<0>(value, boost::mpl::bool_<sizeof...(Types) == 0>());
+	}
+
+	template <std::size_t I, typename Tuple>
+	inline void writeStdTuple(const Tuple& value, boost::mpl::false_ /* is_end */)
+	{
+		write(std::get<I>(value));
+		writeStdTuple<I + 1>(value, boost::mpl::bool_<I + 1 == std::tuple_size<Tuple>::value>());
+	}
+
+	template <std::size_t I, typename Tuple>
+	inline void writeStdTuple(const Tuple& value, boost::mpl::true_ /* is_end */)
+	{
+		UNUSED_ARGUMENT(value);
+	}
+#endif
+
+	/**
+	 * @brief Write the elements of a set one by one, since set nodes are not contiguous.
+	 *
+	 * @param value The set variable to be written.
+	 */
+	template <typename Set>
+	inline void writeSetImpl(const Set& value)
+	{
+		for(typename Set::const_iterator i = value.begin(); i != value.end(); ++i)
+		{
+			write(*i);
+		}
+	}
+
+	/**
+	 * @brief Write a boost::tuple object.
+	 *
+	 * @param value The boost::tuple variable to be written.
+	 */
+	template <typename T0, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8, typename T9>
+	inline void writeBuiltin(const boost::tuple<T0, T1, T2, T3, T4, T5, T6, T7, T8, T9>& value)
+	{
+		writeBoostTuple(value);
+	}
+
+	template <typename H, typename T>
+	inline void writeBoostTuple(const boost::tuples::cons<H, T>& value)
+	{
+		write(value.get_head());
+		writeBoostTuple(value.get_tail());
+	}
+
+	inline void writeBoostTuple(const boost::tuples::null_type& value)
+	{
+		UNUSED_ARGUMENT(value);
+	}
+
+	/**
+	 * @brief Write a boost::optional<T> object.
+	 *
+	 * @param value The boost::optional<T> variable to be written.
+	 */
+	template <typename T>
+	inline void writeBuiltin(const boost::optional<T>& value)
+	{
+		bool initialized = value.is_initialized(); write(initialized);
+		if(initialized)
+			write(*value);
+	}
+
 	/**
 	 * @brief Write a std::pair<K,V> object.
 	 *
@@ -2227,8 +4545,8 @@ public:
 		if(LIKELY(N * sizeof(T) <= MAX_ARRAY_LENGTH))
 		{
 			uint32 length = N * sizeof(T);
-			writeDirect(length);
-			writeBoostArrayImpl(value, boost::mpl::bool_< is_direct_types<T>::value >());
+			writeFixed(length);
+			writeBoostArrayImpl(value, boost::mpl::bool_< is_direct_types<T>::value || is_bulk_serializable<T>::value >());
 		}
 		else
 		{
@@ -2243,7 +4561,7 @@ public:
 	 */
 	inline void writeBuiltin(const boost::system::error_code &value)
 	{
-		int32 code = value.value(); writeDirect(code);
+		int32 code = value.value(); writeFixed(code);
 		const boost::system::error_category& category = value.category();
 		int32 cat = 0;
 
@@ -2264,7 +4582,7 @@ public:
 			BOOST_ASSERT("writing unknown boost::system::error_code category" && 0);
 		}
 
-		writeDirect(cat);
+		writeFixed(cat);
 	}
 
 	/**
@@ -2276,7 +4594,7 @@ public:
 	inline void writeBuiltin(const BufferBase<M,C>& value)
 	{
 		uint32 length = value.dataSize();
-		writeDirect(length);
+		writeLength(length);
 
 		BOOST_ASSERT(value.dataSize() >= length);
 
@@ -2292,7 +4610,7 @@ public:
 	template <typename T, std::size_t N>
 	inline void writeBoostArrayImpl(const boost::array<T, N>& value, boost::mpl::true_ /*native_copy*/)
 	{
-		writeArray((const char*)value.data(), N * sizeof(T));
+		writeFixedArray(value.data(), N);
 	}
 
 	/**
@@ -2362,6 +4680,106 @@ public:
 	 * @param size The given size to be written.
 	 */
 	inline void writeArray(const char* source, std::size_t size)
+	{
+		prepareWrite(size);
+		if(UNLIKELY(mWriteChecksumActive))
+		{
+			// checksum the data while copying it in
+			mWriteChecksum = setArrayChecksum(mWriteChecksum, source, wpos(), size);
+			moveWritePointer(size);
+			return;
+		}
+
+		setArray(source, wpos(), size);
+		wskip(size);
+	}
+
+	/**
+	 * @brief Write a fixed-width scalar in the current byte order.
+	 *
+	 * @param value The value to be written.
+	 */
+	template <typename T>
+	inline void writeFixed(const T& value)
+	{
+		if(UNLIKELY(mSwapBytes))
+			writeDirect(byte_swap(value));
+		else
+			writeDirect(value);
+	}
+
+	/**
+	 * @brief Write an array of scalars in the current byte order.
+	 *
+	 * @param source The pointer to the array.
+	 * @param count The number of elements.
+	 * @param element_size The size of each element.
+	 */
+	inline void writeFixedArray(const char* source, std::size_t count, std::size_t element_size)
+	{
+		std::size_t size = count * element_size;
+		if(LIKELY(!mSwapBytes) || element_size == 1)
+		{
+			writeArray(source, size);
+			return;
+		}
+
+		prepareWrite(size);
+		if(Mode != BufferMode::circular || wpos() + size <= mAllocatedSize)
+		{
+			// convert straight into the buffer
+			byte_swap_array(wptr(), source, count, element_size);
+			wskip(size);
+		}
+		else
+		{
+			// the free space wraps around the end, so convert through a small chunk (multiple of any element size)
+			char chunk[256];
+			while(size > 0)
+			{
+				std::size_t n = std::min(size, sizeof(chunk));
+				byte_swap_array(chunk, source, n / element_size, element_size);
+				setArray(chunk, wpos(), n);
+				wskip(n);
+				source += n;
+				size -= n;
+			}
+		}
+	}
+
+	/**
+	 * @brief Write an array of elements in the current byte order, where only arithmetic elements are converted.
+	 *
+	 * @param source The pointer to the array.
+	 * @param count The number of elements.
+	 */
+	template <typename T>
+	inline void writeFixedArray(const T* source, std::size_t count)
+	{
+		checkBulkByteOrder<T>();
+		if(boost::is_arithmetic<T>::value)
+			writeFixedArray((const char*)source, count, sizeof(T));
+		else
+			writeArray((const char*)source, count * sizeof(T));
+	}
+
+	/**
+	 * @brief Make sure the raw memory layout of a type can be copied, which is not the case for
+	 * bulk-serializable types if the byte order differs from the host's.
+	 */
+	template <typename T>
+	inline void checkBulkByteOrder() const
+	{
+		if(is_bulk_serializable<T>::value && UNLIKELY(mSwapBytes))
+			throw std::logic_error("bulk-serializable type can't be converted to another byte order");
+	}
+
+	/**
+	 * @brief Make sure there's enough free space to write the given size of data, grow the buffer if necessary.
+	 *
+	 * @param size The size to be written.
+	 */
+	inline void prepareWrite(std::size_t size)
 	{
 		BOOST_ASSERT(!mReadOnly);
 
@@ -2378,9 +4796,6 @@ public:
 				std::size_t s = current_wpos + size;
 				resize(round_up_to_nearest_power_of_two<uint64>::apply(s));
 			}
-
-			setArray(source, current_wpos, size);
-			wskip(size);
 		}
 		else
 		{
@@ -2395,12 +4810,68 @@ public:
 				std::size_t s = current_size + size;
 				resize(round_up_to_nearest_power_of_two<uint64>::apply(s) + 1);
 			}
+		}
+	}
 
-			setArray(source, wpos(), size);
-			wskip(size);
+	/**
+	 * @brief Write an integer in the current encoding.
+	 *
+	 * @param value The integer to be written.
+	 */
+	template <typename T>
+	inline void writeInteger(const T& value)
+	{
+		if(mEncoding == BufferEncoding::compact)
+		{
+			writeVarint(encodeZigzag(value, boost::mpl::bool_<boost::is_signed<T>::value>()));
+		}
+		else
+		{
+			writeFixed(value);
 		}
 	}
 
+	/**
+	 * @brief Write a length prefix (of string, container, etc.) in the current encoding.
+	 *
+	 * @param length The length to be written.
+	 */
+	inline void writeLength(uint32 length)
+	{
+		if(mEncoding == BufferEncoding::compact)
+		{
+			writeVarint(length);
+		}
+		else
+		{
+			writeFixed(length);
+		}
+	}
+
+	/**
+	 * @brief Write an unsigned LEB128 varint.
+	 *
+	 * @param value The value to be written.
+	 */
+	inline void writeVarint(uint64 value)
+	{
+		if(LIKELY(value < 0x80))
+		{
+			writeDirect((uint8)value);
+			return;
+		}
+
+		uint8 encoded[10];
+		std::size_t size = 0;
+		while(value >= 0x80)
+		{
+			encoded[size++] = (uint8)(value | 0x80);
+			value >>= 7;
+		}
+		encoded[size++] = (uint8)value;
+		writeArray((const char*)encoded, size);
+	}
+
 	/**
 	 * @brief Get an object from the buffer at specific buffer position.
 	 *
@@ -2412,7 +4883,7 @@ public:
 	template <typename T>
 	inline void getDirect(T& t, std::size_t position)
 	{
-		if(Mode == BufferMode::plain)
+		if(Mode != BufferMode::circular)
 		{
 			t = *((T*)(mData + position));
 		}
@@ -2445,7 +4916,7 @@ public:
 	{
 		BOOST_ASSERT(size <= dataSize());
 
-		if(Mode == BufferMode::plain)
+		if(Mode != BufferMode::circular)
 		{
 			if(UNLIKELY(size == 0)) return;
 			::memcpy(dest, mData + position, size);
@@ -2474,112 +4945,461 @@ public:
 	 * @param t Arbitrary type of object reference.
 	 * @param position The specific buffer position.
 	 */
-	template <typename T>
-	inline void setDirect(const T& t, std::size_t position)
+	template <typename T>
+	inline void setDirect(const T& t, std::size_t position)
+	{
+		if(Mode != BufferMode::circular)
+		{
+			*((T*)(mData + position)) = t;
+		}
+		else
+		{
+			// if we just cross the boundary
+			if(position + sizeof(T) > mAllocatedSize)
+			{
+				// TODO use for-loop instead of memcpy
+				std::size_t size_to_end = mAllocatedSize - position;
+				::memcpy(mData + position, ((byte*)&t), size_to_end);
+				::memcpy(mData, ((byte*)&t) + size_to_end, sizeof(T) - size_to_end);
+			}
+			else
+			{
+				*((T*)(mData + position)) = t;
+			}
+		}
+	}
+
+	/**
+	 * @brief Put an array of data into the buffer at specific buffer position
+	 *
+	 * @note Neither the read nor the write pointer is not altered after this call.
+	 *
+	 * @param source The given array to write data in.
+	 * @param position The specific buffer position.
+	 * @param size The specific array size.
+	 */
+	inline void setArray(const char* source, std::size_t position, std::size_t size)
+	{
+		BOOST_ASSERT(size <= freeSize());
+
+		if(Mode != BufferMode::circular)
+		{
+			if(UNLIKELY(size == 0)) return;
+			::memcpy(mData + position, source, size);
+		}
+		else
+		{
+			// if we just cross the boundary
+			if(position + size > mAllocatedSize)
+			{
+				std::size_t size_to_end = mAllocatedSize - position;
+				::memcpy(mData + position, source, size_to_end);
+				::memcpy(mData, source + size_to_end, size - size_to_end);
+			}
+			else
+			{
+				::memcpy(mData + position, source, size);
+			}
+		}
+	}
+
+public:
+	/**
+	 * @brief Append another buffer object.
+	 *
+	 * @note The read pointer of the source buffer object will not be altered, but the write pointer will be updated.
+	 *
+	 * @param source The buffer object to be read.
+	 */
+	inline void append(BufferBase &source)
+	{
+		BOOST_ASSERT(source.dataSize() <= freeSize());
+		append(source, source.dataSize());
+	}
+
+	/**
+	 * @brief Append another buffer object with specific size.
+	 *
+	 * @note The write pointer will be updated.
+	 *
+	 * @param source The buffer object to be read.
+	 * @param size The specific data size to append.
+	 */
+	template<BufferMode::type M, BufferConcurrency::type C>
+	inline void append(BufferBase<M, C> &source, std::size_t size)
+	{
+		BOOST_ASSERT(size <= source.dataSize());
+		writeArray(source.rptr(), size);
+		source.rskip(size);
+	}
+
+private:
+	/**
+	 * @brief Feed the given range of the internal data into a CRC32C state.
+	 *
+	 * @param crc The current state.
+	 * @param position The starting position of the range.
+	 * @param size The size of the range, which may wrap around the end of circular buffer.
+	 * @return The updated state.
+	 */
+	inline uint32 updateChecksum(uint32 crc, std::size_t position, std::size_t size) const
+	{
+		if(Mode == BufferMode::circular && position + size > mAllocatedSize)
+		{
+			std::size_t size_to_end = mAllocatedSize - position;
+			crc = crc32c_update(crc, mData + position, size_to_end);
+			return crc32c_update(crc, mData, size - size_to_end);
+		}
+		return crc32c_update(crc, mData + position, size);
+	}
+
+	/**
+	 * @brief Copy the given range of the internal data out, feeding it into a CRC32C state in the same pass.
+	 *
+	 * @param crc The current state.
+	 * @param dest The pointer to the array.
+	 * @param position The starting position of the range.
+	 * @param size The size of the range, which may wrap around the end of circular buffer.
+	 * @return The updated state.
+	 */
+	inline uint32 getArrayChecksum(uint32 crc, char* dest, std::size_t position, std::size_t size) const
+	{
+		BOOST_ASSERT(size <= dataSize());
+
+		if(Mode == BufferMode::circular && position + size > mAllocatedSize)
+		{
+			std::size_t size_to_end = mAllocatedSize - position;
+			crc = crc32c_copy(crc, dest, mData + position, size_to_end);
+			return crc32c_copy(crc, dest + size_to_end, mData, size - size_to_end);
+		}
+		return crc32c_copy(crc, dest, mData + position, size);
+	}
+
+	/**
+	 * @brief Copy an array into the given range of the internal data, feeding it into a CRC32C state in the same pass.
+	 *
+	 * @param crc The current state.
+	 * @param source The pointer to the array.
+	 * @param position The starting position of the range.
+	 * @param size The size of the range, which may wrap around the end of circular buffer.
+	 * @return The updated state.
+	 */
+	inline uint32 setArrayChecksum(uint32 crc, const char* source, std::size_t position, std::size_t size)
+	{
+		BOOST_ASSERT(size <= freeSize());
+
+		if(Mode == BufferMode::circular && position + size > mAllocatedSize)
+		{
+			std::size_t size_to_end = mAllocatedSize - position;
+			crc = crc32c_copy(crc, mData + position, source, size_to_end);
+			return crc32c_copy(crc, mData, source + size_to_end, size - size_to_end);
+		}
+		return crc32c_copy(crc, mData + position, source, size);
+	}
+
+	/**
+	 * @brief Peek the length prefix of a frame at given offset from the read pointer.
+	 *
+	 * @note The frame at the offset must not be a skip record left by abandon().
+	 *
+	 * @param offset The offset of the frame relative to the read pointer.
+	 * @param available The current data size.
+	 * @param length The payload length of the frame.
+	 * @return True if the frame is complete, false otherwise.
+	 */
+	inline bool peekFrame(std::size_t offset, std::size_t available, uint32& length)
+	{
+		bool abandoned;
+		if(!peekFrame(offset, available, length, abandoned))
+			return false;
+
+		BOOST_ASSERT(!abandoned);
+		return true;
+	}
+
+	/**
+	 * @brief Peek the length prefix of a frame or a skip record at given offset from the read pointer.
+	 *
+	 * @param offset The offset of the frame relative to the read pointer.
+	 * @param available The current data size.
+	 * @param length The payload length of the frame (or the length to skip).
+	 * @param abandoned True if it's a skip record left by abandon().
+	 * @return True if the frame is complete, false otherwise.
+	 */
+	inline bool peekFrame(std::size_t offset, std::size_t available, uint32& length, bool& abandoned)
+	{
+		if(available < offset + sizeof(uint32))
+			return false;
+
+		std::size_t position = rpos() + offset;
+		if(Mode != BufferMode::plain && position >= mAllocatedSize)
+			position -= mAllocatedSize;
+
+		getDirect(length, position);
+		if(mSwapBytes)
+			length = byte_swap(length);
+		abandoned = (length & FRAME_ABANDONED) != 0;
+		length &= ~FRAME_ABANDONED;
+		return available >= offset + sizeof(uint32) + length;
+	}
+
+	/**
+	 * @brief Skip the records left by abandon() at the read pointer.
+	 */
+	inline void skipAbandoned()
+	{
+		uint32 length;
+		bool abandoned;
+		while(peekFrame(0, dataSize(), length, abandoned) && abandoned)
+		{
+			rskip(sizeof(uint32) + length);
+		}
+	}
+
+	/**
+	 * @brief Keep the reserve pointer of mpsc buffer in sync when the write pointer is moved by single-threaded operations.
+	 */
+	inline void syncReservePos()
+	{
+		if(Concurrency == BufferConcurrency::mpsc)
+			mReservePos = mWritePos;
+	}
+
+	/**
+	 * @brief Allocate the internal data array.
+	 *
+	 * @note For mirrored buffer, the size is rounded up to the page size.
+	 *
+	 * @param size The size to allocate, which is updated to the actual allocated size.
+	 * @return The allocated data array.
+	 */
+	inline byte* allocateData(std::size_t& size)
+	{
+		if(Mode == BufferMode::mirrored)
+		{
+			return allocateMirrored(size);
+		}
+		else
+		{
+			return mAllocator->allocate(size);
+		}
+	}
+
+	/**
+	 * @brief Free the internal data array allocated by allocateData().
+	 *
+	 * @param data The data array.
+	 * @param size The allocated size of the data array.
+	 */
+	inline void deallocateData(byte* data, std::size_t size)
+	{
+		releaseData(mAllocator, data, size);
+	}
+
+	/**
+	 * @brief Free a data array allocated by allocateData() with the given allocator.
+	 *
+	 * @note This is also used to free the data array taken over by BufferRef.
+	 *
+	 * @param allocator The allocator (BufferAllocator*) of the buffer which allocated the data array.
+	 * @param data The data array.
+	 * @param size The allocated size of the data array.
+	 */
+	inline static void releaseData(void* allocator, byte* data, std::size_t size)
 	{
-		if(Mode == BufferMode::plain)
+		if(Mode == BufferMode::mirrored)
 		{
-			*((T*)(mData + position)) = t;
+			UNUSED_ARGUMENT(allocator);
+#ifdef __PLATFORM_LINUX__
+			::munmap((void*)data, size * 2);
+#else
+			UNUSED_ARGUMENT(data);
+			UNUSED_ARGUMENT(size);
+			UNIMPLEMENTED_CODE();
+#endif
 		}
 		else
 		{
-			// if we just cross the boundary
-			if(position + sizeof(T) > mAllocatedSize)
-			{
-				// TODO use for-loop instead of memcpy
-				std::size_t size_to_end = mAllocatedSize - position;
-				::memcpy(mData + position, ((byte*)&t), size_to_end);
-				::memcpy(mData, ((byte*)&t) + size_to_end, sizeof(T) - size_to_end);
-			}
-			else
-			{
-				*((T*)(mData + position)) = t;
-			}
+			((BufferAllocator*)allocator)->deallocate(data, size);
 		}
 	}
 
 	/**
-	 * @brief Put an array of data into the buffer at specific buffer position
-	 *
-	 * @note Neither the read nor the write pointer is not altered after this call.
+	 * @brief Map the given file as the internal data buffer.
 	 *
-	 * @param source The given array to write data in.
-	 * @param position The specific buffer position.
-	 * @param size The specific array size.
+	 * @param path The file path.
+	 * @param mapping The access mode of the mapping.
+	 * @param size The minimal file size for read_write mapping.
+	 * @return The size of the file content before it's extended.
 	 */
-	inline void setArray(const char* source, std::size_t position, std::size_t size)
+	std::size_t mapFile(const std::string& path, BufferMapping::type mapping, std::size_t size)
 	{
-		BOOST_ASSERT(size <= freeSize());
+#ifdef __PLATFORM_LINUX__
+		bool writable = (mapping == BufferMapping::read_write);
 
-		if(Mode == BufferMode::plain)
+		int fd = ::open(path.c_str(), writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+		if(fd < 0)
+			throwSystemError("failed to open " + path);
+
+		struct stat status;
+		if(::fstat(fd, &status) != 0)
 		{
-			if(UNLIKELY(size == 0)) return;
-			::memcpy(mData + position, source, size);
+			::close(fd);
+			throwSystemError("failed to stat " + path);
 		}
-		else
+
+		std::size_t file_size = (std::size_t)status.st_size;
+		std::size_t mapped_size = file_size;
+		if(writable && size > file_size)
 		{
-			// if we just cross the boundary
-			if(position + size > mAllocatedSize)
+			if(::ftruncate(fd, size) != 0)
 			{
-				std::size_t size_to_end = mAllocatedSize - position;
-				::memcpy(mData + position, source, size_to_end);
-				::memcpy(mData, source + size_to_end, size - size_to_end);
+				::close(fd);
+				throwSystemError("failed to extend " + path);
 			}
-			else
+			mapped_size = size;
+		}
+
+		// an empty file cannot be mapped, which simply results in an empty buffer
+		if(mapped_size > 0)
+		{
+			void* data = ::mmap(NULL, mapped_size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+			if(data == MAP_FAILED)
 			{
-				::memcpy(mData + position, source, size);
+				::close(fd);
+				throwSystemError("failed to map " + path);
 			}
+			mData = (byte*)data;
+			mAllocatedSize = mapped_size;
+			mMapped = true;
 		}
+
+		// the mapping stays valid after the descriptor is closed
+		::close(fd);
+		return file_size;
+#else
+		UNUSED_ARGUMENT(path);
+		UNUSED_ARGUMENT(mapping);
+		UNUSED_ARGUMENT(size);
+		UNIMPLEMENTED_CODE();
+		return 0;
+#endif
 	}
 
-public:
 	/**
-	 * @brief Append another buffer object.
-	 *
-	 * @note The read pointer of the source buffer object will not be altered, but the write pointer will be updated.
+	 * @brief Release the memory-mapped file.
+	 */
+	void unmapFile()
+	{
+#ifdef __PLATFORM_LINUX__
+		::munmap((void*)mData, mAllocatedSize);
+#endif
+		mData = NULL;
+		mAllocatedSize = 0;
+		mMapped = false;
+	}
+
+	/**
+	 * @brief Throw boost::system::system_error for the current errno.
 	 *
-	 * @param source The buffer object to be read.
+	 * @param message The error message.
 	 */
-	inline void append(BufferBase &source)
+	static void throwSystemError(const std::string& message)
 	{
-		BOOST_ASSERT(source.dataSize() <= freeSize());
-		append(source, source.dataSize());
+		throw boost::system::system_error(boost::system::error_code(errno, boost::system::get_system_category()), message);
 	}
 
 	/**
-	 * @brief Append another buffer object with specific size.
+	 * @brief Create a ring whose physical pages are mapped twice in a row.
 	 *
-	 * @note The write pointer will be updated.
+	 * The ring is backed by an anonymous memory file (memfd, or an unlinked file
+	 * in /dev/shm for older kernels) mapped at [base, base + size) and again at
+	 * [base + size, base + 2 * size), so any range of at most size bytes starting
+	 * within the ring can be accessed contiguously.
 	 *
-	 * @param source The buffer object to be read.
-	 * @param size The specific data size to append.
+	 * @param size The ring size, which is rounded up to the page size.
+	 * @return The base address of the first mapping.
 	 */
-	template<BufferMode::type M, BufferConcurrency::type C>
-	inline void append(BufferBase<M, C> &source, std::size_t size)
+	static byte* allocateMirrored(std::size_t& size)
 	{
-		BOOST_ASSERT(size <= source.dataSize());
-		writeArray(source.rptr(), size);
-		source.rskip(size);
+#ifdef __PLATFORM_LINUX__
+		std::size_t page_size = (std::size_t)sysconf(_SC_PAGESIZE);
+		size = (size + page_size - 1) / page_size * page_size;
+
+		int fd = -1;
+#ifdef SYS_memfd_create
+		fd = (int)syscall(SYS_memfd_create, "zillians-buffer", 0);
+#endif
+		if(fd < 0)
+		{
+			char path[] = "/dev/shm/zillians-buffer-XXXXXX";
+			fd = mkstemp(path);
+			if(fd >= 0) unlink(path);
+		}
+		if(fd < 0)
+			throw std::bad_alloc();
+
+		if(ftruncate(fd, size) != 0)
+		{
+			close(fd);
+			throw std::bad_alloc();
+		}
+
+		// reserve the address space for both mappings first, then map the file twice into it
+		byte* base = (byte*)mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(base == (byte*)MAP_FAILED)
+		{
+			close(fd);
+			throw std::bad_alloc();
+		}
+
+		if(mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+		   mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+		{
+			munmap(base, size * 2);
+			close(fd);
+			throw std::bad_alloc();
+		}
+
+		close(fd);
+		return base;
+#else
+		UNUSED_ARGUMENT(size);
+		UNIMPLEMENTED_CODE();
+		return NULL;
+#endif
 	}
 
+public:
 	inline void resize(std::size_t size)
 	{
 		BOOST_ASSERT(mOnDemand);
 		BOOST_ASSERT(size > mAllocatedSize);
 
-		if(Mode == BufferMode::circular)
+		if(Mode == BufferMode::mirrored)
 		{
-			crunch();
+			// the data is always contiguous in the mirrored mapping, so just copy it to the new mapping
+			byte* data = allocateData(size);
+			std::size_t data_size = dataSize();
+			if(mData)
+			{
+				if(data_size > 0)
+					::memcpy(data, mData + rpos(), data_size);
+				deallocateData(mData, mAllocatedSize);
+			}
+			mData = data;
+			mAllocatedSize = size;
+			rpos(0);
+			wpos(data_size);
+			return;
 		}
 
-		if(mData)
-		{
-			mData = (byte*)realloc((void*)mData, size);
-		}
-		else
+		if(Mode == BufferMode::circular)
 		{
-			mData = (byte*)malloc(size);
+			crunch();
 		}
+
+		mData = mAllocator->reallocate(mData, mAllocatedSize, size);
 		mAllocatedSize = size;
 	}
 
@@ -2667,13 +5487,24 @@ private:
 	const static std::size_t MAX_VECTOR_LENGTH = 65536;
 	const static std::size_t MAX_LIST_LENGTH = 65536;
 	const static std::size_t MAX_ARRAY_LENGTH = 65536;
+	const static uint32 FRAME_ABANDONED = 0x80000000;	///< Flag in the length prefix of a skip record left by abandon()
 
 	bool mOwner;
 	bool mReadOnly;
 	bool mOnDemand;
+	bool mMapped;
+	BufferEncoding::type mEncoding;
+	BufferByteOrder::type mByteOrder;
+	bool mSwapBytes;
+	bool mReadChecksumActive;
+	bool mWriteChecksumActive;
+	uint32 mReadChecksum;
+	uint32 mWriteChecksum;
+	BufferAllocator* mAllocator;
 
 	position_t mReadPos;
 	position_t mWritePos;
+	position_t mReservePos;
 	position_t mReadPosMarked;
 	position_t mWritePosMarked;
 
@@ -2691,7 +5522,7 @@ public:
 	{
 	}
 
-	BufferT(std::size_t size) : BufferBase<Mode,Concurrency>(size)
+	BufferT(std::size_t size, BufferAllocator* allocator = NULL) : BufferBase<Mode,Concurrency>(size, allocator)
 	{
 	}
 
@@ -2703,6 +5534,10 @@ public:
 	{
 	}
 
+	BufferT(BufferMapping::type mapping, const std::string& path, std::size_t size = 0) : BufferBase<Mode,Concurrency>(mapping, path, size)
+	{
+	}
+
 	BufferT(const BufferT& buffer) : BufferBase<Mode,Concurrency>(buffer)
 	{
 	}
@@ -2726,7 +5561,7 @@ public:
 	{
 	}
 
-	BufferT(std::size_t size) : BufferBase<Mode,Concurrency>(size)
+	BufferT(std::size_t size, BufferAllocator* allocator = NULL) : BufferBase<Mode,Concurrency>(size, allocator)
 	{
 	}
 
@@ -2738,6 +5573,10 @@ public:
 	{
 	}
 
+	BufferT(BufferMapping::type mapping, const std::string& path, std::size_t size = 0) : BufferBase<Mode,Concurrency>(mapping, path, size)
+	{
+	}
+
 	BufferT(const BufferT& buffer) : BufferBase<Mode,Concurrency>(buffer)
 	{
 	}
@@ -2766,7 +5605,7 @@ public:
 	{
 	}
 
-	BufferT(std::size_t size) : BufferBase<Mode,Concurrency>(size)
+	BufferT(std::size_t size, BufferAllocator* allocator = NULL) : BufferBase<Mode,Concurrency>(size, allocator)
 	{
 	}
 
@@ -2778,6 +5617,10 @@ public:
 	{
 	}
 
+	BufferT(BufferMapping::type mapping, const std::string& path, std::size_t size = 0) : BufferBase<Mode,Concurrency>(mapping, path, size)
+	{
+	}
+
 	BufferT(const BufferT& buffer) : BufferBase<Mode,Concurrency>(buffer)
 	{
 	}
@@ -2797,6 +5640,11 @@ typedef BufferT<BufferMode::plain, BufferConcurrency::none, BufferObjectPoolStra
 typedef BufferT<BufferMode::circular, BufferConcurrency::none, BufferObjectPoolStrategy::concurrently_pooled> CircularBuffer;
 typedef BufferT<BufferMode::plain, BufferConcurrency::spsc, BufferObjectPoolStrategy::concurrently_pooled> SpscBuffer;
 typedef BufferT<BufferMode::circular, BufferConcurrency::spsc, BufferObjectPoolStrategy::concurrently_pooled> SpscCircularBuffer;
+typedef BufferT<BufferMode::mirrored, BufferConcurrency::none, BufferObjectPoolStrategy::concurrently_pooled> MirroredBuffer;
+typedef BufferT<BufferMode::mirrored, BufferConcurrency::spsc, BufferObjectPoolStrategy::concurrently_pooled> SpscMirroredBuffer;
+typedef BufferT<BufferMode::plain, BufferConcurrency::mpsc, BufferObjectPoolStrategy::concurrently_pooled> MpscBuffer;
+typedef BufferT<BufferMode::circular, BufferConcurrency::mpsc, BufferObjectPoolStrategy::concurrently_pooled> MpscCircularBuffer;
+typedef BufferT<BufferMode::mirrored, BufferConcurrency::mpsc, BufferObjectPoolStrategy::concurrently_pooled> MpscMirroredBuffer;
 
 inline std::ostream& operator << (std::ostream &stream, Buffer& b)
 {
@@ -2817,6 +5665,119 @@ inline std::istream& operator >> (std::istream& stream, Buffer& b)
 	return stream;
 }
 
+/**
+ * @brief Append the data ranges of a list of buffers to a buffer sequence for scatter-gather I/O.
+ *
+ * @param first The iterator to the first buffer (pointer, shared_ptr, ...) in the list.
+ * @param last The iterator past the last buffer in the list.
+ * @param buffers The buffer sequence, i.e. std::vector<boost::asio::const_buffer>.
+ * @return The total size of the appended data ranges.
+ */
+template<typename Iterator, typename BufferSequence>
+inline std::size_t getDataBuffers(Iterator first, Iterator last, BufferSequence& buffers)
+{
+	std::size_t total = 0;
+	for(Iterator it = first; it != last; ++it)
+	{
+		total += (*it)->getDataBuffers(buffers);
+	}
+	return total;
+}
+
+/**
+ * @brief Consume the given number of bytes from a list of buffers, in order.
+ *
+ * This is used to commit a (partial) scatter-gather write over a list of buffers.
+ *
+ * @param first The iterator to the first buffer in the list.
+ * @param last The iterator past the last buffer in the list.
+ * @param size The number of bytes to consume.
+ * @return The iterator to the first buffer which still contains data.
+ */
+template<typename Iterator>
+inline Iterator rskip(Iterator first, Iterator last, std::size_t size)
+{
+	Iterator it = first;
+	for(; it != last; ++it)
+	{
+		std::size_t available = (*it)->dataSize();
+		if(size < available)
+		{
+			(*it)->rskip(size);
+			break;
+		}
+		(*it)->rskip(available);
+		size -= available;
+	}
+	return it;
+}
+
+#ifdef __PLATFORM_LINUX__
+/**
+ * @brief Fill the given iovec array with the data ranges of a list of buffers.
+ *
+ * @param first The iterator to the first buffer in the list.
+ * @param last The iterator past the last buffer in the list.
+ * @param iov The iovec array to fill.
+ * @param count The capacity of the iovec array.
+ * @return The number of iovec entries filled.
+ */
+template<typename Iterator>
+inline int getDataIovec(Iterator first, Iterator last, struct iovec* iov, int count)
+{
+	int n = 0;
+	for(Iterator it = first; it != last && n < count; ++it)
+	{
+		n += (*it)->getDataIovec(iov + n, count - n);
+	}
+	return n;
+}
+
+/**
+ * @brief Write the data of a list of buffers to the given file descriptor by a single writev() call.
+ *
+ * The read pointers of the buffers are moved forward by the number of bytes accepted by the kernel.
+ *
+ * @param fd The file descriptor to write to.
+ * @param first The iterator to the first buffer in the list.
+ * @param last The iterator past the last buffer in the list.
+ * @return The number of bytes written, or -1 on error (errno is preserved).
+ */
+template<typename Iterator>
+inline ssize_t writeTo(int fd, Iterator first, Iterator last)
+{
+	struct iovec iov[IOV_MAX < 64 ? IOV_MAX : 64];
+	int n = getDataIovec(first, last, iov, sizeof(iov) / sizeof(iov[0]));
+	if(n == 0) return 0;
+
+	ssize_t written = ::writev(fd, iov, n);
+	if(written > 0)
+	{
+		rskip(first, last, written);
+	}
+	return written;
+}
+#endif
+
+/**
+ * @brief ThreadLocalBufferWrapper provides per-thread buffers without any locking.
+ *
+ * get() returns a single buffer per thread, which is created lazily by the given
+ * specification and kept until the thread exits.
+ *
+ * In addition, each thread owns a cache of scratch buffers segregated by power-of-two
+ * size classes (from ZILLIANS_BUFFER_CACHE_MIN_SIZE to ZILLIANS_BUFFER_CACHE_MAX_SIZE).
+ * checkout() takes an empty buffer of at least the requested capacity from the cache
+ * (or creates one), and checkin() puts it back for reuse. As the cache is only touched
+ * by its own thread, neither operation involves locks or atomic instructions.
+ *
+ * @code
+ * 		ThreadLocalBufferWrapper::ScopedBuffer scratch(wrapper, 4096);
+ * 		*scratch << header << payload;
+ * @endcode
+ *
+ * @note A buffer checked in by another thread simply joins the cache of that thread.
+ */
 class ThreadLocalBufferWrapper
 {
 	struct spec_type { enum type { size_only, non_const_buffer_with_size, const_buffer_with_size }; };
@@ -2845,10 +5806,93 @@ class ThreadLocalBufferWrapper
 	} spec;
 
 public:
+	/**
+	 * @brief Statistics of the buffer cache of the calling thread.
+	 */
+	struct Stat
+	{
+		std::size_t checkouts;		///< Number of buffers checked out
+		std::size_t hits;			///< Number of checkouts served from the cache
+		std::size_t misses;			///< Number of checkouts which created a new buffer
+		std::size_t checkins;		///< Number of buffers checked in
+		std::size_t trimmed;		///< Number of buffers deleted on checkin, because they're oversized or the cache is full
+		std::size_t cached_buffers;	///< Number of buffers currently held in the cache
+		std::size_t cached_bytes;	///< Number of bytes currently held in the cache
+	};
+
+private:
+	const static std::size_t CLASS_COUNT = 32;
+
+	/**
+	 * @brief The per-thread buffer cache.
+	 */
+	struct Cache
+	{
+		Cache() : cached_bytes(0)
+		{
+			::memset(&stat, 0, sizeof(stat));
+		}
+
+		~Cache()
+		{
+			trim();
+		}
+
+		void trim()
+		{
+			for(std::size_t i = 0; i < CLASS_COUNT; ++i)
+			{
+				for(std::vector<Buffer*>::iterator it = buffers[i].begin(); it != buffers[i].end(); ++it)
+					delete *it;
+				buffers[i].clear();
+			}
+			cached_bytes = 0;
+			stat.cached_buffers = 0;
+			stat.cached_bytes = 0;
+		}
+
+		std::vector<Buffer*> buffers[CLASS_COUNT];
+		std::size_t cached_bytes;
+		Stat stat;
+	};
+
+public:
+	/**
+	 * @brief RAII helper which checks out a buffer and checks it in when going out of scope.
+	 */
+	class ScopedBuffer : boost::noncopyable
+	{
+	public:
+		ScopedBuffer(ThreadLocalBufferWrapper& wrapper, std::size_t size = ZILLIANS_BUFFER_CACHE_MIN_SIZE) : mWrapper(wrapper), mBuffer(wrapper.checkout(size))
+		{ }
+
+		~ScopedBuffer()
+		{
+			mWrapper.checkin(mBuffer);
+		}
+
+		Buffer* get() const { return mBuffer; }
+		Buffer* operator-> () const { return mBuffer; }
+		Buffer& operator* () const { return *mBuffer; }
+
+	private:
+		ThreadLocalBufferWrapper& mWrapper;
+		Buffer* mBuffer;
+	};
+
+public:
+	ThreadLocalBufferWrapper()
+	{
+		spec.type = spec_type::size_only;
+		spec.def.size_only.size = ZILLIANS_BUFFER_DEFAULT_SIZE;
+		initCache();
+	}
+
 	ThreadLocalBufferWrapper(std::size_t size)// : data(boost::bind(finalize, _1, true))
 	{
 		spec.type = spec_type::size_only;
 		spec.def.size_only.size = size;
+		initCache();
 	}
 
 	ThreadLocalBufferWrapper(byte* data, std::size_t size)// : data(boost::bind(finalize, _1, true))
@@ -2856,6 +5900,7 @@ public:
 		spec.type = spec_type::non_const_buffer_with_size;
 		spec.def.non_const_buffer_with_size.buffer = data;
 		spec.def.non_const_buffer_with_size.size = size;
+		initCache();
 	}
 
 	ThreadLocalBufferWrapper(const byte* data, std::size_t size)// : data(boost::bind(finalize, _1, true))
@@ -2863,6 +5908,7 @@ public:
 		spec.type = spec_type::const_buffer_with_size;
 		spec.def.const_buffer_with_size.buffer = data;
 		spec.def.const_buffer_with_size.size = size;
+		initCache();
 	}
 
 	~ThreadLocalBufferWrapper()
@@ -2903,6 +5949,160 @@ public:
 		return *get();
 	}
 
+public:
+	/**
+	 * @brief Check out an empty scratch buffer from the cache of the calling thread.
+	 *
+	 * The buffer is allocated on demand, so it may grow beyond the requested capacity.
+	 *
+	 * @param size The minimal capacity of the buffer.
+	 * @return The buffer, which should be returned by checkin() on the same thread.
+	 */
+	Buffer* checkout(std::size_t size = ZILLIANS_BUFFER_CACHE_MIN_SIZE)
+	{
+		Cache& c = cache();
+		++c.stat.checkouts;
+
+		if(LIKELY(size <= mMaxCachedSize.load(CACHE_LIMIT_ORDER)))
+		{
+			// any buffer in the class is at least the class size, which is not less than the requested size
+			std::size_t index = getClassIndex(size, true);
+			std::vector<Buffer*>& buffers = c.buffers[index];
+			if(!buffers.empty())
+			{
+				Buffer* buffer = buffers.back();
+				buffers.pop_back();
+				c.cached_bytes -= buffer->allocatedSize();
+				--c.stat.cached_buffers;
+				c.stat.cached_bytes = c.cached_bytes;
+				++c.stat.hits;
+				return buffer;
+			}
+			size = getClassSize(index);
+		}
+
+		++c.stat.misses;
+		Buffer* buffer = new Buffer();
+		buffer->resize(size);
+		return buffer;
+	}
+
+	/**
+	 * @brief Return a scratch buffer checked out by checkout() to the cache of the calling thread.
+	 *
+	 * The buffer is deleted instead if it grew beyond the maximum cached buffer size, or
+	 * the cache of the calling thread is full.
+	 *
+	 * @param buffer The buffer to return.
+	 */
+	void checkin(Buffer* buffer)
+	{
+		BOOST_ASSERT(buffer != NULL);
+
+		Cache& c = cache();
+		++c.stat.checkins;
+
+		std::size_t size = buffer->allocatedSize();
+		if(UNLIKELY(size < ZILLIANS_BUFFER_CACHE_MIN_SIZE || size > mMaxCachedSize.load(CACHE_LIMIT_ORDER) || c.cached_bytes + size > mMaxCachedBytes.load(CACHE_LIMIT_ORDER)))
+		{
+			++c.stat.trimmed;
+			delete buffer;
+			return;
+		}
+
+		// reset everything a previous user may have changed
+		buffer->clear();
+		buffer->setEncoding(BufferEncoding::fixed);
+		buffer->setByteOrder(BufferByteOrder::host);
+		buffer->clearContext();
+		buffer->endReadChecksum();
+		buffer->endWriteChecksum();
+
+		c.buffers[getClassIndex(size, false)].push_back(buffer);
+		c.cached_bytes += size;
+		++c.stat.cached_buffers;
+		c.stat.cached_bytes = c.cached_bytes;
+	}
+
+	/**
+	 * @brief Delete all cached buffers of the calling thread.
+	 */
+	void trim()
+	{
+		Cache* c = mCache.get();
+		if(c) c->trim();
+	}
+
+	/**
+	 * @brief Set the limits of the per-thread cache, which apply to subsequent checkin() calls.
+	 *
+	 * @note This may be called while other threads check buffers in.
+	 *
+	 * @param max_cached_size The maximum size of a buffer to be cached, which is capped by ZILLIANS_BUFFER_CACHE_MAX_SIZE.
+	 * @param max_cached_bytes The maximum total size of buffers cached by each thread.
+	 */
+	void setCacheLimits(std::size_t max_cached_size, std::size_t max_cached_bytes)
+	{
+		mMaxCachedSize.store(std::min<std::size_t>(max_cached_size, ZILLIANS_BUFFER_CACHE_MAX_SIZE), CACHE_LIMIT_ORDER);
+		mMaxCachedBytes.store(max_cached_bytes, CACHE_LIMIT_ORDER);
+	}
+
+	/**
+	 * @brief Get the statistics of the cache of the calling thread.
+	 *
+	 * @return The statistics.
+	 */
+	Stat getStat()
+	{
+		return cache().stat;
+	}
+
+private:
+	void initCache()
+	{
+		mMaxCachedSize.store(ZILLIANS_BUFFER_CACHE_MAX_SIZE, CACHE_LIMIT_ORDER);
+		mMaxCachedBytes.store(ZILLIANS_BUFFER_CACHE_MAX_BYTES, CACHE_LIMIT_ORDER);
+	}
+
+	Cache& cache()
+	{
+		Cache* c = mCache.get();
+		if(UNLIKELY(!c))
+		{
+			c = new Cache();
+			mCache.reset(c);
+		}
+		return *c;
+	}
+
+	/**
+	 * @brief Get the size class of given size.
+	 *
+	 * @param size The buffer size.
+	 * @param round_up True to get the smallest class not less than the size (for checkout), or
+	 * false to get the largest class not greater than the size (for checkin).
+	 * @return The size class index.
+	 */
+	static std::size_t getClassIndex(std::size_t size, bool round_up)
+	{
+		std::size_t index = 0;
+		std::size_t class_size = ZILLIANS_BUFFER_CACHE_MIN_SIZE;
+		while(class_size < size)
+		{
+			class_size <<= 1;
+			++index;
+		}
+		if(!round_up && class_size > size && index > 0)
+			--index;
+		BOOST_ASSERT(index < CLASS_COUNT);
+		return index;
+	}
+
+	static std::size_t getClassSize(std::size_t index)
+	{
+		return (std::size_t)ZILLIANS_BUFFER_CACHE_MIN_SIZE << index;
+	}
+
 private:
 	static void finalize(Buffer* buffer, bool need_cleanup)
 	{
@@ -2914,6 +6114,16 @@ private:
 
 private:
 	boost::thread_specific_ptr<Buffer> data;
+	boost::thread_specific_ptr<Cache> mCache;
+#ifdef __GXX_EXPERIMENTAL_CXX0X__
+	static const std::memory_order CACHE_LIMIT_ORDER = std::memory_order_relaxed;
+	std::atomic<std::size_t> mMaxCachedSize;
+	std::atomic<std::size_t> mMaxCachedBytes;
+#else
+	static const boost::memory_order CACHE_LIMIT_ORDER = boost::memory_order_relaxed;
+	boost::atomic<std::size_t> mMaxCachedSize;
+	boost::atomic<std::size_t> mMaxCachedBytes;
+#endif
 };
 
 }
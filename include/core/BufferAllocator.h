@@ -0,0 +1,399 @@
+/**
+ * Zillians MMO
+ * Copyright (C) 2007-2009 Zillians.com, Inc.
+ * For more information see http://www.zillians.com
+ *
+ * Zillians MMO is the library and runtime for massive multiplayer online game
+ * development in utility computing model, which runs as a service for every
+ * developer to build their virtual world running on our GPU-assisted machines.
+ *
+ * This is a close source library intended to be used solely within Zillians.com
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef ZILLIANS_BUFFERALLOCATOR_H_
+#define ZILLIANS_BUFFERALLOCATOR_H_
+
+#include "core/Common.h"
+#include "core/Atomic.h"
+#include <algorithm>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef ZILLIANS_BUFFER_ALLOCATOR_MAX_CACHED_SIZE
+#define ZILLIANS_BUFFER_ALLOCATOR_MAX_CACHED_SIZE	(1024*1024)
+#endif
+
+namespace zillians {
+
+/**
+ * @brief BufferAllocator is the storage policy of BufferBase, which allocates the internal data array.
+ *
+ * Every buffer keeps the allocator it's created with, so the data array is always
+ * returned to the allocator it comes from. Buffers created without an explicit
+ * allocator use the process-wide default one, which is MallocBufferAllocator
+ * unless changed by setDefault().
+ *
+ * @note The allocator must outlive all buffers (and BufferRef objects) using it,
+ * and it must be thread-safe if buffers are created and destroyed concurrently.
+ */
+class BufferAllocator : boost::noncopyable
+{
+public:
+	virtual ~BufferAllocator()
+	{ }
+
+	/**
+	 * @brief Allocate a data array of the given size.
+	 *
+	 * @param size The size to allocate.
+	 * @return The data array, std::bad_alloc is thrown on failure.
+	 */
+	virtual byte* allocate(std::size_t size) = 0;
+
+	/**
+	 * @brief Free a data array allocated by this allocator.
+	 *
+	 * @param data The data array.
+	 * @param size The size given to allocate() (or reallocate()).
+	 */
+	virtual void deallocate(byte* data, std::size_t size) = 0;
+
+	/**
+	 * @brief Resize a data array allocated by this allocator, keeping its content.
+	 *
+	 * @param data The data array, or NULL to allocate a new one.
+	 * @param size The current size of the data array.
+	 * @param new_size The new size.
+	 * @return The resized data array.
+	 */
+	virtual byte* reallocate(byte* data, std::size_t size, std::size_t new_size)
+	{
+		byte* new_data = allocate(new_size);
+		if(data)
+		{
+			::memcpy(new_data, data, std::min(size, new_size));
+			deallocate(data, size);
+		}
+		return new_data;
+	}
+
+public:
+	/**
+	 * @brief Get the process-wide default allocator.
+	 *
+	 * @return The default allocator.
+	 */
+	static BufferAllocator* getDefault();
+
+	/**
+	 * @brief Set the process-wide default allocator for buffers created afterwards.
+	 *
+	 * @param allocator The new default allocator, or NULL to restore MallocBufferAllocator.
+	 */
+	static void setDefault(BufferAllocator* allocator)
+	{
+		defaultInstance() = allocator ? allocator : getMalloc();
+	}
+
+private:
+	static BufferAllocator* getMalloc();
+
+	inline static BufferAllocator*& defaultInstance()
+	{
+		static BufferAllocator* instance = getMalloc();
+		return instance;
+	}
+};
+
+/**
+ * @brief MallocBufferAllocator allocates data arrays by malloc()/realloc()/free(), which is the default.
+ */
+class MallocBufferAllocator : public BufferAllocator
+{
+public:
+	virtual byte* allocate(std::size_t size)
+	{
+		byte* data = (byte*)::malloc(size);
+		if(UNLIKELY(!data))
+			throw std::bad_alloc();
+		return data;
+	}
+
+	virtual void deallocate(byte* data, std::size_t size)
+	{
+		UNUSED_ARGUMENT(size);
+		::free(data);
+	}
+
+	virtual byte* reallocate(byte* data, std::size_t size, std::size_t new_size)
+	{
+		UNUSED_ARGUMENT(size);
+		byte* new_data = (byte*)::realloc(data, new_size);
+		if(UNLIKELY(!new_data))
+			throw std::bad_alloc();
+		return new_data;
+	}
+};
+
+inline BufferAllocator* BufferAllocator::getMalloc()
+{
+	static MallocBufferAllocator instance;
+	return &instance;
+}
+
+inline BufferAllocator* BufferAllocator::getDefault()
+{
+	return defaultInstance();
+}
+
+/**
+ * @brief PoolBufferAllocator allocates data arrays from a memory pool, i.e. ScalablePoolAllocator.
+ *
+ * The pool type must provide byte* allocate(size_t) and void deallocate(byte*).
+ *
+ * @code
+ * 		ScalablePoolAllocator pool(memory, size);
+ * 		PoolBufferAllocator<ScalablePoolAllocator> allocator(pool);
+ * 		Buffer buffer(4096, &allocator);
+ * @endcode
+ */
+template<typename Pool>
+class PoolBufferAllocator : public BufferAllocator
+{
+public:
+	explicit PoolBufferAllocator(Pool& pool) : mPool(pool)
+	{ }
+
+	virtual byte* allocate(std::size_t size)
+	{
+		byte* data = mPool.allocate(size);
+		if(UNLIKELY(!data))
+			throw std::bad_alloc();
+		return data;
+	}
+
+	virtual void deallocate(byte* data, std::size_t size)
+	{
+		UNUSED_ARGUMENT(size);
+		mPool.deallocate(data);
+	}
+
+private:
+	Pool& mPool;
+};
+
+/**
+ * @brief SizeClassBufferAllocator recycles freed data arrays by size class instead of returning them to malloc().
+ *
+ * Sizes are rounded up to size classes with four classes per power of two (i.e.
+ * 4096, 5120, 6144, 7168, 8192, ...), so the circular buffer sizes (power of two
+ * plus one) waste at most a quarter of the allocation. Freed arrays are kept in a
+ * per-class free list up to the given number of bytes per class; arrays larger than
+ * ZILLIANS_BUFFER_ALLOCATOR_MAX_CACHED_SIZE go to malloc() directly.
+ */
+class SizeClassBufferAllocator : public BufferAllocator
+{
+	enum
+	{
+		MIN_CLASS_SHIFT = 6,	// the smallest class is 64 bytes
+		STEPS_SHIFT = 2,		// 4 classes per power of two
+		CLASS_COUNT = 64
+	};
+
+	struct FreeList
+	{
+		FreeList() : head(NULL), count(0)
+		{ }
+
+		boost::mutex lock;
+		byte* head;		// the next pointer is stored in the first bytes of the freed array
+		std::size_t count;
+	};
+
+public:
+	struct Stat
+	{
+		std::size_t hits;		///< Number of allocations served from the free lists
+		std::size_t misses;		///< Number of allocations served by malloc()
+		std::size_t cached;		///< Number of bytes currently held in the free lists
+	};
+
+public:
+	/**
+	 * @param max_cached_bytes_per_class The maximum number of bytes kept in the free list of each size class.
+	 */
+	explicit SizeClassBufferAllocator(std::size_t max_cached_bytes_per_class = 4*1024*1024) :
+		mMaxCachedBytesPerClass(max_cached_bytes_per_class), mHits(0), mMisses(0)
+	{ }
+
+	virtual ~SizeClassBufferAllocator()
+	{
+		purge();
+	}
+
+public:
+	virtual byte* allocate(std::size_t size)
+	{
+		if(UNLIKELY(size > ZILLIANS_BUFFER_ALLOCATOR_MAX_CACHED_SIZE))
+			return allocateFromSystem(size);
+
+		std::size_t index = getClassIndex(size);
+		FreeList& list = mFreeLists[index];
+		{
+			boost::mutex::scoped_lock lock(list.lock);
+			if(list.head)
+			{
+				byte* data = list.head;
+				list.head = *(byte**)data;
+				--list.count;
+				atomic::inc(&mHits);
+				return data;
+			}
+		}
+
+		atomic::inc(&mMisses);
+		return allocateFromSystem(getClassSize(size));
+	}
+
+	virtual void deallocate(byte* data, std::size_t size)
+	{
+		if(UNLIKELY(size > ZILLIANS_BUFFER_ALLOCATOR_MAX_CACHED_SIZE))
+		{
+			::free(data);
+			return;
+		}
+
+		std::size_t index = getClassIndex(size);
+		FreeList& list = mFreeLists[index];
+		{
+			boost::mutex::scoped_lock lock(list.lock);
+			if((list.count + 1) * getClassSize(size) <= mMaxCachedBytesPerClass)
+			{
+				*(byte**)data = list.head;
+				list.head = data;
+				++list.count;
+				return;
+			}
+		}
+
+		::free(data);
+	}
+
+	virtual byte* reallocate(byte* data, std::size_t size, std::size_t new_size)
+	{
+		// stay in place if both sizes fall into the same class
+		if(data && size <= ZILLIANS_BUFFER_ALLOCATOR_MAX_CACHED_SIZE && new_size <= ZILLIANS_BUFFER_ALLOCATOR_MAX_CACHED_SIZE &&
+				getClassIndex(size) == getClassIndex(new_size))
+			return data;
+
+		return BufferAllocator::reallocate(data, size, new_size);
+	}
+
+public:
+	/**
+	 * @brief Return all cached data arrays to the system.
+	 */
+	void purge()
+	{
+		for(std::size_t i = 0; i < CLASS_COUNT; ++i)
+		{
+			boost::mutex::scoped_lock lock(mFreeLists[i].lock);
+			while(mFreeLists[i].head)
+			{
+				byte* data = mFreeLists[i].head;
+				mFreeLists[i].head = *(byte**)data;
+				::free(data);
+			}
+			mFreeLists[i].count = 0;
+		}
+	}
+
+	/**
+	 * @brief Get the statistics of the allocator.
+	 *
+	 * @return The statistics.
+	 */
+	Stat getStat()
+	{
+		Stat stat;
+		stat.hits = mHits;
+		stat.misses = mMisses;
+		stat.cached = 0;
+		for(std::size_t i = 0; i < CLASS_COUNT; ++i)
+		{
+			boost::mutex::scoped_lock lock(mFreeLists[i].lock);
+			stat.cached += mFreeLists[i].count * getClassSizeByIndex(i);
+		}
+		return stat;
+	}
+
+public:
+	/**
+	 * @brief Get the size class index of the given size.
+	 *
+	 * @param size The size.
+	 * @return The size class index.
+	 */
+	inline static std::size_t getClassIndex(std::size_t size)
+	{
+		if(size <= (1UL << MIN_CLASS_SHIFT))
+			return 0;
+
+		// 2^shift < size <= 2^(shift+1)
+		std::size_t shift = (sizeof(unsigned long long) * 8 - 1) - __builtin_clzll((unsigned long long)(size - 1));
+		std::size_t step_shift = shift - STEPS_SHIFT;
+		std::size_t step = ((size - (1UL << shift)) + (1UL << step_shift) - 1) >> step_shift;
+		return ((shift - MIN_CLASS_SHIFT) << STEPS_SHIFT) + step;
+	}
+
+	/**
+	 * @brief Get the size of the size class to which the given size belongs.
+	 *
+	 * @param size The size.
+	 * @return The size class size.
+	 */
+	inline static std::size_t getClassSize(std::size_t size)
+	{
+		return getClassSizeByIndex(getClassIndex(size));
+	}
+
+	inline static std::size_t getClassSizeByIndex(std::size_t index)
+	{
+		if(index == 0)
+			return 1UL << MIN_CLASS_SHIFT;
+
+		std::size_t shift = ((index - 1) >> STEPS_SHIFT) + MIN_CLASS_SHIFT;
+		std::size_t step = ((index - 1) & ((1UL << STEPS_SHIFT) - 1)) + 1;
+		return (1UL << shift) + (step << (shift - STEPS_SHIFT));
+	}
+
+private:
+	inline static byte* allocateFromSystem(std::size_t size)
+	{
+		byte* data = (byte*)::malloc(size);
+		if(UNLIKELY(!data))
+			throw std::bad_alloc();
+		return data;
+	}
+
+private:
+	std::size_t mMaxCachedBytesPerClass;
+	FreeList mFreeLists[CLASS_COUNT];
+	volatile std::size_t mHits;
+	volatile std::size_t mMisses;
+};
+
+}
+
+#endif/*ZILLIANS_BUFFERALLOCATOR_H_*/
@@ -0,0 +1,538 @@
+/**
+ * Zillians MMO
+ * Copyright (C) 2007-2009 Zillians.com, Inc.
+ * For more information see http://www.zillians.com
+ *
+ * Zillians MMO is the library and runtime for massive multiplayer online game
+ * development in utility computing model, which runs as a service for every
+ * developer to build their virtual world running on our GPU-assisted machines.
+ *
+ * This is a close source library intended to be used solely within Zillians.com
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ZILLIANS_BUFFERCHAIN_H_
+#define ZILLIANS_BUFFERCHAIN_H_
+
+#include "core/Buffer.h"
+#include "core/Atomic.h"
+#include <deque>
+#include <boost/noncopyable.hpp>
+#if BUILD_WITH_TBB
+#include <tbb/concurrent_queue.h>
+#else
+#include "core/ConcurrentQueue.h"
+#endif
+
+#ifndef ZILLIANS_BUFFER_CHAIN_SEGMENT_SIZE
+#define ZILLIANS_BUFFER_CHAIN_SEGMENT_SIZE	65536
+#endif
+
+#ifndef ZILLIANS_BUFFER_CHAIN_POOL_SIZE
+#define ZILLIANS_BUFFER_CHAIN_POOL_SIZE	64
+#endif
+
+namespace zillians {
+
+/**
+ * @brief BufferChain is a segmented buffer which grows by linking fixed-size
+ * segments instead of reallocating the whole data array.
+ *
+ * BufferChain provides the same read()/write()/operator<</operator>> surface as
+ * BufferBase, but data written before is never copied when the chain grows.
+ * Segments are drawn from a process-wide segment pool and returned to it once
+ * they are fully consumed. The pool keeps at most ZILLIANS_BUFFER_CHAIN_POOL_SIZE
+ * segments, and any segment released beyond that is freed.
+ *
+ * Every value written by write() (or operator<<) is stored in a single segment
+ * (a value larger than the segment size gets a dedicated segment of its own),
+ * so reading them back never needs to copy across segments. Raw data written
+ * by writeArray() or readFrom() may span several segments, which can be read
+ * back by readArray() or by reading fixed-size scalar types. Any other value
+ * read from raw data spanning segments is read from a linearized copy of the
+ * segments it spans.
+ *
+ * The wire format of the data (as exposed by getDataIovec() or getDataBuffers())
+ * is identical to the one produced by a single BufferBase.
+ *
+ * @note BufferChain is not thread-safe.
+ */
+class BufferChain : boost::noncopyable
+{
+	/**
+	 * @brief Helper class to identify whether a given type can be read piece by piece across segments.
+	 */
+	template <typename T>
+	struct is_scalar_types
+	{
+		enum { value =
+			boost::is_arithmetic<T>::value &&
+			!boost::is_same<T, bool>::value	// because bool is treated as uint8 in BufferBase
+			};
+	};
+
+	/**
+	 * @brief Helper class to identify whether a given type is always written with the same size.
+	 */
+	template <typename T>
+	struct is_fixed_size_types
+	{
+		enum { value =
+			boost::is_arithmetic<T>::value ||	// segments always use the fixed encoding
+			is_bulk_serializable<T>::value
+			};
+	};
+
+public:
+	BufferChain() : mRawTail(false)
+	{ }
+
+	~BufferChain()
+	{
+		clear();
+	}
+
+public:
+	/**
+	 * @brief Get the current data size over all segments.
+	 *
+	 * @return The current data size.
+	 */
+	inline std::size_t dataSize() const
+	{
+		std::size_t size = 0;
+		for(std::deque<Buffer*>::const_iterator it = mSegments.begin(); it != mSegments.end(); ++it)
+		{
+			size += (*it)->dataSize();
+		}
+		return size;
+	}
+
+	/**
+	 * @brief Get the number of segments currently linked in the chain.
+	 *
+	 * @return The number of segments.
+	 */
+	inline std::size_t segmentCount() const
+	{
+		return mSegments.size();
+	}
+
+	/**
+	 * @brief Release all segments back to the segment pool.
+	 */
+	inline void clear()
+	{
+		while(!mSegments.empty())
+		{
+			releaseSegment(mSegments.front());
+			mSegments.pop_front();
+		}
+		mSplit.clear();
+		mRawTail = false;
+	}
+
+public:
+	/**
+	 * @brief Write an arbitrary variable into the tail segment.
+	 *
+	 * @note A new segment is linked if the tail segment doesn't have enough space
+	 * for the whole value, so that the value never spans across segments.
+	 *
+	 * @param value The value to be written.
+	 */
+	template <typename T>
+	inline void write(const T& value)
+	{
+		Buffer* segment = reserve(probeWriteSize(value, boost::mpl::bool_< is_fixed_size_types<T>::value >()));
+		segment->write(value);
+		mRawTail = false;
+	}
+
+	/**
+	 * @brief Read an arbitrary variable.
+	 *
+	 * @param value The value to be read.
+	 */
+	template <typename T>
+	inline void read(T& value)
+	{
+		readDispatch(value, boost::mpl::bool_< is_scalar_types<T>::value >());
+	}
+
+	template <typename T>
+	inline void readDispatch(T& value, boost::mpl::true_ /*is_scalar_types*/)
+	{
+		readArray((char*)&value, sizeof(T));
+	}
+
+	template <typename T>
+	inline void readDispatch(T& value, boost::mpl::false_ /*is_scalar_types*/)
+	{
+		Buffer* segment = head();
+		if(UNLIKELY(mSplit.front()))
+			segment = linearize();
+		segment->read(value);
+		if(segment->dataSize() == 0)
+			drain();
+	}
+
+	/**
+	 * @brief Write an array of data with given size, which may span across segments.
+	 *
+	 * @param source The pointer to the array.
+	 * @param size The given size to be written.
+	 */
+	inline void writeArray(const char* source, std::size_t size)
+	{
+		while(size > 0)
+		{
+			Buffer* segment = reserveRaw();
+			std::size_t n = std::min(tailFreeSize(segment), size);
+			segment->writeArray(source, n);
+			source += n;
+			size -= n;
+		}
+	}
+
+	/**
+	 * @brief Read an array of data with given size, which may span across segments.
+	 *
+	 * @param dest The pointer to the array.
+	 * @param size The given size to be read.
+	 */
+	inline void readArray(char* dest, std::size_t size)
+	{
+		while(size > 0)
+		{
+			Buffer* segment = head();
+			std::size_t n = std::min(segment->dataSize(), size);
+			segment->readArray(dest, n);
+			dest += n;
+			size -= n;
+			if(segment->dataSize() == 0)
+				drain();
+		}
+	}
+
+	/**
+	 * @brief Move forward the read pointer by given number of bytes, which may span across segments.
+	 *
+	 * @param bytes The number of bytes to skip reading.
+	 */
+	inline void rskip(std::size_t bytes)
+	{
+		zillians::rskip(mSegments.begin(), mSegments.end(), bytes);
+		drain();
+	}
+
+	/**
+	 * @brief Append the data ranges of all segments to a buffer sequence for scatter-gather I/O.
+	 *
+	 * @param buffers The buffer sequence, i.e. std::vector<boost::asio::const_buffer>.
+	 * @return The total size of the appended data ranges.
+	 */
+	template<typename BufferSequence>
+	inline std::size_t getDataBuffers(BufferSequence& buffers) const
+	{
+		return zillians::getDataBuffers(mSegments.begin(), mSegments.end(), buffers);
+	}
+
+#ifdef __PLATFORM_LINUX__
+	/**
+	 * @brief Fill the given iovec array with the data ranges of all segments.
+	 *
+	 * @param iov The iovec array to fill.
+	 * @param count The capacity of the iovec array.
+	 * @return The number of iovec entries filled.
+	 */
+	inline int getDataIovec(struct iovec* iov, int count) const
+	{
+		return zillians::getDataIovec(mSegments.begin(), mSegments.end(), iov, count);
+	}
+
+	/**
+	 * @brief Write the data of all segments to the given file descriptor by a single writev() call.
+	 *
+	 * @param fd The file descriptor to write to.
+	 * @return The number of bytes written, or -1 on error (errno is preserved).
+	 */
+	inline ssize_t writeTo(int fd)
+	{
+		ssize_t written = zillians::writeTo(fd, mSegments.begin(), mSegments.end());
+		drain();
+		return written;
+	}
+
+	/**
+	 * @brief Read from the given file descriptor into the free space of the tail segment.
+	 *
+	 * @param fd The file descriptor to read from.
+	 * @return The number of bytes read, 0 on end-of-file, or -1 on error (errno is preserved).
+	 */
+	inline ssize_t readFrom(int fd)
+	{
+		return reserveRaw()->readFrom(fd);
+	}
+#endif
+
+public:
+	template <typename T>
+	inline BufferChain& operator << (const T& value)
+	{
+		write(value);
+		return *this;
+	}
+
+	template <typename T>
+	inline BufferChain& operator >> (T& value)
+	{
+		read(value);
+		return *this;
+	}
+
+public:
+	/**
+	 * @brief Free all pooled segments.
+	 */
+	static void purge()
+	{
+		pool().purge();
+	}
+
+	/**
+	 * @brief Get the number of segments currently kept in the segment pool.
+	 *
+	 * @return The number of pooled segments.
+	 */
+	static std::size_t pooledSegmentCount()
+	{
+		return pool().count;
+	}
+
+private:
+	/**
+	 * @brief Get the tail segment which has at least the given size of free space, link a new one if necessary.
+	 *
+	 * @param size The required free space.
+	 * @return The tail segment.
+	 */
+	inline Buffer* reserve(std::size_t size)
+	{
+		if(!mSegments.empty())
+		{
+			Buffer* tail = mSegments.back();
+			if(tail->dataSize() == 0)
+				tail->clear();
+			if(tailFreeSize(tail) >= size)
+				return tail;
+		}
+
+		Buffer* segment = acquireSegment(size);
+		mSegments.push_back(segment);
+		mSplit.push_back(false);
+		return segment;
+	}
+
+	/**
+	 * @brief Get the tail segment to append raw data to, which may continue the raw data of the previous one.
+	 *
+	 * @return The tail segment, which has some free space.
+	 */
+	inline Buffer* reserveRaw()
+	{
+		if(mRawTail && !mSegments.empty() && tailFreeSize(mSegments.back()) == 0 && mSegments.back()->dataSize() > 0)
+			mSplit.back() = true;
+		mRawTail = true;
+		return reserve(1);
+	}
+
+	/**
+	 * @brief Get the size to reserve for writing a value, which is probed only if it varies.
+	 *
+	 * @param value The value to be written.
+	 * @return The size of the value.
+	 */
+	template <typename T>
+	inline static std::size_t probeWriteSize(const T& value, boost::mpl::true_ /*is_fixed_size_types*/)
+	{
+		UNUSED_ARGUMENT(value);
+		return Buffer::probeSize<T>();
+	}
+
+	template <typename T>
+	inline static std::size_t probeWriteSize(const T& value, boost::mpl::false_ /*is_fixed_size_types*/)
+	{
+		return Buffer::probeSize(value);
+	}
+
+	/**
+	 * @brief Copy the raw data spanning from the head segment into a single segment.
+	 *
+	 * The run of segments linked by raw data ends at a value boundary (or at the end of the
+	 * data), so each byte is copied once.
+	 *
+	 * @return The new head segment.
+	 */
+	inline Buffer* linearize()
+	{
+		std::size_t count = 1;
+		std::size_t size = mSegments.front()->dataSize();
+		while(mSplit[count - 1])
+		{
+			size += mSegments[count]->dataSize();
+			++count;
+		}
+
+		Buffer* merged = new Buffer(size);
+		for(std::size_t i = 0; i < count; ++i)
+		{
+			Buffer* segment = mSegments.front();
+			merged->writeArray((const char*)segment->rptr(), segment->dataSize());
+			releaseSegment(segment);
+			mSegments.pop_front();
+			mSplit.pop_front();
+		}
+		mSegments.push_front(merged);
+		mSplit.push_front(false);
+		return merged;
+	}
+
+	/**
+	 * @brief Get the free space after the write pointer of a segment.
+	 *
+	 * @note Segments are plain buffers, so the space before the read pointer is not reusable.
+	 *
+	 * @param segment The segment.
+	 * @return The free space available for writing.
+	 */
+	inline static std::size_t tailFreeSize(Buffer* segment)
+	{
+		return segment->allocatedSize() - segment->wpos();
+	}
+
+	/**
+	 * @brief Get the first segment with data.
+	 *
+	 * @return The head segment.
+	 */
+	inline Buffer* head()
+	{
+		drain();
+		if(UNLIKELY(mSegments.empty() || mSegments.front()->dataSize() == 0))
+			throw std::length_error("out of data buffer");
+		return mSegments.front();
+	}
+
+	/**
+	 * @brief Return the fully-consumed segments at the front back to the segment pool.
+	 *
+	 * @note The last segment is kept (and rewound) so that it can be written again.
+	 */
+	inline void drain()
+	{
+		while(!mSegments.empty() && mSegments.front()->dataSize() == 0)
+		{
+			if(mSegments.size() == 1)
+			{
+				mSegments.front()->clear();
+				break;
+			}
+			releaseSegment(mSegments.front());
+			mSegments.pop_front();
+			mSplit.pop_front();
+		}
+	}
+
+	/**
+	 * @brief Get a segment from the segment pool, or allocate a dedicated one for oversized value.
+	 *
+	 * @param size The minimal segment size.
+	 * @return The empty segment.
+	 */
+	inline static Buffer* acquireSegment(std::size_t size)
+	{
+		if(UNLIKELY(size > ZILLIANS_BUFFER_CHAIN_SEGMENT_SIZE))
+			return new Buffer(size);
+
+		Buffer* segment = NULL;
+		if(pool().segments.try_pop(segment))
+			atomic::dec(&pool().count);
+		else
+			segment = new Buffer(ZILLIANS_BUFFER_CHAIN_SEGMENT_SIZE);
+		return segment;
+	}
+
+	/**
+	 * @brief Return a segment to the segment pool, or free it if the pool is full.
+	 *
+	 * @param segment The segment to release.
+	 */
+	inline static void releaseSegment(Buffer* segment)
+	{
+		if(UNLIKELY(segment->allocatedSize() != ZILLIANS_BUFFER_CHAIN_SEGMENT_SIZE))
+		{
+			delete segment;
+			return;
+		}
+
+		SegmentPool& p = pool();
+		if(atomic::inc(&p.count) > ZILLIANS_BUFFER_CHAIN_POOL_SIZE)
+		{
+			atomic::dec(&p.count);
+			delete segment;
+			return;
+		}
+
+		segment->clear();
+		p.segments.push(segment);
+	}
+
+	/**
+	 * @brief The process-wide segment pool, which is purged before the pool container is destroyed.
+	 */
+	struct SegmentPool
+	{
+		SegmentPool() : count(0) { }
+		~SegmentPool() { purge(); }
+
+		void purge()
+		{
+			Buffer* segment = NULL;
+			while(segments.try_pop(segment))
+			{
+				atomic::dec(&count);
+				delete segment;
+			}
+		}
+
+		volatile std::size_t count;	///< The number of pooled segments, counted before a segment is pushed and after it is popped
+
+#if BUILD_WITH_TBB
+		tbb::concurrent_bounded_queue<Buffer*> segments;
+#else
+		ConcurrentQueue<Buffer*> segments;
+#endif
+	};
+
+	inline static SegmentPool& pool()
+	{
+		static SegmentPool instance;
+		return instance;
+	}
+
+private:
+	std::deque<Buffer*> mSegments;
+	std::deque<bool> mSplit;	///< Whether the raw data at the end of each segment continues in the next one
+	bool mRawTail;	///< Whether the last data written to the tail segment is raw data
+};
+
+}
+
+#endif/*ZILLIANS_BUFFERCHAIN_H_*/
@@ -0,0 +1,346 @@
+/**
+ * Zillians MMO
+ * Copyright (C) 2007-2009 Zillians.com, Inc.
+ * For more information see http://www.zillians.com
+ *
+ * Zillians MMO is the library and runtime for massive multiplayer online game
+ * development in utility computing model, which runs as a service for every
+ * developer to build their virtual world running on our GPU-assisted machines.
+ *
+ * This is a close source library intended to be used solely within Zillians.com
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ZILLIANS_BUFFERCOMPRESSOR_H_
+#define ZILLIANS_BUFFERCOMPRESSOR_H_
+
+#include "core/Buffer.h"
+#include <zlib.h>
+#include <climits>
+#include <stdexcept>
+#include <boost/noncopyable.hpp>
+
+#ifndef ZILLIANS_BUFFER_COMPRESSOR_CHUNK_SIZE
+#define ZILLIANS_BUFFER_COMPRESSOR_CHUNK_SIZE	16384
+#endif
+
+namespace zillians {
+
+/**
+ * @brief The compression mode used by BufferCompressor.
+ *
+ * The fast mode always uses the fastest deflate level with the largest hash table,
+ * which is meant for large messages compressed on the fly where latency matters
+ * more than the compression ratio.
+ */
+struct BufferCompressionMode
+{
+	enum type
+	{
+		normal,
+		fast
+	};
+};
+
+/**
+ * @brief The flush behavior of a single BufferCompressor::compress() call.
+ */
+struct BufferCompressionFlush
+{
+	enum type
+	{
+		none,	// keep buffering input to get better compression
+		sync,	// emit all pending output, aligned to byte boundary, so the peer is able to decompress everything written so far
+		finish	// terminate the compressed stream
+	};
+};
+
+namespace detail {
+
+/**
+ * @brief The common streaming loop shared by BufferCompressor and BufferDecompressor.
+ *
+ * Input is consumed from the data ranges of one buffer and output is produced into
+ * the free ranges of another, so both circular and plain buffers are processed in
+ * place without any intermediate copy.
+ */
+class BufferZlibStream : boost::noncopyable
+{
+protected:
+	typedef int (*process_function)(z_streamp, int);
+
+	BufferZlibStream() : mFinished(false)
+	{
+		mStream.zalloc = Z_NULL;
+		mStream.zfree = Z_NULL;
+		mStream.opaque = Z_NULL;
+		mStream.next_in = Z_NULL;
+		mStream.avail_in = 0;
+	}
+
+public:
+	/**
+	 * @brief Check whether the end of the compressed stream has been reached.
+	 *
+	 * @return True if the stream is finished, false otherwise.
+	 */
+	inline bool finished() const { return mFinished; }
+
+	/**
+	 * @brief Get the total number of bytes consumed since the stream was (re)started.
+	 *
+	 * @return The total number of input bytes.
+	 */
+	inline uint64 totalIn() const { return mStream.total_in; }
+
+	/**
+	 * @brief Get the total number of bytes produced since the stream was (re)started.
+	 *
+	 * @return The total number of output bytes.
+	 */
+	inline uint64 totalOut() const { return mStream.total_out; }
+
+protected:
+	/**
+	 * @brief Pump data from the input buffer through zlib into the output buffer.
+	 *
+	 * @note The output buffer grows by given size if it's allocated on demand and runs
+	 * out of free space; otherwise the pump stops when the output buffer is full.
+	 *
+	 * @param process The zlib processing function, i.e. deflate() or inflate().
+	 * @param in The input buffer.
+	 * @param out The output buffer.
+	 * @param flush The zlib flush mode applied to the last input range.
+	 * @param grow_size The size to grow the output buffer.
+	 * @return True if all input is consumed and all pending output is flushed, false if the output buffer is full.
+	 */
+	template<BufferMode::type InMode, BufferConcurrency::type InConcurrency, BufferMode::type OutMode, BufferConcurrency::type OutConcurrency>
+	bool pump(process_function process, BufferBase<InMode, InConcurrency>& in, BufferBase<OutMode, OutConcurrency>& out, int flush, std::size_t grow_size)
+	{
+		std::pair<byte*,std::size_t> src[2];
+		std::pair<byte*,std::size_t> dest[2];
+
+		while(!mFinished)
+		{
+			int src_count = in.getDataRanges(src);
+			int dest_count = out.getFreeRanges(dest);
+			if(dest_count == 0)
+			{
+				if(!out.isOnDemand())
+					return false;
+				out.prepareWrite(grow_size);
+				dest_count = out.getFreeRanges(dest);
+			}
+
+			// avail_in/avail_out are 32-bit, so huge ranges are processed piece by piece
+			std::size_t src_size = (src_count > 0) ? std::min<std::size_t>(src[0].second, UINT_MAX) : 0;
+			std::size_t dest_size = std::min<std::size_t>(dest[0].second, UINT_MAX);
+			bool last = (src_count <= 1 && src_size == ((src_count > 0) ? src[0].second : 0));
+
+			mStream.next_in = (src_count > 0) ? (Bytef*)src[0].first : Z_NULL;
+			mStream.avail_in = (uInt)src_size;
+			mStream.next_out = (Bytef*)dest[0].first;
+			mStream.avail_out = (uInt)dest_size;
+
+			int result = process(&mStream, last ? flush : Z_NO_FLUSH);
+
+			in.rskip(src_size - mStream.avail_in);
+			out.wskip(dest_size - mStream.avail_out);
+
+			if(result == Z_STREAM_END)
+			{
+				mFinished = true;
+				break;
+			}
+
+			if(UNLIKELY(result != Z_OK && result != Z_BUF_ERROR))
+				throw std::runtime_error(std::string("zlib stream error: ") + (mStream.msg ? mStream.msg : zError(result)));
+
+			// Z_BUF_ERROR means no progress was possible, which is not fatal; the
+			// stream is drained once the last input is consumed with output space left
+			if(last && mStream.avail_in == 0 && mStream.avail_out > 0)
+				break;
+		}
+
+		return true;
+	}
+
+protected:
+	z_stream mStream;
+	bool mFinished;
+};
+
+}
+
+/**
+ * @brief BufferCompressor compresses data from one buffer into another incrementally in zlib format.
+ *
+ * Each call to compress() consumes the readable data of the input buffer and
+ * appends the compressed stream to the output buffer, so a large message can be
+ * compressed piece by piece as it's produced without materializing a copy of the
+ * whole message. The output can be decompressed by BufferDecompressor.
+ *
+ * @code
+ * BufferCompressor compressor(BufferCompressionMode::fast);
+ * compressor.compress(message, packet, BufferCompressionFlush::sync);
+ * @endcode
+ *
+ * @note BufferCompressor is not thread-safe.
+ */
+class BufferCompressor : public detail::BufferZlibStream
+{
+public:
+	/**
+	 * @brief Create a compressor with given compression level.
+	 *
+	 * @param level The compression level from 0 (no compression) to 9 (best compression), or Z_DEFAULT_COMPRESSION.
+	 */
+	explicit BufferCompressor(int level = Z_DEFAULT_COMPRESSION) : mLevel(level), mMode(BufferCompressionMode::normal)
+	{
+		init();
+	}
+
+	/**
+	 * @brief Create a compressor with given compression mode.
+	 *
+	 * @param mode The compression mode, the default compression level is used in normal mode.
+	 */
+	explicit BufferCompressor(BufferCompressionMode::type mode) : mLevel(Z_DEFAULT_COMPRESSION), mMode(mode)
+	{
+		init();
+	}
+
+	~BufferCompressor()
+	{
+		deflateEnd(&mStream);
+	}
+
+public:
+	/**
+	 * @brief Compress all readable data of the input buffer into the output buffer.
+	 *
+	 * @note If the output buffer is not allocated on demand and runs out of free space,
+	 * the remaining input is left in the input buffer; call compress() again after the
+	 * output buffer is drained.
+	 *
+	 * @param in The input buffer.
+	 * @param out The output buffer.
+	 * @param flush The flush behavior.
+	 * @return True if all input is consumed and flushed as requested, false if the output buffer is full.
+	 */
+	template<BufferMode::type InMode, BufferConcurrency::type InConcurrency, BufferMode::type OutMode, BufferConcurrency::type OutConcurrency>
+	bool compress(BufferBase<InMode, InConcurrency>& in, BufferBase<OutMode, OutConcurrency>& out, BufferCompressionFlush::type flush = BufferCompressionFlush::none)
+	{
+		BOOST_ASSERT(!mFinished);
+
+		int zflush = Z_NO_FLUSH;
+		if(flush == BufferCompressionFlush::sync)
+			zflush = Z_SYNC_FLUSH;
+		else if(flush == BufferCompressionFlush::finish)
+			zflush = Z_FINISH;
+
+		// reserve the worst case up-front so that the common case never grows twice
+		std::size_t grow_size = std::max<std::size_t>(deflateBound(&mStream, in.dataSize()), ZILLIANS_BUFFER_COMPRESSOR_CHUNK_SIZE);
+		return pump(&deflate, in, out, zflush, grow_size);
+	}
+
+	/**
+	 * @brief Reset the compressor to start a new compressed stream with the same parameters.
+	 */
+	void reset()
+	{
+		deflateReset(&mStream);
+		mFinished = false;
+	}
+
+	/**
+	 * @brief Get the compression level in use.
+	 *
+	 * @return The compression level.
+	 */
+	inline int level() const { return (mMode == BufferCompressionMode::fast) ? Z_BEST_SPEED : mLevel; }
+
+	/**
+	 * @brief Get the compression mode in use.
+	 *
+	 * @return The compression mode.
+	 */
+	inline BufferCompressionMode::type mode() const { return mMode; }
+
+private:
+	void init()
+	{
+		BOOST_ASSERT(mLevel == Z_DEFAULT_COMPRESSION || (mLevel >= Z_NO_COMPRESSION && mLevel <= Z_BEST_COMPRESSION));
+
+		// fast mode spends more memory on the hash chains (memLevel 9) to find matches quicker
+		int mem_level = (mMode == BufferCompressionMode::fast) ? MAX_MEM_LEVEL : 8;
+		int result = deflateInit2(&mStream, level(), Z_DEFLATED, MAX_WBITS, mem_level, Z_DEFAULT_STRATEGY);
+		if(UNLIKELY(result != Z_OK))
+			throw std::runtime_error(std::string("failed to initialize zlib deflate stream: ") + zError(result));
+	}
+
+private:
+	int mLevel;
+	BufferCompressionMode::type mMode;
+};
+
+/**
+ * @brief BufferDecompressor decompresses data produced by BufferCompressor from one buffer into another incrementally.
+ *
+ * The input may be fed in arbitrary pieces; decompress() consumes whatever is
+ * readable and appends the decompressed data to the output buffer. Any data after
+ * the end of the compressed stream is left untouched in the input buffer.
+ *
+ * @note BufferDecompressor is not thread-safe.
+ */
+class BufferDecompressor : public detail::BufferZlibStream
+{
+public:
+	BufferDecompressor()
+	{
+		int result = inflateInit(&mStream);
+		if(UNLIKELY(result != Z_OK))
+			throw std::runtime_error(std::string("failed to initialize zlib inflate stream: ") + zError(result));
+	}
+
+	~BufferDecompressor()
+	{
+		inflateEnd(&mStream);
+	}
+
+public:
+	/**
+	 * @brief Decompress all readable data of the input buffer into the output buffer.
+	 *
+	 * @note Throws std::runtime_error if the input is not a valid compressed stream.
+	 *
+	 * @param in The input buffer.
+	 * @param out The output buffer.
+	 * @return True if all input is consumed (or the stream is finished), false if the output buffer is full.
+	 */
+	template<BufferMode::type InMode, BufferConcurrency::type InConcurrency, BufferMode::type OutMode, BufferConcurrency::type OutConcurrency>
+	bool decompress(BufferBase<InMode, InConcurrency>& in, BufferBase<OutMode, OutConcurrency>& out)
+	{
+		std::size_t grow_size = std::max<std::size_t>(in.dataSize() * 4, ZILLIANS_BUFFER_COMPRESSOR_CHUNK_SIZE);
+		return pump(&inflate, in, out, Z_SYNC_FLUSH, grow_size);
+	}
+
+	/**
+	 * @brief Reset the decompressor to accept a new compressed stream.
+	 */
+	void reset()
+	{
+		inflateReset(&mStream);
+		mFinished = false;
+	}
+};
+
+}
+
+#endif/*ZILLIANS_BUFFERCOMPRESSOR_H_*/
@@ -0,0 +1,438 @@
+/**
+ * Zillians MMO
+ * Copyright (C) 2007-2009 Zillians.com, Inc.
+ * For more information see http://www.zillians.com
+ *
+ * Zillians MMO is the library and runtime for massive multiplayer online game
+ * development in utility computing model, which runs as a service for every
+ * developer to build their virtual world running on our GPU-assisted machines.
+ *
+ * This is a close source library intended to be used solely within Zillians.com
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef ZILLIANS_BUFFERREF_H_
+#define ZILLIANS_BUFFERREF_H_
+
+#include "core/Buffer.h"
+#include "core/Atomic.h"
+
+namespace zillians {
+
+namespace detail {
+
+/**
+ * @brief The reference-counted storage shared by BufferRef objects.
+ */
+struct BufferStorage
+{
+	typedef void (*release_function)(void* context, byte* data, std::size_t size);
+
+	volatile uint32 refs;
+	byte* data;
+	std::size_t size;
+	release_function release;
+	void* context;
+
+	/**
+	 * @brief Allocate a new storage, where the storage header and the data are allocated together.
+	 *
+	 * @param size The data size.
+	 * @return The storage with reference count of one.
+	 */
+	static BufferStorage* create(std::size_t size)
+	{
+		BufferStorage* storage = (BufferStorage*)malloc(sizeof(BufferStorage) + size);
+		if(UNLIKELY(!storage))
+			throw std::bad_alloc();
+
+		storage->refs = 1;
+		storage->data = (byte*)(storage + 1);
+		storage->size = size;
+		storage->release = NULL;
+		storage->context = NULL;
+		return storage;
+	}
+
+	/**
+	 * @brief Take over an existing data array, which is freed by the given function when the last reference is gone.
+	 *
+	 * @param data The data array.
+	 * @param size The allocated size of the data array.
+	 * @param release The function to free the data array.
+	 * @param context The context passed to the release function.
+	 * @return The storage with reference count of one.
+	 */
+	static BufferStorage* adopt(byte* data, std::size_t size, release_function release, void* context)
+	{
+		BufferStorage* storage = (BufferStorage*)malloc(sizeof(BufferStorage));
+		if(UNLIKELY(!storage))
+			throw std::bad_alloc();
+
+		storage->refs = 1;
+		storage->data = data;
+		storage->size = size;
+		storage->release = release;
+		storage->context = context;
+		return storage;
+	}
+
+	inline void addRef()
+	{
+		atomic::inc(&refs);
+	}
+
+	inline void releaseRef()
+	{
+		if(atomic::dec(&refs) == 0)
+		{
+			if(release)
+				release(context, data, size);
+			free(this);
+		}
+	}
+};
+
+}
+
+/**
+ * @brief BufferRef is a cheap handle to a slice of reference-counted storage.
+ *
+ * Copying a BufferRef or taking a sub-slice of it never copies or allocates the
+ * data; all handles share the same storage, which is freed when the last handle
+ * is gone. Every handle carries its own read and write cursors, so the same
+ * payload can be read (or sent) by many consumers independently, and one
+ * received packet can be split into many messages without copying.
+ *
+ * @code
+ * 		BufferSlice packet(buffer);                 // take over the data of a buffer
+ * 		BufferSlice header = packet.readSlice(16);  // split without copying
+ * 		for(...) session->send(packet);             // broadcast by sharing
+ * @endcode
+ *
+ * Reading and writing go through the serialization of BufferBase in fixed encoding,
+ * so anything written into a Buffer can be read from a BufferRef and vice versa.
+ *
+ * @note The reference counting is thread-safe, but a single BufferRef object is not.
+ * Writing through a handle modifies the data seen by every handle sharing the
+ * same storage, so a writable handle should be shared only after writing.
+ *
+ * @param ShadowRead Whether the handle can read from the shared data with its own read cursor.
+ * @param ShadowWrite Whether the handle can write into the shared storage with its own write cursor.
+ */
+template<bool ShadowRead, bool ShadowWrite>
+class BufferRef
+{
+	template<bool R, bool W> friend class BufferRef;
+
+	typedef BufferBase<BufferMode::plain, BufferConcurrency::none> view_type;
+
+public:
+	BufferRef() : mStorage(NULL), mData(NULL), mSize(0), mReadPos(0), mWritePos(0)
+	{ }
+
+	/**
+	 * @brief Allocate a new storage of given size to be written.
+	 *
+	 * @param size The storage size.
+	 */
+	explicit BufferRef(std::size_t size) : mStorage(detail::BufferStorage::create(size)), mSize(size), mReadPos(0), mWritePos(0)
+	{
+		mData = mStorage->data;
+	}
+
+	/**
+	 * @brief Allocate a new storage with a copy of the given data.
+	 *
+	 * @param data The data to copy.
+	 * @param size The data size.
+	 */
+	BufferRef(const byte* data, std::size_t size) : mStorage(detail::BufferStorage::create(size)), mSize(size), mReadPos(0), mWritePos(size)
+	{
+		mData = mStorage->data;
+		if(size > 0)
+			::memcpy(mData, data, size);
+	}
+
+	/**
+	 * @brief Take over the data (from the read pointer to the write pointer) of a buffer.
+	 *
+	 * @note If the buffer owns its internal data array, the array is moved into the
+	 * shared storage without copying, and the buffer is left empty (and grows on demand
+	 * if it's written again). Otherwise the data is copied and consumed from the buffer.
+	 *
+	 * @param buffer The buffer to take over.
+	 */
+	template<BufferMode::type Mode, BufferConcurrency::type Concurrency>
+	explicit BufferRef(BufferBase<Mode, Concurrency>& buffer) : mReadPos(0)
+	{
+		buffer.ensureContiguous(buffer.dataSize());
+
+		mSize = mWritePos = buffer.dataSize();
+		if(buffer.mOwner && buffer.mData)
+		{
+			mStorage = detail::BufferStorage::adopt(buffer.mData, buffer.mAllocatedSize, &BufferBase<Mode, Concurrency>::releaseData, buffer.mAllocator);
+			mData = buffer.rptr();
+
+			buffer.mData = NULL;
+			buffer.mAllocatedSize = 0;
+			buffer.mOnDemand = true;
+			buffer.clear();
+		}
+		else
+		{
+			mStorage = detail::BufferStorage::create(mSize);
+			mData = mStorage->data;
+			if(mSize > 0)
+				::memcpy(mData, buffer.rptr(), mSize);
+			buffer.rskip(mSize);
+		}
+	}
+
+	BufferRef(const BufferRef& ref) : mStorage(ref.mStorage), mData(ref.mData), mSize(ref.mSize), mReadPos(ref.mReadPos), mWritePos(ref.mWritePos)
+	{
+		if(mStorage)
+			mStorage->addRef();
+	}
+
+	/**
+	 * @brief Share the storage of a handle of different access, which can only drop the write access.
+	 *
+	 * @param ref The handle to share.
+	 */
+	template<bool R, bool W>
+	BufferRef(const BufferRef<R, W>& ref) : mStorage(ref.mStorage), mData(ref.mData), mSize(ref.mSize), mReadPos(ref.mReadPos), mWritePos(ref.mWritePos)
+	{
+		BOOST_STATIC_ASSERT(!ShadowWrite || W);
+		if(mStorage)
+			mStorage->addRef();
+	}
+
+#ifdef __GXX_EXPERIMENTAL_CXX0X__
+	BufferRef(BufferRef&& ref) : mStorage(ref.mStorage), mData(ref.mData), mSize(ref.mSize), mReadPos(ref.mReadPos), mWritePos(ref.mWritePos)
+	{
+		ref.mStorage = NULL;
+		ref.mData = NULL;
+		ref.mSize = ref.mReadPos = ref.mWritePos = 0;
+	}
+#endif
+
+	~BufferRef()
+	{
+		if(mStorage)
+			mStorage->releaseRef();
+	}
+
+public:
+	BufferRef& operator = (const BufferRef& ref)
+	{
+		BufferRef(ref).swap(*this);
+		return *this;
+	}
+
+#ifdef __GXX_EXPERIMENTAL_CXX0X__
+	BufferRef& operator = (BufferRef&& ref)
+	{
+		BufferRef(std::move(ref)).swap(*this);
+		return *this;
+	}
+#endif
+
+	inline void swap(BufferRef& ref)
+	{
+		std::swap(mStorage, ref.mStorage);
+		std::swap(mData, ref.mData);
+		std::swap(mSize, ref.mSize);
+		std::swap(mReadPos, ref.mReadPos);
+		std::swap(mWritePos, ref.mWritePos);
+	}
+
+	/**
+	 * @brief Release the reference to the shared storage.
+	 */
+	inline void reset()
+	{
+		BufferRef().swap(*this);
+	}
+
+public:
+	/**
+	 * @brief Get the number of handles sharing the same storage.
+	 *
+	 * @return The reference count, or zero for a null handle.
+	 */
+	inline std::size_t useCount() const
+	{
+		return mStorage ? mStorage->refs : 0;
+	}
+
+	/**
+	 * @brief Check whether this is the only handle of the storage, so it can be written without affecting others.
+	 *
+	 * @return True if the storage is not shared, false otherwise.
+	 */
+	inline bool unique() const
+	{
+		return useCount() == 1;
+	}
+
+	inline std::size_t allocatedSize() const { return mSize; }
+	inline std::size_t dataSize() const { return mWritePos - mReadPos; }
+	inline std::size_t freeSize() const { return mSize - mWritePos; }
+
+	inline std::size_t rpos() const { return mReadPos; }
+	inline std::size_t wpos() const { return mWritePos; }
+
+	inline byte* rptr() const { return mData + mReadPos; }
+	inline byte* wptr() const { return mData + mWritePos; }
+
+	inline void rskip(std::size_t bytes)
+	{
+		BOOST_ASSERT(bytes <= dataSize());
+		mReadPos += bytes;
+	}
+
+	inline void wskip(std::size_t bytes)
+	{
+		BOOST_ASSERT(bytes <= freeSize());
+		mWritePos += bytes;
+	}
+
+	/**
+	 * @brief Rewind the read cursor to the beginning of the slice.
+	 */
+	inline void rewind()
+	{
+		mReadPos = 0;
+	}
+
+public:
+	/**
+	 * @brief Get a sub-slice of the data without consuming it.
+	 *
+	 * @note The sub-slice shares the storage and no memory is allocated.
+	 *
+	 * @param offset The offset relative to the current read cursor.
+	 * @param size The size of the sub-slice.
+	 * @return The sub-slice with its cursors covering the whole sub-slice.
+	 */
+	inline BufferRef slice(std::size_t offset, std::size_t size) const
+	{
+		BOOST_ASSERT(offset + size <= dataSize());
+
+		BufferRef ref(*this);
+		ref.mData = rptr() + offset;
+		ref.mSize = ref.mWritePos = size;
+		ref.mReadPos = 0;
+		return ref;
+	}
+
+	/**
+	 * @brief Consume the given size of data as a sub-slice.
+	 *
+	 * @param size The size of the sub-slice.
+	 * @return The sub-slice with its cursors covering the whole sub-slice.
+	 */
+	inline BufferRef readSlice(std::size_t size)
+	{
+		BufferRef ref = slice(0, size);
+		rskip(size);
+		return ref;
+	}
+
+	/**
+	 * @brief Consume a record written by BufferBase::writeSized() as a sub-slice (excluding the length prefix).
+	 *
+	 * @return The sub-slice of the record.
+	 */
+	inline BufferRef readSizedSlice()
+	{
+		uint32 length; readArray((char*)&length, sizeof(uint32));
+		return readSlice(length);
+	}
+
+public:
+	/**
+	 * @brief Read an arbitrary variable from the shared data.
+	 *
+	 * @param value The value to be read.
+	 */
+	template <typename T>
+	inline void read(T& value)
+	{
+		BOOST_STATIC_ASSERT(ShadowRead);
+
+		view_type view((const byte*)rptr(), dataSize());
+		view.wpos(dataSize());
+		view.read(value);
+		mReadPos += view.rpos();
+	}
+
+	/**
+	 * @brief Write an arbitrary variable into the shared storage.
+	 *
+	 * @param value The value to be written.
+	 */
+	template <typename T>
+	inline void write(const T& value)
+	{
+		BOOST_STATIC_ASSERT(ShadowWrite);
+
+		view_type view(wptr(), freeSize());
+		view.write(value);
+		mWritePos += view.wpos();
+	}
+
+	inline void readArray(char* dest, std::size_t size)
+	{
+		BOOST_STATIC_ASSERT(ShadowRead);
+		BOOST_ASSERT(size <= dataSize());
+
+		::memcpy(dest, rptr(), size);
+		mReadPos += size;
+	}
+
+	inline void writeArray(const char* source, std::size_t size)
+	{
+		BOOST_STATIC_ASSERT(ShadowWrite);
+		BOOST_ASSERT(size <= freeSize());
+
+		::memcpy(wptr(), source, size);
+		mWritePos += size;
+	}
+
+	template <typename T>
+	inline BufferRef& operator << (const T& value)
+	{
+		write(value);
+		return *this;
+	}
+
+	template <typename T>
+	inline BufferRef& operator >> (T& value)
+	{
+		read(value);
+		return *this;
+	}
+
+private:
+	detail::BufferStorage* mStorage;
+	byte* mData;
+	std::size_t mSize;
+	std::size_t mReadPos;
+	std::size_t mWritePos;
+};
+
+typedef BufferRef<true, false> BufferSlice;
+typedef BufferRef<true, true> MutableBufferSlice;
+
+}
+
+#endif/*ZILLIANS_BUFFERREF_H_*/
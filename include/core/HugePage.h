@@ -0,0 +1,434 @@
+/**
+ * Zillians MMO
+ * Copyright (C) 2007-2009 Zillians.com, Inc.
+ * For more information see http://www.zillians.com
+ *
+ * Zillians MMO is the library and runtime for massive multiplayer online game
+ * development in utility computing model, which runs as a service for every
+ * developer to build their virtual world running on our GPU-assisted machines.
+ *
+ * This is a close source library intended to be used solely within Zillians.com
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ZILLIANS_HUGEPAGE_H_
+#define ZILLIANS_HUGEPAGE_H_
+
+#include "core/Common.h"
+#include "core/Atomic.h"
+#include "core/BufferAllocator.h"
+#include <boost/noncopyable.hpp>
+#include <new>
+#include <cstdio>
+#include <cstring>
+#include <stdlib.h>
+
+#ifdef __PLATFORM_LINUX__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifndef ZILLIANS_HUGE_PAGE_THRESHOLD
+#define ZILLIANS_HUGE_PAGE_THRESHOLD	(2*1024*1024)
+#endif
+
+namespace zillians {
+
+/**
+ * @brief How a memory region should be backed by huge pages.
+ */
+struct HugePagePolicy
+{
+	enum type
+	{
+		none,			// regular pages only
+		transparent,	// huge-page-aligned anonymous mapping advised by madvise(MADV_HUGEPAGE)
+		hugetlb,		// explicit huge pages (MAP_HUGETLB) from the reserved pool, falls back to transparent
+	};
+};
+
+/**
+ * @brief How a memory region is actually backed.
+ *
+ * @note transparent only means the kernel accepted the advice; the pages may still be
+ * regular ones if no huge page could be assembled. Use HugePage::getHugePageBytes()
+ * to find out how much of the region is really backed by huge pages.
+ */
+struct HugePageBacking
+{
+	enum type
+	{
+		normal,			// regular pages
+		transparent,	// transparent huge pages were advised
+		hugetlb,		// explicit huge pages
+	};
+};
+
+/**
+ * @brief HugePage maps and unmaps anonymous memory regions backed by huge pages.
+ *
+ * Regions are mapped with the length rounded up to the huge page size and aligned to
+ * it, so that the whole region can be covered by huge pages (and by fewer TLB entries).
+ * When the requested backing is not available, it falls back to the next weaker one
+ * (hugetlb, then transparent, then normal) instead of failing.
+ *
+ * The pages are faulted in by the first thread touching them, so under the default
+ * NUMA policy they are local to that thread's node. Pass prefault = true to fault
+ * them in from the mapping thread right away.
+ *
+ * On platforms without mmap(), regions are allocated by malloc() and reported as normal.
+ */
+class HugePage
+{
+public:
+	/**
+	 * @brief Get the default huge page size of the system.
+	 *
+	 * @return The huge page size, 2MB if it cannot be determined.
+	 */
+	static std::size_t size()
+	{
+		static std::size_t huge_page_size = querySize();
+		return huge_page_size;
+	}
+
+	/**
+	 * @brief Map an anonymous memory region.
+	 *
+	 * @param size The size of the region.
+	 * @param policy The requested huge page backing.
+	 * @param backing Receive the backing actually obtained, can be NULL.
+	 * @param prefault Fault in all pages before returning.
+	 * @return The region, std::bad_alloc is thrown on failure.
+	 */
+	static byte* map(std::size_t size, HugePagePolicy::type policy = HugePagePolicy::hugetlb, HugePageBacking::type* backing = NULL, bool prefault = false)
+	{
+		HugePageBacking::type obtained = HugePageBacking::normal;
+		byte* data = NULL;
+
+#ifdef __PLATFORM_LINUX__
+		std::size_t length = mappedSize(size);
+
+#ifdef MAP_HUGETLB
+		if(policy == HugePagePolicy::hugetlb)
+		{
+			void* p = ::mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if(p != MAP_FAILED)
+			{
+				data = (byte*)p;
+				obtained = HugePageBacking::hugetlb;
+			}
+		}
+#endif
+
+		if(!data)
+		{
+			// over-allocate by one huge page and trim both ends to get an aligned region
+			std::size_t alignment = HugePage::size();
+			void* p = ::mmap(NULL, length + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if(UNLIKELY(p == MAP_FAILED))
+				throw std::bad_alloc();
+
+			byte* raw = (byte*)p;
+			data = (byte*)(((uintptr_t)raw + alignment - 1) & ~(uintptr_t)(alignment - 1));
+			if(data > raw)
+				::munmap(raw, data - raw);
+			if(raw + alignment > data)
+				::munmap(data + length, (raw + alignment) - data);
+
+#ifdef MADV_HUGEPAGE
+			if(policy != HugePagePolicy::none && ::madvise(data, length, MADV_HUGEPAGE) == 0)
+				obtained = HugePageBacking::transparent;
+#endif
+		}
+
+		if(prefault)
+		{
+			std::size_t page_size = (std::size_t)::sysconf(_SC_PAGESIZE);
+			for(std::size_t offset = 0; offset < length; offset += page_size)
+				data[offset] = 0;
+		}
+#else
+		UNUSED_ARGUMENT(policy);
+		data = (byte*)::malloc(size);
+		if(UNLIKELY(!data))
+			throw std::bad_alloc();
+		if(prefault)
+			::memset(data, 0, size);
+#endif
+
+		if(backing)
+			*backing = obtained;
+		return data;
+	}
+
+	/**
+	 * @brief Unmap a region mapped by map().
+	 *
+	 * @param data The region.
+	 * @param size The size given to map().
+	 */
+	static void unmap(byte* data, std::size_t size)
+	{
+		if(!data)
+			return;
+#ifdef __PLATFORM_LINUX__
+		::munmap(data, mappedSize(size));
+#else
+		UNUSED_ARGUMENT(size);
+		::free(data);
+#endif
+	}
+
+	/**
+	 * @brief Get the number of bytes of a region which are currently backed by huge pages.
+	 *
+	 * Both transparent and explicit huge pages are counted, by the per-mapping statistics
+	 * in /proc/self/smaps. Pages not yet faulted in are not counted.
+	 *
+	 * @note The kernel may merge the region with adjacent mappings of the same kind, whose
+	 * huge pages are then attributed to the region in proportion to its share of the mapping,
+	 * so the result is an estimate in that case (but never more than the region size).
+	 *
+	 * @param data The start of the region.
+	 * @param size The size of the region.
+	 * @return The number of bytes backed by huge pages, 0 if unknown.
+	 */
+	static std::size_t getHugePageBytes(const void* data, std::size_t size)
+	{
+		std::size_t bytes = 0;
+#ifdef __PLATFORM_LINUX__
+		FILE* smaps = ::fopen("/proc/self/smaps", "r");
+		if(!smaps)
+			return 0;
+
+		uintptr_t begin = (uintptr_t)data;
+		uintptr_t end = begin + size;
+		std::size_t overlap = 0;
+		std::size_t length = 0;
+		char line[256];
+		while(::fgets(line, sizeof(line), smaps))
+		{
+			unsigned long from = 0, to = 0;
+			unsigned long kb = 0;
+			char key[64];
+			if(::sscanf(line, "%lx-%lx ", &from, &to) == 2)
+			{
+				overlap = (from < end && to > begin) ? std::min<uintptr_t>(to, end) - std::max<uintptr_t>(from, begin) : 0;
+				length = to - from;
+			}
+			else if(overlap > 0 && ::sscanf(line, "%63[^:]: %lu kB", key, &kb) == 2)
+			{
+				if(::strcmp(key, "AnonHugePages") == 0 || ::strcmp(key, "Private_Hugetlb") == 0 || ::strcmp(key, "Shared_Hugetlb") == 0)
+				{
+					// only the share of the region in a merged mapping
+					std::size_t huge = kb * 1024;
+					bytes += (overlap == length) ? huge : std::min(overlap, (std::size_t)((double)huge * overlap / length));
+				}
+			}
+		}
+		::fclose(smaps);
+		bytes = std::min(bytes, size);
+#else
+		UNUSED_ARGUMENT(data);
+		UNUSED_ARGUMENT(size);
+#endif
+		return bytes;
+	}
+
+	/**
+	 * @brief Get the length actually mapped for a region of the given size.
+	 *
+	 * @param size The size of the region.
+	 * @return The size rounded up to the huge page size.
+	 */
+	inline static std::size_t mappedSize(std::size_t size)
+	{
+		std::size_t alignment = HugePage::size();
+		return (size + alignment - 1) & ~(alignment - 1);
+	}
+
+private:
+	static std::size_t querySize()
+	{
+		std::size_t huge_page_size = 2*1024*1024;
+#ifdef __PLATFORM_LINUX__
+		FILE* meminfo = ::fopen("/proc/meminfo", "r");
+		if(meminfo)
+		{
+			char line[256];
+			unsigned long kb = 0;
+			while(::fgets(line, sizeof(line), meminfo))
+			{
+				if(::sscanf(line, "Hugepagesize: %lu kB", &kb) == 1 && kb > 0)
+				{
+					huge_page_size = kb * 1024;
+					break;
+				}
+			}
+			::fclose(meminfo);
+		}
+#endif
+		return huge_page_size;
+	}
+};
+
+/**
+ * @brief HugePageRegion owns a memory region backed by huge pages, i.e. the memory pool given to ScalablePoolAllocator.
+ *
+ * @code
+ * 		HugePageRegion region(256*1024*1024);
+ * 		ScalablePoolAllocator pool(region.data(), region.size());
+ * @endcode
+ *
+ * @note The region must outlive everything allocated from it.
+ */
+class HugePageRegion : boost::noncopyable
+{
+public:
+	/**
+	 * @param size The size of the region.
+	 * @param policy The requested huge page backing.
+	 * @param prefault Fault in all pages in the constructing thread.
+	 */
+	explicit HugePageRegion(std::size_t size, HugePagePolicy::type policy = HugePagePolicy::hugetlb, bool prefault = false) :
+		mSize(size), mBacking(HugePageBacking::normal)
+	{
+		mData = HugePage::map(size, policy, &mBacking, prefault);
+	}
+
+	~HugePageRegion()
+	{
+		HugePage::unmap(mData, mSize);
+	}
+
+public:
+	inline byte* data() const { return mData; }
+
+	inline std::size_t size() const { return mSize; }
+
+	/**
+	 * @brief Get the backing obtained when the region was mapped.
+	 *
+	 * @return The backing.
+	 */
+	inline HugePageBacking::type backing() const { return mBacking; }
+
+	/**
+	 * @brief Get the number of bytes of the region currently backed by huge pages.
+	 *
+	 * @return The number of bytes backed by huge pages.
+	 */
+	inline std::size_t getHugePageBytes() const
+	{
+		return HugePage::getHugePageBytes(mData, mSize);
+	}
+
+private:
+	byte* mData;
+	std::size_t mSize;
+	HugePageBacking::type mBacking;
+};
+
+/**
+ * @brief HugePageBufferAllocator backs large buffer data arrays by huge pages.
+ *
+ * Data arrays smaller than the threshold go to malloc(), since each mapped array takes
+ * at least one huge page. Resizing a mapped array always copies into a new mapping.
+ *
+ * @code
+ * 		HugePageBufferAllocator allocator;
+ * 		CircularBuffer ring(256*1024*1024, &allocator);
+ * @endcode
+ */
+class HugePageBufferAllocator : public BufferAllocator
+{
+public:
+	struct Stat
+	{
+		std::size_t hugetlb;		///< Number of arrays backed by explicit huge pages
+		std::size_t transparent;	///< Number of arrays advised to use transparent huge pages
+		std::size_t normal;			///< Number of arrays mapped with regular pages after falling back
+		std::size_t small;			///< Number of arrays below the threshold allocated by malloc()
+	};
+
+public:
+	/**
+	 * @param policy The requested huge page backing.
+	 * @param threshold The minimal data array size to be backed by huge pages.
+	 */
+	explicit HugePageBufferAllocator(HugePagePolicy::type policy = HugePagePolicy::hugetlb, std::size_t threshold = ZILLIANS_HUGE_PAGE_THRESHOLD) :
+		mPolicy(policy), mThreshold(threshold)
+	{
+		mHugetlbCount = mTransparentCount = mNormalCount = mSmallCount = 0;
+	}
+
+public:
+	virtual byte* allocate(std::size_t size)
+	{
+		if(size < mThreshold)
+		{
+			atomic::inc(&mSmallCount);
+			byte* data = (byte*)::malloc(size);
+			if(UNLIKELY(!data))
+				throw std::bad_alloc();
+			return data;
+		}
+
+		HugePageBacking::type backing;
+		byte* data = HugePage::map(size, mPolicy, &backing);
+		switch(backing)
+		{
+		case HugePageBacking::hugetlb: atomic::inc(&mHugetlbCount); break;
+		case HugePageBacking::transparent: atomic::inc(&mTransparentCount); break;
+		default: atomic::inc(&mNormalCount); break;
+		}
+		return data;
+	}
+
+	virtual void deallocate(byte* data, std::size_t size)
+	{
+		if(size < mThreshold)
+			::free(data);
+		else
+			HugePage::unmap(data, size);
+	}
+
+public:
+	/**
+	 * @brief Get the statistics of the allocator.
+	 *
+	 * @return The statistics.
+	 */
+	inline Stat getStat() const
+	{
+		Stat stat;
+		stat.hugetlb = mHugetlbCount;
+		stat.transparent = mTransparentCount;
+		stat.normal = mNormalCount;
+		stat.small = mSmallCount;
+		return stat;
+	}
+
+	inline HugePagePolicy::type getPolicy() const { return mPolicy; }
+
+	inline std::size_t getThreshold() const { return mThreshold; }
+
+private:
+	HugePagePolicy::type mPolicy;
+	std::size_t mThreshold;
+	volatile std::size_t mHugetlbCount;
+	volatile std::size_t mTransparentCount;
+	volatile std::size_t mNormalCount;
+	volatile std::size_t mSmallCount;
+};
+
+}
+
+#endif/*ZILLIANS_HUGEPAGE_H_*/
@@ -26,9 +26,14 @@
 #define ZILLIANS_SCALABLEPOOLALLOCATOR_H_
 
 #include "core/Prerequisite.h"
+#include "core/Atomic.h"
+#include "core/HugePage.h"
 #include "tbb/spin_mutex.h"// for synchronization
+#include "tbb/spin_rw_mutex.h"
 #include "tbb/atomic.h"
 #include "boost/thread.hpp"
+#include "boost/function.hpp"
+#include <vector>
 #include "log4cxx/logger.h"
 
 #define ZILLIANS_SCALABLEALLOCATOR_STATISTICS ///< Enable statistics for debugging purposes.
@@ -48,30 +53,228 @@ namespace zillians {
  *
  * Inside ScalablePoolAllocator we have a global free memory block list, multiple bins within which
  * we have a list of memory blocks.
+ *
+ * For large pools, the memory pool can be backed by huge pages to reduce TLB misses, see HugePageRegion.
+ *
+ * A pool created with RegionOptions is growable: it maps its first region by itself, and maps
+ * more regions on demand whenever the blocks or the large chunk space run out. Regions which
+ * become entirely free can be unmapped by releaseFreeRegions().
+ *
+ * Free blocks and free large chunks which stay idle for a while can be purged, i.e. their pages
+ * are given back to the OS by madvise() while the address range stays in the pool. Purging is
+ * either done on demand by purge(), or periodically by a background thread, see PurgeOptions.
  */
 class ScalablePoolAllocator
 {
+public:
+	/**
+	 * @brief Options of a growable pool.
+	 */
+	struct RegionOptions
+	{
+		RegionOptions(size_t regionSize = 64*1024*1024, size_t maxRegions = 0, HugePagePolicy::type policy = HugePagePolicy::none) :
+			RegionSize(regionSize), MaxRegions(maxRegions), Policy(policy)
+		{ }
+
+		size_t RegionSize;			///< Size of each region, a large chunk bigger than this gets a dedicated region
+		size_t MaxRegions;			///< Maximum number of regions mapped on demand at the same time (besides the first one), 0 for unlimited
+		HugePagePolicy::type Policy;	///< Huge page backing of the regions mapped by HugePage::map()
+		boost::function<byte*(size_t)> MapRegion;			///< Custom region provider returning NULL on failure, HugePage::map() if empty
+		boost::function<void(byte*, size_t)> UnmapRegion;	///< Custom region release, HugePage::unmap() if empty
+	};
+
+	/**
+	 * @brief Options of purging idle memory.
+	 */
+	struct PurgeOptions
+	{
+		PurgeOptions(uint32 decayTime = 10000, size_t minLargeChunkSize = 64*1024, uint32 interval = 0, bool lazyFree = false, size_t granularity = 0) :
+			DecayTime(decayTime), MinLargeChunkSize(minLargeChunkSize), Interval(interval), LazyFree(lazyFree), Granularity(granularity)
+		{ }
+
+		uint32 DecayTime;			///< Time (in ms) a block or a large chunk has to stay free before it's purged
+		size_t MinLargeChunkSize;	///< Free large chunks smaller than this are never purged
+		uint32 Interval;			///< Period (in ms) of the background purge thread, 0 to purge on demand only
+		bool LazyFree;				///< Use MADV_FREE instead of MADV_DONTNEED, pages are reclaimed only under memory pressure
+		size_t Granularity;			///< Only whole units of this size are purged, 0 for the page size (or the huge page size for a
+									///  growable pool on huge pages). Set HugePage::size() for a pool on a HugePageRegion, so
+									///  that purging never splits huge pages.
+	};
+
 public:// Interface
 	ScalablePoolAllocator(byte* pMemory, size_t size, size_t* binSizes = 0, size_t binCount = 0);
+	explicit ScalablePoolAllocator(const RegionOptions& options, size_t* binSizes = 0, size_t binCount = 0);
 	virtual ~ScalablePoolAllocator();
 
 	virtual byte* allocate(size_t sz);
 	virtual void deallocate(byte* mem);
 
+	/**
+	 * @brief Deallocate memory allocated by allocate(sz) with the same size.
+	 *
+	 * The size tells whether the memory is a small chunk or a large chunk, so this skips
+	 * looking up the pointer in the pool (and in the region table of a growable pool).
+	 *
+	 * @param mem The memory to deallocate.
+	 * @param sz The size given to allocate().
+	 */
+	void deallocate(byte* mem, size_t sz);
+
+	/**
+	 * @brief Allocate memory aligned to the given alignment.
+	 *
+	 * Small chunks are carved downward from the end of the blocks, so a small size class
+	 * whose chunk size is a multiple of the alignment is used whenever there's one. Otherwise
+	 * a large chunk is over-allocated and the unaligned head is given back as a free chunk.
+	 *
+	 * @param sz The size to allocate.
+	 * @param alignment The alignment, which must be a power of two.
+	 * @return The aligned memory, or NULL if out of memory or the alignment is invalid.
+	 */
+	byte* allocate(size_t sz, size_t alignment);
+
+	/**
+	 * @brief Deallocate memory allocated by allocate(sz, alignment) with the same size and alignment.
+	 *
+	 * Memory allocated by allocate(sz, alignment) can be given to deallocate(mem) as well,
+	 * this just skips the pointer lookup like deallocate(mem, sz).
+	 */
+	void deallocate(byte* mem, size_t sz, size_t alignment);
+
+	/**
+	 * @brief Get the alignment every chunk from allocate(sz) has, which depends on the bin sizes.
+	 *
+	 * Small chunks are carved downward from the end of the blocks, so a chunk is aligned to the
+	 * largest power of two dividing its chunk size, i.e. 8 with the default bin sizes.
+	 */
+	inline size_t getMinAlignment() const { return mMinAlignment; }
+
+	/**
+	 * @brief Allocate a number of chunks of the same size at once.
+	 *
+	 * For small chunks the thread's bin is looked up once, and the chunks are taken from the
+	 * private freelist and the bump pointer of the active block as a whole run, updating the
+	 * block state once per run instead of once per chunk.
+	 *
+	 * @param sz The size of each chunk.
+	 * @param count The number of chunks to allocate.
+	 * @param out The array to store the allocated chunks, at least count entries.
+	 * @return The number of chunks allocated, which is less than count only if out of memory.
+	 */
+	size_t allocateBatch(size_t sz, size_t count, byte** out);
+
+	/**
+	 * @brief Deallocate a number of chunks at once.
+	 *
+	 * Consecutive small chunks within the same block (i.e. those from allocateBatch()) are given
+	 * back as a single list, with one update of the block state (or one CAS to the public
+	 * freelist if the block is owned by another thread) per run.
+	 *
+	 * @param ptrs The chunks to deallocate, NULL entries are skipped.
+	 * @param count The number of entries in ptrs.
+	 */
+	void deallocateBatch(byte** ptrs, size_t count);
+
+	/**
+	 * @brief Unmap the regions mapped on demand which are entirely free.
+	 *
+	 * @note The first region of the pool is never unmapped.
+	 *
+	 * @return The number of regions unmapped.
+	 */
+	size_t releaseFreeRegions();
+
+	/**
+	 * @brief Give the pages of idle free blocks and free large chunks back to the OS.
+	 *
+	 * Only memory which has been free for at least PurgeOptions::DecayTime is purged, and the
+	 * headers of the blocks and chunks are kept. Purged memory is faulted in again (zero-filled,
+	 * or unchanged if LazyFree is set and the kernel didn't reclaim it) when it's reused.
+	 *
+	 * @param force Purge all free memory regardless of the decay time.
+	 * @return The number of bytes purged.
+	 */
+	size_t purge(bool force = false);
+
+	/**
+	 * @brief Change the purge options, which (re)starts or stops the background purge thread.
+	 *
+	 * @note This must not be called concurrently with itself or purge().
+	 */
+	void setPurgeOptions(const PurgeOptions& options);
+	inline const PurgeOptions& getPurgeOptions() const { return mPurgeOptions; }
+
 private:// Types and forward declaration
 	typedef size_t ThreadID;
 protected:
 	class FreeChunk;
 	class Block;
 	class Bin;
+	class LargeChunk;
+	class LargeBin;
 
 private:// Method act on pool
+	void initialize(byte* pMemory, size_t size, size_t* binSizes);
 	byte* allocateLarge(size_t sz);
+	byte* allocateLargeAligned(size_t sz, size_t alignment);
 	void deallocateLarge(byte* mem);
+	void deallocateSmall(byte* mem);
+	bool lookupChunk(byte* mem, bool& large);
+	size_t getAlignedSmallSize(size_t sz, size_t alignment);
 	bool isLargeChunk(byte* mem);
 
 	bool allocateBlocks();// Add more blocks to free block stack (mallocBigBlock)
 
+private:// Region operations (growable pool only)
+	struct Region
+	{
+		byte*	mMemory;	///< The memory returned by the region provider
+		size_t	mSize;		///< The size of mMemory
+		byte*	mBegin;		///< Start of the usable (aligned) part
+		byte*	mEnd;		///< End of the usable part
+		bool	mLarge;		///< The region is used for large chunks, otherwise for blocks
+	};
+
+	byte* mapRegion(size_t size);
+	void unmapRegion(const Region& region);
+	bool isRegionLimitReached();
+	bool addBlockRegion(size_t generation);
+	LargeChunk* addLargeRegion(size_t chunkSize);
+	void insertRegion(const Region& region);
+	bool findRegion(byte* mem, bool& large);
+
+private:// Purge operations
+	size_t purgeFreeBlocks(uint32 now, bool force);
+	size_t purgeLargeChunks(uint32 now, bool force);
+	size_t purgeBumpSpace(uint32 now, bool force);
+	bool isBumpSpacePurging(byte* begin, byte* end);
+	size_t adviseFree(byte* begin, byte* end);
+	size_t getPurgeGranularity();
+	void startPurgeThread();
+	void stopPurgeThread();
+	void purgeThreadLoop();
+
+private:// Large chunk operations (segregated fit with boundary tags)
+	LargeChunk* getFreeLargeChunk(size_t chunkSize);
+	LargeChunk* popLargeBin(size_t index, size_t chunkSize, bool firstFit);
+	LargeChunk* allocateLargeFromBumpPtr(size_t chunkSize);
+	bool releaseLargeChunkToBumpPtr(LargeChunk* chunk, size_t chunkSize);
+	void splitLargeChunk(LargeChunk* chunk, size_t chunkSize);
+	bool claimLargeChunk(LargeChunk* chunk, size_t chunkSize);
+	bool claimPrevLargeChunk(LargeChunk* chunk, size_t prevSize);
+	bool claimLargeChunkPair(LargeChunk* low, size_t lowSize, LargeChunk* high, size_t highSize, bool viaFooter);
+	void freeLargeChunk(LargeChunk* chunk, size_t chunkSize);
+	void insertLargeChunk(LargeChunk* chunk, size_t chunkSize, bool purged = false);
+	void recheckLargeChunk(LargeChunk* chunk, size_t chunkSize);
+	void unlinkLargeChunk(size_t index, LargeChunk* chunk);
+	LargeChunk* getNextLargeChunk(LargeChunk* chunk, size_t chunkSize);
+	size_t findNonEmptyLargeBin(size_t index);
+	void markLargeBin(size_t index, bool nonEmpty);
+
+	static size_t getLargeChunkSize(size_t sz);
+	static size_t getLargeBinIndex(size_t chunkSize);
+	static size_t getLargeBinBaseSize(size_t index);
+
 private:
 
 	template<bool asIndex>
@@ -88,16 +291,17 @@ private:
 	void returnPartialBlock(Bin* bin, Block* block);
 	void restoreBumpPtr(Block* block);
 
-private:// public freelist operations
-	tbb::spin_mutex mPublicFreeListLock;
+private:// public freelist operations (lock-free)
 	Block* getPublicFreeListBlock(Bin* bin);
 	void privatizePublicFreeList(Block* block);
-	void freePublicChunk(Block* block, FreeChunk* chunk);
+	void freePublicChunks(Block* block, FreeChunk* head, FreeChunk* tail);
 
 private:// Per block operations
 	byte* allocateFromBlock(Block* block);
 	byte* allocateFromFreeList(Block* block);
 	byte* allocateFromBumpPtr(Block* block);
+	size_t allocateRunFromBlock(Block* block, byte** out, size_t count);
+	void freeChunksToBlock(Block* block, FreeChunk* head, FreeChunk* tail, size_t count);
 	bool emptyEnoughToUse(Block* block);
 	void removeBlock(Bin* bin, Block* block);
 	void prependBlock(Bin* bin, Block* block);
@@ -105,8 +309,8 @@ private:// Per block operations
 	void processLessUsedBlock(Block* block);
 
 private:
-	Bin* allocateTLS(size_t sz);//bootstrapMalloc(tls size)
-	void deallocateTLS(Bin* p);//bootstrapFree
+	static Bin* allocateTLS(size_t sz);//bootstrapMalloc(tls size)
+	static void deallocateTLS(Bin* p);//bootstrapFree
 
 protected:// Internal classes
 	class FreeChunk
@@ -127,8 +331,10 @@ protected:// Internal classes
 		FreeChunk*	mFreeList;			///< Pointer to private freelist
 		size_t		mAllocationCount;	///< # of objects allocated within the block
 		bool		mIsFull;			///< Indicate whether the block is ready for more allocation
-		FreeChunk*	mPublicFreeList;	///< FreeChunk's returned by threads other than owning thread.
+		FreeChunk* volatile	mPublicFreeList;	///< FreeChunk's returned by threads other than owning thread, pushed by CAS
 		Block*		mNextPrivatizable;//?
+		uint32		mFreeTime;			///< Time (in ms) the block was put on the free block stack
+		bool		mPurged;			///< The pages after the block header are purged (valid only on the free block stack)
 	};//Block
 
 	class Bin
@@ -143,12 +349,76 @@ protected:// Internal classes
 		inline Block* setPreviousBlockActive();
 	};//Bin
 
+	/**
+	 * Large chunks are carved downward from the top of the pool. Every chunk starts with a
+	 * boundary tag holding its size (including the header) and the FREE/PREV_FREE flags,
+	 * and a free chunk also keeps its size in the last word (the footer), so that the
+	 * neighbouring chunks on both sides can be found and coalesced in O(1).
+	 *
+	 * The FREE flag of a chunk and the PREV_FREE flag of the chunk after it only change
+	 * while holding the lock of the size class bin the chunk is linked into.
+	 */
 	class LargeChunk
 	{
 	public:
-		LargeChunk*	mNext;
-		size_t		mSize;	///< The size available for allocation. (excluding the size header when allocated)
-		LargeChunk*	mPrev;
+		enum
+		{
+			FREE		= 0x1,	///< The chunk is linked in a bin
+			PREV_FREE	= 0x2,	///< The previous chunk is linked in a bin, and its footer is valid
+			PURGED		= 0x4,	///< The pages of the free chunk body are purged, cleared whenever the size changes
+			FLAG_MASK	= 0xf,
+			HEADER_SIZE	= 16,	///< Size of the header before the user memory, keeps user memory 16-byte aligned
+			MIN_SIZE	= 64,	///< Minimum size of a free chunk split from a larger one
+		};
+
+		volatile size_t	mHead;	///< Chunk size | flags
+		size_t		mFreeTime;	///< Time (in ms) the chunk was linked in a bin (valid only when free)
+		LargeChunk*	mNext;	///< Next free chunk in the bin (valid only when free)
+		LargeChunk*	mPrev;	///< Previous free chunk in the bin (valid only when free)
+
+		inline size_t size() const { return mHead & ~static_cast<size_t>(FLAG_MASK); }
+		inline bool isFree() const { return mHead & FREE; }
+		inline bool isPrevFree() const { return mHead & PREV_FREE; }
+		inline size_t* footer(size_t chunkSize) { return reinterpret_cast<size_t*>(reinterpret_cast<byte*>(this) + chunkSize) - 1; }
+		inline size_t* prevFooter() { return reinterpret_cast<size_t*>(this) - 1; }
+
+		inline void setFlag(size_t flag)
+		{
+			size_t head;
+			do { head = mHead; } while(!atomic::b_cas(&mHead, head | flag, head));
+		}
+		inline void clearFlag(size_t flag)
+		{
+			size_t head;
+			do { head = mHead; } while(!atomic::b_cas(&mHead, head & ~flag, head));
+		}
+		inline void setSize(size_t chunkSize)// keeps PREV_FREE, which is owned by the previous chunk
+		{
+			size_t head;
+			do { head = mHead; } while(!atomic::b_cas(&mHead, chunkSize | (head & PREV_FREE), head));
+		}
+	};
+
+	/**
+	 * The TLS bins of a thread are allocated outside of the pool and refer to the pool through
+	 * the owner, so that a thread exiting after the pool is destroyed finds the pool retired
+	 * instead of touching memory which is gone. The owner is freed with its last reference.
+	 */
+	class BinOwner
+	{
+	public:
+		ScalablePoolAllocator*	mPool;		///< The pool, or NULL once it is destroyed
+		tbb::spin_rw_mutex		mLock;		///< Held for reading while a thread returns its blocks, for writing to retire the pool
+		tbb::atomic<size_t>		mRefCount;	///< The pool plus every thread holding bins
+	};
+
+	class LargeBin
+	{
+	public:
+		LargeBin() : mHead(NULL) { }
+
+		LargeChunk*		mHead;	///< Free chunks within the size class, in no particular order
+		tbb::spin_mutex	mLock;
 	};
 
 	class Stack// Helper class
@@ -157,8 +427,12 @@ protected:// Internal classes
 		inline Stack();
 		inline void push(void** p);
 		inline void* pop();
+		bool removeRange(byte* begin, byte* end);
+		void** removeIdle(uint32 now, uint32 decayTime, size_t maxCount);
+		void append(void** head, void** tail);
 	private:
 		void* mTop;
+		void** mBottom;	///< The last entry, so that append() doesn't walk the stack
 		tbb::spin_mutex mLock;
 	};
 
@@ -174,6 +448,13 @@ private:// Constants
 	const float EMPTY_ENOUGH_THRESHOLD;	///< The amount of which the usage in a block when it can be called "empty enough". Valid values are floats between [0, 1]
 	const size_t OWNER_ID_NULL;			///< Represent a null ID  (uint max)
 
+	enum
+	{
+		LARGE_BIN_COUNT = 128,			///< Number of large chunk size classes, 4 per power of two starting from 64 bytes
+		LARGE_BIN_MAP_WORDS = LARGE_BIN_COUNT / 64,
+		PURGE_BATCH = 16				///< Number of free blocks or large chunks taken out at a time for purging
+	};
+
 private:// Utility methods
 	inline uintptr_t alignUp(uintptr_t ptr, uintptr_t alignTo)
 	{
@@ -213,7 +494,29 @@ private:// Pool variables
 	byte* mBumpPtr;	///< Points to free space start point at top address. NOTE: This bump has different meaning to Block::mBumpPtr
 	/// @remarks While ScalableAllocator::mBumpPtr points to the end of the space, Block::mBumpPtr points to (UsedAddress - ChunkSize)
 
-	LargeChunk* mLargeFreeList;	///< Freelist of large chunks, in ascending size order
+	byte* mLargeEnd;	///< End of the large chunk space, i.e. the end of the topmost large chunk
+
+	LargeBin mLargeBins[LARGE_BIN_COUNT];				///< Free large chunks segregated by size class
+	volatile uint64 mLargeBinMap[LARGE_BIN_MAP_WORDS];	///< Bitmap of non-empty large bins (may be stale, checked under the bin lock)
+
+private:// Region variables
+	bool mGrowable;				///< The pool maps regions by itself
+	RegionOptions mRegionOptions;
+	Region mPrimaryRegion;		///< The first region mapped by a growable pool (which holds mPool)
+	std::vector<Region> mRegions;	///< Regions mapped on demand, in ascending address order
+	tbb::spin_rw_mutex mRegionLock;
+	size_t mBlockRegionGeneration;	///< Number of block regions added so far, guarded by mPoolLock
+	size_t mLargeRegionGeneration;	///< Number of large regions added so far, guarded by mPoolLock
+
+private:// Purge variables
+	PurgeOptions mPurgeOptions;
+	byte* mPurgedBumpPtr;		///< The space between mBlockAllocPtr and this is purged, and untouched since then
+	byte* mPurgingBumpBegin;	///< The space [mPurgingBumpBegin, mPurgingBumpEnd) is being purged without holding mPoolLock,
+	byte* mPurgingBumpEnd;		///  and it's not carved until then (both are NULL if there's none), guarded by mPoolLock
+	uint32 mBumpPtrFreeTime;	///< Time (in ms) mBumpPtr was last moved up
+	tbb::atomic<size_t> mPurgingBlocks;		///< Number of purge batches taken off the free block stack at the moment
+	tbb::atomic<size_t> mPurgingLargeChunks;	///< Number of purge batches taken out of the large bins at the moment
+	boost::thread mPurgeThread;
 
 
 
@@ -225,10 +528,7 @@ private:// Thread local storage control
 	tbb::atomic<ThreadID> mThreadCount;
 
 	Bin* getBin(size_t sz);
-	tbb::spin_mutex	mTLSAllocationLock;	///< Lock used for alloc/dealloc of TLS(bins)
-	FreeChunk*		mTLSChunkList;	///< Chunks freed and used for next TLS allocation (bootStrapObjectList)
-	Block*			mTLSUsedBlocks;	///< Blocks used for TLS allocation (bootStrapBlockUsed)
-	Block*			mTLSAllocBlock;	///< Block used for next TLS allocation (bootStrapBlock)
+	BinOwner*		mBinOwner;	///< Shared with the TLS bins of all threads
 
 	boost::thread_specific_ptr<ThreadID>	mThreadID;///< TLS storing current thread's ID
 	boost::thread_specific_ptr<Bin>			mBins;///< TLS storing sized bins
@@ -236,6 +536,7 @@ private:// Thread local storage control
 private:// Bins
 	typedef std::pair<size_t, size_t> SizePair;
 	size_t *mBinSizes;
+	size_t mMinAlignment;	///< Alignment guaranteed by allocate(sz), see getMinAlignment()
 
 	Stack* mGlobalBins;	///< Contains all blocks returned from threads (globalSizedBins)
 
@@ -266,6 +567,11 @@ public:// Statistics
 		tbb::atomic<size_t> AllocationRecursion;
 		tbb::atomic<size_t> GarbageCollection;
 
+		tbb::atomic<size_t> RegionsInUse;	///< Number of regions mapped on demand
+		tbb::atomic<size_t> RegionBytes;	///< Total size of the regions mapped on demand
+
+		tbb::atomic<size_t> PurgedBytes;	///< Total size of the memory given back to the OS by purge()
+
 		AllocatorStat()
 		{
 			ChunksInUse = 0;
@@ -275,6 +581,9 @@ public:// Statistics
 			Underruns = 0;
 			AllocationRecursion = 0;
 			GarbageCollection = 0;
+			RegionsInUse = 0;
+			RegionBytes = 0;
+			PurgedBytes = 0;
 		}
 	};
 #ifdef ZILLIANS_SCALABLEALLOCATOR_STATISTICS
@@ -0,0 +1,184 @@
+/**
+ * Zillians MMO
+ * Copyright (C) 2007-2009 Zillians.com, Inc.
+ * For more information see http://www.zillians.com
+ *
+ * Zillians MMO is the library and runtime for massive multiplayer online game
+ * development in utility computing model, which runs as a service for every
+ * developer to build their virtual world running on our GPU-assisted machines.
+ *
+ * This is a close source library intended to be used solely within Zillians.com
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ZILLIANS_SCALABLEPOOLSTDALLOCATOR_H_
+#define ZILLIANS_SCALABLEPOOLSTDALLOCATOR_H_
+
+#include "core/ScalablePoolAllocator.h"
+#include <boost/type_traits/alignment_of.hpp>
+#include <limits>
+#include <new>
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define ZILLIANS_SCALABLEPOOL_HAS_MEMORY_RESOURCE
+#endif
+#endif
+
+namespace zillians {
+
+/**
+ * @brief ScalablePoolStdAllocator is a standard allocator which allocates from a ScalablePoolAllocator.
+ *
+ * The allocator only holds a pointer to the pool, so copies (and rebound copies) of it compare
+ * equal as long as they share the same pool. Memory is given back through the sized deallocate
+ * path of the pool, which skips the pointer lookup. Types aligned beyond
+ * ScalablePoolAllocator::getMinAlignment() (which depends on the bin sizes) go through the
+ * aligned paths.
+ *
+ * @code
+ * 		ScalablePoolAllocator pool(memory, size);
+ * 		ScalablePoolStdAllocator<int> allocator(&pool);
+ * 		std::vector<int, ScalablePoolStdAllocator<int> > v(allocator);
+ * @endcode
+ */
+template<typename T>
+class ScalablePoolStdAllocator
+{
+public:
+	typedef T				value_type;
+	typedef T*				pointer;
+	typedef const T*		const_pointer;
+	typedef T&				reference;
+	typedef const T&		const_reference;
+	typedef std::size_t		size_type;
+	typedef std::ptrdiff_t	difference_type;
+
+	template<typename U>
+	struct rebind
+	{
+		typedef ScalablePoolStdAllocator<U> other;
+	};
+
+public:
+	explicit ScalablePoolStdAllocator(ScalablePoolAllocator* pool) throw() : mPool(pool)
+	{ }
+
+	template<typename U>
+	ScalablePoolStdAllocator(const ScalablePoolStdAllocator<U>& other) throw() : mPool(other.getPool())
+	{ }
+
+public:
+	inline pointer allocate(size_type n, const void* /*hint*/ = 0)
+	{
+		if(UNLIKELY(n > max_size()))
+			throw std::bad_alloc();
+
+		byte* data = (ALIGNMENT > mPool->getMinAlignment()) ? mPool->allocate(n * sizeof(T), ALIGNMENT) : mPool->allocate(n * sizeof(T));
+		if(UNLIKELY(!data))
+			throw std::bad_alloc();
+		return reinterpret_cast<pointer>(data);
+	}
+
+	inline void deallocate(pointer p, size_type n)
+	{
+		if(ALIGNMENT > mPool->getMinAlignment())
+			mPool->deallocate(reinterpret_cast<byte*>(p), n * sizeof(T), ALIGNMENT);
+		else
+			mPool->deallocate(reinterpret_cast<byte*>(p), n * sizeof(T));
+	}
+
+	inline size_type max_size() const throw()
+	{
+		return std::numeric_limits<size_type>::max() / sizeof(T);
+	}
+
+	inline void construct(pointer p, const T& value)
+	{
+		new (static_cast<void*>(p)) T(value);
+	}
+
+	inline void destroy(pointer p)
+	{
+		p->~T();
+	}
+
+	inline pointer address(reference x) const { return &x; }
+	inline const_pointer address(const_reference x) const { return &x; }
+
+	inline ScalablePoolAllocator* getPool() const { return mPool; }
+
+private:
+	enum
+	{
+		ALIGNMENT = boost::alignment_of<T>::value	// taken by the aligned path if the pool doesn't guarantee it
+	};
+
+	ScalablePoolAllocator* mPool;
+};
+
+template<typename T, typename U>
+inline bool operator == (const ScalablePoolStdAllocator<T>& a, const ScalablePoolStdAllocator<U>& b)
+{
+	return a.getPool() == b.getPool();
+}
+
+template<typename T, typename U>
+inline bool operator != (const ScalablePoolStdAllocator<T>& a, const ScalablePoolStdAllocator<U>& b)
+{
+	return a.getPool() != b.getPool();
+}
+
+#ifdef ZILLIANS_SCALABLEPOOL_HAS_MEMORY_RESOURCE
+/**
+ * @brief ScalablePoolMemoryResource is a std::pmr::memory_resource which allocates from a ScalablePoolAllocator.
+ *
+ * The memory resource always uses the sized (and aligned) paths of the pool.
+ *
+ * @code
+ * 		ScalablePoolMemoryResource resource(&pool);
+ * 		std::pmr::unordered_map<int, std::pmr::string> m(&resource);
+ * @endcode
+ */
+class ScalablePoolMemoryResource : public std::pmr::memory_resource
+{
+public:
+	explicit ScalablePoolMemoryResource(ScalablePoolAllocator* pool) noexcept : mPool(pool)
+	{ }
+
+	inline ScalablePoolAllocator* getPool() const noexcept { return mPool; }
+
+protected:
+	virtual void* do_allocate(std::size_t bytes, std::size_t alignment) override
+	{
+		byte* data = mPool->allocate(bytes, alignment);
+		if(UNLIKELY(!data))
+			throw std::bad_alloc();
+		return data;
+	}
+
+	virtual void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override
+	{
+		mPool->deallocate(static_cast<byte*>(p), bytes, alignment);
+	}
+
+	virtual bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		const ScalablePoolMemoryResource* resource = dynamic_cast<const ScalablePoolMemoryResource*>(&other);
+		return resource && resource->mPool == mPool;
+	}
+
+private:
+	ScalablePoolAllocator* mPool;
+};
+#endif
+
+}
+
+#endif/*ZILLIANS_SCALABLEPOOLSTDALLOCATOR_H_*/
@@ -0,0 +1,219 @@
+/**
+ * Zillians MMO
+ * Copyright (C) 2007-2010 Zillians.com, Inc.
+ * For more information see http://www.zillians.com
+ *
+ * Zillians MMO is the library and runtime for massive multiplayer online game
+ * development in utility computing model, which runs as a service for every
+ * developer to build their virtual world running on our GPU-assisted machines.
+ *
+ * This is a close source library intended to be used solely within Zillians.com
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ZILLIANS_BYTEORDERUTIL_H_
+#define ZILLIANS_BYTEORDERUTIL_H_
+
+#include "core/Types.h"
+#include <string.h>
+#include <boost/assert.hpp>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define ZILLIANS_BYTEORDER_SIMD 1
+#include <immintrin.h>
+#else
+#define ZILLIANS_BYTEORDER_SIMD 0
+#endif
+
+namespace zillians {
+
+/**
+ * @brief Check whether the host is little-endian.
+ *
+ * @return True if the host is little-endian, false if it's big-endian.
+ */
+inline bool is_little_endian_host()
+{
+#if defined(__BYTE_ORDER__)
+	return __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+#else
+	const uint16 probe = 1;
+	return *(const uint8*)&probe == 1;
+#endif
+}
+
+/**
+ * @brief Reverse the byte order of a scalar (integer or floating point) value.
+ *
+ * @param value The value to convert.
+ * @return The value in reversed byte order.
+ */
+template<typename T>
+inline T byte_swap(T value)
+{
+	if(sizeof(T) == 2)
+	{
+		uint16 x; ::memcpy(&x, &value, 2);
+		x = (uint16)((x >> 8) | (x << 8));
+		::memcpy(&value, &x, 2);
+	}
+	else if(sizeof(T) == 4)
+	{
+		uint32 x; ::memcpy(&x, &value, 4);
+		x = __builtin_bswap32(x);
+		::memcpy(&value, &x, 4);
+	}
+	else if(sizeof(T) == 8)
+	{
+		uint64 x; ::memcpy(&x, &value, 8);
+		x = __builtin_bswap64(x);
+		::memcpy(&value, &x, 8);
+	}
+	return value;
+}
+
+namespace detail {
+
+/**
+ * @brief Reverse the byte order of each element one by one.
+ */
+inline void byte_swap_array_scalar(byte* dest, const byte* source, std::size_t count, std::size_t element_size)
+{
+	switch(element_size)
+	{
+	case 2:
+		for(std::size_t i = 0; i < count; ++i)
+		{
+			uint16 x; ::memcpy(&x, source + i * 2, 2);
+			x = byte_swap(x);
+			::memcpy(dest + i * 2, &x, 2);
+		}
+		break;
+	case 4:
+		for(std::size_t i = 0; i < count; ++i)
+		{
+			uint32 x; ::memcpy(&x, source + i * 4, 4);
+			x = byte_swap(x);
+			::memcpy(dest + i * 4, &x, 4);
+		}
+		break;
+	case 8:
+		for(std::size_t i = 0; i < count; ++i)
+		{
+			uint64 x; ::memcpy(&x, source + i * 8, 8);
+			x = byte_swap(x);
+			::memcpy(dest + i * 8, &x, 8);
+		}
+		break;
+	default:
+		BOOST_ASSERT(element_size == 2 || element_size == 4 || element_size == 8);
+		break;
+	}
+}
+
+#if ZILLIANS_BYTEORDER_SIMD
+/**
+ * @brief Get the shuffle mask (for two 128-bit lanes) which reverses each element of given size.
+ */
+inline const byte* byte_swap_shuffle_mask(std::size_t element_size)
+{
+	static const byte masks[3][32] = {
+		{ 1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14, 1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14 },
+		{ 3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12, 3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12 },
+		{ 7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8, 7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8 } };
+	return masks[element_size == 2 ? 0 : (element_size == 4 ? 1 : 2)];
+}
+
+/**
+ * @brief Reverse the byte order by 16 bytes at a time with SSSE3 pshufb.
+ *
+ * @return The number of bytes converted, the rest (less than 16 bytes) is left to the caller.
+ */
+__attribute__((target("ssse3")))
+inline std::size_t byte_swap_array_ssse3(byte* dest, const byte* source, std::size_t size, std::size_t element_size)
+{
+	const __m128i mask = _mm_loadu_si128((const __m128i*)byte_swap_shuffle_mask(element_size));
+
+	std::size_t i = 0;
+	for(; i + 16 <= size; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(source + i));
+		_mm_storeu_si128((__m128i*)(dest + i), _mm_shuffle_epi8(v, mask));
+	}
+	return i;
+}
+
+/**
+ * @brief Reverse the byte order by 64 bytes at a time with AVX2 vpshufb.
+ *
+ * @note vpshufb shuffles within each 128-bit lane, which is fine since elements never cross lanes.
+ *
+ * @return The number of bytes converted, the rest (less than 32 bytes) is left to the caller.
+ */
+__attribute__((target("avx2")))
+inline std::size_t byte_swap_array_avx2(byte* dest, const byte* source, std::size_t size, std::size_t element_size)
+{
+	const __m256i mask = _mm256_loadu_si256((const __m256i*)byte_swap_shuffle_mask(element_size));
+
+	std::size_t i = 0;
+	for(; i + 64 <= size; i += 64)
+	{
+		__m256i v0 = _mm256_loadu_si256((const __m256i*)(source + i));
+		__m256i v1 = _mm256_loadu_si256((const __m256i*)(source + i + 32));
+		_mm256_storeu_si256((__m256i*)(dest + i), _mm256_shuffle_epi8(v0, mask));
+		_mm256_storeu_si256((__m256i*)(dest + i + 32), _mm256_shuffle_epi8(v1, mask));
+	}
+	for(; i + 32 <= size; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)(source + i));
+		_mm256_storeu_si256((__m256i*)(dest + i), _mm256_shuffle_epi8(v, mask));
+	}
+	return i;
+}
+#endif
+
+}
+
+/**
+ * @brief Reverse the byte order of each element of an array.
+ *
+ * The widest shuffle kernel supported by the running CPU (AVX2 or SSSE3) is used
+ * for the bulk of the array, and the remaining elements are converted one by one.
+ *
+ * @note The source and the destination may be the same (in-place conversion), but
+ * must not overlap otherwise.
+ *
+ * @param dest The destination array.
+ * @param source The source array.
+ * @param count The number of elements.
+ * @param element_size The size of each element, which is 1, 2, 4 or 8.
+ */
+inline void byte_swap_array(void* dest, const void* source, std::size_t count, std::size_t element_size)
+{
+	if(element_size == 1)
+	{
+		if(dest != source)
+			::memcpy(dest, source, count);
+		return;
+	}
+
+	std::size_t size = count * element_size;
+	std::size_t done = 0;
+#if ZILLIANS_BYTEORDER_SIMD
+	if(__builtin_cpu_supports("avx2"))
+		done = detail::byte_swap_array_avx2((byte*)dest, (const byte*)source, size, element_size);
+	else if(__builtin_cpu_supports("ssse3"))
+		done = detail::byte_swap_array_ssse3((byte*)dest, (const byte*)source, size, element_size);
+#endif
+	detail::byte_swap_array_scalar((byte*)dest + done, (const byte*)source + done, (size - done) / element_size, element_size);
+}
+
+}
+
+#endif/*ZILLIANS_BYTEORDERUTIL_H_*/
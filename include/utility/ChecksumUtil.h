@@ -0,0 +1,188 @@
+/**
+ * Zillians MMO
+ * Copyright (C) 2007-2010 Zillians.com, Inc.
+ * For more information see http://www.zillians.com
+ *
+ * Zillians MMO is the library and runtime for massive multiplayer online game
+ * development in utility computing model, which runs as a service for every
+ * developer to build their virtual world running on our GPU-assisted machines.
+ *
+ * This is a close source library intended to be used solely within Zillians.com
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ZILLIANS_CHECKSUMUTIL_H_
+#define ZILLIANS_CHECKSUMUTIL_H_
+
+#include "core/Types.h"
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__clang__) || (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define ZILLIANS_CHECKSUM_SSE42 1
+#include <nmmintrin.h>
+#else
+#define ZILLIANS_CHECKSUM_SSE42 0
+#endif
+
+namespace zillians {
+
+namespace detail {
+
+/**
+ * @brief The lookup table of CRC32C (Castagnoli, reflected polynomial 0x82F63B78) for the software fallback.
+ */
+struct crc32c_table
+{
+	crc32c_table()
+	{
+		for(uint32 i = 0; i < 256; ++i)
+		{
+			uint32 crc = i;
+			for(int k = 0; k < 8; ++k)
+				crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : (crc >> 1);
+			entries[i] = crc;
+		}
+	}
+
+	static const crc32c_table& instance()
+	{
+		static crc32c_table table;
+		return table;
+	}
+
+	uint32 entries[256];
+};
+
+inline uint32 crc32c_update_software(uint32 crc, const byte* data, std::size_t size)
+{
+	const uint32* table = crc32c_table::instance().entries;
+	for(std::size_t i = 0; i < size; ++i)
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+inline uint32 crc32c_copy_software(uint32 crc, byte* dest, const byte* source, std::size_t size)
+{
+	const uint32* table = crc32c_table::instance().entries;
+	for(std::size_t i = 0; i < size; ++i)
+	{
+		byte b = source[i];
+		dest[i] = b;
+		crc = table[(crc ^ b) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if ZILLIANS_CHECKSUM_SSE42
+__attribute__((target("sse4.2")))
+inline uint32 crc32c_update_sse42(uint32 crc, const byte* data, std::size_t size)
+{
+	uint64 crc64 = crc;
+	for(; size >= 8; size -= 8, data += 8)
+	{
+		uint64 x; ::memcpy(&x, data, 8);
+		crc64 = _mm_crc32_u64(crc64, x);
+	}
+	crc = (uint32)crc64;
+	for(; size > 0; --size, ++data)
+		crc = _mm_crc32_u8(crc, *data);
+	return crc;
+}
+
+__attribute__((target("sse4.2")))
+inline uint32 crc32c_copy_sse42(uint32 crc, byte* dest, const byte* source, std::size_t size)
+{
+	uint64 crc64 = crc;
+	for(; size >= 8; size -= 8, source += 8, dest += 8)
+	{
+		uint64 x; ::memcpy(&x, source, 8);
+		crc64 = _mm_crc32_u64(crc64, x);
+		::memcpy(dest, &x, 8);
+	}
+	crc = (uint32)crc64;
+	for(; size > 0; --size, ++source, ++dest)
+	{
+		*dest = *source;
+		crc = _mm_crc32_u8(crc, *dest);
+	}
+	return crc;
+}
+#endif
+
+}
+
+/**
+ * @brief Initial state of an incremental CRC32C computation.
+ */
+const uint32 CRC32C_INIT = 0xFFFFFFFF;
+
+/**
+ * @brief Feed data into an incremental CRC32C computation.
+ *
+ * The SSE4.2 crc32 instruction is used if supported by the running CPU, otherwise
+ * a table-driven software implementation is used. Both produce identical results.
+ *
+ * @param crc The current state, which starts from CRC32C_INIT.
+ * @param data The data.
+ * @param size The size of the data.
+ * @return The updated state.
+ */
+inline uint32 crc32c_update(uint32 crc, const void* data, std::size_t size)
+{
+#if ZILLIANS_CHECKSUM_SSE42
+	if(__builtin_cpu_supports("sse4.2"))
+		return detail::crc32c_update_sse42(crc, (const byte*)data, size);
+#endif
+	return detail::crc32c_update_software(crc, (const byte*)data, size);
+}
+
+/**
+ * @brief Copy data and feed it into an incremental CRC32C computation in a single pass.
+ *
+ * @param crc The current state, which starts from CRC32C_INIT.
+ * @param dest The destination, which must not overlap the data.
+ * @param source The data.
+ * @param size The size of the data.
+ * @return The updated state.
+ */
+inline uint32 crc32c_copy(uint32 crc, void* dest, const void* source, std::size_t size)
+{
+#if ZILLIANS_CHECKSUM_SSE42
+	if(__builtin_cpu_supports("sse4.2"))
+		return detail::crc32c_copy_sse42(crc, (byte*)dest, (const byte*)source, size);
+#endif
+	return detail::crc32c_copy_software(crc, (byte*)dest, (const byte*)source, size);
+}
+
+/**
+ * @brief Get the final CRC32C value from the state of an incremental computation.
+ *
+ * @param crc The current state.
+ * @return The CRC32C value.
+ */
+inline uint32 crc32c_final(uint32 crc)
+{
+	return crc ^ 0xFFFFFFFF;
+}
+
+/**
+ * @brief Compute the CRC32C of the given data in one go.
+ *
+ * @param data The data.
+ * @param size The size of the data.
+ * @return The CRC32C value.
+ */
+inline uint32 crc32c(const void* data, std::size_t size)
+{
+	return crc32c_final(crc32c_update(CRC32C_INIT, data, size));
+}
+
+}
+
+#endif/*ZILLIANS_CHECKSUMUTIL_H_*/
@@ -24,9 +24,35 @@
 
 #include "core/ScalablePoolAllocator.h"
 #include "tbb/tbb_thread.h"
+#include <new>
+#ifdef __PLATFORM_LINUX__
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#endif
 
 namespace zillians {
 
+namespace {
+/**
+ * Coarse monotonic clock in milliseconds for the purge decay time, wraps around every 49 days.
+ */
+inline uint32 getPurgeClock()
+{
+#ifdef __PLATFORM_LINUX__
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return static_cast<uint32>(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#else
+	return 0;
+#endif
+}
+}
+
 #if BUILD_WITH_LOG4CXX
 log4cxx::LoggerPtr ScalablePoolAllocator::mLogger(log4cxx::Logger::getLogger("zillians.common.core.ScalablePoolAllocator"));
 #endif
@@ -38,18 +64,61 @@ ScalablePoolAllocator::ScalablePoolAllocator(byte* pMemory, size_t size, size_t*
 , MIN_LARGE_CHUNK_SIZE(binSizes?binSizes[binCount-1]+1:8193)
 , INVALID(0x1)
 , BIN_COUNT(binCount?binCount:32)// Default to 32 bins between 4 to 8K bytes
-, TLS_SIZE(sizeof(Bin) * (BIN_COUNT + 1))// Bin size times number of bins, 1 for additional space to store "this" pointer
+, TLS_SIZE(sizeof(Bin) * (BIN_COUNT + 1))// Bin size times number of bins, 1 for additional space to store the BinOwner pointer
+// TODO: above line needs more explaination.
+, EMPTY_ENOUGH_THRESHOLD((BLOCK_SIZE - sizeof(Block)) * 0.75f)// 75% full is empty enough
+, OWNER_ID_NULL(static_cast<size_t>(-1))
+, mGrowable(false)
+, mThreadID(ThreadIDTLSCleanUpFunction)
+, mBins(BinTLSCleanUpFunction)
+{
+	initialize(pMemory, size, binSizes);
+}//c'tor
+
+ScalablePoolAllocator::ScalablePoolAllocator(const RegionOptions& options, size_t* binSizes, size_t binCount)
+: BLOCK_SIZE(16384)// Default to 16K blocks
+, BIG_BLOCK_BLOCK_COUNT(16)// Allocate 16 new blocks at a time whenever there's not enough blocks to go around
+, BIG_BLOCK_SIZE(BLOCK_SIZE * BIG_BLOCK_BLOCK_COUNT)
+, MIN_LARGE_CHUNK_SIZE(binSizes?binSizes[binCount-1]+1:8193)
+, INVALID(0x1)
+, BIN_COUNT(binCount?binCount:32)// Default to 32 bins between 4 to 8K bytes
+, TLS_SIZE(sizeof(Bin) * (BIN_COUNT + 1))// Bin size times number of bins, 1 for additional space to store the BinOwner pointer
 // TODO: above line needs more explaination.
 , EMPTY_ENOUGH_THRESHOLD((BLOCK_SIZE - sizeof(Block)) * 0.75f)// 75% full is empty enough
 , OWNER_ID_NULL(static_cast<size_t>(-1))
+, mGrowable(true)
+, mRegionOptions(options)
 , mThreadID(ThreadIDTLSCleanUpFunction)
 , mBins(BinTLSCleanUpFunction)
+{
+	mPrimaryRegion.mSize = options.RegionSize;
+	mPrimaryRegion.mMemory = mapRegion(mPrimaryRegion.mSize);
+	if(!mPrimaryRegion.mMemory)
+		throw std::bad_alloc();
+	mPrimaryRegion.mBegin = mPrimaryRegion.mMemory;
+	mPrimaryRegion.mEnd = mPrimaryRegion.mMemory + mPrimaryRegion.mSize;
+	mPrimaryRegion.mLarge = false;
+
+	try
+	{
+		initialize(mPrimaryRegion.mMemory, mPrimaryRegion.mSize, binSizes);
+	}
+	catch(...)
+	{
+		unmapRegion(mPrimaryRegion);
+		throw;
+	}
+}//c'tor
+
+void ScalablePoolAllocator::initialize(byte* pMemory, size_t size, size_t* binSizes)
 {
 	// check minimum buffer size
 	if(size < BLOCK_SIZE * 17)
 		throw std::length_error("ScalablePoolAllocator needs at least BLOCK_SIZE * 17 bytes");
 
-	memset(pMemory, 0, size);
+	// Only the metadata is cleared, everything else is initialized when it's carved out, so that
+	// the pages of a pool (or a mapped region) are not committed before they're used
+	memset(pMemory, 0, BIN_COUNT * sizeof(Stack));
 
 	// Store mGlobalBins in our heap. (NOTE 20101230 Nothing: This is needed before we cannot delete it prior to deletion of ScalablePoolAllocator
 	mGlobalBins = (Stack*)pMemory;//new Stack[BIN_COUNT];
@@ -69,17 +138,27 @@ ScalablePoolAllocator::ScalablePoolAllocator(byte* pMemory, size_t size, size_t*
 	//mThreadID = new boost::thread_specific_ptr<ThreadID>(ThreadIDTLSCleanUpFunction);
 	//mBins = new boost::thread_specific_ptr<Bin>(BinTLSCleanUpFunction);
 
-	mTLSChunkList = NULL;
-	mTLSUsedBlocks = NULL;
-	mTLSAllocBlock = NULL;
+	mBinOwner = new BinOwner;
+	mBinOwner->mPool = this;
+	mBinOwner->mRefCount = 1;
 	mThreadCount = 0;
 
 	// Initialize pool
 	mBlockAllocPtr = mPool;
+	mBlockRegionGeneration = 0;
+	mLargeRegionGeneration = 0;
+	mPurgedBumpPtr = mPool;
+	mPurgingBumpBegin = mPurgingBumpEnd = NULL;
+	mBumpPtrFreeTime = getPurgeClock();
+	mPurgingBlocks = 0;
+	mPurgingLargeChunks = 0;
 
 	// Large Allocation
 	mBumpPtr = mPoolEnd;
-	mLargeFreeList = NULL;
+	for(size_t i = 0; i < LARGE_BIN_MAP_WORDS; ++i)
+	{
+		mLargeBinMap[i] = 0;
+	}
 
 	// Initialize bin settings
 	// 20090302 nothing - Allocate mBinSizes in mPool, and align to 128 byte boundary for cache coherence.
@@ -104,12 +183,48 @@ ScalablePoolAllocator::ScalablePoolAllocator(byte* pMemory, size_t size, size_t*
 		mBinSizes[28] = 5120;	mBinSizes[29] = 6144;	mBinSizes[30] = 7168;	mBinSizes[31] = 8192;
 	}
 
-	STAT_RESET();
+	// User memory of large chunks is aligned to the chunk header, and small chunks to the lowest set bit of their size
+	mMinAlignment = LargeChunk::HEADER_SIZE;
+	for(size_t i = 0; i < BIN_COUNT; ++i)
+	{
+		mMinAlignment = std::min(mMinAlignment, mBinSizes[i] & (~mBinSizes[i] + 1));
+	}
 
-}//c'tor
+	// Large chunks are carved downward from here, keep them aligned for the chunk header.
+	// The topmost chunk is a fence which is never freed, so every large chunk has a next chunk.
+	mBumpPtr = reinterpret_cast<byte*>(alignDown(reinterpret_cast<uintptr_t>(mBumpPtr), LargeChunk::HEADER_SIZE)) - LargeChunk::HEADER_SIZE;
+	reinterpret_cast<LargeChunk*>(mBumpPtr)->mHead = LargeChunk::HEADER_SIZE;
+	mLargeEnd = mBumpPtr;
+
+	STAT_RESET();
+}
 
 ScalablePoolAllocator::~ScalablePoolAllocator()
 {
+	stopPurgeThread();
+
+	// Return the blocks of the calling thread, and retire the pool for every other thread, which
+	// may still exit and clean up its bins after the pool memory is gone
+	mBins.reset();
+	{
+		tbb::spin_rw_mutex::scoped_lock lock(mBinOwner->mLock, true);
+		mBinOwner->mPool = NULL;
+	}
+	if(--mBinOwner->mRefCount == 0)
+	{
+		delete mBinOwner;
+	}
+
+	if(mGrowable)
+	{
+		for(std::vector<Region>::iterator it = mRegions.begin(); it != mRegions.end(); ++it)
+		{
+			unmapRegion(*it);
+		}
+		mRegions.clear();
+		unmapRegion(mPrimaryRegion);
+	}
+
 	//
 	//SAFE_DELETE_ARRAY(mGlobalBins);
 
@@ -200,810 +315,1811 @@ void ScalablePoolAllocator::deallocate(byte* mem)//done
 {
 	if(!mem) { return; }
 
-	if((mem < mPool)||(mem > mPoolEnd))
+	bool large;
+	if(!lookupChunk(mem, large))
 	{
-		// NOTE: This should never ever happen, it's user's fault if this happens
-#if BUILD_WITH_LOG4CXX
-		LOG4CXX_ERROR(mLogger, "mem is not inside the pool. User's fault!");
-#endif
-		assert(0);
 		return;
 	}
 	STAT_ADD(mStatistics.TotalDeallocations);
 
-	if(isLargeChunk(mem))
+	if(large)
 	{
 		deallocateLarge(mem);
-		return;
 	}
-	STAT_ADD(mStatistics.TotalSmallDeallocations);
-	STAT_SUB(mStatistics.ChunksInUse);
+	else
+	{
+		deallocateSmall(mem);
+	}
+}
 
-	FreeChunk* chunk = reinterpret_cast<FreeChunk*>(mem);
-	ThreadID tid = getThreadID();
-	Block* block = reinterpret_cast<Block*>( alignDown(reinterpret_cast<uintptr_t>(mem), BLOCK_SIZE) );
 
-	if(tid == block->mOwnerID)
-	{
-		chunk->mNext = block->mFreeList;
-		block->mFreeList = chunk;
-		block->mAllocationCount--;
+void ScalablePoolAllocator::deallocate(byte* mem, size_t sz)
+{
+	if(!mem) { return; }
 
-		if(block->mIsFull)
-		{
-			if(emptyEnoughToUse(block))
-			{
-				moveBlockToBinFront(block);
-			}
-		}
-		else
-		{
-			if( (block->mAllocationCount == 0) && (block->mPublicFreeList == NULL) )
-			{
-				processLessUsedBlock(block);
-			}
-		}
+	// Same dispatch as allocate(sz)
+	STAT_ADD(mStatistics.TotalDeallocations);
+	if( sz >= MIN_LARGE_CHUNK_SIZE )
+	{
+		deallocateLarge(mem);
 	}
 	else
 	{
-		freePublicChunk(block, chunk);
+		deallocateSmall(mem);
 	}
 }
 
 
-byte* ScalablePoolAllocator::allocateLarge(size_t sz)
+byte* ScalablePoolAllocator::allocate(size_t sz, size_t alignment)
 {
-	tbb::spin_mutex::scoped_lock lock(mPoolLock);
-	STAT_ADD(mStatistics.TotalLargeAllocations);
-	STAT_ADDV(mStatistics.AllocatedSize, sz);
-	STAT_ADDV(mStatistics.AllocatedSize, sizeof(size_t));
-
-
-	LargeChunk* chunk = mLargeFreeList;
-	size_t* psz = NULL;
-
-	// 1. Search for a FreeChunk that's large enough for allocation
-	while(chunk)
+	if( !alignment || (alignment & (alignment - 1)) )
 	{
-		if(chunk->mSize == sz)// Exact fit
-		{
-			// Detach chunk from list
-			if(chunk->mPrev)
-			{
-				chunk->mPrev->mNext = chunk->mNext;
-			}
-			else
-			{
-				mLargeFreeList = chunk->mNext;
-			}
-			if(chunk->mNext)
-			{
-				chunk->mNext->mPrev = chunk->mPrev;
-			}
-
-			psz = reinterpret_cast<size_t*>(chunk);
-			*psz = sz;
-			return reinterpret_cast<byte*>(psz) + sizeof(size_t);
-		}
-		else if(chunk->mSize > sz)// Fit
-		{
-			if(chunk->mSize - sz > sizeof(LargeChunk))// add a new LargeChunk
-			{
-				LargeChunk* newchunk = reinterpret_cast<LargeChunk*>( reinterpret_cast<byte*>(chunk) + sz + sizeof(size_t) );
-				newchunk->mNext = chunk->mNext;
-				newchunk->mPrev = chunk->mPrev;
-				newchunk->mSize = chunk->mSize - sz -sizeof(size_t);
-				if(newchunk->mPrev)
-				{
-					newchunk->mPrev->mNext = newchunk;
-				}
-				else
-				{
-					mLargeFreeList = newchunk;
-				}
-				if(newchunk->mNext)
-				{
-					newchunk->mNext->mPrev = newchunk;
-				}
-				psz = reinterpret_cast<size_t*>(chunk);
-				*psz = sz;
-				return reinterpret_cast<byte*>(psz) + sizeof(size_t);
-			}
-			else// remain space cannot fit a new LargeChunk, give entire LargeChunk to user.
-			{
-				// Detach chunk from list
-				if(chunk->mPrev)
-				{
-					chunk->mPrev->mNext = chunk->mNext;
-				}
-				else
-				{
-					mLargeFreeList = chunk->mNext;
-				}
-				if(chunk->mNext)
-				{
-					chunk->mNext->mPrev = chunk->mPrev;
-				}
-
-				psz = reinterpret_cast<size_t*>(chunk);
-				*psz = sz;
-				return reinterpret_cast<byte*>(psz) + sizeof(size_t);
-			}
-		}
-		chunk = chunk->mNext;
-	}//while(chunk)
+		return NULL;// Not a power of two
+	}
 
-	// 2. Allocate from mBumpPtr
-	mBumpPtr = mBumpPtr - sz - sizeof(size_t);
-	if(mBumpPtr < mBlockAllocPtr)
+	size_t smallSize = getAlignedSmallSize(sz, alignment);
+	if(smallSize)
 	{
-		// Out of memory!
-		mBumpPtr = mBumpPtr + sz + sizeof(size_t);
-		STAT_ADD(mStatistics.GarbageCollection);// TODO: Need some sort of garbage collection
-		STAT_SUBV(mStatistics.AllocatedSize, sizeof(size_t));
-		STAT_SUBV(mStatistics.AllocatedSize, sz);
-		return NULL;
+		return allocate(smallSize);
 	}
-	psz = reinterpret_cast<size_t*>(mBumpPtr);
-	*psz = sz;
-
-	return reinterpret_cast<byte*>(psz) + sizeof(size_t);
 
-}//allocateLarge(size_t sz)
+	STAT_ADD(mStatistics.TotalAllocations);
+	return allocateLargeAligned(sz, alignment);
+}
 
 
-void ScalablePoolAllocator::deallocateLarge(byte* mem)
+void ScalablePoolAllocator::deallocate(byte* mem, size_t sz, size_t alignment)
 {
-	tbb::spin_mutex::scoped_lock lock(mPoolLock);
-	STAT_ADD(mStatistics.TotalLargeDeallocations);
-
-	size_t* psz = (reinterpret_cast<size_t*>(mem - sizeof(size_t)));
-	STAT_SUBV(mStatistics.AllocatedSize, *psz);
-	STAT_SUBV(mStatistics.AllocatedSize, sizeof(size_t));
+	if(!mem) { return; }
 
-	if(mem == mBumpPtr + sizeof(size_t))// At front, move the bump pointer back
+	// Same dispatch as allocate(sz, alignment)
+	STAT_ADD(mStatistics.TotalDeallocations);
+	if(getAlignedSmallSize(sz, alignment))
 	{
-		mBumpPtr = mBumpPtr + (*psz) + sizeof(size_t);
-		return;
+		deallocateSmall(mem);
 	}
 	else
 	{
-		LargeChunk* lc = reinterpret_cast<LargeChunk*>(psz);
-		lc->mSize = *psz;
-		LargeChunk* list = mLargeFreeList;
+		deallocateLarge(mem);
+	}
+}
+
+
+/**
+ * Get the size to allocate a small chunk aligned to the given alignment, or 0 if a large chunk is needed.
+ *
+ * Blocks are aligned to BLOCK_SIZE and chunks are carved downward from the block end, so every
+ * chunk is aligned to the alignment if the chunk size is a multiple of it.
+ */
+size_t ScalablePoolAllocator::getAlignedSmallSize(size_t sz, size_t alignment)
+{
+	if(alignment > BLOCK_SIZE)
+	{
+		return 0;
+	}
+
+	size_t alignedSize = alignUp(std::max(sz, alignment), alignment);
+	if(alignedSize >= MIN_LARGE_CHUNK_SIZE || getChunkSize(alignedSize) % alignment != 0)
+	{
+		return 0;
+	}
+	return alignedSize;
+}
+
 
-		if(list == NULL)// The only item in freelist
+size_t ScalablePoolAllocator::allocateBatch(size_t sz, size_t count, byte** out)
+{
+	size_t n = 0;
+	if( sz >= MIN_LARGE_CHUNK_SIZE )
+	{
+		while( n < count && (out[n] = allocate(sz)) )
 		{
-			lc->mPrev = lc->mNext = NULL;
-			mLargeFreeList = lc;
-			STAT_ADD(mStatistics.LargeChunkInFreeList);
-			return;
+			++n;
 		}
+		return n;
+	}
+
+	Bin* bin = getBin(sz);
+	if(bin == NULL)//Out of memory
+	{
+		return 0;
+	}
 
-		// Find position in the list
-		while((list->mNext != NULL) && (list < lc))
+	while(n < count)
+	{
+		Block* block = bin->getActiveBlock();
+		if(block)
 		{
-			list = list->mNext;
+			size_t run = allocateRunFromBlock(block, out + n, count - n);
+			STAT_ADDV(mStatistics.TotalAllocations, run);
+			STAT_ADDV(mStatistics.TotalSmallAllocations, run);
+			STAT_ADDV(mStatistics.ChunksInUse, run);
+			n += run;
 		}
-		if(list->mNext == NULL)// last item
+		if(n == count)
 		{
-			if(list < lc)// Append to the end of freelist
-			{
-				lc->mNext = NULL;
-				lc->mPrev = list;
-				list->mNext = lc;
-			}
-			else// Insert before last item
-			{
-				lc->mNext = list;
-				lc->mPrev = list->mPrev;
-				list->mPrev = lc;
-				if(lc->mPrev)
-				{
-					lc->mPrev->mNext = lc;
-				}
-				else//lc is head
-				{
-					mLargeFreeList = lc;
-				}
-			}
+			break;
 		}
-		else// list > lc
+
+		// The active block is used up, let allocate() find the next block and make it active
+		if( !(out[n] = allocate(sz)) )
 		{
-			lc->mNext = list;
-			lc->mPrev = list->mPrev;
-			list->mPrev = lc;
-			if(lc->mPrev)
-			{
-				lc->mPrev->mNext = lc;
-			}
-			else
-			{
-				mLargeFreeList = lc;
-			}
+			break;// Out of memory
 		}
-		STAT_ADD(mStatistics.LargeChunkInFreeList);
+		++n;
+	}
+	return n;
+}
+
 
-		// Merge next/prev blocks if they are neighbours
-		if((lc->mPrev) && (reinterpret_cast<byte*>(lc->mPrev) + lc->mPrev->mSize + sizeof(size_t) == reinterpret_cast<byte*>(lc)))
+void ScalablePoolAllocator::deallocateBatch(byte** ptrs, size_t count)
+{
+	size_t i = 0;
+	while(i < count)
+	{
+		byte* mem = ptrs[i++];
+		bool large;
+		if( !mem || !lookupChunk(mem, large) )
 		{
-			lc->mPrev->mSize += (lc->mSize + sizeof(size_t));
-			lc->mPrev->mNext = lc->mNext;
-			if(lc->mNext)
-			{
-				lc->mNext->mPrev = lc->mPrev;
-			}
-			lc = lc->mPrev;
-			STAT_SUB(mStatistics.LargeChunkInFreeList);
+			continue;
 		}
-		if((lc->mNext) && (reinterpret_cast<byte*>(lc) + lc->mSize + sizeof(size_t) == reinterpret_cast<byte*>(lc->mNext)))
+		if(large)
 		{
-			lc->mSize += (lc->mNext->mSize + sizeof(size_t));
-			lc->mNext = lc->mNext->mNext;
-			if(lc->mNext)
-			{
-				lc->mNext->mPrev = lc;
-			}
-			STAT_SUB(mStatistics.LargeChunkInFreeList);
+			STAT_ADD(mStatistics.TotalDeallocations);
+			deallocateLarge(mem);
+			continue;
 		}
-	}
-}//deallocateLarge(byte* mem)
 
+		// Chain up the following chunks of the same block, which can't be large chunks since
+		// the block takes the whole BLOCK_SIZE aligned range
+		Block* block = reinterpret_cast<Block*>( alignDown(reinterpret_cast<uintptr_t>(mem), BLOCK_SIZE) );
+		FreeChunk* head = reinterpret_cast<FreeChunk*>(mem);
+		FreeChunk* tail = head;
+		size_t run = 1;
+		while( i < count && ptrs[i] && alignDown(reinterpret_cast<uintptr_t>(ptrs[i]), BLOCK_SIZE) == reinterpret_cast<uintptr_t>(block) )
+		{
+			tail->mNext = reinterpret_cast<FreeChunk*>(ptrs[i++]);
+			tail = tail->mNext;
+			++run;
+		}
 
-bool ScalablePoolAllocator::isLargeChunk(byte* mem)// done
-{
-	return (mem > mBlockAllocPtr);
+		STAT_ADDV(mStatistics.TotalDeallocations, run);
+		STAT_ADDV(mStatistics.TotalSmallDeallocations, run);
+		STAT_SUBV(mStatistics.ChunksInUse, run);
+		freeChunksToBlock(block, head, tail, run);
+	}
 }
 
 
-ScalablePoolAllocator::ThreadID ScalablePoolAllocator::getThreadID()
+bool ScalablePoolAllocator::lookupChunk(byte* mem, bool& large)
 {
-	ThreadID ret = reinterpret_cast<ThreadID>(mThreadID.get());
-	if( ret == 0 )
+	if((mem >= mPool) && (mem <= mPoolEnd))
 	{
-		ret = ++mThreadCount;// Atomic operation
-		mThreadID.reset(reinterpret_cast<ThreadID*>(ret));
+		large = isLargeChunk(mem);
+		return true;
 	}
-	return ret;
+	if(findRegion(mem, large))
+	{
+		return true;
+	}
+
+	// NOTE: This should never ever happen, it's user's fault if this happens
+#if BUILD_WITH_LOG4CXX
+	LOG4CXX_ERROR(mLogger, "mem is not inside the pool. User's fault!");
+#endif
+	assert(0);
+	return false;
 }
 
 
-ScalablePoolAllocator::Bin* ScalablePoolAllocator::getBin(size_t sz)//done
+void ScalablePoolAllocator::deallocateSmall(byte* mem)
 {
-	Bin* bins = mBins.get();
+	STAT_ADD(mStatistics.TotalSmallDeallocations);
+	STAT_SUB(mStatistics.ChunksInUse);
 
-	if(bins == NULL)// First time used, create bins
-	{
-		bins = allocateTLS(TLS_SIZE);
-		if(bins == NULL)//Out of memory
-		{
-			return NULL;
-		}
-		uintptr_t* sa = reinterpret_cast<uintptr_t*>(bins);
-		*sa = reinterpret_cast<uintptr_t>(this);
-		bins = bins + 1;
-		mBins.reset(bins);
-	}
-	return bins + getIndex(sz);
+	FreeChunk* chunk = reinterpret_cast<FreeChunk*>(mem);
+	Block* block = reinterpret_cast<Block*>( alignDown(reinterpret_cast<uintptr_t>(mem), BLOCK_SIZE) );
+	freeChunksToBlock(block, chunk, chunk, 1);
 }
 
 
-ScalablePoolAllocator::Bin* ScalablePoolAllocator::allocateTLS(size_t sz)// done
+void ScalablePoolAllocator::freeChunksToBlock(Block* block, FreeChunk* head, FreeChunk* tail, size_t count)
 {
-	Bin* ret;
+	ThreadID tid = getThreadID();
 
+	if(tid == block->mOwnerID)
 	{
-		tbb::spin_mutex::scoped_lock lock(mTLSAllocationLock);
+		tail->mNext = block->mFreeList;
+		block->mFreeList = head;
+		block->mAllocationCount -= count;
 
-		if(mTLSChunkList)// Free chunk ready to use
+		if(block->mIsFull)
 		{
-			ret = reinterpret_cast<Bin*>(mTLSChunkList);
-			mTLSChunkList = mTLSChunkList->mNext;
+			if(emptyEnoughToUse(block))
+			{
+				moveBlockToBinFront(block);
+			}
 		}
 		else
 		{
-			if( !mTLSAllocBlock )
-			{
-				mTLSAllocBlock = getEmptyBlock(sz);
-			}
-			if( mTLSAllocBlock == NULL )//Out of memory
-			{
-				return NULL;
-			}
-			ret = reinterpret_cast<Bin*>(mTLSAllocBlock->mBumpPtr);
-			mTLSAllocBlock->mBumpPtr = reinterpret_cast<FreeChunk*>( reinterpret_cast<uintptr_t>(mTLSAllocBlock->mBumpPtr) - mTLSAllocBlock->mChunkSize );
-			if( reinterpret_cast<uintptr_t>(mTLSAllocBlock->mBumpPtr) < reinterpret_cast<uintptr_t>(mTLSAllocBlock) + sizeof(Block))
+			if( (block->mAllocationCount == 0) && (block->mPublicFreeList == NULL) )
 			{
-				mTLSAllocBlock->mBumpPtr = NULL;
-				mTLSAllocBlock->mNext = mTLSUsedBlocks;
-				mTLSUsedBlocks = mTLSAllocBlock;
-				mTLSAllocBlock = NULL;
+				processLessUsedBlock(block);
 			}
 		}
-	}//unlock
-
-	memset(ret, 0, sz);
-	return ret;
+	}
+	else
+	{
+		freePublicChunks(block, head, tail);
+	}
 }
 
 
-void ScalablePoolAllocator::deallocateTLS(Bin* p)//done (bootStrapFree)
+byte* ScalablePoolAllocator::allocateLarge(size_t sz)
 {
-	{// lock
-		tbb::spin_mutex::scoped_lock lock(mTLSAllocationLock);
-		reinterpret_cast<FreeChunk*>(p)->mNext = mTLSChunkList;
-		mTLSChunkList = reinterpret_cast<FreeChunk*>(p);
-	}// unlock
-}
-
+	STAT_ADD(mStatistics.TotalLargeAllocations);
 
-bool ScalablePoolAllocator::allocateBlocks()//done (mallocBigBlock)
-{
-	tbb::spin_mutex::scoped_lock lock(mPoolLock);// NOTE: can be replace with atomic addition to mBlockAllocPtr
-	Block* blk = reinterpret_cast<Block*>(mBlockAllocPtr);
-	mBlockAllocPtr += BIG_BLOCK_SIZE;
+	size_t chunkSize = getLargeChunkSize(sz);
 
-	STAT_ADDV(mStatistics.AllocatedSize, BIG_BLOCK_SIZE);
-	if(mBlockAllocPtr > mBumpPtr)
+	// 1. Take a free chunk from the size class bins, or
+	// 2. Carve a new chunk from mBumpPtr
+	LargeChunk* chunk = getFreeLargeChunk(chunkSize);
+	if(!chunk)
 	{
-		STAT_SUBV(mStatistics.AllocatedSize, BIG_BLOCK_SIZE);
-		return false;// Out of memory!
+		chunk = allocateLargeFromBumpPtr(chunkSize);
 	}
+	while(!chunk && mPurgingLargeChunks)
+	{
+		// Chunks being purged are out of the bins for a moment, wait for them instead of failing (or growing)
+		tbb::this_tbb_thread::yield();
+		chunk = getFreeLargeChunk(chunkSize);
+	}
+	if(!chunk && mGrowable)
+	{
+		// 3. Map a new region for large chunks
+		chunk = addLargeRegion(chunkSize);
+	}
+	if(!chunk)
+	{
+		// Out of memory!
+		STAT_ADD(mStatistics.GarbageCollection);// TODO: Need some sort of garbage collection
+		return NULL;
+	}
+
+	STAT_ADDV(mStatistics.AllocatedSize, chunk->size());
+	return reinterpret_cast<byte*>(chunk) + LargeChunk::HEADER_SIZE;
+}//allocateLarge(size_t sz)
 
-	blk->mBumpPtr = reinterpret_cast<FreeChunk*>( reinterpret_cast<uintptr_t>(blk) + BIG_BLOCK_SIZE );
-	mFreeBlockStack.push(reinterpret_cast<void**>(blk));
 
-	STAT_ADDV(mStatistics.BlocksInFreeBlockStack, BIG_BLOCK_BLOCK_COUNT);
-	return true;
+byte* ScalablePoolAllocator::allocateLargeAligned(size_t sz, size_t alignment)
+{
+	// Large chunks are always aligned to the header size
+	if(alignment <= LargeChunk::HEADER_SIZE)
+	{
+		return allocateLarge(sz);
+	}
+
+	// Leave room for an unaligned head which is big enough to be a free chunk
+	byte* mem = allocateLarge(sz + alignment + LargeChunk::MIN_SIZE);
+	if(!mem)
+	{
+		return NULL;
+	}
+
+	LargeChunk* chunk = reinterpret_cast<LargeChunk*>(mem - LargeChunk::HEADER_SIZE);
+	byte* aligned = reinterpret_cast<byte*>(alignUp(reinterpret_cast<uintptr_t>(mem), alignment));
+	if(aligned != mem)
+	{
+		while(static_cast<size_t>(aligned - mem) < LargeChunk::MIN_SIZE)
+		{
+			aligned += alignment;
+		}
+
+		// Give the head back (coalesced with the chunk before it), the aligned chunk has no flags
+		// until the head is linked into a bin
+		size_t headSize = aligned - mem;
+		LargeChunk* alignedChunk = reinterpret_cast<LargeChunk*>(aligned - LargeChunk::HEADER_SIZE);
+		alignedChunk->mHead = chunk->size() - headSize;
+		chunk->setSize(headSize);
+		STAT_SUBV(mStatistics.AllocatedSize, headSize);
+		freeLargeChunk(chunk, headSize);
+		chunk = alignedChunk;
+	}
+
+	// Give the tail back as well. The chunk after it may be the free remainder of allocateLarge(),
+	// so the tail is freed (and coalesced) instead of being split off like splitLargeChunk() does.
+	size_t chunkSize = chunk->size();
+	size_t usedSize = getLargeChunkSize(sz);
+	if(chunkSize - usedSize >= LargeChunk::MIN_SIZE)
+	{
+		LargeChunk* tail = reinterpret_cast<LargeChunk*>(reinterpret_cast<byte*>(chunk) + usedSize);
+		tail->mHead = chunkSize - usedSize;
+		chunk->setSize(usedSize);
+		STAT_SUBV(mStatistics.AllocatedSize, chunkSize - usedSize);
+		freeLargeChunk(tail, chunkSize - usedSize);
+	}
+
+	return aligned;
 }
 
 
-template<bool asIndex>
-size_t ScalablePoolAllocator::getIndexOrChunkSize(size_t sz)
+void ScalablePoolAllocator::deallocateLarge(byte* mem)
 {
-	if( BIN_COUNT < 17 || sz <= mBinSizes[15] )	{// [0-15]
-		if( BIN_COUNT < 9 || sz <= mBinSizes[7] )		{// [0-7]
-			if( BIN_COUNT < 5 || sz <= mBinSizes[3] )		{//[0-3]
-				if( BIN_COUNT < 3 || sz <= mBinSizes[1] )		{
-					if( sz <= mBinSizes[0] )	{	return asIndex?0:mBinSizes[0];	}
-					else						{	return asIndex?1:mBinSizes[1];	}
-				}else{
-					if( sz <= mBinSizes[2] )	{	return asIndex?2:mBinSizes[2];	}
-					else						{	return asIndex?3:mBinSizes[3];	}
-				}
-			}else{//[4-7]
-				if( BIN_COUNT < 7 || sz <= mBinSizes[5] )		{
-					if( sz <= mBinSizes[4] )	{	return asIndex?4:mBinSizes[4];	}
-					else						{	return asIndex?5:mBinSizes[5];	}
-				}else{
-					if( sz <= mBinSizes[6] )	{	return asIndex?6:mBinSizes[6];	}
-					else						{	return asIndex?7:mBinSizes[7];	}
-				}
-			}
-		}else{// [8 - 15]
-			if( BIN_COUNT < 13 || sz <= mBinSizes[11] )		{//[8-11]
-				if( BIN_COUNT < 11 || sz <= mBinSizes[9] )		{
-					if( sz <= mBinSizes[8] )	{	return asIndex?8:mBinSizes[8];	}
-					else						{	return asIndex?9:mBinSizes[9];	}
-				}else{
-					if( sz <= mBinSizes[10])	{	return asIndex?10:mBinSizes[10];	}
-					else						{	return asIndex?11:mBinSizes[11];	}
-				}
-			}else{//[12-15]
-				if( BIN_COUNT < 15 || sz <= mBinSizes[13] )	{
-					if( sz <= mBinSizes[12] )	{	return asIndex?12:mBinSizes[12];	}
-					else						{	return asIndex?13:mBinSizes[13];	}
-				}else{
-					if( sz <= mBinSizes[14] )	{	return asIndex?14:mBinSizes[14];	}
-					else						{	return asIndex?15:mBinSizes[15];	}
-		}	}	}
-	}else{// [16-31]
-		if( BIN_COUNT < 25 || sz <= mBinSizes[23] )		{// [16-23]
-			if( BIN_COUNT < 21 || sz <= mBinSizes[19] )		{//[16-19]
-				if( BIN_COUNT < 19 || sz <= mBinSizes[17] )		{
-					if( sz <= mBinSizes[16] )	{	return asIndex?16:mBinSizes[16];	}
-					else						{	return asIndex?17:mBinSizes[17];	}
-				}else{
-					if( sz <= mBinSizes[18] )	{	return asIndex?18:mBinSizes[18];	}
-					else						{	return asIndex?19:mBinSizes[19];	}
-				}
-			}else{//[20-23]
-				if( BIN_COUNT < 23 || sz <= mBinSizes[21] )		{
-					if( sz <= mBinSizes[20] )	{	return asIndex?20:mBinSizes[20];	}
-					else						{	return asIndex?21:mBinSizes[21];	}
-				}else{
-					if( sz <= mBinSizes[22] )	{	return asIndex?22:mBinSizes[22];	}
-					else						{	return asIndex?23:mBinSizes[23];	}
-				}
-			}
-		}else{// [24 - 31]
-			if( BIN_COUNT < 29 || sz <= mBinSizes[27] )		{//[24-27]
-				if( BIN_COUNT < 27 || sz <= mBinSizes[25] )	{
-					if( sz <= mBinSizes[24] )	{	return asIndex?24:mBinSizes[24];	}
-					else						{	return asIndex?25:mBinSizes[25];	}
-				}else{
-					if( sz <= mBinSizes[26] )	{	return asIndex?26:mBinSizes[26];	}
-					else						{	return asIndex?27:mBinSizes[27];	}
-				}
-			}else{//[28-31]
-				if( BIN_COUNT < 31 || sz <= mBinSizes[29] )	{
-					if( sz <= mBinSizes[28] )	{	return asIndex?28:mBinSizes[28];	}
-					else						{	return asIndex?29:mBinSizes[29];	}
-				}else{
-					if( sz <= mBinSizes[30] )	{	return asIndex?30:mBinSizes[30];	}
-					else						{	return asIndex?31:mBinSizes[31];	}
-		}	}	}
-	}
-}//getIndexOrChunkSize()
+	STAT_ADD(mStatistics.TotalLargeDeallocations);
 
-size_t ScalablePoolAllocator::getIndex(size_t sz)//done
+	LargeChunk* chunk = reinterpret_cast<LargeChunk*>(mem - LargeChunk::HEADER_SIZE);
+	size_t chunkSize = chunk->size();
+	STAT_SUBV(mStatistics.AllocatedSize, chunkSize);
+
+	freeLargeChunk(chunk, chunkSize);
+}//deallocateLarge(byte* mem)
+
+
+void ScalablePoolAllocator::freeLargeChunk(LargeChunk* chunk, size_t chunkSize)
 {
-	return getIndexOrChunkSize<true>(sz);
+	// 1. Merge the next chunk if it's free
+	LargeChunk* next = getNextLargeChunk(chunk, chunkSize);
+	if(next->isFree())
+	{
+		size_t nextSize = next->size();
+		if(claimLargeChunk(next, nextSize))
+		{
+			chunkSize += nextSize;
+		}
+	}
+
+	// 2. Merge the previous chunk if it's free
+	if(chunk->isPrevFree())
+	{
+		size_t prevSize = *chunk->prevFooter();
+		if(claimPrevLargeChunk(chunk, prevSize))
+		{
+			chunk = reinterpret_cast<LargeChunk*>(reinterpret_cast<byte*>(chunk) - prevSize);
+			chunkSize += prevSize;
+		}
+	}
+
+	// 3. Give the chunk back to mBumpPtr if it's the lowest one, otherwise link it into the bins
+	if(releaseLargeChunkToBumpPtr(chunk, chunkSize))
+	{
+		return;
+	}
+	insertLargeChunk(chunk, chunkSize);
+
+	// 4. A neighbour freed at the same time may have missed this chunk in steps 1 and 2
+	recheckLargeChunk(chunk, chunkSize);
 }
-size_t ScalablePoolAllocator::getChunkSize(size_t sz)//done
+
+
+/**
+ * Look for free neighbours again after linking a chunk into the bins, since a neighbour freed at
+ * the same time may have missed it (and vice versa). The FREE flag of the higher chunk and its
+ * PREV_FREE flag live in the same word, so at least one of the two threads sees the other chunk
+ * free here, and claiming the pair lets only one of them merge it.
+ */
+void ScalablePoolAllocator::recheckLargeChunk(LargeChunk* chunk, size_t chunkSize)
 {
-	return getIndexOrChunkSize<false>(sz);
+	LargeChunk* next = getNextLargeChunk(chunk, chunkSize);
+	if(next->isFree())
+	{
+		size_t nextSize = next->size();
+		if(claimLargeChunkPair(chunk, chunkSize, next, nextSize, false))
+		{
+			freeLargeChunk(chunk, chunkSize + nextSize);
+			return;
+		}
+	}
+	if(chunk->isPrevFree())
+	{
+		size_t prevSize = *chunk->prevFooter();
+		LargeChunk* prev = reinterpret_cast<LargeChunk*>(reinterpret_cast<byte*>(chunk) - prevSize);
+		if(claimLargeChunkPair(prev, prevSize, chunk, chunkSize, true))
+		{
+			freeLargeChunk(prev, prevSize + chunkSize);
+		}
+	}
 }
 
 
-void ScalablePoolAllocator::initEmptyBlock(Block* block, size_t sz)//done
+ScalablePoolAllocator::LargeChunk* ScalablePoolAllocator::getFreeLargeChunk(size_t chunkSize)
 {
-	size_t idx = getIndex(sz);
-	size_t chunkSize = getChunkSize(sz);
-	Bin* tls = mBins.get();
+	LargeChunk* chunk = NULL;
+	size_t index = getLargeBinIndex(chunkSize);
 
-	block->mNext = NULL;
-	block->mPrev = NULL;
-	block->mChunkSize = chunkSize;
-	block->mOwnerID = getThreadID();
-	block->mBumpPtr = reinterpret_cast<FreeChunk*>( reinterpret_cast<uintptr_t>(block) + BLOCK_SIZE - chunkSize );
-	block->mFreeList = NULL;
-	block->mPublicFreeList = NULL;
-	block->mAllocationCount = 0;
-	block->mIsFull = false;
-	block->mNextPrivatizable = tls ? reinterpret_cast<Block*>(tls + idx) : NULL;
+	// Every chunk in the bins above the size class of chunkSize is large enough, so just take the first one
+	size_t first = (getLargeBinBaseSize(index) == chunkSize) ? index : index + 1;
+	for(size_t i = findNonEmptyLargeBin(first); i < LARGE_BIN_COUNT; i = findNonEmptyLargeBin(i + 1))
+	{
+		if( (chunk = popLargeBin(i, chunkSize, false)) )
+		{
+			break;
+		}
+	}
+
+	// Otherwise look for a fit in the size class of chunkSize itself
+	if(!chunk && first != index)
+	{
+		chunk = popLargeBin(index, chunkSize, true);
+	}
+
+	if(chunk)
+	{
+		splitLargeChunk(chunk, chunkSize);
+	}
+	return chunk;
 }
 
 
-ScalablePoolAllocator::Block* ScalablePoolAllocator::getEmptyBlock(size_t chunkSize)//done
+ScalablePoolAllocator::LargeChunk* ScalablePoolAllocator::popLargeBin(size_t index, size_t chunkSize, bool firstFit)
 {
-	Block* ret = NULL;
-	Block* bigBlock;
+	LargeBin& bin = mLargeBins[index];
+	tbb::spin_mutex::scoped_lock lock(bin.mLock);
 
-	bigBlock = reinterpret_cast<Block*>(mFreeBlockStack.pop());
-	while( !bigBlock )
+	LargeChunk* chunk = bin.mHead;
+	if(firstFit)
 	{
-		if( !allocateBlocks() )// Failed to allocate, most likely out of memory
+		while(chunk && chunk->size() < chunkSize)
 		{
-			return NULL;
+			chunk = chunk->mNext;
 		}
-		bigBlock = reinterpret_cast<Block*>(mFreeBlockStack.pop());
 	}
 
-	bigBlock->mBumpPtr = reinterpret_cast<FreeChunk*>( reinterpret_cast<uintptr_t>(bigBlock->mBumpPtr) - BLOCK_SIZE);
-	ret = reinterpret_cast<Block*>(bigBlock->mBumpPtr);
-	if(ret != bigBlock)
+	if(!chunk)
 	{
-		mFreeBlockStack.push( reinterpret_cast<void**>(bigBlock) );
+		if(!bin.mHead)
+		{
+			markLargeBin(index, false);
+		}
+		return NULL;
 	}
-	initEmptyBlock(ret, chunkSize);
 
-	STAT_SUB(mStatistics.BlocksInFreeBlockStack);
-	STAT_ADD(mStatistics.BlocksInUse);
-	return ret;
+	unlinkLargeChunk(index, chunk);
+	return chunk;
 }
 
 
-void ScalablePoolAllocator::returnEmptyBlock(Block* block)//done
+ScalablePoolAllocator::LargeChunk* ScalablePoolAllocator::allocateLargeFromBumpPtr(size_t chunkSize)
 {
-	block->mPublicFreeList = NULL;
-	block->mNextPrivatizable = NULL;
+	while(true)
+	{
+		{//lock
+			tbb::spin_mutex::scoped_lock lock(mPoolLock);
 
-	block->mNext = NULL;
-	block->mPrev = NULL;
-	block->mChunkSize = 0;
-	block->mOwnerID = OWNER_ID_NULL;
+			if(mBumpPtr < mBlockAllocPtr + chunkSize)
+			{
+				return NULL;
+			}
+			if(!isBumpSpacePurging(mBumpPtr - chunkSize, mBumpPtr))
+			{
+				mBumpPtr -= chunkSize;
+				if(mBumpPtr < mPurgedBumpPtr)
+				{
+					mPurgedBumpPtr = mBumpPtr;
+				}
 
-	// for an empty block, bump pointer should point right after the end of the block
-	block->mBumpPtr = reinterpret_cast<FreeChunk*>( reinterpret_cast<uintptr_t>(block) + BLOCK_SIZE );
-	block->mFreeList = NULL;
-	block->mAllocationCount = 0;
-	block->mIsFull = false;
+				// The lowest chunk has no previous chunk, so PREV_FREE is never set
+				LargeChunk* chunk = reinterpret_cast<LargeChunk*>(mBumpPtr);
+				chunk->mHead = chunkSize;
+				return chunk;
+			}
+		}//unlock
 
-	STAT_SUB(mStatistics.BlocksInUse);
-	STAT_ADD(mStatistics.BlocksInFreeBlockStack);
-	mFreeBlockStack.push( reinterpret_cast<void**>(block) );
+		// Wait for purgeBumpSpace() to finish with the space
+		tbb::this_tbb_thread::yield();
+	}
 }
 
 
-ScalablePoolAllocator::Block* ScalablePoolAllocator::getPartialBlock(Bin* bin, size_t sz)//done
+bool ScalablePoolAllocator::releaseLargeChunkToBumpPtr(LargeChunk* chunk, size_t chunkSize)
 {
-	Block* ret;
-	size_t idx = getIndex(sz);
-	ret = reinterpret_cast<Block*>(mGlobalBins[idx].pop());
-	if(ret)
+	tbb::spin_mutex::scoped_lock lock(mPoolLock);
+
+	if(reinterpret_cast<byte*>(chunk) != mBumpPtr)
 	{
-		ret->mNext = NULL;
-		ret->mPrev = NULL;
-		ret->mOwnerID = getThreadID();
-		ret->mNextPrivatizable = reinterpret_cast<Block*>(bin);
-		privatizePublicFreeList(ret);
-		if(ret->mAllocationCount)
-		{
-			emptyEnoughToUse(ret);
-		}
-		else
+		return false;
+	}
+	mBumpPtr += chunkSize;
+	mBumpPtrFreeTime = getPurgeClock();
+
+	// Free chunks which become the lowest one are given back as well
+	while(mBumpPtr < mLargeEnd)
+	{
+		LargeChunk* lowest = reinterpret_cast<LargeChunk*>(mBumpPtr);
+		size_t lowestSize = lowest->size();
+		if(!lowest->isFree() || !claimLargeChunk(lowest, lowestSize))
 		{
-			restoreBumpPtr(ret);
+			break;
 		}
+		mBumpPtr += lowestSize;
 	}
-	return ret;
+	return true;
 }
 
 
-void ScalablePoolAllocator::returnPartialBlock(Bin* bin, Block* block)//done
+void ScalablePoolAllocator::splitLargeChunk(LargeChunk* chunk, size_t chunkSize)
 {
-	size_t idx = getIndex(block->mChunkSize);
-	if( reinterpret_cast<uintptr_t>(block->mNextPrivatizable) == reinterpret_cast<uintptr_t>(bin) )
+	size_t remainSize = chunk->size() - chunkSize;
+	if(remainSize < LargeChunk::MIN_SIZE)
+	{
+		return;// Give entire chunk to user
+	}
+
+	chunk->setSize(chunkSize);
+
+	LargeChunk* remain = reinterpret_cast<LargeChunk*>(reinterpret_cast<byte*>(chunk) + chunkSize);
+	remain->mHead = remainSize;
+	insertLargeChunk(remain, remainSize);
+}
+
+
+bool ScalablePoolAllocator::claimLargeChunk(LargeChunk* chunk, size_t chunkSize)
+{
+	size_t index = getLargeBinIndex(chunkSize);
+	tbb::spin_mutex::scoped_lock lock(mLargeBins[index].mLock);
+
+	// The chunk may have been taken (or merged) by another thread in the meantime
+	if(!chunk->isFree() || chunk->size() != chunkSize)
+	{
+		return false;
+	}
+
+	unlinkLargeChunk(index, chunk);
+	return true;
+}
+
+
+bool ScalablePoolAllocator::claimPrevLargeChunk(LargeChunk* chunk, size_t prevSize)
+{
+	if(prevSize < LargeChunk::MIN_SIZE)
+	{
+		return false;// Footer changed under us
+	}
+
+	size_t index = getLargeBinIndex(prevSize);
+	tbb::spin_mutex::scoped_lock lock(mLargeBins[index].mLock);
+
+	// The footer is stable while PREV_FREE is set. A chunk with this footer which is not linked
+	// yet cannot set PREV_FREE since it needs the bin lock we're holding, so check the footer first.
+	if(*chunk->prevFooter() != prevSize || !chunk->isPrevFree())
+	{
+		return false;
+	}
+
+	LargeChunk* prev = reinterpret_cast<LargeChunk*>(reinterpret_cast<byte*>(chunk) - prevSize);
+	unlinkLargeChunk(index, prev);
+	return true;
+}
+
+
+/**
+ * Take two adjacent free chunks out of the bins at once, holding both bin locks while checking
+ * that neither has been taken or merged yet. If the lower chunk was found by the footer of the
+ * higher one (viaFooter), the footer is checked like claimPrevLargeChunk() does.
+ */
+bool ScalablePoolAllocator::claimLargeChunkPair(LargeChunk* low, size_t lowSize, LargeChunk* high, size_t highSize, bool viaFooter)
+{
+	if(lowSize < LargeChunk::MIN_SIZE)
+	{
+		return false;// Footer changed under us
+	}
+
+	size_t lowIndex = getLargeBinIndex(lowSize);
+	size_t highIndex = getLargeBinIndex(highSize);
+
+	// Lock the bins in index order, which is the only place holding two bin locks
+	tbb::spin_mutex::scoped_lock first(mLargeBins[std::min(lowIndex, highIndex)].mLock);
+	tbb::spin_mutex::scoped_lock second;
+	if(lowIndex != highIndex)
+	{
+		second.acquire(mLargeBins[std::max(lowIndex, highIndex)].mLock);
+	}
+
+	if(!high->isFree() || high->size() != highSize)
+	{
+		return false;
+	}
+	if(viaFooter && (*high->prevFooter() != lowSize || !high->isPrevFree()))
+	{
+		return false;
+	}
+	if(!low->isFree() || low->size() != lowSize)
+	{
+		return false;
+	}
+
+	unlinkLargeChunk(lowIndex, low);
+	unlinkLargeChunk(highIndex, high);
+	return true;
+}
+
+
+void ScalablePoolAllocator::insertLargeChunk(LargeChunk* chunk, size_t chunkSize, bool purged)
+{
+	chunk->setSize(chunkSize);
+	if(purged)
+	{
+		chunk->setFlag(LargeChunk::PURGED);
+	}
+	*chunk->footer(chunkSize) = chunkSize;
+	chunk->mFreeTime = getPurgeClock();
+
+	size_t index = getLargeBinIndex(chunkSize);
+	LargeBin& bin = mLargeBins[index];
+	LargeChunk* next = getNextLargeChunk(chunk, chunkSize);
+	{//lock
+		tbb::spin_mutex::scoped_lock lock(bin.mLock);
+
+		chunk->mPrev = NULL;
+		chunk->mNext = bin.mHead;
+		if(bin.mHead)
+		{
+			bin.mHead->mPrev = chunk;
+		}
+		bin.mHead = chunk;
+
+		chunk->setFlag(LargeChunk::FREE);
+		next->setFlag(LargeChunk::PREV_FREE);
+		markLargeBin(index, true);
+	}//unlock
+	STAT_ADD(mStatistics.LargeChunkInFreeList);
+}
+
+
+void ScalablePoolAllocator::unlinkLargeChunk(size_t index, LargeChunk* chunk)
+{
+	// NOTE: must be called with the bin lock held
+	LargeBin& bin = mLargeBins[index];
+	if(chunk->mPrev)
+	{
+		chunk->mPrev->mNext = chunk->mNext;
+	}
+	else
+	{
+		bin.mHead = chunk->mNext;
+	}
+	if(chunk->mNext)
+	{
+		chunk->mNext->mPrev = chunk->mPrev;
+	}
+	if(!bin.mHead)
+	{
+		markLargeBin(index, false);
+	}
+
+	chunk->clearFlag(LargeChunk::FREE);
+	getNextLargeChunk(chunk, chunk->size())->clearFlag(LargeChunk::PREV_FREE);
+	STAT_SUB(mStatistics.LargeChunkInFreeList);
+}
+
+
+ScalablePoolAllocator::LargeChunk* ScalablePoolAllocator::getNextLargeChunk(LargeChunk* chunk, size_t chunkSize)
+{
+	// Every large chunk space ends with a fence chunk, so there's always a next chunk
+	return reinterpret_cast<LargeChunk*>(reinterpret_cast<byte*>(chunk) + chunkSize);
+}
+
+
+size_t ScalablePoolAllocator::findNonEmptyLargeBin(size_t index)
+{
+	for(size_t word = index >> 6; word < LARGE_BIN_MAP_WORDS; ++word)
+	{
+		uint64 bits = mLargeBinMap[word];
+		if(word == (index >> 6))
+		{
+			bits &= ~static_cast<uint64>(0) << (index & 63);
+		}
+		if(bits)
+		{
+			return (word << 6) + __builtin_ctzll(bits);
+		}
+	}
+	return LARGE_BIN_COUNT;
+}
+
+
+void ScalablePoolAllocator::markLargeBin(size_t index, bool nonEmpty)
+{
+	volatile uint64* word = &mLargeBinMap[index >> 6];
+	uint64 bit = static_cast<uint64>(1) << (index & 63);
+	uint64 bits;
+	do
+	{
+		bits = *word;
+		if( ((bits & bit) != 0) == nonEmpty )
+		{
+			return;
+		}
+	} while( !atomic::b_cas(word, nonEmpty ? (bits | bit) : (bits & ~bit), bits) );
+}
+
+
+size_t ScalablePoolAllocator::getLargeChunkSize(size_t sz)
+{
+	size_t chunkSize = (sz + LargeChunk::HEADER_SIZE + (LargeChunk::HEADER_SIZE - 1)) & ~static_cast<size_t>(LargeChunk::HEADER_SIZE - 1);
+	return (chunkSize < LargeChunk::MIN_SIZE) ? static_cast<size_t>(LargeChunk::MIN_SIZE) : chunkSize;
+}
+
+
+size_t ScalablePoolAllocator::getLargeBinIndex(size_t chunkSize)
+{
+	// 4 size classes per power of two, i.e. 64, 80, 96, 112, 128, 160, ...
+	size_t shift = (sizeof(unsigned long long) * 8 - 1) - __builtin_clzll(static_cast<unsigned long long>(chunkSize));
+	if(shift < 6)
+	{
+		return 0;
+	}
+	size_t index = ((shift - 6) << 2) + ((chunkSize >> (shift - 2)) & 3);
+	return (index < LARGE_BIN_COUNT) ? index : LARGE_BIN_COUNT - 1;
+}
+
+
+size_t ScalablePoolAllocator::getLargeBinBaseSize(size_t index)
+{
+	return static_cast<size_t>(4 + (index & 3)) << ((index >> 2) + 4);
+}
+
+
+bool ScalablePoolAllocator::isLargeChunk(byte* mem)// done
+{
+	return (mem > mBlockAllocPtr);
+}
+
+
+ScalablePoolAllocator::ThreadID ScalablePoolAllocator::getThreadID()
+{
+	ThreadID ret = reinterpret_cast<ThreadID>(mThreadID.get());
+	if( ret == 0 )
+	{
+		ret = ++mThreadCount;// Atomic operation
+		mThreadID.reset(reinterpret_cast<ThreadID*>(ret));
+	}
+	return ret;
+}
+
+
+ScalablePoolAllocator::Bin* ScalablePoolAllocator::getBin(size_t sz)//done
+{
+	Bin* bins = mBins.get();
+
+	if(bins == NULL)// First time used, create bins
+	{
+		bins = allocateTLS(TLS_SIZE);
+		if(bins == NULL)//Out of memory
+		{
+			return NULL;
+		}
+		*reinterpret_cast<BinOwner**>(bins) = mBinOwner;
+		++mBinOwner->mRefCount;
+		bins = bins + 1;
+		mBins.reset(bins);
+	}
+	return bins + getIndex(sz);
+}
+
+
+ScalablePoolAllocator::Bin* ScalablePoolAllocator::allocateTLS(size_t sz)// done
+{
+	// Allocated from the heap rather than the pool, so that the bins outlive the pool memory
+	Bin* ret = reinterpret_cast<Bin*>(::operator new(sz, std::nothrow));
+	if(ret == NULL)//Out of memory
+	{
+		return NULL;
+	}
+
+	memset(ret, 0, sz);
+	return ret;
+}
+
+
+void ScalablePoolAllocator::deallocateTLS(Bin* p)//done (bootStrapFree)
+{
+	::operator delete(p);
+}
+
+
+bool ScalablePoolAllocator::allocateBlocks()//done (mallocBigBlock)
+{
+	size_t generation;
+	while(true)
+	{
+		{//lock
+			tbb::spin_mutex::scoped_lock lock(mPoolLock);// NOTE: can be replace with atomic addition to mBlockAllocPtr
+			if(mBlockAllocPtr + BIG_BLOCK_SIZE > mBumpPtr)
+			{
+				generation = mBlockRegionGeneration;
+				break;
+			}
+			if(!isBumpSpacePurging(mBlockAllocPtr, mBlockAllocPtr + BIG_BLOCK_SIZE))
+			{
+				Block* blk = reinterpret_cast<Block*>(mBlockAllocPtr);
+				mBlockAllocPtr += BIG_BLOCK_SIZE;
+				STAT_ADDV(mStatistics.AllocatedSize, BIG_BLOCK_SIZE);
+
+				blk->mBumpPtr = reinterpret_cast<FreeChunk*>( reinterpret_cast<uintptr_t>(blk) + BIG_BLOCK_SIZE );
+				blk->mFreeTime = getPurgeClock();
+				blk->mPurged = false;
+				mFreeBlockStack.push(reinterpret_cast<void**>(blk));
+
+				STAT_ADDV(mStatistics.BlocksInFreeBlockStack, BIG_BLOCK_BLOCK_COUNT);
+				return true;
+			}
+		}//unlock
+
+		// Wait for purgeBumpSpace() to finish with the space
+		tbb::this_tbb_thread::yield();
+	}
+
+	// Out of memory! A growable pool maps another region for blocks
+	return mGrowable && addBlockRegion(generation);
+}
+
+
+template<bool asIndex>
+size_t ScalablePoolAllocator::getIndexOrChunkSize(size_t sz)
+{
+	if( BIN_COUNT < 17 || sz <= mBinSizes[15] )	{// [0-15]
+		if( BIN_COUNT < 9 || sz <= mBinSizes[7] )		{// [0-7]
+			if( BIN_COUNT < 5 || sz <= mBinSizes[3] )		{//[0-3]
+				if( BIN_COUNT < 3 || sz <= mBinSizes[1] )		{
+					if( sz <= mBinSizes[0] )	{	return asIndex?0:mBinSizes[0];	}
+					else						{	return asIndex?1:mBinSizes[1];	}
+				}else{
+					if( sz <= mBinSizes[2] )	{	return asIndex?2:mBinSizes[2];	}
+					else						{	return asIndex?3:mBinSizes[3];	}
+				}
+			}else{//[4-7]
+				if( BIN_COUNT < 7 || sz <= mBinSizes[5] )		{
+					if( sz <= mBinSizes[4] )	{	return asIndex?4:mBinSizes[4];	}
+					else						{	return asIndex?5:mBinSizes[5];	}
+				}else{
+					if( sz <= mBinSizes[6] )	{	return asIndex?6:mBinSizes[6];	}
+					else						{	return asIndex?7:mBinSizes[7];	}
+				}
+			}
+		}else{// [8 - 15]
+			if( BIN_COUNT < 13 || sz <= mBinSizes[11] )		{//[8-11]
+				if( BIN_COUNT < 11 || sz <= mBinSizes[9] )		{
+					if( sz <= mBinSizes[8] )	{	return asIndex?8:mBinSizes[8];	}
+					else						{	return asIndex?9:mBinSizes[9];	}
+				}else{
+					if( sz <= mBinSizes[10])	{	return asIndex?10:mBinSizes[10];	}
+					else						{	return asIndex?11:mBinSizes[11];	}
+				}
+			}else{//[12-15]
+				if( BIN_COUNT < 15 || sz <= mBinSizes[13] )	{
+					if( sz <= mBinSizes[12] )	{	return asIndex?12:mBinSizes[12];	}
+					else						{	return asIndex?13:mBinSizes[13];	}
+				}else{
+					if( sz <= mBinSizes[14] )	{	return asIndex?14:mBinSizes[14];	}
+					else						{	return asIndex?15:mBinSizes[15];	}
+		}	}	}
+	}else{// [16-31]
+		if( BIN_COUNT < 25 || sz <= mBinSizes[23] )		{// [16-23]
+			if( BIN_COUNT < 21 || sz <= mBinSizes[19] )		{//[16-19]
+				if( BIN_COUNT < 19 || sz <= mBinSizes[17] )		{
+					if( sz <= mBinSizes[16] )	{	return asIndex?16:mBinSizes[16];	}
+					else						{	return asIndex?17:mBinSizes[17];	}
+				}else{
+					if( sz <= mBinSizes[18] )	{	return asIndex?18:mBinSizes[18];	}
+					else						{	return asIndex?19:mBinSizes[19];	}
+				}
+			}else{//[20-23]
+				if( BIN_COUNT < 23 || sz <= mBinSizes[21] )		{
+					if( sz <= mBinSizes[20] )	{	return asIndex?20:mBinSizes[20];	}
+					else						{	return asIndex?21:mBinSizes[21];	}
+				}else{
+					if( sz <= mBinSizes[22] )	{	return asIndex?22:mBinSizes[22];	}
+					else						{	return asIndex?23:mBinSizes[23];	}
+				}
+			}
+		}else{// [24 - 31]
+			if( BIN_COUNT < 29 || sz <= mBinSizes[27] )		{//[24-27]
+				if( BIN_COUNT < 27 || sz <= mBinSizes[25] )	{
+					if( sz <= mBinSizes[24] )	{	return asIndex?24:mBinSizes[24];	}
+					else						{	return asIndex?25:mBinSizes[25];	}
+				}else{
+					if( sz <= mBinSizes[26] )	{	return asIndex?26:mBinSizes[26];	}
+					else						{	return asIndex?27:mBinSizes[27];	}
+				}
+			}else{//[28-31]
+				if( BIN_COUNT < 31 || sz <= mBinSizes[29] )	{
+					if( sz <= mBinSizes[28] )	{	return asIndex?28:mBinSizes[28];	}
+					else						{	return asIndex?29:mBinSizes[29];	}
+				}else{
+					if( sz <= mBinSizes[30] )	{	return asIndex?30:mBinSizes[30];	}
+					else						{	return asIndex?31:mBinSizes[31];	}
+		}	}	}
+	}
+}//getIndexOrChunkSize()
+
+size_t ScalablePoolAllocator::getIndex(size_t sz)//done
+{
+	return getIndexOrChunkSize<true>(sz);
+}
+size_t ScalablePoolAllocator::getChunkSize(size_t sz)//done
+{
+	return getIndexOrChunkSize<false>(sz);
+}
+
+
+void ScalablePoolAllocator::initEmptyBlock(Block* block, size_t sz)//done
+{
+	size_t idx = getIndex(sz);
+	size_t chunkSize = getChunkSize(sz);
+	Bin* tls = mBins.get();
+
+	block->mNext = NULL;
+	block->mPrev = NULL;
+	block->mChunkSize = chunkSize;
+	block->mOwnerID = getThreadID();
+	block->mBumpPtr = reinterpret_cast<FreeChunk*>( reinterpret_cast<uintptr_t>(block) + BLOCK_SIZE - chunkSize );
+	block->mFreeList = NULL;
+	block->mPublicFreeList = NULL;
+	block->mAllocationCount = 0;
+	block->mIsFull = false;
+	block->mNextPrivatizable = tls ? reinterpret_cast<Block*>(tls + idx) : NULL;
+}
+
+
+ScalablePoolAllocator::Block* ScalablePoolAllocator::getEmptyBlock(size_t chunkSize)//done
+{
+	Block* ret = NULL;
+	Block* bigBlock;
+
+	bigBlock = reinterpret_cast<Block*>(mFreeBlockStack.pop());
+	while( !bigBlock )
+	{
+		if( mPurgingBlocks )
+		{
+			// Blocks being purged are off the stack for a moment, wait for them instead of failing (or growing)
+			tbb::this_tbb_thread::yield();
+		}
+		else if( !allocateBlocks() )// Failed to allocate, most likely out of memory
+		{
+			return NULL;
+		}
+		bigBlock = reinterpret_cast<Block*>(mFreeBlockStack.pop());
+	}
+
+	bigBlock->mBumpPtr = reinterpret_cast<FreeChunk*>( reinterpret_cast<uintptr_t>(bigBlock->mBumpPtr) - BLOCK_SIZE);
+	ret = reinterpret_cast<Block*>(bigBlock->mBumpPtr);
+	if(ret != bigBlock)
+	{
+		mFreeBlockStack.push( reinterpret_cast<void**>(bigBlock) );
+	}
+	initEmptyBlock(ret, chunkSize);
+
+	STAT_SUB(mStatistics.BlocksInFreeBlockStack);
+	STAT_ADD(mStatistics.BlocksInUse);
+	return ret;
+}
+
+
+void ScalablePoolAllocator::returnEmptyBlock(Block* block)//done
+{
+	block->mPublicFreeList = NULL;
+	block->mNextPrivatizable = NULL;
+
+	block->mNext = NULL;
+	block->mPrev = NULL;
+	block->mChunkSize = 0;
+	block->mOwnerID = OWNER_ID_NULL;
+
+	// for an empty block, bump pointer should point right after the end of the block
+	block->mBumpPtr = reinterpret_cast<FreeChunk*>( reinterpret_cast<uintptr_t>(block) + BLOCK_SIZE );
+	block->mFreeList = NULL;
+	block->mAllocationCount = 0;
+	block->mIsFull = false;
+	block->mFreeTime = getPurgeClock();
+	block->mPurged = false;
+
+	STAT_SUB(mStatistics.BlocksInUse);
+	STAT_ADD(mStatistics.BlocksInFreeBlockStack);
+	mFreeBlockStack.push( reinterpret_cast<void**>(block) );
+}
+
+
+ScalablePoolAllocator::Block* ScalablePoolAllocator::getPartialBlock(Bin* bin, size_t sz)//done
+{
+	Block* ret;
+	size_t idx = getIndex(sz);
+	ret = reinterpret_cast<Block*>(mGlobalBins[idx].pop());
+	if(ret)
+	{
+		ret->mNext = NULL;
+		ret->mPrev = NULL;
+		ret->mOwnerID = getThreadID();
+		ret->mNextPrivatizable = reinterpret_cast<Block*>(bin);
+		privatizePublicFreeList(ret);
+		if(ret->mAllocationCount)
+		{
+			emptyEnoughToUse(ret);
+		}
+		else
+		{
+			restoreBumpPtr(ret);
+		}
+	}
+	return ret;
+}
+
+
+void ScalablePoolAllocator::returnPartialBlock(Bin* bin, Block* block)//done
+{
+	size_t idx = getIndex(block->mChunkSize);
+	if( reinterpret_cast<uintptr_t>(block->mNextPrivatizable) == reinterpret_cast<uintptr_t>(bin) )
+	{
+		// mark the public freelist unusable if it's empty, so that other threads won't post the block to the mail box of this bin
+		void* oldval = atomic::cas_ptr(reinterpret_cast<void* volatile*>(&block->mPublicFreeList), reinterpret_cast<void*>(INVALID), NULL);
+		if(oldval != NULL)
+		{
+			// need to wait for the other thread finishes freeing the object
+			int waitcnt = 256;
+			while( reinterpret_cast<uintptr_t>(const_cast<Block* volatile &>(block->mNextPrivatizable)) == reinterpret_cast<uintptr_t>(bin) )
+			{
+				if(--waitcnt == 0)
+				{
+					tbb::this_tbb_thread::yield();
+					waitcnt = 256;
+				}
+			}
+		}
+	}
+
+	block->mPrev = NULL;
+	block->mOwnerID = 0;
+
+	block->mNextPrivatizable = reinterpret_cast<Block*>(INVALID);
+	mGlobalBins[idx].push(reinterpret_cast<void**>(block));
+}
+
+
+void ScalablePoolAllocator::restoreBumpPtr(Block* block)//done
+{
+	// This will make the block empty, and it assumes there're no allocations within the block
+	block->mBumpPtr = reinterpret_cast<FreeChunk*>( reinterpret_cast<uintptr_t>(block) + BLOCK_SIZE - block->mChunkSize );
+	block->mFreeList = NULL;
+	block->mIsFull = false;
+}
+
+
+
+byte* ScalablePoolAllocator::allocateFromBlock(Block* block)//done
+{
+	byte* ret;
+	if( (ret = allocateFromFreeList(block)) )
+	{
+		return ret;
+	}
+	if( (ret = allocateFromBumpPtr(block)) )
+	{
+		return ret;
+	}
+	block->mIsFull = true;
+	return NULL;
+}
+
+
+byte* ScalablePoolAllocator::allocateFromFreeList(Block* block)//done
+{
+	byte* ret;
+	if( !block->mFreeList )
+	{
+		return NULL;
+	}
+	ret = reinterpret_cast<byte*>(block->mFreeList);
+	block->mFreeList = block->mFreeList->mNext;
+	block->mAllocationCount++;
+	return ret;
+}
+
+
+/**
+ * Take up to count chunks from the private freelist and then the bump pointer, and mark the block
+ * full if it runs out (like allocateFromBlock() does).
+ */
+size_t ScalablePoolAllocator::allocateRunFromBlock(Block* block, byte** out, size_t count)
+{
+	size_t n = 0;
+
+	FreeChunk* chunk = block->mFreeList;
+	while( chunk && n < count )
+	{
+		out[n++] = reinterpret_cast<byte*>(chunk);
+		chunk = chunk->mNext;
+	}
+	block->mFreeList = chunk;
+
+	if( n < count && block->mBumpPtr )
+	{
+		// Chunks at mBumpPtr, mBumpPtr - mChunkSize, ... down to the end of the block header
+		uintptr_t bump = reinterpret_cast<uintptr_t>(block->mBumpPtr);
+		size_t available = (bump - (reinterpret_cast<uintptr_t>(block) + sizeof(Block))) / block->mChunkSize + 1;
+		size_t run = std::min(available, count - n);
+		for(size_t i = 0; i < run; ++i)
+		{
+			out[n++] = reinterpret_cast<byte*>(bump);
+			bump -= block->mChunkSize;
+		}
+		block->mBumpPtr = (run == available) ? NULL : reinterpret_cast<FreeChunk*>(bump);
+	}
+
+	block->mAllocationCount += n;
+	if(n < count)
+	{
+		block->mIsFull = true;
+	}
+	return n;
+}
+
+
+byte* ScalablePoolAllocator::allocateFromBumpPtr(Block* block)//done
+{
+	byte* ret = reinterpret_cast<byte*>(block->mBumpPtr);
+	if(ret)
+	{
+		block->mBumpPtr = reinterpret_cast<FreeChunk*>( reinterpret_cast<uintptr_t>(block->mBumpPtr) - block->mChunkSize );
+		if( reinterpret_cast<uintptr_t>(block->mBumpPtr) < reinterpret_cast<uintptr_t>(block) + sizeof(Block) )
+		{
+			block->mBumpPtr = NULL;
+		}
+		block->mAllocationCount++;
+	}
+	return ret;
+}
+
+
+ScalablePoolAllocator::Block* ScalablePoolAllocator::getPublicFreeListBlock(Bin* bin)//done
+{
+	Block* ret;
+	{//lock
+		tbb::spin_mutex::scoped_lock lock(bin->mMailBoxLock);
+		ret = bin->mMailBox;
+		if(ret)
+		{
+			bin->mMailBox = ret->mNextPrivatizable;// ? when is this property a block, when is it a bin?
+			ret->mNextPrivatizable = reinterpret_cast<Block*>(bin);
+		}
+	}//unlock
+	if(ret)
+	{
+		privatizePublicFreeList(ret);
+	}
+	return ret;
+}
+
+
+void ScalablePoolAllocator::privatizePublicFreeList(Block* block)//done
+{
+	FreeChunk* tmp, *publicFreeList;
+
+	///{ take the whole public freelist by exchanging it with NULL
+	do
+	{
+		publicFreeList = block->mPublicFreeList;
+	} while( !atomic::b_cas_ptr(reinterpret_cast<void* volatile*>(&block->mPublicFreeList), NULL, publicFreeList) );
+	tmp = publicFreeList;
+	///}
+	if( !isInvalid( reinterpret_cast<uintptr_t>(tmp) ) )// return/getPartialBlock could set it to INVALID
+	{
+		block->mAllocationCount--;
+		while( isValid( reinterpret_cast<uintptr_t>(tmp->mNext) ) )// the list will end with either NULL or UNUSABLE
+		{
+			tmp = tmp->mNext;
+			block->mAllocationCount--;
+		}
+		// prepend to private freelist
+		tmp->mNext = block->mFreeList;
+		block->mFreeList = publicFreeList;
+	}
+}
+
+
+void ScalablePoolAllocator::freePublicChunks(Block* block, FreeChunk* head, FreeChunk* tail)//done
+{
+	Bin* bin;
+	FreeChunk* publicFreeList;
+
+	// push the list [head, tail] to the public freelist; no ABA problem here since the owner only takes the whole list
+	do
+	{
+		publicFreeList = tail->mNext = block->mPublicFreeList;
+	} while( !atomic::b_cas_ptr(reinterpret_cast<void* volatile*>(&block->mPublicFreeList), head, publicFreeList) );
+
+	if( publicFreeList == NULL )
+	{
+		if( !isInvalid( reinterpret_cast<uintptr_t>(block->mNextPrivatizable) ) )
+		{
+			bin = reinterpret_cast<Bin*>(block->mNextPrivatizable);
+			tbb::spin_mutex::scoped_lock maillock(bin->mMailBoxLock);
+			block->mNextPrivatizable = bin->mMailBox;
+			bin->mMailBox = block;
+		}
+		else
+		{
+			// MALLOC_ASSERT( block->owner==0, ASSERT_TEXT );
+		}
+	}
+}
+
+
+bool ScalablePoolAllocator::emptyEnoughToUse(Block* block)//done
+{
+	if(block->mBumpPtr)
+	{
+		block->mIsFull = false;
+		return true;
+	}
+	block->mIsFull = (block->mAllocationCount * block->mChunkSize > EMPTY_ENOUGH_THRESHOLD);
+	return !(block->mIsFull);
+}
+
+
+void ScalablePoolAllocator::removeBlock(Bin* bin, Block* block)//done
+{
+	//size_t sz = block->mChunkSize;
+	if(block == bin->mActiveBlock)
+	{
+		bin->mActiveBlock = block->mPrev ? block->mPrev : block->mNext;
+	}
+	if(block->mPrev)
+	{
+		block->mPrev->mNext = block->mNext;
+	}
+	if(block->mNext)
+	{
+		block->mNext->mPrev = block->mPrev;
+	}
+	block->mNext = NULL;
+	block->mPrev = NULL;
+}
+
+
+void ScalablePoolAllocator::prependBlock(Bin* bin, Block* block)//done
+{
+	//size_t sz = block->mChunkSize;
+	Block* active;
+	active = bin->mActiveBlock;
+	block->mNext = active;
+	if(active)
+	{
+		block->mPrev = active->mPrev;
+		active->mPrev = block;
+		if(block->mPrev)
+		{
+			block->mPrev->mNext = block;
+		}
+	}
+	else
+	{
+		bin->mActiveBlock = block;
+	}
+}
+
+
+void ScalablePoolAllocator::moveBlockToBinFront(Block* block)// done
+{
+	Bin* bin = getBin(block->mChunkSize);
+	removeBlock(bin, block);
+	prependBlock(bin, block);
+}
+
+
+void ScalablePoolAllocator::processLessUsedBlock(Block* block)//done
+{
+	Bin* bin = getBin(block->mChunkSize);
+	if( (block != bin->getActiveBlock()) && (block != bin->getActiveBlock()->mPrev) )
+	{
+		removeBlock(bin, block);
+		returnEmptyBlock(block);
+	}
+	else
+	{
+		restoreBumpPtr(block);
+	}
+}
+
+/// Bin
+///{
+ScalablePoolAllocator::Block* ScalablePoolAllocator::Bin::setPreviousBlockActive()//done
+{
+	Block* tmp = mActiveBlock->mPrev;
+	if(tmp)
+	{
+		mActiveBlock = tmp;
+	}
+	return tmp;
+}
+
+///}
+
+/// Regions
+///{
+byte* ScalablePoolAllocator::mapRegion(size_t size)
+{
+	if(mRegionOptions.MapRegion)
+	{
+		return mRegionOptions.MapRegion(size);
+	}
+
+	try
+	{
+		return HugePage::map(size, mRegionOptions.Policy);
+	}
+	catch(std::bad_alloc&)
+	{
+		return NULL;
+	}
+}
+
+void ScalablePoolAllocator::unmapRegion(const Region& region)
+{
+	if(mRegionOptions.UnmapRegion)
+	{
+		mRegionOptions.UnmapRegion(region.mMemory, region.mSize);
+	}
+	else
+	{
+		HugePage::unmap(region.mMemory, region.mSize);
+	}
+}
+
+bool ScalablePoolAllocator::isRegionLimitReached()
+{
+	if(!mRegionOptions.MaxRegions)
+	{
+		return false;
+	}
+	tbb::spin_rw_mutex::scoped_lock lock(mRegionLock, false);
+	return mRegions.size() >= mRegionOptions.MaxRegions;
+}
+
+/**
+ * Map a region and carve it into big blocks. The region is mapped without holding mPoolLock, and
+ * dropped if another thread has added a block region since the caller saw the pool out of blocks
+ * (as of the given generation), in which case the caller just takes a block again.
+ */
+bool ScalablePoolAllocator::addBlockRegion(size_t generation)
+{
+	if(isRegionLimitReached())
+	{
+		return false;
+	}
+
+	Region region;
+	region.mSize = std::max(mRegionOptions.RegionSize, BIG_BLOCK_SIZE + BLOCK_SIZE);
+	region.mMemory = mapRegion(region.mSize);
+	if(!region.mMemory)
+	{
+		return false;
+	}
+	region.mBegin = reinterpret_cast<byte*>(alignUp(reinterpret_cast<uintptr_t>(region.mMemory), BLOCK_SIZE));
+	region.mEnd = reinterpret_cast<byte*>(alignDown(reinterpret_cast<uintptr_t>(region.mMemory + region.mSize), BLOCK_SIZE));
+	region.mLarge = false;
+
+	{//lock
+		tbb::spin_mutex::scoped_lock lock(mPoolLock);
+		bool raced = (generation != mBlockRegionGeneration);
+		if(raced || isRegionLimitReached())
+		{
+			lock.release();
+			unmapRegion(region);
+			return raced;
+		}
+		++mBlockRegionGeneration;
+		insertRegion(region);
+
+		STAT_ADDV(mStatistics.AllocatedSize, region.mEnd - region.mBegin);
+		STAT_ADDV(mStatistics.BlocksInFreeBlockStack, (region.mEnd - region.mBegin) / BLOCK_SIZE);
+		for(byte* p = region.mBegin; p < region.mEnd; p += BIG_BLOCK_SIZE)
+		{
+			Block* blk = reinterpret_cast<Block*>(p);
+			blk->mBumpPtr = reinterpret_cast<FreeChunk*>( std::min(p + BIG_BLOCK_SIZE, region.mEnd) );
+			blk->mFreeTime = getPurgeClock();
+			blk->mPurged = false;
+			mFreeBlockStack.push(reinterpret_cast<void**>(blk));
+		}
+	}//unlock
+	return true;
+}
+
+/**
+ * Map a region holding a single free chunk between two fence chunks, and split the
+ * requested chunk from it. Like addBlockRegion(), the region is mapped without holding
+ * mPoolLock; if another thread has added a large region in the meantime, the new region is
+ * dropped and the chunk is looked up in the bins again.
+ */
+ScalablePoolAllocator::LargeChunk* ScalablePoolAllocator::addLargeRegion(size_t chunkSize)
+{
+	while(true)
+	{
+		size_t generation;
+		{//lock
+			tbb::spin_mutex::scoped_lock lock(mPoolLock);
+			generation = mLargeRegionGeneration;
+		}//unlock
+		if(isRegionLimitReached())
+		{
+			return NULL;
+		}
+
+		Region region;
+		region.mSize = std::max(mRegionOptions.RegionSize, chunkSize + 2 * LargeChunk::HEADER_SIZE);
+		region.mMemory = mapRegion(region.mSize);
+		if(!region.mMemory)
+		{
+			return NULL;
+		}
+		region.mBegin = reinterpret_cast<byte*>(alignUp(reinterpret_cast<uintptr_t>(region.mMemory), LargeChunk::HEADER_SIZE));
+		region.mEnd = reinterpret_cast<byte*>(alignDown(reinterpret_cast<uintptr_t>(region.mMemory + region.mSize), LargeChunk::HEADER_SIZE));
+		region.mLarge = true;
+
+		bool raced;
+		{//lock
+			tbb::spin_mutex::scoped_lock lock(mPoolLock);
+			raced = (generation != mLargeRegionGeneration);
+			if(!raced && !isRegionLimitReached())
+			{
+				++mLargeRegionGeneration;
+				reinterpret_cast<LargeChunk*>(region.mBegin)->mHead = LargeChunk::HEADER_SIZE;
+				reinterpret_cast<LargeChunk*>(region.mEnd - LargeChunk::HEADER_SIZE)->mHead = LargeChunk::HEADER_SIZE;
+				insertRegion(region);
+
+				LargeChunk* chunk = reinterpret_cast<LargeChunk*>(region.mBegin + LargeChunk::HEADER_SIZE);
+				chunk->mHead = (region.mEnd - region.mBegin) - 2 * LargeChunk::HEADER_SIZE;
+				lock.release();
+
+				splitLargeChunk(chunk, chunkSize);
+				return chunk;
+			}
+		}//unlock
+
+		unmapRegion(region);
+		if(!raced)
+		{
+			return NULL;// Region limit reached
+		}
+		LargeChunk* chunk = getFreeLargeChunk(chunkSize);
+		if(chunk)
+		{
+			return chunk;
+		}
+	}
+}
+
+void ScalablePoolAllocator::insertRegion(const Region& region)
+{
+	tbb::spin_rw_mutex::scoped_lock lock(mRegionLock, true);
+
+	std::vector<Region>::iterator it = mRegions.begin();
+	while(it != mRegions.end() && it->mBegin < region.mBegin)
+	{
+		++it;
+	}
+	mRegions.insert(it, region);
+
+	STAT_ADD(mStatistics.RegionsInUse);
+	STAT_ADDV(mStatistics.RegionBytes, region.mSize);
+}
+
+bool ScalablePoolAllocator::findRegion(byte* mem, bool& large)
+{
+	if(!mGrowable)
+	{
+		return false;
+	}
+
+	tbb::spin_rw_mutex::scoped_lock lock(mRegionLock, false);
+
+	// Binary search for the last region starting at or before mem
+	size_t lo = 0, hi = mRegions.size();
+	while(lo < hi)
+	{
+		size_t mid = (lo + hi) / 2;
+		if(mRegions[mid].mBegin <= mem)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(lo == 0 || mem >= mRegions[lo - 1].mEnd)
+	{
+		return false;
+	}
+	large = mRegions[lo - 1].mLarge;
+	return true;
+}
+
+size_t ScalablePoolAllocator::releaseFreeRegions()
+{
+	std::vector<Region> released;
 	{
-		void* oldval = NULL;
-		{//lock
-			tbb::spin_mutex::scoped_lock lock(mPublicFreeListLock);
-			if( (oldval = reinterpret_cast<void*>(block->mPublicFreeList)) == NULL)
+		tbb::spin_rw_mutex::scoped_lock lock(mRegionLock, true);
+
+		std::vector<Region>::iterator it = mRegions.begin();
+		while(it != mRegions.end())
+		{
+			bool isFree;
+			if(it->mLarge)
 			{
-				block->mPublicFreeList = reinterpret_cast<FreeChunk*>(INVALID);
+				// A free large region is a single free chunk between the fences
+				LargeChunk* chunk = reinterpret_cast<LargeChunk*>(it->mBegin + LargeChunk::HEADER_SIZE);
+				size_t chunkSize = (it->mEnd - it->mBegin) - 2 * LargeChunk::HEADER_SIZE;
+				isFree = chunk->isFree() && chunk->size() == chunkSize && claimLargeChunk(chunk, chunkSize);
 			}
-		}//unlock
-		if(oldval != NULL)
-		{
-			// need to wait for the other thread finishes freeing the object
-			int waitcnt = 256;
-			while( reinterpret_cast<uintptr_t>(const_cast<Block* volatile &>(block->mNextPrivatizable)) == reinterpret_cast<uintptr_t>(bin) )
+			else
 			{
-				if(--waitcnt == 0)
+				isFree = mFreeBlockStack.removeRange(it->mBegin, it->mEnd);
+				if(isFree)
 				{
-					tbb::this_tbb_thread::yield();
-					waitcnt = 256;
+					STAT_SUBV(mStatistics.AllocatedSize, it->mEnd - it->mBegin);
+					STAT_SUBV(mStatistics.BlocksInFreeBlockStack, (it->mEnd - it->mBegin) / BLOCK_SIZE);
 				}
 			}
+
+			if(isFree)
+			{
+				STAT_SUB(mStatistics.RegionsInUse);
+				STAT_SUBV(mStatistics.RegionBytes, it->mSize);
+				released.push_back(*it);
+				it = mRegions.erase(it);
+			}
+			else
+			{
+				++it;
+			}
 		}
 	}
 
-	block->mPrev = NULL;
-	block->mOwnerID = 0;
-
-	block->mNextPrivatizable = reinterpret_cast<Block*>(INVALID);
-	mGlobalBins[idx].push(reinterpret_cast<void**>(block));
+	for(std::vector<Region>::iterator it = released.begin(); it != released.end(); ++it)
+	{
+		unmapRegion(*it);
+	}
+	return released.size();
 }
+///}
 
-
-void ScalablePoolAllocator::restoreBumpPtr(Block* block)//done
+/// Purge
+///{
+size_t ScalablePoolAllocator::purge(bool force)
 {
-	// This will make the block empty, and it assumes there're no allocations within the block
-	block->mBumpPtr = reinterpret_cast<FreeChunk*>( reinterpret_cast<uintptr_t>(block) + BLOCK_SIZE - block->mChunkSize );
-	block->mFreeList = NULL;
-	block->mIsFull = false;
-}
+	uint32 now = getPurgeClock();
 
+	size_t purged = 0;
+	purged += purgeFreeBlocks(now, force);
+	purged += purgeLargeChunks(now, force);
+	purged += purgeBumpSpace(now, force);
 
-
-byte* ScalablePoolAllocator::allocateFromBlock(Block* block)//done
-{
-	byte* ret;
-	if( (ret = allocateFromFreeList(block)) )
-	{
-		return ret;
-	}
-	if( (ret = allocateFromBumpPtr(block)) )
-	{
-		return ret;
-	}
-	block->mIsFull = true;
-	return NULL;
+	STAT_ADDV(mStatistics.PurgedBytes, purged);
+	return purged;
 }
 
-
-byte* ScalablePoolAllocator::allocateFromFreeList(Block* block)//done
+void ScalablePoolAllocator::setPurgeOptions(const PurgeOptions& options)
 {
-	byte* ret;
-	if( !block->mFreeList )
+	stopPurgeThread();
+	mPurgeOptions = options;
+	if(mPurgeOptions.Interval)
 	{
-		return NULL;
+		startPurgeThread();
 	}
-	ret = reinterpret_cast<byte*>(block->mFreeList);
-	block->mFreeList = block->mFreeList->mNext;
-	block->mAllocationCount++;
-	return ret;
 }
 
-
-byte* ScalablePoolAllocator::allocateFromBumpPtr(Block* block)//done
+size_t ScalablePoolAllocator::purgeFreeBlocks(uint32 now, bool force)
 {
-	byte* ret = reinterpret_cast<byte*>(block->mBumpPtr);
-	if(ret)
+	size_t purged = 0;
+	while(true)
 	{
-		block->mBumpPtr = reinterpret_cast<FreeChunk*>( reinterpret_cast<uintptr_t>(block->mBumpPtr) - block->mChunkSize );
-		if( reinterpret_cast<uintptr_t>(block->mBumpPtr) < reinterpret_cast<uintptr_t>(block) + sizeof(Block) )
+		// Take a few idle entries off the stack at a time, so that madvise() isn't called with the stack
+		// lock held while the other free blocks stay available (see getEmptyBlock())
+		++mPurgingBlocks;
+		void** head = mFreeBlockStack.removeIdle(now, force ? 0 : mPurgeOptions.DecayTime, PURGE_BATCH);
+		void** tail = NULL;
+		size_t count = 0;
+		for(void** entry = head; entry; entry = reinterpret_cast<void**>(*entry))
 		{
-			block->mBumpPtr = NULL;
-		}
-		block->mAllocationCount++;
-	}
-	return ret;
-}
+			Block* blk = reinterpret_cast<Block*>(entry);
 
+			// Keep the header, which holds the stack link and the end of the entry
+			purged += adviseFree(reinterpret_cast<byte*>(blk + 1), reinterpret_cast<byte*>(blk->mBumpPtr));
+			blk->mPurged = true;
+			tail = entry;
+			++count;
+		}
+		if(head)
+		{
+			// Purged blocks go to the bottom, so that the blocks still in memory are reused first
+			mFreeBlockStack.append(head, tail);
+		}
+		--mPurgingBlocks;
 
-ScalablePoolAllocator::Block* ScalablePoolAllocator::getPublicFreeListBlock(Bin* bin)//done
-{
-	Block* ret;
-	{//lock
-		tbb::spin_mutex::scoped_lock lock(bin->mMailBoxLock);
-		ret = bin->mMailBox;
-		if(ret)
+		if(count < PURGE_BATCH)
 		{
-			bin->mMailBox = ret->mNextPrivatizable;// ? when is this property a block, when is it a bin?
-			ret->mNextPrivatizable = reinterpret_cast<Block*>(bin);
+			return purged;
 		}
-	}//unlock
-	if(ret)
-	{
-		privatizePublicFreeList(ret);
 	}
-	return ret;
 }
 
-
-void ScalablePoolAllocator::privatizePublicFreeList(Block* block)//done
+size_t ScalablePoolAllocator::purgeLargeChunks(uint32 now, bool force)
 {
-	FreeChunk* tmp, *publicFreeList;
+	size_t minSize = std::max<size_t>(mPurgeOptions.MinLargeChunkSize, LargeChunk::MIN_SIZE);
 
-	///{ public freelist locking scheme
-	{
-		tbb::spin_mutex::scoped_lock lock(mPublicFreeListLock);
-		publicFreeList = block->mPublicFreeList;
-		block->mPublicFreeList = NULL;
-	}
-	tmp = publicFreeList;
-	///}
-	if( !isInvalid( reinterpret_cast<uintptr_t>(tmp) ) )// return/getPartialBlock could set it to INVALID
+	size_t purged = 0;
+	for(size_t i = findNonEmptyLargeBin(getLargeBinIndex(minSize)); i < LARGE_BIN_COUNT; i = findNonEmptyLargeBin(i + 1))
 	{
-		block->mAllocationCount--;
-		while( isValid( reinterpret_cast<uintptr_t>(tmp->mNext) ) )// the list will end with either NULL or UNUSABLE
+		size_t count;
+		do
 		{
-			tmp = tmp->mNext;
-			block->mAllocationCount--;
-		}
-		// prepend to private freelist
-		tmp->mNext = block->mFreeList;
-		block->mFreeList = publicFreeList;
+			// Take a few chunks out of the bin at a time, so that madvise() isn't called with the bin
+			// lock held (see allocateLarge())
+			LargeChunk* batch[PURGE_BATCH];
+			count = 0;
+			++mPurgingLargeChunks;
+			{//lock
+				tbb::spin_mutex::scoped_lock lock(mLargeBins[i].mLock);
+				for(LargeChunk* chunk = mLargeBins[i].mHead; chunk && count < PURGE_BATCH; chunk = chunk->mNext)
+				{
+					if(chunk->size() < minSize || (chunk->mHead & LargeChunk::PURGED))
+					{
+						continue;
+					}
+					if(!force && now - static_cast<uint32>(chunk->mFreeTime) < mPurgeOptions.DecayTime)
+					{
+						continue;
+					}
+					batch[count++] = chunk;
+				}
+				for(size_t k = 0; k < count; ++k)
+				{
+					unlinkLargeChunk(i, batch[k]);
+				}
+			}//unlock
+
+			for(size_t k = 0; k < count; ++k)
+			{
+				// Keep the header with the bin links and the footer
+				size_t chunkSize = batch[k]->size();
+				purged += adviseFree(reinterpret_cast<byte*>(batch[k] + 1), reinterpret_cast<byte*>(batch[k]->footer(chunkSize)));
+
+				// Link it back like freeLargeChunk() does, the neighbours may have been freed in the meantime
+				if(!releaseLargeChunkToBumpPtr(batch[k], chunkSize))
+				{
+					insertLargeChunk(batch[k], chunkSize, true);
+					recheckLargeChunk(batch[k], chunkSize);
+				}
+			}
+			--mPurgingLargeChunks;
+		} while(count == PURGE_BATCH);
 	}
+	return purged;
 }
 
-
-void ScalablePoolAllocator::freePublicChunk(Block* block, FreeChunk* chunk)//done
+size_t ScalablePoolAllocator::purgeBumpSpace(uint32 now, bool force)
 {
-	Bin* bin;
-	FreeChunk* publicFreeList;
+	// Large chunks given back to mBumpPtr end up in the space between the blocks and the large chunks
+	byte* begin;
+	byte* end;
 	{//lock
-		tbb::spin_mutex::scoped_lock lock(mPublicFreeListLock);
-		publicFreeList = chunk->mNext = block->mPublicFreeList;
-		block->mPublicFreeList = chunk;
-	}//unlock
+		tbb::spin_mutex::scoped_lock lock(mPoolLock);
 
-	if( publicFreeList == NULL )
-	{
-		if( !isInvalid( reinterpret_cast<uintptr_t>(block->mNextPrivatizable) ) )
+		if(mPurgingBumpEnd || (!force && now - mBumpPtrFreeTime < mPurgeOptions.DecayTime))
 		{
-			bin = reinterpret_cast<Bin*>(block->mNextPrivatizable);
-			tbb::spin_mutex::scoped_lock maillock(bin->mMailBoxLock);
-			block->mNextPrivatizable = bin->mMailBox;
-			bin->mMailBox = block;
+			return 0;
 		}
-		else
+		begin = std::max(mBlockAllocPtr, mPurgedBumpPtr);
+		end = mBumpPtr;
+		if(begin >= end)
 		{
-			// MALLOC_ASSERT( block->owner==0, ASSERT_TEXT );
+			return 0;
 		}
-	}
-}
+		mPurgingBumpBegin = begin;
+		mPurgingBumpEnd = end;
+	}//unlock
 
+	// madvise() is called without mPoolLock, only the allocations carving into the space wait for it
+	size_t purged = adviseFree(begin, end);
 
-bool ScalablePoolAllocator::emptyEnoughToUse(Block* block)//done
-{
-	if(block->mBumpPtr)
-	{
-		block->mIsFull = false;
-		return true;
-	}
-	block->mIsFull = (block->mAllocationCount * block->mChunkSize > EMPTY_ENOUGH_THRESHOLD);
-	return !(block->mIsFull);
+	{//lock
+		tbb::spin_mutex::scoped_lock lock(mPoolLock);
+		mPurgingBumpBegin = mPurgingBumpEnd = NULL;
+		mPurgedBumpPtr = end;
+	}//unlock
+	return purged;
 }
 
+bool ScalablePoolAllocator::isBumpSpacePurging(byte* begin, byte* end)
+{
+	return begin < mPurgingBumpEnd && mPurgingBumpBegin < end;
+}
 
-void ScalablePoolAllocator::removeBlock(Bin* bin, Block* block)//done
+size_t ScalablePoolAllocator::adviseFree(byte* begin, byte* end)
 {
-	//size_t sz = block->mChunkSize;
-	if(block == bin->mActiveBlock)
+#ifdef __PLATFORM_LINUX__
+	uintptr_t granularity = getPurgeGranularity();
+
+	// Only whole pages (or huge pages) are given back, a partial one would be split
+	begin = reinterpret_cast<byte*>(alignUp(reinterpret_cast<uintptr_t>(begin), granularity));
+	end = reinterpret_cast<byte*>(alignDown(reinterpret_cast<uintptr_t>(end), granularity));
+	if(begin >= end)
 	{
-		bin->mActiveBlock = block->mPrev ? block->mPrev : block->mNext;
+		return 0;
 	}
-	if(block->mPrev)
+
+	int advice = MADV_DONTNEED;
+#ifdef MADV_FREE
+	if(mPurgeOptions.LazyFree)
 	{
-		block->mPrev->mNext = block->mNext;
+		advice = MADV_FREE;
 	}
-	if(block->mNext)
+#endif
+	if(::madvise(begin, end - begin, advice) != 0)
 	{
-		block->mNext->mPrev = block->mPrev;
+		// MADV_FREE is not supported before Linux 4.5
+		if(advice == MADV_DONTNEED || ::madvise(begin, end - begin, MADV_DONTNEED) != 0)
+		{
+			return 0;
+		}
 	}
-	block->mNext = NULL;
-	block->mPrev = NULL;
+	return end - begin;
+#else
+	return 0;
+#endif
 }
 
-
-void ScalablePoolAllocator::prependBlock(Bin* bin, Block* block)//done
+size_t ScalablePoolAllocator::getPurgeGranularity()
 {
-	//size_t sz = block->mChunkSize;
-	Block* active;
-	active = bin->mActiveBlock;
-	block->mNext = active;
-	if(active)
+	if(mPurgeOptions.Granularity)
 	{
-		block->mPrev = active->mPrev;
-		active->mPrev = block;
-		if(block->mPrev)
-		{
-			block->mPrev->mNext = block;
-		}
+		return mPurgeOptions.Granularity;
 	}
-	else
+	if(mGrowable && mRegionOptions.Policy != HugePagePolicy::none)
 	{
-		bin->mActiveBlock = block;
+		return HugePage::size();
 	}
+#ifdef __PLATFORM_LINUX__
+	static const size_t pageSize = sysconf(_SC_PAGESIZE);
+	return pageSize;
+#else
+	return 4096;
+#endif
 }
 
-
-void ScalablePoolAllocator::moveBlockToBinFront(Block* block)// done
+void ScalablePoolAllocator::startPurgeThread()
 {
-	Bin* bin = getBin(block->mChunkSize);
-	removeBlock(bin, block);
-	prependBlock(bin, block);
+	boost::thread t(boost::bind(&ScalablePoolAllocator::purgeThreadLoop, this));
+	mPurgeThread.swap(t);
 }
 
-
-void ScalablePoolAllocator::processLessUsedBlock(Block* block)//done
+void ScalablePoolAllocator::stopPurgeThread()
 {
-	Bin* bin = getBin(block->mChunkSize);
-	if( (block != bin->getActiveBlock()) && (block != bin->getActiveBlock()->mPrev) )
-	{
-		removeBlock(bin, block);
-		returnEmptyBlock(block);
-	}
-	else
+	if(mPurgeThread.joinable())
 	{
-		restoreBumpPtr(block);
+		mPurgeThread.interrupt();
+		mPurgeThread.join();
 	}
 }
 
-/// Bin
-///{
-ScalablePoolAllocator::Block* ScalablePoolAllocator::Bin::setPreviousBlockActive()//done
+void ScalablePoolAllocator::purgeThreadLoop()
 {
-	Block* tmp = mActiveBlock->mPrev;
-	if(tmp)
+	try
 	{
-		mActiveBlock = tmp;
+		while(true)
+		{
+			boost::this_thread::sleep(boost::posix_time::milliseconds(mPurgeOptions.Interval));
+			purge();
+		}
 	}
-	return tmp;
+	catch(boost::thread_interrupted&)
+	{ }
 }
-
 ///}
 
 /// Stack
 ///{
-ScalablePoolAllocator::Stack::Stack() : mTop(NULL)
+ScalablePoolAllocator::Stack::Stack() : mTop(NULL), mBottom(NULL)
 {}
 void ScalablePoolAllocator::Stack::push(void** p)
 {
 	tbb::spin_mutex::scoped_lock lock(mLock);
+	if( !mTop ) { mBottom = p; }
 	*p = mTop;
 	mTop = reinterpret_cast<void*>(p);
 }
@@ -1015,10 +2131,98 @@ void* ScalablePoolAllocator::Stack::pop()
 		if( !mTop ) { return ret; }
 		ret = reinterpret_cast<void**>(mTop);
 		mTop = *ret;
+		if( !mTop ) { mBottom = NULL; }
 	}
 	*ret = NULL;
 	return ret;
 }
+/**
+ * Remove all free blocks within [begin, end) if they cover the whole range, used on mFreeBlockStack only.
+ * Every entry is a run of blocks ending at its mBumpPtr (see getEmptyBlock()).
+ */
+bool ScalablePoolAllocator::Stack::removeRange(byte* begin, byte* end)
+{
+	tbb::spin_mutex::scoped_lock lock(mLock);
+
+	size_t freeSize = 0;
+	for(byte* p = reinterpret_cast<byte*>(mTop); p; p = reinterpret_cast<byte*>(*reinterpret_cast<void**>(p)))
+	{
+		if(p >= begin && p < end)
+		{
+			freeSize += reinterpret_cast<byte*>(reinterpret_cast<Block*>(p)->mBumpPtr) - p;
+		}
+	}
+	if(freeSize != static_cast<size_t>(end - begin))
+	{
+		return false;
+	}
+
+	void** link = &mTop;
+	while(*link)
+	{
+		byte* p = reinterpret_cast<byte*>(*link);
+		if(p >= begin && p < end)
+		{
+			*link = *reinterpret_cast<void**>(p);
+		}
+		else
+		{
+			link = reinterpret_cast<void**>(p);
+		}
+	}
+	mBottom = (link == &mTop) ? NULL : link;
+	return true;
+}
+/**
+ * Remove up to maxCount free blocks which are not purged yet and have been idle for decayTime, used on
+ * mFreeBlockStack only. The removed entries are returned as a list linked by their first word.
+ */
+void** ScalablePoolAllocator::Stack::removeIdle(uint32 now, uint32 decayTime, size_t maxCount)
+{
+	tbb::spin_mutex::scoped_lock lock(mLock);
+
+	void** idle = NULL;
+	size_t count = 0;
+	void** link = &mTop;
+	while(*link && count < maxCount)
+	{
+		Block* blk = reinterpret_cast<Block*>(*link);
+		if(!blk->mPurged && now - blk->mFreeTime >= decayTime)
+		{
+			*link = blk->mNext;
+			blk->mNext = reinterpret_cast<Block*>(idle);
+			idle = reinterpret_cast<void**>(blk);
+			++count;
+			if(!*link)
+			{
+				mBottom = (link == &mTop) ? NULL : link;
+			}
+		}
+		else
+		{
+			link = reinterpret_cast<void**>(blk);
+		}
+	}
+	return idle;
+}
+/**
+ * Put a list linked by the first word at the bottom of the stack, so that it's popped last.
+ */
+void ScalablePoolAllocator::Stack::append(void** head, void** tail)
+{
+	tbb::spin_mutex::scoped_lock lock(mLock);
+
+	if(mBottom)
+	{
+		*mBottom = head;
+	}
+	else
+	{
+		mTop = head;
+	}
+	mBottom = tail;
+	*tail = NULL;
+}
 ///}
 
 /// TLS Clean up functions
@@ -1030,15 +2234,23 @@ void ScalablePoolAllocator::ThreadIDTLSCleanUpFunction(ThreadID* t)
 }
 void ScalablePoolAllocator::BinTLSCleanUpFunction(Bin* bins)
 {
+	if(!bins)
+	{
+		return;
+	}
+
 	// This is needed due to unavailability of "this" pointer inside a static member function.
-	// The pointer is obtained from TLS that had stored "this" pointer during initial getBin() method.
-	ScalablePoolAllocator* _this = reinterpret_cast<ScalablePoolAllocator*>( *((uintptr_t*)((byte*)bins - sizeof(Bin))) );
+	// The owner is obtained from TLS that had stored it during initial getBin() method.
+	BinOwner* owner = *reinterpret_cast<BinOwner**>(bins - 1);
 	Block* threadlessBlock;
 	Block* threadBlock;
 
-	if(bins)
 	{
-		for(size_t idx = 0; idx < _this->BIN_COUNT; idx++)
+		tbb::spin_rw_mutex::scoped_lock lock(owner->mLock, false);
+		ScalablePoolAllocator* _this = owner->mPool;
+
+		// The blocks are gone with the pool once it is destroyed
+		for(size_t idx = 0; _this && idx < _this->BIN_COUNT; idx++)
 		{
 			if(bins[idx].mActiveBlock == NULL) { continue; }
 
@@ -1072,11 +2284,13 @@ void ScalablePoolAllocator::BinTLSCleanUpFunction(Bin* bins)
 			}
 			bins[idx].mActiveBlock = NULL;
 		}
-		_this->deallocateTLS(bins - 1);// Including the "this" pointer upon deallocation
-		bins = NULL;
 	}
 
-	bins = NULL;
+	deallocateTLS(bins - 1);// Including the owner pointer upon deallocation
+	if(--owner->mRefCount == 0)
+	{
+		delete owner;
+	}
 }
 ///}
 
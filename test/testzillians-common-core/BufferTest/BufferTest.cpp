@@ -22,6 +22,10 @@
 
 #include "core/Prerequisite.h"
 #include "core/Buffer.h"
+#include "core/BufferChain.h"
+#include "core/BufferRef.h"
+#include "core/BufferCompressor.h"
+#include "core/HugePage.h"
 #include "utility/UUIDUtil.h"
 #include <iostream>
 #include <string>
@@ -34,6 +38,14 @@
 using namespace zillians;
 using namespace std;
 
+struct BulkPositionUpdate
+{
+	uint32 id;
+	float x, y, z;
+};
+
+ZILLIANS_BUFFER_BULK_SERIALIZABLE(BulkPositionUpdate)
+
 BOOST_AUTO_TEST_SUITE( BufferTest )
 
 BOOST_AUTO_TEST_CASE( StringEncodingAndDecodingTest )
@@ -311,6 +323,7 @@ BOOST_AUTO_TEST_CASE( SerializableEncodingAndDecodingTest1 )
 //	b->readSerializable(obj2);
 
 	std::size_t sizeProbed = b->probeSize(obj1);
+	BOOST_CHECK(Buffer::probeSizeSerializable(obj1) == sizeProbed);
 	(*b) << obj1;
 	BOOST_CHECK(b->dataSize() == sizeProbed);
 
@@ -1053,4 +1066,1163 @@ BOOST_AUTO_TEST_CASE( StdPairSerializeTest )
 	BOOST_CHECK(result.second == uuid1);
 }
 
+BOOST_AUTO_TEST_CASE( VectoredIoTest )
+{
+	int fds[2];
+	BOOST_REQUIRE(pipe(fds) == 0);
+
+	// circular buffer with wrapped-around data is written by two iovec entries
+	CircularBuffer src(64);
+	for(int i=0;i<12;++i) src << i;
+	for(int i=0;i<12;++i) { int x; src >> x; }
+	for(int i=0;i<12;++i) src << i;
+
+	struct iovec iov[2];
+	BOOST_CHECK(src.getDataIovec(iov, 2) == 2);
+	BOOST_CHECK(iov[0].iov_len + iov[1].iov_len == 12 * sizeof(int));
+
+	BOOST_CHECK(src.writeTo(fds[1]) == (ssize_t)(12 * sizeof(int)));
+	BOOST_CHECK(src.dataSize() == 0);
+
+	CircularBuffer dest(32);
+	int expected = 0;
+	while(expected < 12)
+	{
+		BOOST_REQUIRE(dest.readFrom(fds[0]) > 0);
+		while(dest.dataSize() >= sizeof(int))
+		{
+			int x; dest >> x;
+			BOOST_CHECK(x == expected++);
+		}
+	}
+
+	// list of buffers is gathered by a single writev() call
+	std::vector<Buffer*> buffers;
+	for(int i=0;i<3;++i)
+	{
+		buffers.push_back(new Buffer(64));
+		*buffers.back() << i;
+	}
+	BOOST_CHECK(writeTo(fds[1], buffers.begin(), buffers.end()) == (ssize_t)(3 * sizeof(int)));
+	for(int i=0;i<3;++i)
+	{
+		BOOST_CHECK(buffers[i]->dataSize() == 0);
+		SAFE_DELETE(buffers[i]);
+	}
+
+	Buffer result(64);
+	BOOST_CHECK(result.readFrom(fds[0]) == (ssize_t)(3 * sizeof(int)));
+	for(int i=0;i<3;++i)
+	{
+		int x; result >> x;
+		BOOST_CHECK(x == i);
+	}
+
+	close(fds[0]);
+	close(fds[1]);
+}
+
+BOOST_AUTO_TEST_CASE( MirroredBufferTest )
+{
+	MirroredBuffer b(1000);
+	BOOST_CHECK(b.allocatedSize() + 1 >= 1000);
+
+	// wrap around the end of the ring many times with odd-sized records
+	std::string s(77, 'x');
+	for(int iter = 0; iter < 1024; ++iter)
+	{
+		s[iter % s.size()] = (char)iter;
+		b << iter << s;
+
+		std::pair<byte*,std::size_t> ranges[2];
+		BOOST_CHECK(b.getDataRanges(ranges) == 1);
+		BOOST_CHECK(ranges[0].second == b.dataSize());
+
+		int x; std::string y;
+		b >> x >> y;
+		BOOST_CHECK(x == iter);
+		BOOST_CHECK(y == s);
+		BOOST_CHECK(b.dataSize() == 0);
+	}
+
+	// on-demand resizing keeps the data in order
+	MirroredBuffer c;
+	for(int i=0;i<4096;++i) c << i;
+	for(int i=0;i<4096;++i)
+	{
+		int x; c >> x;
+		BOOST_CHECK(x == i);
+	}
+}
+
+BOOST_AUTO_TEST_CASE( BufferChainTest )
+{
+	BufferChain chain;
+
+	chain << (int)0;
+	byte* first_segment = NULL;
+	{
+		std::vector<std::pair<byte*,std::size_t> > ranges;
+		chain.getDataBuffers(ranges);
+		BOOST_REQUIRE(ranges.size() == 1);
+		first_segment = ranges[0].first;
+	}
+
+	// grow over many segments, including an oversized value
+	std::string s(1000, 'z');
+	std::vector<int> large(60000, 7);
+	for(int i=1;i<200;++i) chain << i << s;
+	chain << large;
+	chain << (int)-1;
+
+	BOOST_CHECK(chain.segmentCount() > 3);
+
+	std::vector<std::pair<byte*,std::size_t> > ranges;
+	std::size_t total = chain.getDataBuffers(ranges);
+	BOOST_CHECK(total == chain.dataSize());
+	BOOST_CHECK(ranges[0].first == first_segment);	// previously written bytes are never moved
+
+	// the wire format is identical to a single buffer
+	Buffer flat;
+	flat << (int)0;
+	for(int i=1;i<200;++i) flat << i << s;
+	flat << large;
+	flat << (int)-1;
+	BOOST_REQUIRE(flat.dataSize() == total);
+	std::size_t offset = 0;
+	for(std::size_t i=0;i<ranges.size();++i)
+	{
+		BOOST_CHECK(memcmp(flat.rptr() + offset, ranges[i].first, ranges[i].second) == 0);
+		offset += ranges[i].second;
+	}
+
+	for(int i=0;i<200;++i)
+	{
+		int x; chain >> x;
+		BOOST_CHECK(x == i);
+		if(i > 0)
+		{
+			std::string y; chain >> y;
+			BOOST_CHECK(y == s);
+		}
+	}
+	std::vector<int> z; chain >> z;
+	BOOST_CHECK(z == large);
+	int last; chain >> last;
+	BOOST_CHECK(last == -1);
+	BOOST_CHECK(chain.dataSize() == 0);
+	BOOST_CHECK(chain.segmentCount() == 1);
+
+	// raw data spans across segment boundaries
+	std::vector<int> raw(50000);
+	for(int i=0;i<50000;++i) raw[i] = i;
+	chain.writeArray((const char*)&raw[0], raw.size() * sizeof(int));
+	BOOST_CHECK(chain.segmentCount() > 1);
+	for(int i=0;i<50000;++i)
+	{
+		int x; chain >> x;
+		BOOST_CHECK(x == i);
+	}
+
+	// values other than scalars read from raw data spanning segment boundaries
+	Buffer values;
+	for(int i=0;i<300;++i) values << std::string(500 + i, 'a' + i % 26) << (bool)(i % 2);
+	chain << (int)7;
+	chain.writeArray((const char*)values.rptr(), values.dataSize());
+	chain << std::string("end");
+	BOOST_CHECK(chain.segmentCount() > 2);
+	int seven; chain >> seven;
+	BOOST_CHECK(seven == 7);
+	for(int i=0;i<300;++i)
+	{
+		std::string x; bool y;
+		chain >> x >> y;
+		BOOST_CHECK(x == std::string(500 + i, 'a' + i % 26));
+		BOOST_CHECK(y == (bool)(i % 2));
+	}
+	std::string end; chain >> end;
+	BOOST_CHECK(end == "end");
+	BOOST_CHECK(chain.dataSize() == 0);
+
+	// reading past the end of the chain throws instead of waiting for data
+	chain << (uint32)1;
+	uint32 one; chain >> one;
+	BOOST_CHECK(one == 1);
+	uint32 none;
+	BOOST_CHECK_THROW(chain >> none, std::length_error);
+	std::string nothing;
+	BOOST_CHECK_THROW(chain >> nothing, std::length_error);
+
+	// the segment pool is bounded no matter how much data was chained
+	{
+		BufferChain huge;
+		std::vector<char> block(ZILLIANS_BUFFER_CHAIN_SEGMENT_SIZE * 4, 'x');
+		for(int i=0;i<(ZILLIANS_BUFFER_CHAIN_POOL_SIZE / 4) + 16;++i)
+			huge.writeArray(&block[0], block.size());
+		BOOST_CHECK(huge.segmentCount() > ZILLIANS_BUFFER_CHAIN_POOL_SIZE);
+	}
+	BOOST_CHECK(BufferChain::pooledSegmentCount() <= ZILLIANS_BUFFER_CHAIN_POOL_SIZE);
+	BufferChain::purge();
+	BOOST_CHECK(BufferChain::pooledSegmentCount() == 0);
+}
+
+BOOST_AUTO_TEST_CASE( CompactEncodingTest )
+{
+	Buffer b;
+	b.setEncoding(BufferEncoding::compact);
+
+	b << (int32)1 << (int32)-1 << (uint32)300 << (int64)-1234567890123LL << std::numeric_limits<uint64>::max() << std::numeric_limits<int64>::min();
+	BOOST_CHECK(b.dataSize() == 1 + 1 + 2 + 6 + 10 + 10);
+
+	int32 a0, a1; uint32 a2; int64 a3; uint64 a4; int64 a5;
+	b >> a0 >> a1 >> a2 >> a3 >> a4 >> a5;
+	BOOST_CHECK(a0 == 1);
+	BOOST_CHECK(a1 == -1);
+	BOOST_CHECK(a2 == 300);
+	BOOST_CHECK(a3 == -1234567890123LL);
+	BOOST_CHECK(a4 == std::numeric_limits<uint64>::max());
+	BOOST_CHECK(a5 == std::numeric_limits<int64>::min());
+
+	// length prefixes and container elements are compact as well, and match probeSize()
+	std::vector<int32> v;
+	for(int i=0;i<100;++i) v.push_back(i - 50);
+	std::map<uint32, std::string> m;
+	m[1] = "one"; m[1000] = "thousand";
+	std::string s("hello");
+
+	std::size_t before = b.dataSize();
+	b << v << m << s;
+	BOOST_CHECK(b.dataSize() - before == Buffer::probeSize(v, b.encoding()) + Buffer::probeSize(m, b.encoding()) + Buffer::probeSize(s, b.encoding()));
+	BOOST_CHECK(Buffer::probeSize(v, b.encoding()) == 1 + 100);
+	BOOST_CHECK(Buffer::probeSize(s, b.encoding()) == 1 + 5);
+
+	std::vector<int32> v1; std::map<uint32, std::string> m1; std::string s1;
+	b >> v1 >> m1 >> s1;
+	BOOST_CHECK(v1 == v);
+	BOOST_CHECK(m1 == m);
+	BOOST_CHECK(s1 == s);
+
+	// compact encoding across the wrap-around of circular buffer
+	CircularBuffer c(64);
+	c.setEncoding(BufferEncoding::compact);
+	for(int iter = 0; iter < 100; ++iter)
+	{
+		c << (uint64)iter * 1000000007ULL;
+		uint64 x; c >> x;
+		BOOST_CHECK(x == (uint64)iter * 1000000007ULL);
+	}
+}
+
+BOOST_AUTO_TEST_CASE( BulkCopyVectorTest )
+{
+	Buffer b;
+
+	std::vector<BulkPositionUpdate> updates(20000);
+	for(int i=0;i<20000;++i)
+	{
+		updates[i].id = i;
+		updates[i].x = i * 0.5f; updates[i].y = -i * 0.25f; updates[i].z = 1.0f;
+	}
+
+	b << updates;
+	BOOST_CHECK(b.dataSize() == sizeof(uint32) + 20000 * sizeof(BulkPositionUpdate));
+	BOOST_CHECK(Buffer::probeSize(updates) == b.dataSize());
+
+	std::vector<BulkPositionUpdate> result;
+	b >> result;
+	BOOST_REQUIRE(result.size() == updates.size());
+	BOOST_CHECK(memcmp(&result[0], &updates[0], updates.size() * sizeof(BulkPositionUpdate)) == 0);
+
+	// vector of scalars keeps the same wire format as element by element write
+	std::vector<int32> v;
+	for(int i=0;i<1000;++i) v.push_back(i * 7);
+	b << v;
+	BOOST_CHECK(b.dataSize() == sizeof(uint32) + 1000 * sizeof(int32));
+	uint32 length; b >> length;
+	BOOST_CHECK(length == 1000);
+	for(int i=0;i<1000;++i)
+	{
+		int32 x; b >> x;
+		BOOST_CHECK(x == i * 7);
+	}
+
+	// compact encoding still writes integers one by one as varint
+	b.setEncoding(BufferEncoding::compact);
+	b << v << updates;
+	std::vector<int32> v1; std::vector<BulkPositionUpdate> updates1;
+	b >> v1 >> updates1;
+	BOOST_CHECK(v1 == v);
+	BOOST_CHECK(updates1.size() == updates.size() && updates1.back().id == 19999);
+}
+
+struct SizedTestObject
+{
+	template <typename Archive>
+	void serialize(Archive& ar, const unsigned int version)
+	{
+		ar & id;
+		ar & name;
+		ar & children;
+	}
+
+	int32 id;
+	std::string name;
+	std::vector<std::string> children;
+};
+
+BOOST_AUTO_TEST_CASE( SinglePassSizedWriteTest )
+{
+	SizedTestObject obj;
+	obj.id = 42;
+	obj.name = "root";
+	for(int i=0;i<100;++i) obj.children.push_back(std::string(i % 17 + 1, 'c'));
+
+	// plain buffer grows on demand during the write
+	Buffer b;
+	std::size_t length = b.writeSized(obj);
+	BOOST_CHECK(length == Buffer::probeSize(obj));
+	BOOST_CHECK(b.dataSize() == length + sizeof(uint32));
+
+	uint32 prefix; b.getDirect(prefix, b.rpos());
+	BOOST_CHECK(prefix == length);
+
+	SizedTestObject result;
+	b.readSized(result);
+	BOOST_CHECK(result.id == 42 && result.name == "root" && result.children == obj.children);
+	BOOST_CHECK(b.dataSize() == 0);
+
+	// circular buffer is resized (and crunched) in the middle of the write
+	CircularBuffer c;
+	for(int i=0;i<20;++i) c << i;
+	for(int i=0;i<10;++i) { int x; c >> x; }
+	length = c.writeSized(obj);
+	BOOST_CHECK(length == Buffer::probeSize(obj));
+	for(int i=10;i<20;++i) { int x; c >> x; BOOST_CHECK(x == i); }
+	result = SizedTestObject();
+	c.readSized(result);
+	BOOST_CHECK(result.id == 42 && result.children == obj.children);
+
+	// trailing data unknown to the reader is skipped
+	b.writeSized(std::make_pair(obj.id, obj.name));
+	b << (int32)-1;
+	int32 id; b.readSized(id);
+	BOOST_CHECK(id == 42);
+	int32 tail; b >> tail;
+	BOOST_CHECK(tail == -1);
+}
+
+BOOST_AUTO_TEST_CASE( ViewReadTest )
+{
+	// string views point directly into the buffer
+	Buffer b;
+	b << std::string("hello") << std::string("") << std::string("world");
+	BufferSpan<char> v = b.readView();
+	BOOST_CHECK(v.size() == 5 && v.str() == "hello");
+	BOOST_CHECK(v.end() == (const char*)b.rptr());
+	BOOST_CHECK(b.readView().empty());
+	BOOST_CHECK(b.readView().str() == "world");
+	BOOST_CHECK(b.dataSize() == 0);
+
+	// arrays written as vector are read back as spans
+	std::vector<int32> vi; for(int i=0;i<100;++i) vi.push_back(i*3);
+	b << vi;
+	BufferSpan<int32> si = b.readSpan<int32>();
+	BOOST_CHECK(si.size() == 100 && std::equal(si.begin(), si.end(), vi.begin()));
+
+	// the data wrapped around the end of circular buffer is crunched before viewing
+	CircularBuffer c(64);
+	for(int i=0;i<12;++i) c << (int32)i;
+	for(int i=0;i<12;++i) { int32 x; c >> x; }
+	c << std::string("wrapped around the end");
+	BOOST_CHECK(c.readView().str() == "wrapped around the end");
+
+	// records written by writeSized() are iterated without copying
+	Buffer r;
+	r.writeSized(std::string("first"));
+	r.writeSized((int32)7);
+	r << (uint32)100; // incomplete record
+	BufferSpan<char> record;
+	BOOST_CHECK(r.nextView(record) && record.size() == Buffer::probeSize(std::string("first")));
+	BOOST_CHECK(r.nextView(record) && record.size() == sizeof(int32) && *(const int32*)record.data() == 7);
+	BOOST_CHECK(!r.nextView(record));
+	BOOST_CHECK(r.dataSize() == sizeof(uint32));
+}
+
+BOOST_AUTO_TEST_CASE( BufferRefTest )
+{
+	// the data array of an owning buffer is taken over without copying
+	Buffer b;
+	b << (int32)1 << std::string("hello") << (int32)2;
+	b.writeSized(std::string("first"));
+	b.writeSized(std::string("second"));
+	byte* data = b.rptr();
+
+	BufferSlice packet(b);
+	BOOST_CHECK(packet.rptr() == data && packet.unique());
+	BOOST_CHECK(b.dataSize() == 0);
+	b << (int32)3; // the buffer grows again on demand
+	BOOST_CHECK(b.dataSize() == sizeof(int32));
+
+	int32 i; std::string s;
+	packet >> i >> s;
+	BOOST_CHECK(i == 1 && s == "hello");
+
+	// sub-slices share the storage and have their own cursors
+	BufferSlice header = packet.readSlice(sizeof(int32));
+	BufferSlice first = packet.readSizedSlice();
+	BufferSlice second = packet.readSizedSlice();
+	BOOST_CHECK(packet.dataSize() == 0 && packet.useCount() == 4);
+	header >> i; BOOST_CHECK(i == 2);
+	first >> s; BOOST_CHECK(s == "first");
+	second >> s; BOOST_CHECK(s == "second");
+
+	// broadcast by sharing the same payload
+	{
+		std::vector<BufferSlice> sessions(1000, first);
+		BOOST_CHECK(first.useCount() == 1004);
+		for(std::size_t n=0;n<sessions.size();++n)
+		{
+			sessions[n].rewind();
+			sessions[n] >> s;
+			BOOST_CHECK(s == "first");
+		}
+	}
+	packet.reset();
+	header.reset();
+	BOOST_CHECK(first.useCount() == 2);
+
+	// writable handle over new storage, shared as read-only handles afterwards
+	MutableBufferSlice w(64);
+	w << (int32)42 << std::string("shared");
+	BOOST_CHECK(w.freeSize() == 64 - sizeof(int32) - Buffer::probeSize(std::string("shared")));
+	BufferSlice r1(w), r2(w);
+	BOOST_CHECK(w.useCount() == 3);
+	r1 >> i; BOOST_CHECK(i == 42);
+	r2 >> i >> s; BOOST_CHECK(i == 42 && s == "shared");
+	BOOST_CHECK(r1.dataSize() == w.dataSize() - sizeof(int32));
+
+	// non-owning buffer is copied
+	byte raw[8] = { 1, 0, 0, 0, 2, 0, 0, 0 };
+	Buffer external(raw, sizeof(raw)); external.wpos(sizeof(raw));
+	BufferSlice copied(external);
+	BOOST_CHECK(copied.rptr() != raw && copied.dataSize() == sizeof(raw));
+	copied >> i; BOOST_CHECK(i == 1);
+}
+
+static void mpscProducer(MpscCircularBuffer* buffer, int32 id, int32 count)
+{
+	for(int32 i=0;i<count;++i)
+	{
+		while(!buffer->tryWrite(std::make_pair(id, i)))
+			boost::this_thread::yield();
+	}
+}
+
+static void mpscCommit(MpscBuffer* buffer, std::size_t position, std::size_t size)
+{
+	buffer->commit(position, size);
+}
+
+BOOST_AUTO_TEST_CASE( MpscBufferTest )
+{
+	// commit in order different from the reservation, the later commit waits for the earlier one
+	MpscBuffer p(16);
+	std::size_t first, second, third;
+	BOOST_CHECK(p.reserve(4, first) && p.reserve(8, second));
+	BOOST_CHECK(!p.reserve(8, third));
+	p.setDirect((int32)2, second); p.setDirect((int32)3, second + 4);
+	boost::thread committer(boost::bind(mpscCommit, &p, second, 8));
+	boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+	BOOST_CHECK(p.dataSize() == 0);
+	p.setDirect((int32)1, first);
+	p.commit(first, 4);
+	committer.join();
+	BOOST_CHECK(p.dataSize() == 12);
+	int32 a, b, c; p >> a >> b >> c;
+	BOOST_CHECK(a == 1 && b == 2 && c == 3);
+
+	// abandoned space is returned if it's the last reservation, otherwise published as a skip record
+	MpscBuffer q(32);
+	BOOST_CHECK(q.reserve(8, first) && q.reserve(8, second));
+	q.setDirect((uint32)4, second); q.setDirect((int32)5, second + 4);
+	q.abandon(first, 8);
+	q.commit(second, 8);
+	BOOST_CHECK(q.reserve(8, third));
+	q.abandon(third, 8);
+	BOOST_CHECK(q.reserve(8, first) && first == third);
+	q.setDirect((uint32)4, first); q.setDirect((int32)6, first + 4);
+	q.commit(first, 8);
+	BOOST_CHECK(q.dataSize() == 24);
+	q.readSized(a); q.readSized(b);
+	BOOST_CHECK(a == 5 && b == 6);
+	BOOST_CHECK(q.dataSize() == 0);
+
+	// an odd-sized skip record between two records is consumed by every record reader
+	for(int reader = 0; reader < 4; ++reader)
+	{
+		// the third skip record wraps around the end, in the middle of its header, which the
+		// views of readFrames() can't span without crunching
+		MpscCircularBuffer r(68);
+		std::size_t odd;
+		for(int wrap = 0; wrap < (reader == 2 ? 2 : 3); ++wrap)
+		{
+			BOOST_CHECK(r.reserve(8, first) && r.reserve(13, odd) && r.reserve(8, second));
+			r.setDirect((uint32)4, first); r.setDirect((int32)7, (first + 4) % 68);
+			r.setDirect((uint32)4, second); r.setDirect((int32)8, (second + 4) % 68);
+			r.commit(first, 8);
+			r.abandon(odd, 13);
+			r.commit(second, 8);
+			BOOST_CHECK(r.dataSize() == 29);
+
+			int32 x = 0, y = 0;
+			if(reader == 0)
+			{
+				r.readSized(x); r.readSized(y);
+			}
+			else if(reader == 1)
+			{
+				BufferSpan<char> view;
+				BOOST_CHECK(r.nextView(view) && view.size() == 4); memcpy(&x, view.data(), 4);
+				BOOST_CHECK(r.nextView(view) && view.size() == 4); memcpy(&y, view.data(), 4);
+				BOOST_CHECK(!r.nextView(view));
+			}
+			else if(reader == 2)
+			{
+				std::vector<BufferSpan<char> > frames;
+				BOOST_CHECK(r.readFrames(frames) == 2);
+				memcpy(&x, frames[0].data(), 4); memcpy(&y, frames[1].data(), 4);
+			}
+			else
+			{
+				std::vector<BufferFrame> frames;
+				BOOST_CHECK(r.readFrames(frames) == 2);
+				BOOST_CHECK(frames[0].size() == 4 && frames[1].size() == 4);
+				frames[0].copyTo((char*)&x); frames[1].copyTo((char*)&y);
+			}
+			BOOST_CHECK(x == 7 && y == 8);
+			BOOST_CHECK(r.dataSize() == 0);
+		}
+	}
+
+	// producers may be filling the space after the write pointer, so data is never moved
+	BOOST_CHECK_THROW(q.crunch(), std::logic_error);
+
+	// single-threaded writes keep the reservation in sync
+	MpscCircularBuffer s(64);
+	s << (int32)7;
+	BOOST_CHECK(s.tryWrite(std::string("after")));
+	std::string str; s >> a >> str;
+	BOOST_CHECK(a == 7 && str == "after");
+
+	// concurrent producers, each record is seen as a whole and in per-producer order
+	const int32 producers = 4;
+	const int32 count = 20000;
+	MpscCircularBuffer buffer(1024);
+	boost::thread_group group;
+	for(int32 id=0;id<producers;++id)
+		group.create_thread(boost::bind(mpscProducer, &buffer, id, count));
+
+	std::vector<int32> expected(producers, 0);
+	int32 received = 0;
+	bool ordered = true;
+	while(received < producers * count)
+	{
+		if(buffer.dataSize() == 0)
+		{
+			boost::this_thread::yield();
+			continue;
+		}
+		std::pair<int32,int32> record; buffer >> record;
+		if(record.first < 0 || record.first >= producers || record.second != expected[record.first]++)
+			ordered = false;
+		++received;
+	}
+	group.join_all();
+	BOOST_CHECK(ordered);
+	BOOST_CHECK(buffer.dataSize() == 0);
+}
+
+static void allocateRepeatedly(BufferAllocator* allocator, int count)
+{
+	for(int i=0;i<count;++i)
+		allocator->deallocate(allocator->allocate(64 + i % 1024), 64 + i % 1024);
+}
+
+BOOST_AUTO_TEST_CASE( BufferAllocatorTest )
+{
+	// size classes, four per power of two
+	BOOST_CHECK(SizeClassBufferAllocator::getClassSize(1) == 64);
+	BOOST_CHECK(SizeClassBufferAllocator::getClassSize(65) == 80);
+	BOOST_CHECK(SizeClassBufferAllocator::getClassSize(4096) == 4096);
+	BOOST_CHECK(SizeClassBufferAllocator::getClassSize(4097) == 5120);
+	for(std::size_t size = 1; size < 100000; size += 7)
+	{
+		std::size_t index = SizeClassBufferAllocator::getClassIndex(size);
+		BOOST_CHECK(SizeClassBufferAllocator::getClassSizeByIndex(index) >= size);
+		BOOST_CHECK(index == 0 || SizeClassBufferAllocator::getClassSizeByIndex(index - 1) < size);
+	}
+
+	// data arrays of short-lived buffers are recycled
+	SizeClassBufferAllocator allocator;
+	byte* data = NULL;
+	{
+		Buffer b(4096, &allocator);
+		BOOST_CHECK(b.getAllocator() == &allocator);
+		data = b.wptr();
+	}
+	{
+		Buffer b(4000, &allocator);
+		BOOST_CHECK(b.wptr() == data);
+		b << std::string("recycled");
+	}
+	SizeClassBufferAllocator::Stat stat = allocator.getStat();
+	BOOST_CHECK(stat.hits == 1 && stat.misses == 1 && stat.cached == 4096);
+
+	// growing on demand, copying and sharing go through the same allocator
+	{
+		Buffer b;
+		b.setAllocator(&allocator);
+		for(int i=0;i<10000;++i) b << i;
+		Buffer copy(b);
+		BOOST_CHECK(copy.getAllocator() == &allocator);
+		BufferSlice slice(b);
+		int x; copy >> x; slice >> x;
+		BOOST_CHECK(x == 0);
+
+		CircularBuffer c(100, &allocator);
+		for(int i=0;i<100;++i) { c << i; int y; c >> y; }
+	}
+	stat = allocator.getStat();
+	BOOST_CHECK(stat.cached > 4096);
+	allocator.purge();
+	BOOST_CHECK(allocator.getStat().cached == 0);
+
+	// the default allocator is used by buffers created afterwards
+	BufferAllocator::setDefault(&allocator);
+	{
+		Buffer b(128);
+		BOOST_CHECK(b.getAllocator() == &allocator);
+	}
+	BufferAllocator::setDefault(NULL);
+	BOOST_CHECK(Buffer(128).getAllocator() != &allocator);
+
+	// every allocation from concurrent threads is counted as either a hit or a miss
+	SizeClassBufferAllocator shared;
+	boost::thread_group group;
+	for(int t=0;t<4;++t)
+		group.create_thread(boost::bind(allocateRepeatedly, &shared, 10000));
+	group.join_all();
+	stat = shared.getStat();
+	BOOST_CHECK(stat.hits + stat.misses == 4 * 10000);
+}
+
+BOOST_AUTO_TEST_CASE( ByteOrderTest )
+{
+	// bulk conversion agrees with the scalar conversion for all sizes and tails
+	std::vector<uint64> source(131), swapped(131);
+	for(std::size_t i=0;i<source.size();++i) source[i] = 0x0102030405060708ULL * (i + 1);
+	for(std::size_t count=0;count<=source.size();count+=13)
+	{
+		byte_swap_array(&swapped[0], &source[0], count, sizeof(uint64));
+		for(std::size_t i=0;i<count;++i) BOOST_CHECK(swapped[i] == byte_swap(source[i]));
+
+		const uint32* s32 = (const uint32*)&source[0]; uint32* d32 = (uint32*)&swapped[0];
+		byte_swap_array(d32, s32, count * 2, sizeof(uint32));
+		for(std::size_t i=0;i<count*2;++i) BOOST_CHECK(d32[i] == byte_swap(s32[i]));
+
+		const uint16* s16 = (const uint16*)&source[0]; uint16* d16 = (uint16*)&swapped[0];
+		byte_swap_array(d16, s16, count * 4, sizeof(uint16));
+		for(std::size_t i=0;i<count*4;++i) BOOST_CHECK(d16[i] == byte_swap(s16[i]));
+	}
+	swapped = source;
+	byte_swap_array(&swapped[0], &swapped[0], swapped.size(), sizeof(uint64)); // in place
+	BOOST_CHECK(swapped[100] == byte_swap(source[100]));
+
+	// scalars and length prefixes are written in network byte order
+	Buffer b;
+	b.setByteOrder(BufferByteOrder::network);
+	b << (uint32)0x01020304 << std::string("ab") << 1.5f;
+	const byte expected[] = { 1, 2, 3, 4, 0, 0, 0, 2, 'a', 'b' };
+	BOOST_CHECK(::memcmp(b.rptr(), expected, sizeof(expected)) == 0);
+	uint32 u; std::string str; float f;
+	b >> u >> str >> f;
+	BOOST_CHECK(u == 0x01020304 && str == "ab" && f == 1.5f);
+
+	// bulk arrays are converted, and can be read back by a host-order reader after manual swapping
+	std::vector<int32> vi; for(int i=0;i<1000;++i) vi.push_back(i * 7919 - 300000);
+	std::vector<double> vd; for(int i=0;i<100;++i) vd.push_back(i * 0.25);
+	boost::array<uint16, 9> au; for(int i=0;i<9;++i) au[i] = (uint16)(i * 1000 + 1);
+	b << vi << vd << au;
+
+	Buffer raw(b.rptr(), b.dataSize()); raw.wpos(b.dataSize());
+	uint32 length; raw >> length;
+	BOOST_CHECK(byte_swap(length) == vi.size());
+	int32 first; raw >> first;
+	BOOST_CHECK(byte_swap(first) == vi[0]);
+
+	std::vector<int32> ri; std::vector<double> rd; boost::array<uint16, 9> ru;
+	b >> ri >> rd >> ru;
+	BOOST_CHECK(ri == vi && rd == vd && ru == au);
+
+	// conversion across the wrap-around of circular buffer, where elements may straddle the end
+	CircularBuffer c(4096);
+	c.setByteOrder(BufferByteOrder::big);
+	std::vector<uint64> vl(source.begin(), source.begin() + 100);
+	for(int round=0;round<20;++round)
+	{
+		c << (uint8)round << vl;
+		uint8 r; std::vector<uint64> rl;
+		c >> r >> rl;
+		BOOST_CHECK(r == round && rl == vl);
+	}
+
+	// wide characters are converted element by element
+	Buffer w;
+	w.setByteOrder(BufferByteOrder::big);
+	std::wstring ws(L"wide");
+	w << ws;
+	BOOST_CHECK(w.rptr()[4 + sizeof(wchar_t) - 1] == 'w' && w.rptr()[4] == 0);
+	std::wstring rws; w >> rws;
+	BOOST_CHECK(rws == ws);
+
+	// the raw layout of bulk-serializable types can't be converted, so they're rejected
+	BulkPositionUpdate update = { 1, 1.0f, 2.0f, 3.0f };
+	std::vector<BulkPositionUpdate> updates(3, update);
+	BOOST_CHECK_THROW(w << update, std::logic_error);
+	BOOST_CHECK_THROW(w << updates, std::logic_error);
+	w.setByteOrder(BufferByteOrder::host);
+	w << update << updates;
+	w.setByteOrder(BufferByteOrder::big);
+	BOOST_CHECK_THROW(w >> update, std::logic_error);
+
+	// sized records use the same byte order for the prefix
+	Buffer s;
+	s.setByteOrder(BufferByteOrder::big);
+	s.writeSized((int32)5);
+	BOOST_CHECK(s.rptr()[3] == 4);
+	BufferSpan<char> record;
+	BOOST_CHECK(s.nextView(record) && record.size() == 4);
+}
+
+BOOST_AUTO_TEST_CASE( ChecksumTest )
+{
+	// CRC32C check value, and hardware and software implementations agree
+	BOOST_CHECK(crc32c("123456789", 9) == 0xE3069283);
+	std::vector<byte> data(1000);
+	for(std::size_t i=0;i<data.size();++i) data[i] = (byte)(i * 131 + 7);
+	for(std::size_t size=0;size<data.size();size+=37)
+	{
+		uint32 incremental = crc32c_update(CRC32C_INIT, &data[0], size / 3);
+		incremental = crc32c_update(incremental, &data[size / 3], size - size / 3);
+		BOOST_CHECK(crc32c_final(incremental) == crc32c_final(detail::crc32c_update_software(CRC32C_INIT, &data[0], size)));
+
+		// copying and checksumming in a single pass
+		std::vector<byte> copy(size + 1, 0);
+		BOOST_CHECK(crc32c_final(crc32c_copy(CRC32C_INIT, &copy[0], &data[0], size)) == crc32c(&data[0], size));
+		BOOST_CHECK(crc32c_final(detail::crc32c_copy_software(CRC32C_INIT, &copy[0], &data[0], size)) == crc32c(&data[0], size));
+		BOOST_CHECK(size == 0 || ::memcmp(&copy[0], &data[0], size) == 0);
+	}
+
+	// the trailer is computed while writing, and verified while reading
+	Buffer b;
+	std::vector<std::string> names; names.push_back("alpha"); names.push_back("beta");
+	b.writeChecked(std::make_pair((int32)42, names));
+	BOOST_CHECK(b.dataSize() == Buffer::probeSize(std::make_pair((int32)42, names)) + sizeof(uint32));
+	uint32 trailer; b.getDirect(trailer, b.wpos() - sizeof(uint32));
+	BOOST_CHECK(trailer == crc32c(b.rptr(), b.dataSize() - sizeof(uint32)));
+
+	std::pair<int32, std::vector<std::string> > result;
+	BOOST_CHECK(b.readChecked(result));
+	BOOST_CHECK(result.first == 42 && result.second == names);
+
+	// corrupted data is detected
+	b.writeChecked(std::string("payload"));
+	b.rptr()[5] ^= 0x10;
+	std::string str;
+	BOOST_CHECK(!b.readChecked(str));
+	BOOST_CHECK(b.dataSize() == 0);
+
+	// frames wrapping around the end of circular buffer
+	CircularBuffer c(256);
+	for(int round=0;round<50;++round)
+	{
+		std::vector<int32> v(round % 7 + 3, round);
+		v[0] = round * 7919;
+		c.writeChecked(v);
+		std::vector<int32> r;
+		BOOST_CHECK(c.readChecked(r) && r == v);
+	}
+}
+
+static void drainCircularBuffer(CircularBuffer& from, Buffer& to)
+{
+	std::pair<byte*,std::size_t> ranges[2];
+	int n = from.getDataRanges(ranges);
+	for(int i=0;i<n;++i)
+		to.writeArray((const char*)ranges[i].first, ranges[i].second);
+	from.clear();
+}
+
+BOOST_AUTO_TEST_CASE( CompressorTest )
+{
+	Buffer source;
+	for(int32 i=0;i<20000;++i) source << (int32)(i % 100) << std::string("state");
+	std::string expected((const char*)source.rptr(), source.dataSize());
+
+	for(int level=0;level<=Z_BEST_COMPRESSION;level+=Z_BEST_COMPRESSION)
+	{
+		// compress piece by piece and decompress in one go
+		BufferCompressor compressor(level);
+		Buffer compressed;
+		Buffer piece;
+		for(std::size_t offset=0;offset<expected.size();offset+=10000)
+		{
+			piece.clear();
+			piece.writeArray(expected.data() + offset, std::min<std::size_t>(10000, expected.size() - offset));
+			BOOST_CHECK(compressor.compress(piece, compressed));
+			BOOST_CHECK(piece.dataSize() == 0);
+		}
+		BOOST_CHECK(compressor.compress(piece, compressed, BufferCompressionFlush::finish));
+		BOOST_CHECK(compressor.finished());
+		BOOST_CHECK(compressor.totalIn() == expected.size());
+		if(level > 0)
+			BOOST_CHECK(compressed.dataSize() < expected.size() / 10);
+
+		BufferDecompressor decompressor;
+		Buffer restored;
+		BOOST_CHECK(decompressor.decompress(compressed, restored));
+		BOOST_CHECK(decompressor.finished());
+		BOOST_CHECK(std::string((const char*)restored.rptr(), restored.dataSize()) == expected);
+	}
+
+	// fast mode through fixed-size circular buffers, with sync flush per message
+	BufferCompressor compressor(BufferCompressionMode::fast);
+	BOOST_CHECK(compressor.level() == Z_BEST_SPEED);
+	BufferDecompressor decompressor;
+	CircularBuffer in(1000), link(300), out(2000);
+	int stalls = 0;
+	uint32 seed = 1;
+	for(int32 round=0;round<50;++round)
+	{
+		std::vector<int32> message(round * 3 + 10);
+		for(std::size_t i=0;i<message.size();++i) message[i] = (int32)(seed = seed * 1664525u + 1013904223u);
+		in << message;
+		Buffer restored;
+		while(!compressor.compress(in, link, BufferCompressionFlush::sync))
+		{
+			++stalls;
+			BOOST_CHECK(decompressor.decompress(link, out));
+			drainCircularBuffer(out, restored);
+		}
+		BOOST_CHECK(decompressor.decompress(link, out));
+		drainCircularBuffer(out, restored);
+		std::vector<int32> result;
+		restored >> result;
+		BOOST_CHECK(result == message);
+	}
+	BOOST_CHECK(stalls > 0);
+
+	// corrupted stream is rejected
+	Buffer garbage, sink;
+	garbage << std::string("definitely not a deflate stream");
+	BufferDecompressor rejecting;
+	BOOST_CHECK_THROW(rejecting.decompress(garbage, sink), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE( FrameTest )
+{
+	// frames built by several writes, extracted in one batch; the incomplete tail is kept
+	Buffer b;
+	for(int32 i=0;i<5;++i)
+	{
+		std::size_t frame = b.beginFrame();
+		b << i << std::string("frame");
+		BOOST_CHECK(b.endFrame(frame) == Buffer::probeSize(i) + Buffer::probeSize(std::string("frame")));
+	}
+	b.writeFrame("raw", 3);
+	b.writeFixed((uint32)100); b.writeArray("partial", 7);
+
+	std::vector< BufferSpan<char> > views;
+	BOOST_CHECK(b.readFrames(views) == 6);
+	BOOST_CHECK(views.size() == 6 && views[5].str() == "raw");
+	Buffer frame_reader;
+	frame_reader.writeArray(views[3].data(), views[3].size());
+	int32 index; std::string name;
+	frame_reader >> index >> name;
+	BOOST_CHECK(index == 3 && name == "frame");
+	BOOST_CHECK(b.dataSize() == sizeof(uint32) + 7);
+	BOOST_CHECK(b.readFrames(views) == 0);
+
+	// frames wrapping around the end of circular buffer, as ranges and as views
+	CircularBuffer c(200);
+	std::string expected;
+	int next = 0;
+	for(int round=0;round<40;++round)
+	{
+		for(int i=0;i<round % 4 + 1;++i)
+		{
+			std::string payload(next % 30, (char)('a' + next % 26));
+			c.writeFrame(payload.data(), payload.size());
+			++next;
+		}
+
+		std::string extracted;
+		if(round % 2 == 0)
+		{
+			std::vector<BufferFrame> frames;
+			BOOST_CHECK(c.readFrames(frames, 2) == std::min(2, round % 4 + 1));
+			for(std::size_t i=0;i<frames.size();++i)
+			{
+				std::vector<char> copy(frames[i].size());
+				if(!copy.empty()) frames[i].copyTo(&copy[0]);
+				extracted.append(copy.begin(), copy.end());
+			}
+		}
+		BufferSpan<char> view;
+		while(c.nextView(view))
+			extracted += view.str();
+
+		std::string e;
+		for(int k=next - (round % 4 + 1);k<next;++k) e += std::string(k % 30, (char)('a' + k % 26));
+		BOOST_CHECK(extracted == e);
+		BOOST_CHECK(c.dataSize() == 0);
+	}
+
+	CircularBuffer v(100);
+	for(int round=0;round<20;++round)
+	{
+		v.writeFrame("0123456789abcdefghij", 20);
+		v.writeFrame("klmnopqrstuvwxyz", 16);
+		std::vector< BufferSpan<char> > spans;
+		BOOST_CHECK(v.readFrames(spans) == 2);
+		BOOST_CHECK(spans[0].str() == "0123456789abcdefghij" && spans[1].str() == "klmnopqrstuvwxyz");
+	}
+}
+
+BOOST_AUTO_TEST_CASE( MappedBufferTest )
+{
+	char path[] = "/tmp/zillians-buffer-test-XXXXXX";
+	int fd = mkstemp(path);
+	BOOST_REQUIRE(fd >= 0);
+	close(fd);
+
+	// write a snapshot through a read-write mapping
+	std::vector<int32> entities(60000);
+	for(std::size_t i=0;i<entities.size();++i) entities[i] = (int32)i * 3;
+	{
+		Buffer snapshot(BufferMapping::read_write, path, 1 << 20);
+		BOOST_CHECK(snapshot.isMapped() && snapshot.isMutable());
+		BOOST_CHECK(snapshot.dataSize() == 0 && snapshot.allocatedSize() == (1 << 20));
+		snapshot << std::string("world") << entities;
+		BOOST_CHECK(snapshot.sync());
+	}
+
+	// and load it lazily through a read-only mapping
+	{
+		Buffer snapshot(BufferMapping::read_only, path);
+		BOOST_CHECK(snapshot.isMapped() && !snapshot.isMutable());
+		BOOST_CHECK(snapshot.dataSize() == (1 << 20));
+		BOOST_CHECK(snapshot.advise(BufferAdvice::sequential));
+		BOOST_CHECK(snapshot.advise(BufferAdvice::willneed, 100, 5000));
+
+		std::string name; std::vector<int32> loaded;
+		snapshot >> name >> loaded;
+		BOOST_CHECK(name == "world" && loaded == entities);
+
+		// a copy aliases the mapping without owning it
+		Buffer copy(snapshot);
+		BOOST_CHECK(!copy.isMapped() && copy.rptr() == snapshot.rptr());
+	}
+
+	// reopening for write appends after the existing content
+	{
+		Buffer snapshot(BufferMapping::read_write, path);
+		BOOST_CHECK(snapshot.dataSize() == (1 << 20) && snapshot.freeSize() == 0);
+	}
+
+	// an empty file results in an empty buffer, which can still be advised
+	BOOST_REQUIRE(truncate(path, 0) == 0);
+	{
+		Buffer snapshot(BufferMapping::read_only, path);
+		BOOST_CHECK(snapshot.dataSize() == 0 && !snapshot.isMapped());
+		BOOST_CHECK(snapshot.advise(BufferAdvice::sequential));
+	}
+
+	unlink(path);
+	BOOST_CHECK_THROW(Buffer(BufferMapping::read_only, path), boost::system::system_error);
+}
+
+static void threadLocalBufferWorker(ThreadLocalBufferWrapper* wrapper, ThreadLocalBufferWrapper::Stat* stat)
+{
+	for(int i=0;i<1000;++i)
+	{
+		ThreadLocalBufferWrapper::ScopedBuffer a(*wrapper, 100);
+		ThreadLocalBufferWrapper::ScopedBuffer b(*wrapper, 3000);
+		*a << i; *b << std::string(2000, 'x');
+	}
+	*stat = wrapper->getStat();
+}
+
+BOOST_AUTO_TEST_CASE( ThreadLocalBufferCacheTest )
+{
+	ThreadLocalBufferWrapper wrapper;
+
+	// buffers are recycled within their size class
+	Buffer* a = wrapper.checkout(1000);
+	BOOST_CHECK(a->allocatedSize() >= 1000 && a->dataSize() == 0);
+	a->setContext(BufferContext(new int32(1)));
+	a->beginWriteChecksum();
+	*a << std::string("scratch");
+	a->setEncoding(BufferEncoding::compact);
+	wrapper.checkin(a);
+
+	Buffer* b = wrapper.checkout(600);
+	BOOST_CHECK(b == a && b->dataSize() == 0 && b->encoding() == BufferEncoding::fixed && !b->getContext());
+	Buffer* c = wrapper.checkout(600);
+	BOOST_CHECK(c != b);
+	ThreadLocalBufferWrapper::Stat stat = wrapper.getStat();
+	BOOST_CHECK(stat.checkouts == 3 && stat.hits == 1 && stat.misses == 2 && stat.cached_buffers == 0);
+
+	// a buffer grown beyond the cached size is trimmed on return
+	wrapper.setCacheLimits(64 * 1024, 1024 * 1024);
+	for(int i=0;i<20000;++i) *b << i;
+	wrapper.checkin(b);
+	wrapper.checkin(c);
+	stat = wrapper.getStat();
+	BOOST_CHECK(stat.checkins == 3 && stat.trimmed == 1 && stat.cached_buffers == 1 && stat.cached_bytes == c->allocatedSize());
+
+	wrapper.trim();
+	BOOST_CHECK(wrapper.getStat().cached_buffers == 0 && wrapper.getStat().cached_bytes == 0);
+
+	// every thread has its own cache
+	ThreadLocalBufferWrapper::Stat stats[4];
+	boost::thread_group threads;
+	for(int i=0;i<4;++i)
+		threads.create_thread(boost::bind(threadLocalBufferWorker, &wrapper, &stats[i]));
+	threads.join_all();
+	for(int i=0;i<4;++i)
+	{
+		BOOST_CHECK(stats[i].checkouts == 2000 && stats[i].misses == 2 && stats[i].hits == 1998);
+		BOOST_CHECK(stats[i].cached_buffers == 2);
+	}
+	BOOST_CHECK(wrapper.getStat().checkouts == 3);
+}
+
+BOOST_AUTO_TEST_CASE( ExtendedContainerTest )
+{
+	for(int encoding=0;encoding<2;++encoding)
+	{
+		Buffer b;
+		b.setEncoding(encoding == 0 ? BufferEncoding::fixed : BufferEncoding::compact);
+
+		// deque spans several internal blocks, so the bulk path copies more than one run
+		std::deque<int32> d;
+		for(int32 i=0;i<5000;++i) { if(i % 2) d.push_back(i); else d.push_front(-i); }
+		std::deque<std::string> ds; ds.push_back("a"); ds.push_back("bc");
+		std::set<uint64> s; for(uint64 i=0;i<300;++i) s.insert(i * 1000003);
+		std::set<std::string> ss; ss.insert("x"); ss.insert("yz");
+		boost::tuple<int32, std::string, double> bt(7, "seven", 7.5);
+		boost::optional<std::string> present(std::string("here")), absent;
+		std::vector< boost::optional<int32> > vo(3); vo[1] = 5;
+
+		std::size_t expected = Buffer::probeSize(d, b.encoding()) + Buffer::probeSize(ds, b.encoding()) + Buffer::probeSize(s, b.encoding()) +
+				Buffer::probeSize(ss, b.encoding()) + Buffer::probeSize(bt, b.encoding()) + Buffer::probeSize(present, b.encoding()) +
+				Buffer::probeSize(absent, b.encoding()) + Buffer::probeSize(vo, b.encoding());
+		b << d << ds << s << ss << bt << present << absent << vo;
+		BOOST_CHECK(b.dataSize() == expected);
+
+		// the runs of the deque blocks add up to the same layout as a vector
+		Buffer v;
+		v.setEncoding(b.encoding());
+		v << std::vector<int32>(d.begin(), d.end());
+		BOOST_CHECK(::memcmp(v.rptr(), b.rptr(), v.dataSize()) == 0);
+
+		std::deque<int32> d2; std::deque<std::string> ds2; std::set<uint64> s2; std::set<std::string> ss2;
+		boost::tuple<int32, std::string, double> bt2;
+		boost::optional<std::string> present2, absent2(std::string("stale"));
+		std::vector< boost::optional<int32> > vo2;
+		b >> d2 >> ds2 >> s2 >> ss2 >> bt2 >> present2 >> absent2 >> vo2;
+		BOOST_CHECK(d2 == d && ds2 == ds && s2 == s && ss2 == ss);
+		BOOST_CHECK(bt2.get<0>() == 7 && bt2.get<1>() == "seven" && bt2.get<2>() == 7.5);
+		BOOST_CHECK(present2 && *present2 == "here" && !absent2);
+		BOOST_CHECK(vo2 == vo);
+		BOOST_CHECK(b.dataSize() == 0);
+
+#ifdef __GXX_EXPERIMENTAL_CXX0X__
+		std::unordered_map<std::string, int32> um; for(int32 i=0;i<100;++i) um[std::to_string(i)] = i;
+		std::unordered_map<int32, int64> pm; for(int32 i=0;i<100;++i) pm[i * 7] = -i;
+		std::unordered_set<int32> us; for(int32 i=0;i<100;++i) us.insert(i * 3);
+		std::tuple<int32, std::string, std::vector<int16> > st(1, "one", std::vector<int16>(3, 1));
+		expected = Buffer::probeSize(um, b.encoding()) + Buffer::probeSize(pm, b.encoding()) + Buffer::probeSize(us, b.encoding()) + Buffer::probeSize(st, b.encoding());
+		b << um << pm << us << st;
+		BOOST_CHECK(b.dataSize() == expected);
+
+		std::unordered_map<std::string, int32> um2; std::unordered_map<int32, int64> pm2; std::unordered_set<int32> us2;
+		std::tuple<int32, std::string, std::vector<int16> > st2;
+		b >> um2 >> pm2 >> us2 >> st2;
+		BOOST_CHECK(um2 == um && pm2 == pm && us2 == us && st2 == st);
+		BOOST_CHECK(b.dataSize() == 0);
+#endif
+	}
+}
+
+BOOST_AUTO_TEST_CASE( HugePageTest )
+{
+	// regions are aligned to the huge page size, and never fail because of missing huge pages
+	for(int policy = HugePagePolicy::none; policy <= HugePagePolicy::hugetlb; ++policy)
+	{
+		HugePageRegion region(3*1024*1024, (HugePagePolicy::type)policy, true);
+		BOOST_CHECK(region.data() != NULL);
+		BOOST_CHECK_EQUAL((uintptr_t)region.data() % HugePage::size(), 0);
+		BOOST_CHECK(region.getHugePageBytes() <= HugePage::mappedSize(region.size()));
+		if(policy == HugePagePolicy::none)
+		{
+			BOOST_CHECK_EQUAL(region.backing(), HugePageBacking::normal);
+		}
+
+		memset(region.data(), 0x5a, region.size());
+		BOOST_CHECK_EQUAL(region.data()[region.size() - 1], 0x5a);
+	}
+
+	// adjacent regions may be merged into one mapping, whose huge pages are not counted twice
+	{
+		HugePageRegion first(4*1024*1024, HugePagePolicy::transparent, true);
+		HugePageRegion second(4*1024*1024, HugePagePolicy::transparent, true);
+		BOOST_CHECK(first.getHugePageBytes() <= first.size());
+		BOOST_CHECK(second.getHugePageBytes() <= second.size());
+		BOOST_CHECK(HugePage::getHugePageBytes(first.data() + HugePage::size(), HugePage::size()) <= HugePage::size());
+	}
+
+	// large buffers are mapped, small ones go to malloc()
+	HugePageBufferAllocator allocator(HugePagePolicy::transparent);
+	{
+		CircularBuffer ring(4*1024*1024, &allocator);
+		Buffer small(128, &allocator);
+
+		for(int round = 0; round < 3; ++round)
+		{
+			for(int32 i = 0; i < 500000; ++i)
+				ring << i;
+			int32 value;
+			for(int32 i = 0; i < 500000; ++i)
+			{
+				ring >> value;
+				BOOST_CHECK_EQUAL(value, i);
+			}
+		}
+	}
+
+	HugePageBufferAllocator::Stat stat = allocator.getStat();
+	BOOST_CHECK_EQUAL(stat.small, 1);
+	BOOST_CHECK_EQUAL(stat.hugetlb + stat.transparent + stat.normal, 1);
+	BOOST_CHECK_EQUAL(stat.hugetlb, 0);
+
+	// allocations from concurrent threads are all counted
+	boost::thread_group group;
+	for(int t=0;t<4;++t)
+		group.create_thread(boost::bind(allocateRepeatedly, &allocator, 1000));
+	group.join_all();
+	BOOST_CHECK_EQUAL(allocator.getStat().small, 1 + 4 * 1000);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
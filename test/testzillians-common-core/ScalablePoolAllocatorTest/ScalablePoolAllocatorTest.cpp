@@ -18,109 +18,436 @@
  *
  */
 /**
- * @file ScalablePoolAllocator.cpp
- * @todo Put file description here.
+ * @file ScalablePoolAllocatorTest.cpp
+ * Integrity test of ScalablePoolAllocator, checking the contents of the allocated memory and
+ * the allocator statistics.
  *
  * @date Mar 1, 2009 nothing - Initial version created.
  */
 
-/**
- * Arguments
- * @li -perf	Performance test
- * @li -intg	Integrity test
- */
-
-#include <iostream>
-#include <cstring>
+#include "core/Prerequisite.h"
 #include "core/ScalablePoolAllocator.h"
-#include <log4cxx/logger.h>
-#include <log4cxx/basicconfigurator.h>
+#include <vector>
+#include <cstring>
+#include <boost/scoped_array.hpp>
+#include <boost/bind.hpp>
+
+#define BOOST_TEST_MODULE ScalablePoolAllocatorTest
+#define BOOST_TEST_MAIN
+#include <boost/test/unit_test.hpp>
+
+using namespace zillians;
 
-using namespace std;
+#define POOL_SIZE	(64*1024*1024)
 
-enum TestMode
+// The pool must not rely on zero-filled memory
+static byte* garbage(byte* p, size_t sz)
 {
-	Unknown = 0,
-	Performance = 1,
-	Integrity
+	memset(p, 0xa5, sz);
+	return p;
+}
+
+struct PoolFixture
+{
+	PoolFixture() : memory(new byte[POOL_SIZE]), pool(garbage(memory.get(), POOL_SIZE), POOL_SIZE)
+	{ }
+
+	boost::scoped_array<byte> memory;	// destroyed after the pool
+	ScalablePoolAllocator pool;
 };
 
-TestMode testMode = Unknown;
-log4cxx::LoggerPtr logg(log4cxx::Logger::getLogger("zillians.common.core.ScalablePoolAllocatorTest"));
+static void fill(byte* p, size_t sz, size_t seed)
+{
+	for(size_t i = 0; i < sz; ++i)
+		p[i] = static_cast<byte>(seed + i);
+}
 
-int testPerformance();
-int testIntegrity();
+static bool verify(byte* p, size_t sz, size_t seed)
+{
+	for(size_t i = 0; i < sz; ++i)
+		if(p[i] != static_cast<byte>(seed + i))
+			return false;
+	return true;
+}
+
+static void freeEvery(ScalablePoolAllocator* pool, std::vector<byte*>* chunks, size_t first, size_t step, boost::barrier* start)
+{
+	start->wait();
+	for(size_t i = first; i < chunks->size(); i += step)
+		pool->deallocate((*chunks)[i]);
+}
 
-int main(int argc, char** argv)
+static void freeRange(ScalablePoolAllocator* pool, std::vector<byte*>* chunks, size_t begin, size_t end, boost::barrier* start)
 {
-	log4cxx::BasicConfigurator::configure();
+	start->wait();
+	for(size_t i = begin; i < end; ++i)
+		pool->deallocate((*chunks)[i]);
+}
 
-	// Parse argv
-	for(int i = 1; i < argc; ++i)
+static void allocateAndFree(ScalablePoolAllocator* pool, size_t smallCount, size_t largeCount, bool* ok)
+{
+	std::vector<byte*> chunks;
+	std::vector<size_t> sizes;
+	for(size_t i = 0; i < smallCount + largeCount; ++i)
 	{
-		if(strcmp(argv[i], "-perf") == 0)
-		{
-			testMode = Performance;
-		}
-		else if(strcmp(argv[i], "-intg") == 0)
+		size_t sz = (i < smallCount) ? 16 + (i % 32) * 64 : 100000 + (i % 5) * 300000;
+		byte* p = pool->allocate(sz);
+		if(!p)
 		{
-			testMode = Integrity;
+			*ok = false;
+			break;
 		}
+		fill(p, sz, i);
+		chunks.push_back(p);
+		sizes.push_back(sz);
+	}
+	for(size_t i = 0; i < chunks.size(); ++i)
+	{
+		if(!verify(chunks[i], sizes[i], i))
+			*ok = false;
+		pool->deallocate(chunks[i]);
+	}
+}
+
+BOOST_FIXTURE_TEST_SUITE( ScalablePoolAllocatorTest, PoolFixture )
+
+BOOST_AUTO_TEST_CASE( LargeChunkCoalescingTest )
+{
+	// Large chunks are carved downward, so a, b, c are adjacent and the sentinel keeps them off mBumpPtr
+	const size_t sz = 20000;
+	byte* a = pool.allocate(sz);
+	byte* b = pool.allocate(sz);
+	byte* c = pool.allocate(sz);
+	byte* sentinel = pool.allocate(sz);
+	BOOST_REQUIRE(a && b && c && sentinel);
+	BOOST_CHECK(c < b && b < a);
+	fill(b, sz, 1);
+	fill(sentinel, sz, 2);
+
+	// Neither neighbour of a or c is free
+	pool.deallocate(a);
+	pool.deallocate(c);
+	BOOST_CHECK_EQUAL(pool.getAllocatorStat().LargeChunkInFreeList, 2U);
+	BOOST_CHECK(verify(b, sz, 1));
+
+	// b merges both of them by the boundary tags, into a single chunk starting at c
+	pool.deallocate(b);
+	BOOST_CHECK_EQUAL(pool.getAllocatorStat().LargeChunkInFreeList, 1U);
+	byte* merged = pool.allocate(3 * sz);
+	BOOST_CHECK_EQUAL(merged, c);
+	fill(merged, 3 * sz, 3);
+	BOOST_CHECK(verify(sentinel, sz, 2));
+	pool.deallocate(merged);
+
+	// The lowest chunk goes back to mBumpPtr together with the free chunks above it
+	pool.deallocate(sentinel);
+	BOOST_CHECK_EQUAL(pool.getAllocatorStat().LargeChunkInFreeList, 0U);
+	byte* big = pool.allocate(POOL_SIZE - 8*1024*1024);
+	BOOST_CHECK(big);
+	pool.deallocate(big);
+}
+
+BOOST_AUTO_TEST_CASE( LargeChunkSizeClassTest )
+{
+	// Free chunks of many size classes are reused for smaller requests, splitting off the rest
+	std::vector<byte*> chunks;
+	std::vector<size_t> sizes;
+	for(size_t sz = 8193; sz < 4*1024*1024; sz = sz * 3 / 2)
+	{
+		byte* p = pool.allocate(sz);
+		BOOST_REQUIRE(p);
+		fill(p, sz, sz);
+		chunks.push_back(p);
+		sizes.push_back(sz);
+	}
+	for(size_t i = 0; i < chunks.size(); i += 2)
+		pool.deallocate(chunks[i]);
+	for(size_t i = 0; i < chunks.size(); i += 2)
+	{
+		chunks[i] = pool.allocate(sizes[i] / 2);
+		BOOST_REQUIRE(chunks[i]);
+		fill(chunks[i], sizes[i] / 2, i);
 	}
+	for(size_t i = 0; i < chunks.size(); ++i)
+		BOOST_CHECK(verify(chunks[i], (i % 2) ? sizes[i] : sizes[i] / 2, (i % 2) ? sizes[i] : i));
+	for(size_t i = 0; i < chunks.size(); ++i)
+		pool.deallocate(chunks[i]);
 
-	// No test mode selected, error
-	if(testMode == Unknown)
+	BOOST_CHECK_EQUAL(pool.getAllocatorStat().LargeChunkInFreeList, 0U);
+	BOOST_CHECK_EQUAL(pool.getAllocatorStat().TotalLargeAllocations, pool.getAllocatorStat().TotalLargeDeallocations);
+}
+
+BOOST_AUTO_TEST_CASE( ConcurrentLargeChunkCoalescingTest )
+{
+	// Two threads free interleaved neighbours at the same time, which must still end up as one free chunk
+	for(int round = 0; round < 20; ++round)
 	{
-		LOG4CXX_ERROR(logg, "No test selected. Use -perf for performance test, -intg for integrity test.");
-		return -1;
+		std::vector<byte*> chunks;
+		for(int i = 0; i < 256; ++i)
+			chunks.push_back(pool.allocate(10000 + (i % 7) * 1000));
+		byte* sentinel = pool.allocate(10000);
+		BOOST_REQUIRE(sentinel);
+
+		boost::barrier start(2);
+		boost::thread t0(boost::bind(freeEvery, &pool, &chunks, 0, 2, &start));
+		boost::thread t1(boost::bind(freeEvery, &pool, &chunks, 1, 2, &start));
+		t0.join();
+		t1.join();
+		BOOST_CHECK_EQUAL(pool.getAllocatorStat().LargeChunkInFreeList, 1U);
+
+		pool.deallocate(sentinel);
+		BOOST_CHECK_EQUAL(pool.getAllocatorStat().LargeChunkInFreeList, 0U);
 	}
+}
 
-	int ret = 0;
-	if(testMode == Performance)
+BOOST_AUTO_TEST_CASE( CrossThreadDeallocationTest )
+{
+	// Chunks allocated here are freed by other threads at once, i.e. pushed to the public freelists
+	// of the blocks, and must be reused here instead of taking new blocks
+	const size_t threads = 4;
+	const size_t count = 4000;
+	size_t blocksInUse = 0;
+	for(int round = 0; round < 10; ++round)
 	{
-		ret = testPerformance();
+		std::vector<byte*> chunks(count * 2);
+		for(size_t i = 0; i < chunks.size(); ++i)
+		{
+			chunks[i] = pool.allocate(8 + (i % 64) * 16);
+			BOOST_REQUIRE(chunks[i]);
+			fill(chunks[i], 8 + (i % 64) * 16, i);
+		}
+
+		// Free the first half remotely, the second half must stay intact
+		boost::barrier start(threads);
+		boost::thread_group group;
+		for(size_t t = 0; t < threads; ++t)
+			group.create_thread(boost::bind(freeRange, &pool, &chunks, t * count / threads, (t + 1) * count / threads, &start));
+		group.join_all();
+
+		BOOST_CHECK_EQUAL(pool.getAllocatorStat().ChunksInUse, count);
+		for(size_t i = count; i < chunks.size(); ++i)
+			BOOST_CHECK(verify(chunks[i], 8 + (i % 64) * 16, i));
+		for(size_t i = count; i < chunks.size(); ++i)
+			pool.deallocate(chunks[i]);
+		BOOST_CHECK_EQUAL(pool.getAllocatorStat().ChunksInUse, 0U);
+
+		// Without reusing the public freelists, half of the blocks would be lost every round. Allow a
+		// block per bin to be pending on a public freelist.
+		if(round == 0)
+			blocksInUse = pool.getAllocatorStat().BlocksInUse;
+		else
+			BOOST_CHECK(pool.getAllocatorStat().BlocksInUse <= blocksInUse + 32);
 	}
-	else if(testMode == Integrity)
+	BOOST_CHECK_EQUAL(pool.getAllocatorStat().Underruns, 0U);
+}
+
+BOOST_AUTO_TEST_CASE( GrowableRegionTest )
+{
+	ScalablePoolAllocator growable(ScalablePoolAllocator::RegionOptions(4*1024*1024));
+
+	for(int round = 0; round < 3; ++round)
 	{
-		ret = testIntegrity();
+		// Way more than the first region, from a thread whose bins are given back when it exits
+		bool ok = true;
+		boost::thread t(boost::bind(allocateAndFree, &growable, 40000, 50, &ok));
+		t.join();
+		BOOST_CHECK(ok);
+
+		ScalablePoolAllocator::AllocatorStat stat = growable.getAllocatorStat();
+		BOOST_CHECK(stat.RegionsInUse > 0U);
+		BOOST_CHECK_EQUAL(stat.ChunksInUse, 0U);
+
+		// Everything is free, so every region mapped on demand can be released
+		BOOST_CHECK_EQUAL(growable.releaseFreeRegions(), stat.RegionsInUse);
+		BOOST_CHECK_EQUAL(growable.getAllocatorStat().RegionsInUse, 0U);
+		BOOST_CHECK_EQUAL(growable.getAllocatorStat().RegionBytes, 0U);
 	}
 
-	// Finish
-	return ret;
+	// The first region is kept
+	byte* p = growable.allocate(100);
+	BOOST_CHECK(p);
+	growable.deallocate(p);
 }
 
+static void allocateAndOutlive(ScalablePoolAllocator* pool, boost::barrier* allocated, boost::barrier* destroyed)
+{
+	byte* p = pool->allocate(100);
+	pool->deallocate(p);
+	allocated->wait();
+	destroyed->wait();
+}
 
-struct Allocation
+BOOST_AUTO_TEST_CASE( ThreadOutlivesPoolTest )
 {
-	size_t sz;
-	byte* data;
-};
+	// The worker keeps its bins until it exits, which is after the pool and its memory are gone
+	for(int growable = 0; growable < 2; ++growable)
+	{
+		boost::barrier allocated(2), destroyed(2);
+		byte* memory = growable ? NULL : new byte[POOL_SIZE];
+		ScalablePoolAllocator* pool = growable ?
+				new ScalablePoolAllocator(ScalablePoolAllocator::RegionOptions(4*1024*1024)) :
+				new ScalablePoolAllocator(garbage(memory, POOL_SIZE), POOL_SIZE);
 
+		boost::thread t(boost::bind(allocateAndOutlive, pool, &allocated, &destroyed));
+		allocated.wait();
+		delete pool;
+		delete[] memory;
+		destroyed.wait();
+		t.join();
+	}
+}
 
-/**
- * Test allocation and deallocation speed by allocate/deallocate
- * 1000000 times.
- *
- * Default settings:
- * @li 4 threads
- * @li Random allocation between 4 and 16384 bytes. Making half of them in bins, half of them in large allocation.
- *
- * @return 0 for success, fail otherwise
- */
-int testPerformance()
+BOOST_AUTO_TEST_CASE( RegionLimitTest )
+{
+	// MaxRegions counts the regions mapped on demand, the first region is always there
+	size_t allocated[3] = { 0 };
+	for(size_t maxRegions = 1; maxRegions <= 2; ++maxRegions)
+	{
+		ScalablePoolAllocator limited(ScalablePoolAllocator::RegionOptions(4*1024*1024, maxRegions));
+		while(limited.allocate(1024*1024))
+			++allocated[maxRegions];
+		BOOST_CHECK_EQUAL(limited.getAllocatorStat().RegionsInUse, maxRegions);
+	}
+	BOOST_CHECK(allocated[1] > 0U);
+	BOOST_CHECK(allocated[2] > allocated[1]);
+}
+
+BOOST_AUTO_TEST_CASE( PurgeAndReuseTest )
+{
+	bool ok = true;
+	boost::thread t(boost::bind(allocateAndFree, &pool, 20000, 20, &ok));
+	t.join();
+	BOOST_CHECK(ok);
+	size_t freeChunks = pool.getAllocatorStat().LargeChunkInFreeList;
+
+	// Nothing has been idle long enough yet
+	BOOST_CHECK_EQUAL(pool.purge(), 0U);
+
+	size_t purged = pool.purge(true);
+	BOOST_CHECK(purged > 0U);
+	BOOST_CHECK_EQUAL(pool.getAllocatorStat().PurgedBytes, purged);
+	BOOST_CHECK_EQUAL(pool.getAllocatorStat().LargeChunkInFreeList, freeChunks);
+	BOOST_CHECK_EQUAL(pool.purge(true), 0U);
+
+	// Purged memory is reused as usual, and purged again once it's free
+	t = boost::thread(boost::bind(allocateAndFree, &pool, 20000, 20, &ok));
+	t.join();
+	BOOST_CHECK(ok);
+	BOOST_CHECK(pool.purge(true) > 0U);
+	BOOST_CHECK_EQUAL(pool.getAllocatorStat().ChunksInUse, 0U);
+
+	// Nothing smaller than the granularity is purged
+	t = boost::thread(boost::bind(allocateAndFree, &pool, 20000, 20, &ok));
+	t.join();
+	pool.setPurgeOptions(ScalablePoolAllocator::PurgeOptions(0, 64*1024, 0, false, 2 * POOL_SIZE));
+	BOOST_CHECK_EQUAL(pool.purge(true), 0U);
+}
+
+BOOST_AUTO_TEST_CASE( BackgroundPurgeTest )
 {
-	const size_t sz = 100 * 1048576;
-	byte* buf = new byte[sz];// 100MB
-	zillians::ScalablePoolAllocator allocator(buf, sz);
+	// Find out how many chunks fill the pool
+	std::vector<byte*> chunks;
+	byte* p;
+	while( (p = pool.allocate(1024*1024)) )
+		chunks.push_back(p);
+	for(size_t i = 0; i < chunks.size(); ++i)
+		pool.deallocate(chunks[i]);
+	size_t capacity = chunks.size();
 
+	// Memory taken out for purging is waited for, so a full pool still gets all of it
+	pool.setPurgeOptions(ScalablePoolAllocator::PurgeOptions(0, 64*1024, 1));
+	for(int round = 0; round < 50; ++round)
+	{
+		chunks.clear();
+		for(size_t i = 0; i < capacity; ++i)
+		{
+			p = pool.allocate(1024*1024 - (i % 3) * 100000);
+			BOOST_REQUIRE(p);
+			fill(p, 4096, i);
+			chunks.push_back(p);
+		}
+		for(size_t i = 0; i < chunks.size(); ++i)
+		{
+			BOOST_CHECK(verify(chunks[i], 4096, i));
+			pool.deallocate(chunks[i]);
+		}
+	}
+	pool.setPurgeOptions(ScalablePoolAllocator::PurgeOptions());
+	BOOST_CHECK(pool.getAllocatorStat().PurgedBytes > 0U);
+}
 
+static size_t inUse(ScalablePoolAllocator& pool)
+{
+	return pool.getAllocatorStat().TotalAllocations - pool.getAllocatorStat().TotalDeallocations;
+}
 
-	delete[] buf;
-	return -1;
+static void deallocateBatch(ScalablePoolAllocator* pool, std::vector<byte*>* chunks)
+{
+	pool->deallocateBatch(&(*chunks)[0], chunks->size());
 }
 
+BOOST_AUTO_TEST_CASE( BatchAllocationTest )
+{
+	const size_t sizes[] = { 8, 100, 1000, 8192, 20000 };
+	for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+	{
+		// Runs span several blocks, and the chunks of one batch must not overlap
+		std::vector<byte*> chunks(1000, NULL);
+		BOOST_REQUIRE_EQUAL(pool.allocateBatch(sizes[s], chunks.size(), &chunks[0]), chunks.size());
+		for(size_t i = 0; i < chunks.size(); ++i)
+			fill(chunks[i], sizes[s], i);
+		for(size_t i = 0; i < chunks.size(); ++i)
+			BOOST_CHECK(verify(chunks[i], sizes[s], i));
+		BOOST_CHECK_EQUAL(inUse(pool), chunks.size());
+
+		// Mixed with chunks from allocate() and NULL entries, which are skipped
+		for(size_t i = 0; i < chunks.size(); i += 3)
+			pool.deallocate(chunks[i]);
+		for(size_t i = 0; i < chunks.size(); i += 3)
+			chunks[i] = (i % 2) ? NULL : pool.allocate(sizes[s]);
+		pool.deallocateBatch(&chunks[0], chunks.size());
+		BOOST_CHECK_EQUAL(inUse(pool), 0U);
+	}
+
+	// A batch freed by another thread goes to the public freelists
+	std::vector<byte*> chunks(5000, NULL);
+	BOOST_REQUIRE_EQUAL(pool.allocateBatch(64, chunks.size(), &chunks[0]), chunks.size());
+	boost::thread t(boost::bind(deallocateBatch, &pool, &chunks));
+	t.join();
+	BOOST_CHECK_EQUAL(pool.getAllocatorStat().ChunksInUse, 0U);
+	BOOST_CHECK_EQUAL(pool.allocateBatch(64, chunks.size(), &chunks[0]), chunks.size());
+	pool.deallocateBatch(&chunks[0], chunks.size());
+	BOOST_CHECK_EQUAL(pool.getAllocatorStat().Underruns, 0U);
+}
 
-int testIntegrity()
+BOOST_AUTO_TEST_CASE( PartialBatchTest )
 {
-	return -1;
+	const size_t sizes[] = { 2048, 1024*1024 };
+	for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+	{
+		const size_t size = 4*1024*1024;
+		boost::scoped_array<byte> memory(new byte[size]);
+		ScalablePoolAllocator small(garbage(memory.get(), size), size);
+
+		// Running out of memory fills only the first n entries, all of them usable
+		std::vector<byte*> chunks(size / sizes[s] + 1, NULL);
+		size_t n = small.allocateBatch(sizes[s], chunks.size(), &chunks[0]);
+		BOOST_CHECK(n > 0U);
+		BOOST_CHECK(n < chunks.size());
+		for(size_t i = 0; i < n; ++i)
+			fill(chunks[i], sizes[s], i);
+		for(size_t i = 0; i < n; ++i)
+			BOOST_CHECK(verify(chunks[i], sizes[s], i));
+		BOOST_CHECK(!small.allocate(sizes[s]));
+
+		// The entries past n are left untouched (NULL), so the whole array can be given back
+		small.deallocateBatch(&chunks[0], chunks.size());
+		BOOST_CHECK_EQUAL(small.getAllocatorStat().TotalDeallocations, n);
+
+		// Everything freed can be allocated again
+		BOOST_CHECK_EQUAL(small.allocateBatch(sizes[s], chunks.size(), &chunks[0]), n);
+		small.deallocateBatch(&chunks[0], n);
+	}
 }
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,169 @@
+/**
+ * Zillians MMO
+ * Copyright (C) 2007-2009 Zillians.com, Inc.
+ * For more information see http://www.zillians.com
+ *
+ * Zillians MMO is the library and runtime for massive multiplayer online game
+ * development in utility computing model, which runs as a service for every
+ * developer to build their virtual world running on our GPU-assisted machines.
+ *
+ * This is a close source library intended to be used solely within Zillians.com
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "core/Prerequisite.h"
+#include "core/ScalablePoolStdAllocator.h"
+#include <vector>
+#include <map>
+#include <string>
+#include <boost/scoped_array.hpp>
+
+#define BOOST_TEST_MODULE ScalablePoolStdAllocatorTest
+#define BOOST_TEST_MAIN
+#include <boost/test/unit_test.hpp>
+
+using namespace zillians;
+
+#define POOL_SIZE	(64*1024*1024)
+
+struct PoolFixture
+{
+	PoolFixture() : memory(new byte[POOL_SIZE]), pool(memory.get(), POOL_SIZE)
+	{ }
+
+	boost::scoped_array<byte> memory;	// destroyed after the pool
+	ScalablePoolAllocator pool;
+};
+
+BOOST_FIXTURE_TEST_SUITE( ScalablePoolStdAllocatorTest, PoolFixture )
+
+BOOST_AUTO_TEST_CASE( AlignedAllocationTest )
+{
+	size_t sizes[] = { 1, 24, 100, 4000, 8192, 10000, 100000 };
+	for(size_t alignment = 1; alignment <= 65536; alignment <<= 1)
+	{
+		std::vector<byte*> allocated;
+		for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+		{
+			byte* p = pool.allocate(sizes[i], alignment);
+			BOOST_REQUIRE(p);
+			BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(p) % alignment, 0U);
+			memset(p, 0xcd, sizes[i]);
+			allocated.push_back(p);
+		}
+		for(size_t i = 0; i < allocated.size(); ++i)
+		{
+			// alternate between the sized path and the pointer lookup
+			if(i % 2)
+				pool.deallocate(allocated[i], sizes[i], alignment);
+			else
+				pool.deallocate(allocated[i]);
+		}
+	}
+
+	// invalid alignment
+	BOOST_CHECK(!pool.allocate(16, 24));
+
+	// everything is given back and coalesced, including the unaligned heads and tails of large chunks
+	BOOST_CHECK_EQUAL(pool.getAllocatorStat().LargeChunkInFreeList, 0U);
+	byte* big = pool.allocate(POOL_SIZE - 8*1024*1024);
+	BOOST_CHECK(big);
+	pool.deallocate(big, POOL_SIZE - 8*1024*1024);
+}
+
+BOOST_AUTO_TEST_CASE( SizedDeallocationTest )
+{
+	size_t sizes[] = { 8, 64, 8192, 8193, 65536 };
+	for(int round = 0; round < 100; ++round)
+	{
+		std::vector<byte*> allocated;
+		for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+			allocated.push_back(pool.allocate(sizes[i]));
+		for(size_t i = 0; i < allocated.size(); ++i)
+			pool.deallocate(allocated[i], sizes[i]);
+	}
+	BOOST_CHECK_EQUAL(pool.getAllocatorStat().ChunksInUse, 0U);
+	BOOST_CHECK_EQUAL(pool.getAllocatorStat().TotalAllocations, pool.getAllocatorStat().TotalDeallocations);
+}
+
+BOOST_AUTO_TEST_CASE( StdContainerTest )
+{
+	typedef std::basic_string<char, std::char_traits<char>, ScalablePoolStdAllocator<char> > PoolString;
+	typedef std::map<int, PoolString, std::less<int>, ScalablePoolStdAllocator<std::pair<const int, PoolString> > > PoolMap;
+
+	ScalablePoolStdAllocator<int> allocator(&pool);
+	{
+		std::vector<int, ScalablePoolStdAllocator<int> > v(allocator);
+		for(int i = 0; i < 100000; ++i)
+			v.push_back(i);
+		for(int i = 0; i < 100000; ++i)
+			BOOST_CHECK_EQUAL(v[i], i);
+
+		PoolMap m(std::less<int>(), allocator);
+		for(int i = 0; i < 1000; ++i)
+			m.insert(std::make_pair(i, PoolString(i, 'x', allocator)));
+		for(int i = 0; i < 1000; ++i)
+			BOOST_CHECK_EQUAL(m.find(i)->second.size(), (size_t)i);
+
+		BOOST_CHECK(v.get_allocator() == m.get_allocator());
+		BOOST_CHECK(pool.getAllocatorStat().ChunksInUse > 0U);
+	}
+	BOOST_CHECK_EQUAL(pool.getAllocatorStat().ChunksInUse, 0U);
+
+	boost::scoped_array<byte> otherMemory(new byte[1024*1024]);
+	ScalablePoolAllocator other(otherMemory.get(), 1024*1024);
+	BOOST_CHECK(allocator != ScalablePoolStdAllocator<char>(&other));
+}
+
+BOOST_AUTO_TEST_CASE( CustomBinAlignmentTest )
+{
+	BOOST_CHECK_EQUAL(pool.getMinAlignment(), 8U);
+
+	// Bin sizes which are not multiples of 8 only guarantee 4-byte alignment
+	size_t binSizes[] = { 12, 20, 36, 52, 100, 260, 1028, 4100 };
+	boost::scoped_array<byte> customMemory(new byte[16*1024*1024]);
+	ScalablePoolAllocator custom(customMemory.get(), 16*1024*1024, binSizes, sizeof(binSizes) / sizeof(binSizes[0]));
+	BOOST_CHECK_EQUAL(custom.getMinAlignment(), 4U);
+
+	ScalablePoolStdAllocator<double> allocator(&custom);
+	std::vector<double*> allocated;
+	for(size_t n = 1; n < 600; n += 7)
+	{
+		double* p = allocator.allocate(n);
+		BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(p) % boost::alignment_of<double>::value, 0U);
+		for(size_t i = 0; i < n; ++i)
+			p[i] = static_cast<double>(i);
+		allocated.push_back(p);
+	}
+	for(size_t k = 0, n = 1; k < allocated.size(); ++k, n += 7)
+		allocator.deallocate(allocated[k], n);
+	BOOST_CHECK_EQUAL(custom.getAllocatorStat().TotalAllocations, custom.getAllocatorStat().TotalDeallocations);
+}
+
+#ifdef ZILLIANS_SCALABLEPOOL_HAS_MEMORY_RESOURCE
+BOOST_AUTO_TEST_CASE( MemoryResourceTest )
+{
+	ScalablePoolMemoryResource resource(&pool);
+	{
+		std::pmr::vector<std::pmr::string> v(&resource);
+		for(int i = 0; i < 1000; ++i)
+			v.emplace_back(i, 'x');
+		for(int i = 0; i < 1000; ++i)
+			BOOST_CHECK_EQUAL(v[i].size(), (size_t)i);
+		BOOST_CHECK(pool.getAllocatorStat().ChunksInUse > 0U);
+	}
+	BOOST_CHECK_EQUAL(pool.getAllocatorStat().ChunksInUse, 0U);
+
+	ScalablePoolMemoryResource same(&pool);
+	BOOST_CHECK(resource == same);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
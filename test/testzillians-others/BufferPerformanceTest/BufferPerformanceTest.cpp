@@ -0,0 +1,272 @@
+/**
+ * Zillians MMO
+ * Copyright (C) 2007-2009 Zillians.com, Inc.
+ * For more information see http://www.zillians.com
+ *
+ * Zillians MMO is the library and runtime for massive multiplayer online game
+ * development in utility computing model, which runs as a service for every
+ * developer to build their virtual world running on our GPU-assisted machines.
+ *
+ * This is a close source library intended to be used solely within Zillians.com
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+/**
+ * Buffer serialization throughput benchmark
+ *
+ * For every object kind (scalars, strings, POD vectors, maps and serializable
+ * structs) and every buffer flavor (plain/circular x none/spsc), a batch of
+ * objects is written into a pre-sized buffer and read back, repeated several
+ * rounds and the best round is kept. Circular buffers keep their pointers
+ * across rounds and are sized so that the data wraps around the end. The
+ * same number of bytes is copied by a single memcpy as the baseline, so
+ * ratio_to_memcpy tells how close the serialization path is to the raw
+ * memory bandwidth (1.0 == memcpy speed).
+ *
+ * The result is printed as CSV (one header line followed by one line per case)
+ * to stdout, or to the file given as the first argument.
+ *
+ * Usage: BufferPerformanceTest [output.csv] [rounds]
+ */
+
+#include "core/Prerequisite.h"
+#include "core/Buffer.h"
+#include <tbb/tick_count.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+
+using namespace zillians;
+
+#define OBJECT_COUNT_SCALAR		(1024*1024)
+#define OBJECT_COUNT_STRING		(64*1024)
+#define OBJECT_COUNT_VECTOR		(4*1024)
+#define OBJECT_COUNT_MAP		(4*1024)
+#define OBJECT_COUNT_STRUCT		(256*1024)
+#define DEFAULT_ROUNDS			10
+
+struct SerializableObject
+{
+	int32 id;
+	float position[3];
+	std::string name;
+
+	template<typename Archive>
+	void serialize(Archive& ar, const unsigned int version)
+	{
+		ar & id;
+		ar & position[0];
+		ar & position[1];
+		ar & position[2];
+		ar & name;
+	}
+};
+
+struct BenchmarkResult
+{
+	double write_seconds;
+	double read_seconds;
+	std::size_t bytes;
+};
+
+static FILE* gOutput = stdout;
+static int gRounds = DEFAULT_ROUNDS;
+
+/**
+ * Prevent the compiler from dropping the read-back values.
+ */
+static volatile std::size_t gSink = 0;
+
+template<typename T>
+inline void consume(const T& value)			{ gSink += sizeof(value); }
+inline void consume(const std::string& value)	{ gSink += value.size(); }
+template<typename T>
+inline void consume(const std::vector<T>& value)	{ gSink += value.size(); }
+template<typename K, typename V>
+inline void consume(const std::map<K,V>& value)	{ gSink += value.size(); }
+inline void consume(const SerializableObject& value)	{ gSink += value.name.size(); }
+
+template<typename BufferType>
+struct is_circular
+{
+	enum { value =
+		boost::is_base_and_derived<BufferBase<BufferMode::circular, BufferConcurrency::none>, BufferType>::value ||
+		boost::is_base_and_derived<BufferBase<BufferMode::circular, BufferConcurrency::spsc>, BufferType>::value
+		};
+};
+
+template<typename BufferType, typename T>
+BenchmarkResult runBuffer(const std::vector<T>& objects)
+{
+	BenchmarkResult result;
+	result.bytes = 0;
+	for(typename std::vector<T>::const_iterator it = objects.begin(); it != objects.end(); ++it)
+		result.bytes += BufferType::probeSize(*it);
+
+	result.write_seconds = 1e100;
+	result.read_seconds = 1e100;
+
+	// a third more than a round, so every round starts at a different position and wraps around
+	BufferType buffer(is_circular<BufferType>::value ? result.bytes + result.bytes / 3 + 1 : result.bytes);
+	T value;
+	for(int round = 0; round < gRounds; ++round)
+	{
+		if(!is_circular<BufferType>::value)
+			buffer.clear();
+
+		tbb::tick_count start = tbb::tick_count::now();
+		for(typename std::vector<T>::const_iterator it = objects.begin(); it != objects.end(); ++it)
+			buffer << *it;
+		tbb::tick_count stop = tbb::tick_count::now();
+		result.write_seconds = std::min(result.write_seconds, (stop - start).seconds());
+
+		if(buffer.dataSize() != result.bytes)
+		{
+			fprintf(stderr, "unexpected data size: %lu (expected %lu)\n", (unsigned long)buffer.dataSize(), (unsigned long)result.bytes);
+			exit(EXIT_FAILURE);
+		}
+
+		start = tbb::tick_count::now();
+		for(std::size_t i = 0; i < objects.size(); ++i)
+		{
+			buffer >> value;
+			consume(value);
+		}
+		stop = tbb::tick_count::now();
+		result.read_seconds = std::min(result.read_seconds, (stop - start).seconds());
+	}
+
+	return result;
+}
+
+double runMemcpy(std::size_t bytes)
+{
+	std::vector<char> source(bytes, 'x');
+	std::vector<char> dest(bytes);
+
+	double best = 1e100;
+	for(int round = 0; round < gRounds; ++round)
+	{
+		tbb::tick_count start = tbb::tick_count::now();
+		memcpy(&dest[0], &source[0], bytes);
+		tbb::tick_count stop = tbb::tick_count::now();
+		best = std::min(best, (stop - start).seconds());
+		gSink += dest[round % bytes];
+	}
+	return best;
+}
+
+void report(const char* kind, const char* mode, const char* concurrency, const char* direction, std::size_t objects, std::size_t bytes, double seconds, double memcpy_seconds)
+{
+	// guard against timer resolution on tiny batches
+	seconds = std::max(seconds, 1e-9);
+	memcpy_seconds = std::max(memcpy_seconds, 1e-9);
+
+	double bytes_per_sec = (double)bytes / seconds;
+	double objects_per_sec = (double)objects / seconds;
+	double ratio = memcpy_seconds / seconds;
+
+	fprintf(gOutput, "%s,%s,%s,%s,%lu,%lu,%.9f,%.0f,%.0f,%.6f\n",
+			kind, mode, concurrency, direction,
+			(unsigned long)objects, (unsigned long)bytes,
+			seconds, bytes_per_sec, objects_per_sec, ratio);
+}
+
+template<typename BufferType, typename T>
+void runCase(const char* kind, const char* mode, const char* concurrency, const std::vector<T>& objects)
+{
+	BenchmarkResult result = runBuffer<BufferType>(objects);
+	double memcpy_seconds = runMemcpy(result.bytes);
+
+	report(kind, mode, concurrency, "write", objects.size(), result.bytes, result.write_seconds, memcpy_seconds);
+	report(kind, mode, concurrency, "read", objects.size(), result.bytes, result.read_seconds, memcpy_seconds);
+	fflush(gOutput);
+}
+
+template<typename T>
+void runAllBuffers(const char* kind, const std::vector<T>& objects)
+{
+	runCase<Buffer>(kind, "plain", "none", objects);
+	runCase<CircularBuffer>(kind, "circular", "none", objects);
+	runCase<SpscBuffer>(kind, "plain", "spsc", objects);
+	runCase<SpscCircularBuffer>(kind, "circular", "spsc", objects);
+}
+
+int main(int argc, char** argv)
+{
+	if(argc > 1)
+	{
+		gOutput = fopen(argv[1], "w");
+		if(!gOutput)
+		{
+			perror(argv[1]);
+			return EXIT_FAILURE;
+		}
+	}
+	if(argc > 2)
+	{
+		gRounds = std::max(1, atoi(argv[2]));
+	}
+
+	fprintf(gOutput, "kind,mode,concurrency,direction,objects,bytes,seconds,bytes_per_sec,objects_per_sec,ratio_to_memcpy\n");
+
+	// scalars
+	{
+		std::vector<int64> objects(OBJECT_COUNT_SCALAR);
+		for(std::size_t i = 0; i < objects.size(); ++i)
+			objects[i] = (int64)i * 2654435761LL;
+		runAllBuffers("scalar", objects);
+	}
+
+	// strings
+	{
+		std::vector<std::string> objects(OBJECT_COUNT_STRING);
+		for(std::size_t i = 0; i < objects.size(); ++i)
+			objects[i] = std::string(16 + i % 48, 'a' + i % 26);
+		runAllBuffers("string", objects);
+	}
+
+	// POD vectors
+	{
+		std::vector< std::vector<int32> > objects(OBJECT_COUNT_VECTOR);
+		for(std::size_t i = 0; i < objects.size(); ++i)
+			objects[i].assign(256, (int32)i);
+		runAllBuffers("pod_vector", objects);
+	}
+
+	// maps
+	{
+		std::vector< std::map<int32, int32> > objects(OBJECT_COUNT_MAP);
+		for(std::size_t i = 0; i < objects.size(); ++i)
+			for(int32 k = 0; k < 32; ++k)
+				objects[i][k] = (int32)i ^ k;
+		runAllBuffers("map", objects);
+	}
+
+	// serializable structs
+	{
+		std::vector<SerializableObject> objects(OBJECT_COUNT_STRUCT);
+		for(std::size_t i = 0; i < objects.size(); ++i)
+		{
+			objects[i].id = (int32)i;
+			objects[i].position[0] = (float)i;
+			objects[i].position[1] = (float)i * 0.5f;
+			objects[i].position[2] = (float)i * 0.25f;
+			objects[i].name = "object";
+		}
+		runAllBuffers("struct", objects);
+	}
+
+	if(gOutput != stdout)
+		fclose(gOutput);
+
+	return 0;
+}
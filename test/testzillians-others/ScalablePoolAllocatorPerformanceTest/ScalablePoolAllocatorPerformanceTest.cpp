@@ -0,0 +1,205 @@
+/**
+ * Zillians MMO
+ * Copyright (C) 2007-2009 Zillians.com, Inc.
+ * For more information see http://www.zillians.com
+ *
+ * Zillians MMO is the library and runtime for massive multiplayer online game
+ * development in utility computing model, which runs as a service for every
+ * developer to build their virtual world running on our GPU-assisted machines.
+ *
+ * This is a close source library intended to be used solely within Zillians.com
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * ScalablePoolAllocator cross-thread free benchmark
+ *
+ * Every thread allocates a batch of small chunks, then frees the batch allocated
+ * by its neighbour thread, so that all frees go through the public freelists of
+ * blocks owned by other threads. Afterwards every thread allocates the same batch
+ * again, which has to privatize the public freelists of its blocks.
+ *
+ * Both phases are timed from the barrier which starts them to the barrier which
+ * ends them, and repeated for 2 to 64 threads, once with allocate()/deallocate()
+ * per chunk and once with allocateBatch()/deallocateBatch() on the whole batch.
+ * The result is printed as CSV to stdout, or to the file given as the first argument.
+ *
+ * Usage: ScalablePoolAllocatorPerformanceTest [output.csv] [rounds]
+ */
+
+#include "core/Prerequisite.h"
+#include "core/ScalablePoolAllocator.h"
+#include <tbb/tick_count.h>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include <boost/bind.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+
+using namespace zillians;
+
+#define POOL_SIZE			(512*1024*1024)
+#define CHUNKS_PER_THREAD	20000
+#define CHUNK_SIZE			64
+#define MAX_THREADS			64
+#define DEFAULT_ROUNDS		5
+
+struct BenchmarkContext
+{
+	BenchmarkContext(ScalablePoolAllocator& allocator, int threads, bool batch) :
+		allocator(allocator), threads(threads), batch(batch), barrier(threads), slots(threads), failed(false)
+	{
+		for(int i = 0; i < threads; ++i)
+			slots[i].resize(CHUNKS_PER_THREAD);
+	}
+
+	ScalablePoolAllocator& allocator;
+	int threads;
+	bool batch;
+	boost::barrier barrier;
+	std::vector< std::vector<byte*> > slots;
+	tbb::tick_count marks[4];
+	bool failed;
+};
+
+static FILE* gOutput = stdout;
+static int gRounds = DEFAULT_ROUNDS;
+
+void allocateSlots(BenchmarkContext& context, std::vector<byte*>& slots)
+{
+	if(context.batch)
+	{
+		if(context.allocator.allocateBatch(CHUNK_SIZE, slots.size(), &slots[0]) != slots.size())
+		{
+			context.failed = true;
+			return;
+		}
+		for(std::size_t i = 0; i < slots.size(); ++i)
+			*(int*)slots[i] = (int)i;
+		return;
+	}
+
+	for(std::size_t i = 0; i < slots.size(); ++i)
+	{
+		slots[i] = context.allocator.allocate(CHUNK_SIZE);
+		if(!slots[i])
+		{
+			context.failed = true;
+			return;
+		}
+		*(int*)slots[i] = (int)i;
+	}
+}
+
+void freeSlots(BenchmarkContext& context, std::vector<byte*>& slots)
+{
+	if(context.batch)
+	{
+		context.allocator.deallocateBatch(&slots[0], slots.size());
+		std::fill(slots.begin(), slots.end(), (byte*)NULL);
+		return;
+	}
+
+	for(std::size_t i = 0; i < slots.size(); ++i)
+	{
+		context.allocator.deallocate(slots[i]);
+		slots[i] = NULL;
+	}
+}
+
+void worker(BenchmarkContext* context, int index)
+{
+	std::vector<byte*>& own = context->slots[index];
+	std::vector<byte*>& neighbour = context->slots[(index + 1) % context->threads];
+
+	allocateSlots(*context, own);
+
+	// remote free
+	context->barrier.wait();
+	if(index == 0) context->marks[0] = tbb::tick_count::now();
+	freeSlots(*context, neighbour);
+	context->barrier.wait();
+	if(index == 0) context->marks[1] = tbb::tick_count::now();
+
+	// allocate again from the privatized public freelists
+	context->barrier.wait();
+	if(index == 0) context->marks[2] = tbb::tick_count::now();
+	allocateSlots(*context, own);
+	context->barrier.wait();
+	if(index == 0) context->marks[3] = tbb::tick_count::now();
+
+	freeSlots(*context, own);
+}
+
+void runBenchmark(byte* pool, int threads, bool batch)
+{
+	double free_seconds = 1e100;
+	double alloc_seconds = 1e100;
+	bool failed = false;
+
+	ScalablePoolAllocator allocator(pool, POOL_SIZE);
+	for(int round = 0; round < gRounds; ++round)
+	{
+		BenchmarkContext context(allocator, threads, batch);
+
+		boost::thread_group group;
+		for(int i = 0; i < threads; ++i)
+			group.create_thread(boost::bind(worker, &context, i));
+		group.join_all();
+
+		free_seconds = std::min(free_seconds, (context.marks[1] - context.marks[0]).seconds());
+		alloc_seconds = std::min(alloc_seconds, (context.marks[3] - context.marks[2]).seconds());
+		failed = failed || context.failed;
+	}
+
+	std::size_t operations = (std::size_t)threads * CHUNKS_PER_THREAD;
+	fprintf(gOutput, "%s,%d,%d,%lu,%.9f,%.0f,%.9f,%.0f,%s\n",
+			batch ? "batch" : "single", threads, CHUNK_SIZE, (unsigned long)operations,
+			free_seconds, (double)operations / std::max(free_seconds, 1e-9),
+			alloc_seconds, (double)operations / std::max(alloc_seconds, 1e-9),
+			failed ? "out_of_memory" : "ok");
+	fflush(gOutput);
+}
+
+int main(int argc, char** argv)
+{
+	if(argc > 1)
+	{
+		gOutput = fopen(argv[1], "w");
+		if(!gOutput)
+		{
+			perror(argv[1]);
+			return EXIT_FAILURE;
+		}
+	}
+	if(argc > 2)
+	{
+		gRounds = std::max(1, atoi(argv[2]));
+	}
+
+	byte* pool = new byte[POOL_SIZE];
+
+	fprintf(gOutput, "api,threads,chunk_size,frees,remote_free_seconds,remote_frees_per_sec,realloc_seconds,reallocs_per_sec,status\n");
+	for(int batch = 0; batch < 2; ++batch)
+	{
+		for(int threads = 2; threads <= MAX_THREADS; threads *= 2)
+		{
+			runBenchmark(pool, threads, batch != 0);
+		}
+	}
+
+	delete[] pool;
+
+	if(gOutput != stdout)
+		fclose(gOutput);
+
+	return 0;
+}